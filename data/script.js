@@ -6,6 +6,43 @@ window.addEventListener('load', onLoad);
 function onLoad(event) {
     initWebSocket();
     setupFormValidation();
+    loadSimSettings();
+    loadWifiSettings();
+    loadCaptures();
+    setupSnapshotRestore();
+}
+
+// Pre-fill the simulation form on the settings page with the device's values
+function loadSimSettings() {
+    const form = document.querySelector('form[action="/sim"]');
+    if (!form) return;
+    fetch('/sim').then(r => r.json()).then(sim => {
+        form.elements['enabled'].checked = sim.enabled;
+        form.elements['strokeIn'].value = sim.strokeIn;
+        form.elements['strokeOut'].value = sim.strokeOut;
+        form.elements['jitter'].value = sim.jitter;
+        form.elements['bounce'].value = sim.bounce;
+        form.elements['valve'].value = sim.valve;
+        form.elements['fault'].value = sim.fault;
+    }).catch(err => console.log('Simulation settings unavailable: ' + err));
+}
+
+// Pre-fill the static IP fields, so that saving WiFi again keeps them, and
+// show how the last connection was made
+function loadWifiSettings() {
+    const form = document.querySelector('form[action="/setwifi"]');
+    if (!form) return;
+    fetch('/diag/wifi').then(r => r.json()).then(w => {
+        form.elements['ssid'].value = w.ssid;
+        if (w.static) {
+            ['ip', 'gateway', 'subnet', 'dns'].forEach(n => form.elements[n].value = w.static[n]);
+        }
+        if (w.bootConnectMs) {
+            setText('wifi-connect', 'Connected at boot in ' + w.bootConnectMs + ' ms (' + w.method +
+                (w.bootFallback ? ' after the cached AP failed' : '') + '). Reconnects: ' + w.reconnects +
+                (w.reconnects ? ', last ' + w.lastReconnectMs + ' ms' : '') + '.');
+        }
+    }).catch(err => console.log('WiFi settings unavailable: ' + err));
 }
 
 function initWebSocket() {
@@ -18,6 +55,8 @@ function initWebSocket() {
 
 function onOpen(event) {
     console.log('Connection opened');
+    startLatencyProbe();
+    if (document.getElementById('diag-loop')) websocket.send('sub:diag');
     const header = document.querySelector('h1');
     if(header) {
         if(!header.dataset.originalText) header.dataset.originalText = header.textContent;
@@ -27,6 +66,7 @@ function onOpen(event) {
 
 function onClose(event) {
     console.log('Connection closed');
+    stopLatencyProbe();
     const header = document.querySelector('h1');
     if(header && header.dataset.originalText) {
         header.textContent = header.dataset.originalText + ' (Disconnected 🔴)';
@@ -35,8 +75,107 @@ function onClose(event) {
 }
 
 function onMessage(event) {
+    const receivedAt = performance.now();
     var data = JSON.parse(event.data);
+    if (data.topic === 'pong') {
+        onPong(data, receivedAt);
+        return;
+    }
+    if (data.topic === 'diag') {
+        updateDiagnostics(data);
+        return;
+    }
     updateUI(data);
+    if (data.edgeTs) measureLatency(data.edgeTs, receivedAt);
+}
+
+// ========== LATENCY PROBE ==========
+// Status frames caused by an edge carry its device time ("edgeTs", us).
+// "ping:<t>" / pong exchanges give the offset between the device clock and
+// performance.now(); the sample with the shortest round trip wins, NTP style.
+// Edge -> received and edge -> rendered (next animation frame) go to the
+// display and, as percentiles, back to the device every LATENCY_REPORT_MS.
+const LATENCY_PING_MS = 5000;
+const LATENCY_REPORT_MS = 10000;
+const LATENCY_PINGS_KEPT = 6;        // Offset uses the best of the last 30 s
+const LATENCY_DISPLAY_SAMPLES = 100;
+
+const latency = {
+    pings: [],          // {offset, rtt}
+    offset: null,       // Device ms minus client ms
+    rtt: 0,
+    pending: [],        // {received, rendered} since the last report
+    recent: [],         // Edge -> rendered, for the display
+    timers: []
+};
+
+function startLatencyProbe() {
+    stopLatencyProbe();
+    latency.pings = [];
+    latency.offset = null;
+    sendPing();
+    latency.timers.push(setInterval(sendPing, LATENCY_PING_MS));
+    latency.timers.push(setInterval(reportLatency, LATENCY_REPORT_MS));
+}
+
+function stopLatencyProbe() {
+    latency.timers.forEach(clearInterval);
+    latency.timers = [];
+    latency.pending = [];
+}
+
+function sendPing() {
+    if (websocket.readyState === WebSocket.OPEN) {
+        websocket.send('ping:' + performance.now().toFixed(3));
+    }
+}
+
+function onPong(data, receivedAt) {
+    const rtt = receivedAt - data.c;
+    latency.pings.push({offset: data.d / 1000 - (data.c + receivedAt) / 2, rtt: rtt});
+    if (latency.pings.length > LATENCY_PINGS_KEPT) latency.pings.shift();
+    const best = latency.pings.reduce((a, b) => b.rtt < a.rtt ? b : a);
+    latency.offset = best.offset;
+    latency.rtt = best.rtt;
+}
+
+function measureLatency(edgeTs, receivedAt) {
+    if (latency.offset === null) return;
+    const edge = edgeTs / 1000 - latency.offset;   // In performance.now() time
+    requestAnimationFrame(renderedAt => {
+        const sample = {received: receivedAt - edge, rendered: renderedAt - edge};
+        latency.pending.push(sample);
+        latency.recent.push(sample.rendered);
+        if (latency.recent.length > LATENCY_DISPLAY_SAMPLES) latency.recent.shift();
+        showLatency();
+    });
+}
+
+function percentile(sorted, p) {
+    if (sorted.length === 0) return 0;
+    return sorted[Math.min(sorted.length - 1, Math.floor(p / 100 * sorted.length))];
+}
+
+function showLatency() {
+    const el = document.getElementById('latency');
+    if (!el) return;
+    const sorted = latency.recent.slice().sort((a, b) => a - b);
+    el.querySelector('.status-text').textContent =
+        percentile(sorted, 50).toFixed(0) + ' / ' + percentile(sorted, 95).toFixed(0) +
+        ' ms (' + sorted.length + ' edges, clock ±' + (latency.rtt / 2).toFixed(0) + ' ms)';
+}
+
+function reportLatency() {
+    const n = latency.pending.length;
+    if (n === 0 || websocket.readyState !== WebSocket.OPEN) return;
+    const us = ms => Math.max(0, Math.round(ms * 1000));
+    const received = latency.pending.map(s => s.received).sort((a, b) => a - b);
+    const rendered = latency.pending.map(s => s.rendered).sort((a, b) => a - b);
+    const fields = [n];
+    [received, rendered].forEach(list => [50, 95, 99].forEach(p => fields.push(us(percentile(list, p)))));
+    fields.push(us(rendered[n - 1]), us(latency.rtt));
+    websocket.send('lat:' + fields.join(','));
+    latency.pending = [];
 }
 
 function updateUI(data) {
@@ -52,6 +191,16 @@ function updateUI(data) {
     if (lastCycleEl) lastCycleEl.textContent = data.lastDuration > 0 ? data.lastDuration : '--';
     if (avgCycleEl) avgCycleEl.textContent = data.avgDuration > 0 ? data.avgDuration : '--';
 
+    // Valve response and travel per direction, flagged when a valve slows down
+    const valveEl = document.getElementById('valve-response');
+    if (valveEl && data.valve) {
+        const ms = us => us > 0 ? (us / 1000).toFixed(1) : '--';
+        valveEl.querySelector('.status-text').textContent =
+            ms(data.valve.responseUs[0]) + ' / ' + ms(data.valve.responseUs[1]) + ' ms (travel ' +
+            ms(data.valve.travelUs[0]) + ' / ' + ms(data.valve.travelUs[1]) + ' ms)' +
+            (data.valve.slow ? ' - SLOW, check valves' : '');
+    }
+
     // Draw Chart if history exists
     if (data.history && Array.isArray(data.history)) {
         drawChart(data.history);
@@ -137,6 +286,9 @@ function updateUI(data) {
         animStatus.textContent = direction;
     }
 
+    const simBanner = document.getElementById('sim-banner');
+    if (simBanner) simBanner.style.display = data.simulation ? 'block' : 'none';
+
     if (data.estopActive) {
         if (estopAlert) estopAlert.style.display = 'block';
         if (estopStatus) {
@@ -204,6 +356,28 @@ function updateUI(data) {
         }
 }
 
+// The firmware takes the snapshot as a raw body and not as a multipart form,
+// so the file is sent with fetch
+function setupSnapshotRestore() {
+    const form = document.getElementById('snapshot-restore');
+    if (!form) return;
+    form.addEventListener('submit', function(e) {
+        e.preventDefault();
+        const file = form.elements['snapshot'].files[0];
+        if (!file) return;
+        const sections = ['config', 'outputwear'].filter(n => form.elements[n].checked);
+        const query = '?sections=' + sections.join(',') + (form.elements['keepWifi'].checked ? '&keepWifi=1' : '');
+        setText('snapshot-result', 'Uploading...');
+        fetch('/snapshot' + query, {method: 'POST', body: file})
+            .then(r => r.text().then(text => {
+                if (!r.ok) throw new Error(text);
+                const res = JSON.parse(text);
+                setText('snapshot-result', 'Restored ' + res.keys + ' keys (' + res.restored.join(', ') + '). Restarting...');
+            }))
+            .catch(err => setText('snapshot-result', 'Restore rejected: ' + err.message));
+    });
+}
+
 function setupFormValidation() {
     const timeoutInput = document.querySelector('input[name="timeout"]');
     if (timeoutInput) {
@@ -357,3 +531,231 @@ function drawChart(history) {
 }
 
 // Initialization handled by window.load and setupFormValidation in main script
+
+// ========== DIAGNOSTICS PAGE ==========
+// Fed by the "diag" topic once a second. Each frame covers the second since
+// the previous one; flash totals are cumulative and turned into rates here.
+const DIAG_HISTORY = 120;   // Sparkline length in frames (2 minutes)
+
+const diag = {
+    loopMax: [],
+    cpu: [],                // Busy % of the busier core
+    heap: [],
+    flash: []               // {t, totals} for the last minute
+};
+
+function pushHistory(list, value) {
+    list.push(value);
+    if (list.length > DIAG_HISTORY) list.shift();
+}
+
+function formatBytes(n) {
+    if (n >= 1048576) return (n / 1048576).toFixed(1) + ' MB';
+    if (n >= 1024) return (n / 1024).toFixed(1) + ' KB';
+    return n + ' B';
+}
+
+function setText(id, text) {
+    const el = document.getElementById(id);
+    if (el) el.textContent = text;
+}
+
+function updateDiagnostics(d) {
+    // Loop period: bucket b holds periods below minUs << b (the last is open)
+    const counts = d.loop.counts;
+    const loops = counts.reduce((a, b) => a + b, 0);
+    let p99 = 0;
+    for (let b = 0, seen = 0; b < counts.length; b++) {
+        seen += counts[b];
+        if (seen >= loops * 0.99) {
+            p99 = (d.loop.minUs << b) / 1000;
+            break;
+        }
+    }
+    setText('diag-loop-rate', loops);
+    setText('diag-loop-p99', loops ? p99.toFixed(p99 < 1 ? 2 : 0) : '--');
+    setText('diag-loop-max', (d.loop.maxUs / 1000).toFixed(1));
+    drawBars('diag-loop-hist', counts);
+    pushHistory(diag.loopMax, d.loop.maxUs / 1000);
+    drawSparkline('diag-loop-spark', diag.loopMax, '#00838f');
+
+    // CPU: ticks per task and core, IDLEn is the idle time of core n
+    const totals = [0, 0];
+    const tasks = Object.keys(d.cpu).map(name => {
+        totals[0] += d.cpu[name][0];
+        totals[1] += d.cpu[name][1];
+        return {name: name, ticks: d.cpu[name]};
+    });
+    const pct = (t, core) => totals[core] ? 100 * t / totals[core] : 0;
+    const busy = [0, 1].map(core => {
+        const idle = d.cpu['IDLE' + core];
+        return idle ? 100 - pct(idle[core], core) : 100;
+    });
+    setText('diag-core0', busy[0].toFixed(0) + '% busy');
+    setText('diag-core1', busy[1].toFixed(0) + '% busy');
+    pushHistory(diag.cpu, Math.max(busy[0], busy[1]));
+    drawSparkline('diag-cpu-spark', diag.cpu, '#e91e63', 100);
+    tasks.sort((a, b) => (b.ticks[0] + b.ticks[1]) - (a.ticks[0] + a.ticks[1]));
+    const taskRows = document.getElementById('diag-tasks');
+    if (taskRows) {
+        taskRows.innerHTML = tasks.map(t =>
+            '<tr><td>' + t.name + '</td><td>' + pct(t.ticks[0], 0).toFixed(1) + '%</td><td>' +
+            pct(t.ticks[1], 1).toFixed(1) + '%</td></tr>').join('') +
+            (d.cpuUnattributed ? '<tr><td>(table full)</td><td colspan="2">' + d.cpuUnattributed + ' ticks</td></tr>' : '');
+    }
+
+    setText('diag-heap-free', formatBytes(d.heap.free));
+    setText('diag-heap-min', formatBytes(d.heap.minFree));
+    setText('diag-heap-largest', formatBytes(d.heap.largest));
+    pushHistory(diag.heap, d.heap.free / 1024);
+    drawSparkline('diag-heap-spark', diag.heap, '#2196f3');
+
+    setText('diag-ws-queues', d.ws.queues.length ? d.ws.queues.join(' / ') : 'none');
+    setText('diag-ws-pool', d.ws.poolInUse);
+    setText('diag-ws-dropped', d.ws.poolExhausted + ' / ' + d.ws.skipped);
+
+    // Flash: bytes over the last minute from the cumulative totals
+    const now = Date.now();
+    diag.flash.push({t: now, totals: d.flash});
+    while (diag.flash.length > 1 && now - diag.flash[0].t > 60000) diag.flash.shift();
+    const first = diag.flash[0].totals;
+    const flashRows = document.getElementById('diag-flash-rows');
+    if (flashRows) {
+        flashRows.innerHTML = Object.keys(d.flash).map(name =>
+            '<tr><td>' + name + '</td><td>' + formatBytes(d.flash[name]) + '</td><td>' +
+            formatBytes(d.flash[name] - (first[name] || 0)) + '</td></tr>').join('');
+    }
+}
+
+function sizeCanvas(id) {
+    const canvas = document.getElementById(id);
+    if (!canvas) return null;
+    canvas.width = canvas.parentElement.clientWidth;
+    canvas.height = canvas.parentElement.clientHeight;
+    return canvas;
+}
+
+function drawSparkline(id, values, color, fixedMax) {
+    const canvas = sizeCanvas(id);
+    if (!canvas || values.length < 2) return;
+    const ctx = canvas.getContext('2d');
+    const max = fixedMax || Math.max(...values) || 1;
+    const min = fixedMax ? 0 : Math.min(...values);
+    const range = max - min || 1;
+    const xStep = canvas.width / (DIAG_HISTORY - 1);
+    const x0 = canvas.width - (values.length - 1) * xStep;
+    ctx.strokeStyle = color;
+    ctx.lineWidth = 1.5;
+    ctx.beginPath();
+    values.forEach((v, i) => {
+        const y = canvas.height - 2 - ((v - min) / range) * (canvas.height - 4);
+        if (i === 0) ctx.moveTo(x0 + i * xStep, y);
+        else ctx.lineTo(x0 + i * xStep, y);
+    });
+    ctx.stroke();
+    ctx.fillStyle = '#999';
+    ctx.font = '10px Arial';
+    ctx.fillText(values[values.length - 1].toFixed(1) + ' (max ' + Math.max(...values).toFixed(1) + ')', 2, 10);
+}
+
+function drawBars(id, counts) {
+    const canvas = sizeCanvas(id);
+    if (!canvas) return;
+    const ctx = canvas.getContext('2d');
+    // Log-scaled heights so a handful of slow loops still shows up
+    const max = Math.log10(Math.max(...counts) + 1) || 1;
+    const w = canvas.width / counts.length;
+    counts.forEach((c, i) => {
+        const h = Math.log10(c + 1) / max * (canvas.height - 2);
+        ctx.fillStyle = i >= counts.length - 3 ? '#f44336' : '#00bcd4';   // Red from 8 ms up
+        ctx.fillRect(i * w + 1, canvas.height - h, w - 2, h);
+    });
+}
+
+
+// ========== FAULT CAPTURES ==========
+// Flight recorder windows listed from /diag/captures and drawn scope style:
+// one lane per I/O channel, then line pressure and the longest loop pass,
+// with the trigger (t = 0) marked in red.
+const CAPTURE_LANES = ['gpo1', 'gpo2', 'endStopIn', 'endStopOut', 'estop', 'inputA', 'inputB', 'inputC', 'inputD', 'auto'];
+const CAPTURE_LABEL_PX = 64;
+
+function loadCaptures() {
+    const rows = document.getElementById('capture-rows');
+    if (!rows) return;
+    fetch('/diag/captures').then(r => r.json()).then(list => {
+        setText('capture-window', list.preMs + ' ms before to ' + list.postMs + ' ms after the trigger');
+        list.captures.sort((a, b) => b.id - a.id);
+        rows.innerHTML = list.captures.map(c =>
+            '<tr><td>' + c.id + '</td><td>' + c.reason + '</td><td>' + (c.uptimeMs / 60000).toFixed(1) + ' min</td><td>' +
+            c.samples + '</td><td><a href="#" data-capture="' + c.id + '">View</a> <a href="/diag/captures?id=' + c.id +
+            '" download="capture-' + c.id + '.json">JSON</a></td></tr>').join('') ||
+            '<tr><td colspan="5">No captures yet</td></tr>';
+        rows.querySelectorAll('[data-capture]').forEach(a => a.onclick = e => {
+            e.preventDefault();
+            showCapture(a.dataset.capture);
+        });
+        if (list.captures.length) showCapture(list.captures[0].id);
+    }).catch(err => console.log('Captures unavailable: ' + err));
+}
+
+function showCapture(id) {
+    fetch('/diag/captures?id=' + id).then(r => r.json()).then(drawCapture)
+        .catch(err => setText('capture-info', 'Capture ' + id + ' unavailable: ' + err));
+}
+
+function drawCapture(c) {
+    const canvas = sizeCanvas('capture-scope');
+    if (!canvas || c.samples.length < 2) return;
+    const ctx = canvas.getContext('2d');
+    const t0 = c.samples[0][0];
+    const span = (c.samples[c.samples.length - 1][0] - t0) || 1;
+    const x = t => CAPTURE_LABEL_PX + (t - t0) / span * (canvas.width - CAPTURE_LABEL_PX - 2);
+    const laneH = 14;
+    ctx.font = '10px Arial';
+    ctx.lineWidth = 1;
+
+    // Digital lanes: step traces, up = bit set
+    CAPTURE_LANES.forEach((name, i) => {
+        const bit = c.channels.indexOf(name);
+        const top = i * laneH + 2;
+        const y = s => top + ((s[1] >> bit) & 1 ? 1 : laneH - 3);
+        ctx.fillStyle = '#999';
+        ctx.fillText(name, 0, top + 10);
+        ctx.strokeStyle = '#00838f';
+        ctx.beginPath();
+        ctx.moveTo(x(c.samples[0][0]), y(c.samples[0]));
+        for (let j = 1; j < c.samples.length; j++) {
+            ctx.lineTo(x(c.samples[j][0]), y(c.samples[j - 1]));
+            ctx.lineTo(x(c.samples[j][0]), y(c.samples[j]));
+        }
+        ctx.stroke();
+    });
+
+    // Pressure (0.1 bar) and loop period (us) share the rest, each on its own scale
+    const top = CAPTURE_LANES.length * laneH + 8;
+    const h = canvas.height - top - 2;
+    [[3, 0.1, 'bar', '#e91e63'], [2, 0.001, 'ms loop', '#2196f3']].forEach(([field, scale, unit, color], k) => {
+        const values = c.samples.map(s => s[field] * scale);
+        const max = Math.max(...values) || 1;
+        ctx.strokeStyle = color;
+        ctx.beginPath();
+        c.samples.forEach((s, j) => {
+            const y = top + h - Math.max(0, values[j]) / max * h;
+            if (j === 0) ctx.moveTo(x(s[0]), y);
+            else ctx.lineTo(x(s[0]), y);
+        });
+        ctx.stroke();
+        ctx.fillStyle = color;
+        ctx.fillText('max ' + max.toFixed(1) + ' ' + unit, 0, top + 10 + k * 12);
+    });
+
+    ctx.strokeStyle = '#f44336';
+    ctx.beginPath();
+    ctx.moveTo(x(0), 0);
+    ctx.lineTo(x(0), canvas.height);
+    ctx.stroke();
+    setText('capture-info', 'Capture ' + c.id + ': ' + c.reason + ' in ' + c.mode + ' (' + c.cycleDirection + '), ' +
+        c.count + ' samples over ' + (span / 1000).toFixed(0) + ' ms, ' + c.strokes + ' strokes since boot' +
+        (c.simulation ? ', simulated' : ''));
+}
@@ -0,0 +1,102 @@
+/*
+ * Fixed-capacity strings
+ *
+ * Inline character buffers with a compile-time capacity, for runtime paths
+ * that must not touch the heap (Arduino String allocates on every copy and
+ * concatenation). Writes that don't fit are truncated and flagged instead of
+ * growing the buffer. Platform independent, like status_publisher.h.
+ */
+
+#ifndef FIXED_STRING_H
+#define FIXED_STRING_H
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+// N is the buffer size including the terminating NUL.
+template <size_t N>
+class FixedString {
+ public:
+  static const size_t CAPACITY = N - 1;
+
+  FixedString() : len_(0), truncated_(false) { buf_[0] = '\0'; }
+  FixedString(const char* s) : len_(0), truncated_(false) { buf_[0] = '\0'; append(s); }
+
+  FixedString& operator=(const char* s) { assign(s); return *this; }
+
+  void clear() {
+    len_ = 0;
+    truncated_ = false;
+    buf_[0] = '\0';
+  }
+
+  void assign(const char* s) { clear(); append(s); }
+  void assign(const char* s, size_t n) { clear(); append(s, n); }
+
+  void append(const char* s) { if (s) append(s, strlen(s)); }
+
+  void append(const char* s, size_t n) {
+    size_t room = N - 1 - len_;
+    if (n > room) {
+      n = room;
+      truncated_ = true;
+    }
+    memcpy(buf_ + len_, s, n);
+    len_ += n;
+    buf_[len_] = '\0';
+  }
+
+  void append(char c) { append(&c, 1); }
+
+  // printf-style formatting: format() replaces the contents, appendf() adds.
+  void format(const char* fmt, ...) __attribute__((format(printf, 2, 3))) {
+    clear();
+    va_list ap;
+    va_start(ap, fmt);
+    appendv(fmt, ap);
+    va_end(ap);
+  }
+
+  void appendf(const char* fmt, ...) __attribute__((format(printf, 2, 3))) {
+    va_list ap;
+    va_start(ap, fmt);
+    appendv(fmt, ap);
+    va_end(ap);
+  }
+
+  void appendv(const char* fmt, va_list ap) {
+    int n = vsnprintf(buf_ + len_, N - len_, fmt, ap);
+    if (n < 0) {
+      buf_[len_] = '\0';
+      return;
+    }
+    if ((size_t)n >= N - len_) {
+      len_ = N - 1;
+      truncated_ = true;
+    } else {
+      len_ += n;
+    }
+  }
+
+  const char* c_str() const { return buf_; }
+  size_t length() const { return len_; }
+  bool empty() const { return len_ == 0; }
+  bool truncated() const { return truncated_; }
+
+  bool operator==(const char* s) const { return strcmp(buf_, s ? s : "") == 0; }
+  bool operator!=(const char* s) const { return !(*this == s); }
+
+ private:
+  char buf_[N];
+  size_t len_;
+  bool truncated_;
+};
+
+// Sizes from the 802.11 / WPA2 limits plus the NUL.
+typedef FixedString<33> SsidString;       // SSID: up to 32 bytes
+typedef FixedString<65> PassphraseString; // WPA2 passphrase: up to 63 chars (64 hex)
+typedef FixedString<16> IpString;         // "255.255.255.255"
+
+#endif  // FIXED_STRING_H
@@ -0,0 +1,180 @@
+/*
+ * Compressed stroke history
+ *
+ * Stroke durations change little from one stroke to the next, so instead of
+ * 32-bit values they are stored as the difference from the previous stroke,
+ * zigzag-mapped and varint-encoded (1 byte for +/-63 ms, 2 bytes for
+ * +/-8191 ms). Every HISTORY_KEYFRAME_INTERVAL strokes an absolute value
+ * (keyframe) starts a new block. Decoding can start at any block, and when
+ * the ring is full the oldest block is dropped whole. Platform independent,
+ * like status_publisher.h.
+ */
+
+#ifndef HISTORY_CODEC_H
+#define HISTORY_CODEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+const uint32_t HISTORY_KEYFRAME_INTERVAL = 16;
+const size_t VARINT_MAX_BYTES = 5;
+
+// ========== ENCODING ==========
+inline uint32_t zigzagEncode(int32_t v) { return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31); }
+inline int32_t zigzagDecode(uint32_t v) { return (int32_t)(v >> 1) ^ -(int32_t)(v & 1); }
+
+inline size_t varintLength(uint32_t v) {
+  size_t n = 1;
+  while (v >= 0x80) {
+    v >>= 7;
+    n++;
+  }
+  return n;
+}
+
+inline size_t varintEncode(uint32_t v, uint8_t* out) {
+  size_t n = 0;
+  while (v >= 0x80) {
+    out[n++] = (uint8_t)(v | 0x80);
+    v >>= 7;
+  }
+  out[n++] = (uint8_t)v;
+  return n;
+}
+
+// ========== HISTORY RING ==========
+// BYTES of encoded data plus a 2-byte start offset per block. Entries are
+// indexed 0 (oldest kept) .. count()-1 (newest). Not locked internally.
+template <size_t BYTES>
+class CompressedHistory {
+ public:
+  static const size_t MAX_BLOCKS = BYTES / HISTORY_KEYFRAME_INTERVAL + 2;
+
+  CompressedHistory() { clear(); }
+
+  void clear() {
+    firstBlock_ = 0;
+    blockCount_ = 0;
+    lastBlockCount_ = 0;
+    writePos_ = 0;
+    used_ = 0;
+    prev_ = 0;
+    total_ = 0;
+  }
+
+  void append(uint32_t v) {
+    bool keyframe = (blockCount_ == 0 || lastBlockCount_ == HISTORY_KEYFRAME_INTERVAL);
+    uint32_t code = keyframe ? v : zigzagEncode((int32_t)(v - prev_));
+    size_t n = varintLength(code);
+
+    // A full block is at most BYTES / 2, so there are always at least two
+    // blocks when space runs out and the one being appended to survives
+    while (blockCount_ > 1 && (used_ + n > BYTES || (keyframe && blockCount_ == MAX_BLOCKS))) {
+      dropOldest();
+    }
+
+    if (keyframe) {
+      starts_[(firstBlock_ + blockCount_) % MAX_BLOCKS] = (uint16_t)writePos_;
+      blockCount_++;
+      lastBlockCount_ = 0;
+    }
+    uint8_t buf[VARINT_MAX_BYTES];
+    varintEncode(code, buf);
+    for (size_t i = 0; i < n; i++) {
+      ring_[writePos_] = buf[i];
+      writePos_ = (writePos_ + 1) % BYTES;
+    }
+    used_ += n;
+    lastBlockCount_++;
+    prev_ = v;
+    total_++;
+  }
+
+  uint32_t count() const {
+    return blockCount_ == 0 ? 0 : (blockCount_ - 1) * HISTORY_KEYFRAME_INTERVAL + lastBlockCount_;
+  }
+  uint32_t total() const { return total_; }    // Appended since clear()
+  uint32_t last() const { return prev_; }
+  size_t bytesUsed() const { return used_; }
+  static size_t capacityBytes() { return BYTES; }
+
+  // Streaming decoder: yields entries from `start` to the newest in order.
+  // Costs O(1) to position (one block lookup plus at most a block of skips).
+  class Reader {
+   public:
+    Reader(const CompressedHistory& h, uint32_t start) : h_(h), remaining_(0), inBlock_(0) {
+      uint32_t n = h.count();
+      if (start >= n) return;
+      remaining_ = n - start;
+      block_ = start / HISTORY_KEYFRAME_INTERVAL;
+      openBlock();
+      for (uint32_t skip = start % HISTORY_KEYFRAME_INTERVAL; skip > 0; skip--) {
+        uint32_t v;
+        decode(&v);
+      }
+    }
+
+    bool next(uint32_t* out) {
+      if (remaining_ == 0) return false;
+      if (inBlock_ == HISTORY_KEYFRAME_INTERVAL) {
+        block_++;
+        openBlock();
+      }
+      decode(out);
+      remaining_--;
+      return true;
+    }
+
+    uint32_t remaining() const { return remaining_; }
+
+   private:
+    void openBlock() {
+      pos_ = h_.starts_[(h_.firstBlock_ + block_) % MAX_BLOCKS];
+      inBlock_ = 0;
+    }
+
+    void decode(uint32_t* out) {
+      uint32_t code = 0;
+      for (int shift = 0; shift < 35; shift += 7) {
+        uint8_t b = h_.ring_[pos_];
+        pos_ = (pos_ + 1) % BYTES;
+        code |= (uint32_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) break;
+      }
+      value_ = (inBlock_ == 0) ? code : value_ + zigzagDecode(code);
+      inBlock_++;
+      *out = value_;
+    }
+
+    const CompressedHistory& h_;
+    uint32_t remaining_;
+    uint32_t block_;
+    uint32_t inBlock_;
+    size_t pos_;
+    uint32_t value_;
+  };
+
+ private:
+  void dropOldest() {
+    size_t start = starts_[firstBlock_];
+    size_t next = starts_[(firstBlock_ + 1) % MAX_BLOCKS];
+    used_ -= (next + BYTES - start) % BYTES;
+    firstBlock_ = (firstBlock_ + 1) % MAX_BLOCKS;
+    blockCount_--;
+  }
+
+  static_assert(BYTES >= 2 * HISTORY_KEYFRAME_INTERVAL * VARINT_MAX_BYTES, "History ring must hold two full blocks");
+  static_assert(BYTES <= 65535, "Block offsets are 16-bit");
+
+  uint8_t ring_[BYTES];
+  uint16_t starts_[MAX_BLOCKS];
+  uint32_t firstBlock_;
+  uint32_t blockCount_;
+  uint32_t lastBlockCount_;
+  size_t writePos_;
+  size_t used_;
+  uint32_t prev_;
+  uint32_t total_;
+};
+
+#endif  // HISTORY_CODEC_H
@@ -15,6 +15,22 @@
 #include <LittleFS.h>
 #include <Update.h>
 #include <ArduinoJson.h>
+#include <esp_partition.h>
+#include <esp_ota_ops.h>
+#include <mbedtls/sha256.h>
+#include <nvs.h>
+#include <sys/time.h>
+#include <new>
+#include <esp_netif.h>
+#include <lwip/tcpip.h>
+#include <lwip/etharp.h>
+#include <lwip/dhcp.h>
+#include <esp_freertos_hooks.h>
+#include <driver/adc.h>
+#include <AsyncTCP.h>
+#include "status_publisher.h"
+#include "fixed_string.h"
+#include "history_codec.h"
 
 // ========== PIN DEFINITIONS ==========
 // GPO Outputs - Control SSRs for hydraulic valve
@@ -35,21 +51,37 @@ const int ENDSTOP_OUT_PIN = 33;  // End stop for "out" position
 const int ESTOP_PIN = 27;        // Emergency Stop (Normally Closed Switch) -> OPEN = STOP
 
 // ========== CONSTANTS ==========
-const unsigned long DEBOUNCE_DELAY = 50;  // Debounce time in milliseconds
+const unsigned long DEBOUNCE_DELAY = 50;  // Debounce window (ms) until an input is calibrated
 const unsigned long CYCLE_DELAY = 500;    // Delay between cycle direction changes
 const unsigned long DEFAULT_CYCLE_TIMEOUT = 30000;  // Default 30 seconds timeout
 const unsigned long STATUS_UPDATE_INTERVAL = 1000; // WebSocket broadcast interval (ms)
 
+// Memory budget (see MEMORY MAP; the split is checked at compile time)
+const size_t MEMORY_APP_BUDGET = 192 * 1024;       // Internal DRAM this firmware may claim once WiFi/lwIP are up
+const size_t MEMORY_ARENA_BUDGET = 64 * 1024;      // Boot-time arena for diagnostic rings and tables
+const size_t MEMORY_STATIC_BUDGET = 12 * 1024;     // Fixed subsystem buffers in .bss
+const size_t MEMORY_NETWORK_RESERVE = 64 * 1024;   // Free heap kept for AsyncTCP buffers and WebSocket queues
+
+// Static asset RAM cache (hot web files served from memory instead of flash)
+const size_t ASSET_CACHE_BUDGET = 32 * 1024;        // Most the cache may be set to hold (reserved in MEMORY MAP)
+const size_t ASSET_CACHE_MAX_FILE = 16 * 1024;      // Larger files are always served from flash
+const size_t ASSET_CACHE_HEAP_RESERVE = MEMORY_NETWORK_RESERVE;  // Never cache if free heap would drop below this
+const unsigned long ASSET_CACHE_REVALIDATE_MS = 5000; // Min time between size/mtime checks per asset
+
 // ========== GLOBAL OBJECTS ==========
 AsyncWebServer server(80);
 AsyncWebSocket ws("/ws");
 Preferences preferences;
+// notifyClients() runs on the loop task, WebSocket events and /status on the
+// AsyncTCP task; this lock serializes use of the shared status snapshot/frame.
+SemaphoreHandle_t statusLock = NULL;  // Created in setup()
 
 // ========== CONFIGURATION VARIABLES ==========
-String wifiSSID = "";
-String wifiPassword = "";
+SsidString wifiSSID;
+PassphraseString wifiPassword;
 unsigned long cycleTimeout = DEFAULT_CYCLE_TIMEOUT;  // Configurable via web interface
 bool timeoutEnabled = true;
+size_t assetCacheBudget = ASSET_CACHE_BUDGET;        // POST /diag/cache?budget=, up to ASSET_CACHE_BUDGET
 
 // ========== STATE VARIABLES ==========
 // System mode
@@ -76,6 +108,15 @@ struct ButtonState {
   unsigned long lastPressTime; // For UI visualization
 };
 
+// Remote inputs, indexing the per-input debounce windows
+enum RemoteInput {
+  REMOTE_A,
+  REMOTE_B,
+  REMOTE_C,
+  REMOTE_D,
+  REMOTE_COUNT
+};
+
 ButtonState inputA = {HIGH, HIGH, 0, false, 0};
 ButtonState inputB = {HIGH, HIGH, 0, false, 0};
 ButtonState inputC = {HIGH, HIGH, 0, false, 0};
@@ -89,13 +130,49 @@ unsigned long lastStatusUpdate = 0; // Track last WebSocket broadcast
 bool lastEndStopIn = HIGH;
 bool lastEndStopOut = HIGH;
 
+// End-stop health tracking slots (see SENSOR HEALTH)
+enum SensorId {
+  SENSOR_ENDSTOP_IN,
+  SENSOR_ENDSTOP_OUT,
+  SENSOR_COUNT
+};
+
+// Alarm rule slots (see ALARMS)
+enum AlarmId {
+  ALARM_STROKE_TIME,
+  ALARM_STROKE_RATE,
+  ALARM_SENSOR_HEALTH,
+  ALARM_PRESSURE_HIGH,
+  ALARM_VALVE_RESPONSE,
+  ALARM_ESTOP,
+  ALARM_TIMEOUT,
+  ALARM_BOTH_END_STOPS,
+  ALARM_OVERPRESSURE,
+  ALARM_COUNT
+};
+
 // Emergency Stop State
 bool isEstopActive = false;
 
+// Set by an overpressure trip (see PRESSURE MONITORING): manual jog stays
+// blocked until both buttons are released
+bool pressureLatched = false;
+
 // Cycle Statistics
-unsigned long cycleDurations[20];
-int cycleIndex = 0;
-int cycleCount = 0;
+// Every stroke duration is kept in a delta + varint compressed ring (see
+// history_codec.h): ~2 bytes per stroke instead of 4, so the same RAM holds
+// several hundred strokes instead of the last 20. The status frame still
+// carries the newest STATUS_HISTORY_LEN; GET /history streams all of them.
+const size_t STROKE_HISTORY_BYTES = 1024;
+typedef CompressedHistory<STROKE_HISTORY_BYTES> StrokeHistory;
+StrokeHistory strokeHistory;  // Written on the loop task under statusLock
+// Per-stroke peak and mean line pressure in 0.1 bar (see PRESSURE MONITORING),
+// same codec, carved from the arena
+StrokeHistory* pressurePeakHistory = NULL;
+StrokeHistory* pressureMeanHistory = NULL;
+// Per-travel valve response and travel time in us (see VALVE RESPONSE),
+// [IN, OUT][response, travel], carved from the arena
+StrokeHistory* valveHistory[2][2] = {{NULL, NULL}, {NULL, NULL}};
 unsigned long lastDuration = 0;
 unsigned long avgDuration = 0;
 
@@ -103,533 +180,7453 @@ void updateStats(unsigned long duration) {
   // Filter out invalid durations (e.g. initial boot noise)
   if (duration < 100) return;
 
-  cycleDurations[cycleIndex] = duration;
-  cycleIndex = (cycleIndex + 1) % 20;
-  if (cycleCount < 20) cycleCount++;
-  
+  xSemaphoreTake(statusLock, portMAX_DELAY);
+  strokeHistory.append(duration);
+
+  // Average over the same window the UI chart shows
+  uint32_t n = strokeHistory.count();
+  uint32_t window = min(n, (uint32_t)STATUS_HISTORY_LEN);
+  StrokeHistory::Reader reader(strokeHistory, n - window);
   unsigned long sum = 0;
-  for (int i=0; i<cycleCount; i++) sum += cycleDurations[i];
-  avgDuration = sum / cycleCount;
+  uint32_t v;
+  while (reader.next(&v)) sum += v;
+  avgDuration = sum / window;
   lastDuration = duration;
+  xSemaphoreGive(statusLock);
 }
 
+// ========== ALLOCATION-FREE FORMATTING ==========
+// Runtime logging and formatting go through fixed-size buffers instead of
+// Arduino String. Serial.printf is also avoided for long lines because it
+// falls back to malloc past 64 characters.
+const size_t LOG_LINE_MAX = 128;
 
-// ========== FORWARD DECLARATIONS ==========
-void updateButtonState(ButtonState* btn, int pin);
-void handleManualMode();
-void handleAutoLoopMode();
-void handleSaveSettings(AsyncWebServerRequest *request);
-void handleSetWiFi(AsyncWebServerRequest *request);
-String getStatusJson();
-void notifyClients();
-void onWsEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len);
-void loadSettings();
-void saveSettings();
-void setupWiFi();
-void setupOTA();
-void setupWebServer();
+void logLine(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+void logLine(const char* fmt, ...) {
+  FixedString<LOG_LINE_MAX> line;
+  va_list ap;
+  va_start(ap, fmt);
+  line.appendv(fmt, ap);
+  va_end(ap);
+  Serial.println(line.c_str());
+}
 
-// ========== SETUP ==========
-void setup() {
-  // Initialize serial for debugging
-  Serial.begin(115200);
-  Serial.println("ESP32 Grout Pump Control System Starting...");
-  
-  // Configure GPO pins as outputs
-  pinMode(GPO1_PIN, OUTPUT);
-  pinMode(GPO2_PIN, OUTPUT);
-  digitalWrite(GPO1_PIN, LOW);
-  digitalWrite(GPO2_PIN, LOW);
-  
-  // Configure GPI pins as inputs with internal pull-up resistors
-  // All pins now support internal pull-ups - no external resistors needed!
-  pinMode(INPUT_A_PIN, INPUT_PULLUP);
-  pinMode(INPUT_B_PIN, INPUT_PULLUP);
-  pinMode(INPUT_C_PIN, INPUT_PULLUP);
-  pinMode(INPUT_D_PIN, INPUT_PULLUP);
-  pinMode(ENDSTOP_IN_PIN, INPUT_PULLUP);
-  pinMode(ENDSTOP_OUT_PIN, INPUT_PULLUP);
-  pinMode(ESTOP_PIN, INPUT_PULLUP);
-  
-  Serial.println("System initialized in MANUAL mode");
-  Serial.println("Pin Configuration:");
-  Serial.println("  GPO1 (SSR1): GPIO " + String(GPO1_PIN));
-  Serial.println("  GPO2 (SSR2): GPIO " + String(GPO2_PIN));
-  Serial.println("  Input A (Manual GPO1): GPIO " + String(INPUT_A_PIN));
-  Serial.println("  Input B (Manual GPO2): GPIO " + String(INPUT_B_PIN));
-  Serial.println("  Input C (Start Loop): GPIO " + String(INPUT_C_PIN));
-  Serial.println("  Input D (Stop Loop): GPIO " + String(INPUT_D_PIN));
-  Serial.println("  End Stop IN: GPIO " + String(ENDSTOP_IN_PIN));
-  Serial.println("  End Stop OUT: GPIO " + String(ENDSTOP_OUT_PIN));
-  Serial.println("  E-STOP (NC): GPIO " + String(ESTOP_PIN));
-  Serial.println("  All inputs use internal pull-ups - no external resistors needed!");
-  
-  // Initialize LittleFS for web files
-  if (!LittleFS.begin(true)) {
-    Serial.println("LittleFS mount failed! Web interface may not work.");
-    Serial.println("Upload filesystem files using: pio run --target uploadfs");
-  } else {
-    Serial.println("LittleFS mounted successfully");
-  }
-  
-  // Load settings from flash
-  loadSettings();
-  
-  // Setup WiFi connection
-  setupWiFi();
-  
-  // Setup OTA updates
-  setupOTA();
-  
-  // Setup web server
-  setupWebServer();
-  
-  Serial.println("Setup complete!");
+IpString formatIp(const IPAddress& ip) {
+  IpString s;
+  s.format("%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+  return s;
 }
 
-// ========== MAIN LOOP ==========
-void loop() {
-  bool stateChanged = false;
+// ========== HEAP ALLOCATION COUNTER ==========
+// malloc/calloc/realloc are wrapped at link time (-Wl,--wrap in
+// platformio.ini; operator new and Arduino String go through them). Calls
+// made on the loop task are charged to the section it is in, which shows
+// whether the control tick and status path allocate in steady state
+// (GET /diag/alloc). The wrappers run for every task, so they stay cheap.
+enum AllocSection {
+  ALLOC_OTHER,
+  ALLOC_CONTROL,          // loop() outside the status path
+  ALLOC_STATUS_RENDER,    // Status capture and serialization
+  ALLOC_STATUS_SEND,      // WebSocket transport (library-owned buffers)
+  ALLOC_SECTION_COUNT
+};
+const char* const ALLOC_SECTION_NAMES[ALLOC_SECTION_COUNT] = {"other", "control", "statusRender", "statusSend"};
 
-  // Handle OTA updates
-  ArduinoOTA.handle();
-  
-  // WebSocket cleanup
-  ws.cleanupClients();
-  
-  // Check Emergency Stop (Normal Open logic for NC switch: HIGH = Open/Triggered)
-  if (digitalRead(ESTOP_PIN) == HIGH) {
-    if (!isEstopActive) {
-      Serial.println("!!! EMERGENCY STOP ACTIVATED !!!");
-      isEstopActive = true;
-      stateChanged = true;
-    }
-    
-    // Safety: Force everything off immediately
-    digitalWrite(GPO1_PIN, LOW);
-    digitalWrite(GPO2_PIN, LOW);
-    currentMode = MODE_MANUAL;
-    cycleDirection = CYCLE_STOPPED;
-    
-    // Immediately notify on ESTOP
-    if (stateChanged) notifyClients();
+struct AllocCounter {
+  uint32_t calls;
+  uint32_t bytes;
+};
 
-    // Skip remaining logic
-    return;
-  } else {
-    // ESTOP Released
-    if (isEstopActive) {
-      Serial.println("Emergency Stop Released - Returning to MANUAL mode");
-      isEstopActive = false;
-      stateChanged = true;
-    }
+volatile uint32_t allocTotalCalls = 0;        // All tasks
+AllocCounter allocLoopCounters[ALLOC_SECTION_COUNT];
+TaskHandle_t allocLoopTask = NULL;            // Set in setup() (setup and loop share the task)
+volatile uint8_t allocSection = ALLOC_OTHER;  // Only written by the loop task
+
+inline void allocNote(size_t size) {
+  __atomic_fetch_add(&allocTotalCalls, 1, __ATOMIC_RELAXED);
+  if (allocLoopTask && xTaskGetCurrentTaskHandle() == allocLoopTask) {
+    allocLoopCounters[allocSection].calls++;
+    allocLoopCounters[allocSection].bytes += size;
   }
+}
 
-  // Read and debounce all inputs
-  updateButtonState(&inputA, INPUT_A_PIN);
-  updateButtonState(&inputB, INPUT_B_PIN);
-  updateButtonState(&inputC, INPUT_C_PIN);
-  updateButtonState(&inputD, INPUT_D_PIN);
+extern "C" {
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t n, size_t size);
+void* __real_realloc(void* ptr, size_t size);
 
-  // Debug Output for Endstops
-  bool currentEndStopIn = digitalRead(ENDSTOP_IN_PIN);
-  bool currentEndStopOut = digitalRead(ENDSTOP_OUT_PIN);
+void* __wrap_malloc(size_t size) {
+  allocNote(size);
+  return __real_malloc(size);
+}
 
-  if (currentEndStopIn != lastEndStopIn) {
-    if (currentEndStopIn == HIGH) Serial.println("DEBUG: End Stop IN Triggered!");
-    else Serial.println("DEBUG: End Stop IN Released.");
-    lastEndStopIn = currentEndStopIn;
-    stateChanged = true;
-  }
+void* __wrap_calloc(size_t n, size_t size) {
+  allocNote(n * size);
+  return __real_calloc(n, size);
+}
 
-  if (currentEndStopOut != lastEndStopOut) {
-    if (currentEndStopOut == HIGH) Serial.println("DEBUG: End Stop OUT Triggered!");
-    else Serial.println("DEBUG: End Stop OUT Released.");
-    lastEndStopOut = currentEndStopOut;
-    stateChanged = true;
+void* __wrap_realloc(void* ptr, size_t size) {
+  allocNote(size);
+  return __real_realloc(ptr, size);
+}
+}
+
+// Charges loop-task allocations in the enclosing scope to `section`.
+// No-op on other tasks.
+class AllocSectionScope {
+ public:
+  explicit AllocSectionScope(uint8_t section) : active_(xTaskGetCurrentTaskHandle() == allocLoopTask), prev_(allocSection) {
+    if (active_) allocSection = section;
   }
-  
-  // Check for mode change requests
-  // Start AUTO loop
-  if (inputC.pressed) {
-    if (currentMode != MODE_AUTO_LOOP) {
-      currentMode = MODE_AUTO_LOOP;
-      // Resume from last direction, or default to OUT if unknown
-      if (cycleDirection == CYCLE_STOPPED) {
-        cycleDirection = CYCLE_OUT;
-      }
-      lastCycleTime = millis();
-      cycleStartTime = millis();  // Start timeout timer
-      Serial.println("Switched to AUTO LOOP mode");
-      stateChanged = true;
-    }
-    inputC.pressed = false;
+  ~AllocSectionScope() {
+    if (active_) allocSection = prev_;
   }
-  
-  // Stop AUTO loop
-  if (inputD.pressed || ((currentMode == MODE_AUTO_LOOP) && (inputA.pressed || inputB.pressed))) {
-    if (currentMode == MODE_AUTO_LOOP) {
-      currentMode = MODE_MANUAL;
-      // Do NOT reset cycleDirection -> Keep it for resuming later
-      digitalWrite(GPO1_PIN, LOW);
-      digitalWrite(GPO2_PIN, LOW);
-      Serial.println("Switched to MANUAL mode");
-      stateChanged = true;
-    }
-    inputD.pressed = false;
+ private:
+  bool active_;
+  uint8_t prev_;
+};
+
+#define ALLOC_SECTION(section) AllocSectionScope _allocSection(section)
+
+size_t getAllocJson(char* out, size_t cap) {
+  StaticJsonDocument<512> doc;
+  doc["totalCalls"] = allocTotalCalls;
+  JsonObject loopTask = doc.createNestedObject("loopTask");
+  for (int i = 0; i < ALLOC_SECTION_COUNT; i++) {
+    JsonObject c = loopTask.createNestedObject(ALLOC_SECTION_NAMES[i]);
+    c["calls"] = allocLoopCounters[i].calls;
+    c["bytes"] = allocLoopCounters[i].bytes;
   }
-  
-  // Capture Pre-Execution State
-  int prevGPO1 = digitalRead(GPO1_PIN);
-  int prevGPO2 = digitalRead(GPO2_PIN);
-  CycleDirection prevCycleDir = cycleDirection;
+  doc["freeHeap"] = ESP.getFreeHeap();
+  doc["largestBlock"] = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+  doc["minFreeHeap"] = ESP.getMinFreeHeap();
+  return serializeJson(doc, out, cap);
+}
 
-  // Execute based on current mode
-  if (currentMode == MODE_MANUAL) {
-    handleManualMode();
-  } else {
-    handleAutoLoopMode();
+// ========== MEMORY ARENA ==========
+// Rings and tables are carved from one block allocated first thing at boot,
+// before WiFi and the web server fragment the heap. Nothing is ever freed
+// back; each subsystem takes its slice once in its init function.
+struct MemoryArena {
+  uint8_t* base;
+  size_t size;
+  size_t used;
+};
+
+MemoryArena memArena = {NULL, 0, 0};
+
+void memoryArenaInit() {
+  memArena.base = (uint8_t*)heap_caps_malloc(MEMORY_ARENA_BUDGET, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  memArena.size = memArena.base ? MEMORY_ARENA_BUDGET : 0;
+  memArena.used = 0;
+  if (!memArena.base) logLine("ERROR: memory arena (%lu bytes) not allocated", (unsigned long)MEMORY_ARENA_BUDGET);
+}
+
+// Returns zeroed, 4-byte aligned memory, or NULL if the arena is exhausted.
+void* arenaAlloc(const char* owner, size_t bytes) {
+  bytes = (bytes + 3) & ~(size_t)3;
+  if (!memArena.base || memArena.used + bytes > memArena.size) {
+    logLine("ERROR: memory arena exhausted allocating %lu bytes for %s", (unsigned long)bytes, owner);
+    return NULL;
   }
+  void* p = memArena.base + memArena.used;
+  memArena.used += bytes;
+  memset(p, 0, bytes);
+  return p;
+}
 
-  // Check Post-Execution State for changes
-  if (digitalRead(GPO1_PIN) != prevGPO1) stateChanged = true;
-  if (digitalRead(GPO2_PIN) != prevGPO2) stateChanged = true;
-  if (cycleDirection != prevCycleDir) stateChanged = true;
+// ========== I/O LAYER ==========
+// All pin access from the control logic goes through these helpers so the
+// simulation mode can mask the SSR outputs and substitute modelled inputs.
+// Output state is tracked as the *commanded* level, not read back from the pad.
+int gpo1Level = LOW;
+int gpo2Level = LOW;
 
-  // Broadcast status via WebSocket if Changed OR Timer Expired
-  if (stateChanged || (millis() - lastStatusUpdate > STATUS_UPDATE_INTERVAL)) {
-    notifyClients();
-    lastStatusUpdate = millis();
+// Switching counters since boot for the wear model (see OUTPUT WEAR). Only
+// real pad switching counts; simulation never drives the SSRs.
+const int OUTPUT_COUNT = 2;
+const char* const OUTPUT_NAMES[OUTPUT_COUNT] = {"gpo1", "gpo2"};
+
+struct OutputCounters {
+  uint32_t cycles;              // Energize operations (off -> on)
+  uint64_t energizedMs;         // Completed on-time
+  unsigned long onSinceMs;
+};
+
+OutputCounters outputCounters[OUTPUT_COUNT];
+// Device clock of each output's last off -> on command (simulated too), the
+// start of the valve response time (see VALVE RESPONSE)
+int64_t outputOnUs[OUTPUT_COUNT] = {0, 0};
+
+void outputCountSwitch(int idx, int from, int to) {
+  if (from == to) return;
+  OutputCounters& c = outputCounters[idx];
+  if (to == HIGH) {
+    c.cycles++;
+    c.onSinceMs = millis();
+  } else {
+    c.energizedMs += millis() - c.onSinceMs;
   }
 }
 
-// ========== BUTTON DEBOUNCING ==========
-void updateButtonState(ButtonState* btn, int pin) {
-  bool reading = digitalRead(pin);
-  
-  // If the switch changed, due to noise or pressing
-  if (reading != btn->lastState) {
-    btn->lastDebounceTime = millis();
+// ========== SIMULATION (DRY RUN) ==========
+// When enabled, the SSR outputs are never driven and a cylinder model produces
+// the end-stop signals from the commanded direction. Everything else (stats,
+// WebSocket, logs) runs unchanged, so a bare bench board can soak-test the
+// firmware. Simulated remote presses can be injected via POST /sim/press.
+enum SimFault {
+  SIM_FAULT_NONE,
+  SIM_FAULT_STALL,      // Cylinder doesn't move, no pressure (-> cycle timeout)
+  SIM_FAULT_CLOG,       // Cylinder doesn't move, pressure builds (-> overpressure trip)
+  SIM_FAULT_DEAD_IN,    // IN sensor never triggers
+  SIM_FAULT_DEAD_OUT,   // OUT sensor never triggers
+  SIM_FAULT_STUCK_IN,   // IN sensor always triggered
+  SIM_FAULT_STUCK_OUT,  // OUT sensor always triggered
+  SIM_FAULT_ESTOP       // E-stop circuit open
+};
+const char* SIM_FAULT_NAMES[] = {"none", "stall", "clog", "deadIn", "deadOut", "stuckIn", "stuckOut", "estop"};
+const int SIM_FAULT_COUNT = sizeof(SIM_FAULT_NAMES) / sizeof(SIM_FAULT_NAMES[0]);
+
+const unsigned long DEFAULT_SIM_STROKE_MS = 3000;
+const unsigned long SIM_BOUNCE_TOGGLE_MS = 2;  // Chatter period while bouncing
+
+bool simEnabled = false;
+volatile int simRequest = -1;  // Pending enable(1)/disable(0) from the web task, applied in loop()
+unsigned long simStrokeInMs = DEFAULT_SIM_STROKE_MS;
+unsigned long simStrokeOutMs = DEFAULT_SIM_STROKE_MS;
+int simJitterPct = 5;              // Random per-stroke speed variation
+unsigned long simBounceMs = 0;     // End-stop chatter duration on arrival
+unsigned long simValveMs = 40;     // Command to first movement (valve response)
+volatile SimFault simFault = SIM_FAULT_NONE;
+volatile unsigned long simPressUntil[4] = {0, 0, 0, 0};  // Inputs A-D held LOW until
+
+struct SimCylinder {
+  float position;            // 0.0 = fully IN, 1.0 = fully OUT
+  float speedFactor;         // Jitter applied to the current stroke
+  int lastDir;               // -1 IN, +1 OUT, 0 stopped
+  unsigned long dirSinceUs;  // When the current direction was commanded
+  unsigned long lastUpdateUs;
+  unsigned long arrivedInMs;
+  unsigned long arrivedOutMs;
+};
+
+SimCylinder simCylinder = {0.0f, 1.0f, 0, 0, 0, 0, 0};
+
+void simReset() {
+  simCylinder.position = 0.0f;  // Start retracted on the IN end stop
+  simCylinder.speedFactor = 1.0f;
+  simCylinder.lastDir = 0;
+  simCylinder.dirSinceUs = micros();
+  simCylinder.lastUpdateUs = micros();
+  simCylinder.arrivedInMs = millis();
+  simCylinder.arrivedOutMs = 0;
+}
+
+// Advance the cylinder model by the time since the last call.
+void simUpdate() {
+  unsigned long nowUs = micros();
+  float dtMs = (nowUs - simCylinder.lastUpdateUs) / 1000.0f;
+  simCylinder.lastUpdateUs = nowUs;
+
+  int dir = 0;
+  if (gpo1Level == HIGH && gpo2Level == LOW) dir = -1;       // GPO1 = IN
+  else if (gpo2Level == HIGH && gpo1Level == LOW) dir = 1;   // GPO2 = OUT
+
+  if (dir != simCylinder.lastDir && dir != 0) {
+    simCylinder.speedFactor = 1.0f + (random(2 * simJitterPct + 1) - simJitterPct) / 100.0f;
+    simCylinder.dirSinceUs = nowUs;
   }
-  
-  // Check if enough time has passed since last change
-  if ((millis() - btn->lastDebounceTime) > DEBOUNCE_DELAY) {
-    // If the button state has changed
-    if (reading != btn->currentState) {
-      btn->currentState = reading;
-      
-      // Detect button press event (transition from HIGH to LOW for active-low)
-      // This is edge-triggered - the flag is set on press and must be cleared by handler
-      if (btn->currentState == LOW) {
-        btn->pressed = true;
-        btn->lastPressTime = millis(); // Record timestamp for UI
-        notifyClients();
-      } else {
-        // Clear pressed flag when button is released
-        btn->pressed = false;
-      }
-    }
+  simCylinder.lastDir = dir;
+  if (dir == 0 || simFault == SIM_FAULT_STALL || simFault == SIM_FAULT_CLOG) return;
+  if (nowUs - simCylinder.dirSinceUs < simValveMs * 1000 * simCylinder.speedFactor) return;  // Spool still shifting
+
+  unsigned long strokeMs = (dir < 0) ? simStrokeInMs : simStrokeOutMs;
+  float wasAt = simCylinder.position;
+  simCylinder.position += dir * simCylinder.speedFactor * dtMs / strokeMs;
+
+  if (simCylinder.position <= 0.0f) {
+    simCylinder.position = 0.0f;
+    if (wasAt > 0.0f) simCylinder.arrivedInMs = millis();
+  } else if (simCylinder.position >= 1.0f) {
+    simCylinder.position = 1.0f;
+    if (wasAt < 1.0f) simCylinder.arrivedOutMs = millis();
   }
-  
-  btn->lastState = reading;
 }
 
-// ========== MANUAL MODE HANDLER ==========
-void handleManualMode() {
-  bool inputAPressed = (digitalRead(INPUT_A_PIN) == LOW);
-  bool inputBPressed = (digitalRead(INPUT_B_PIN) == LOW);
+// Simulated end-stop pin level (HIGH = triggered, like the NC sensors).
+int simEndStopLevel(bool inSide) {
+  if (simFault == (inSide ? SIM_FAULT_STUCK_IN : SIM_FAULT_STUCK_OUT)) return HIGH;
+  if (simFault == (inSide ? SIM_FAULT_DEAD_IN : SIM_FAULT_DEAD_OUT)) return LOW;
 
-  // Read endstops to update direction logic even in manual mode
-  bool endStopIn = (digitalRead(ENDSTOP_IN_PIN) == HIGH);
-  bool endStopOut = (digitalRead(ENDSTOP_OUT_PIN) == HIGH);
+  bool atStop = inSide ? (simCylinder.position <= 0.0f) : (simCylinder.position >= 1.0f);
+  if (!atStop) return LOW;
 
-  // Update direction based on End Stops (Top Priority)
-  // If we hit an end stop in manual mode, the NEXT auto-move must be the opposite way.
-  if (endStopIn) {
-    cycleDirection = CYCLE_OUT;
-  } else if (endStopOut) {
-    cycleDirection = CYCLE_IN;
+  unsigned long sinceArrival = millis() - (inSide ? simCylinder.arrivedInMs : simCylinder.arrivedOutMs);
+  if (sinceArrival < simBounceMs) {
+    return ((sinceArrival / SIM_BOUNCE_TOGGLE_MS) % 2 == 0) ? HIGH : LOW;
   }
+  return HIGH;
+}
 
-  // Safety: Prevent simultaneous activation of both outputs
-  if (inputAPressed && inputBPressed) {
-    // If both buttons pressed, turn off both outputs
-    digitalWrite(GPO1_PIN, LOW);
-    digitalWrite(GPO2_PIN, LOW);
-    return;
+void valveResetStats();
+bool pressureBlocksOutput();
+
+// Apply a pending enable/disable request. Always drops to MANUAL with the
+// outputs off so a rig never starts moving on a mode switch. Valve timing
+// starts over so modelled figures never mix with (or replace) real ones.
+void simApplyRequest() {
+  int request = simRequest;
+  if (request < 0) return;
+  simRequest = -1;
+
+  digitalWrite(GPO1_PIN, LOW);
+  digitalWrite(GPO2_PIN, LOW);
+  if (!simEnabled) {
+    outputCountSwitch(0, gpo1Level, LOW);
+    outputCountSwitch(1, gpo2Level, LOW);
   }
-  
-  // Input A controls GPO2 (Extend / OUT)
-  if (inputAPressed) {
-    digitalWrite(GPO1_PIN, LOW);  // Ensure other output is off
+  gpo1Level = LOW;
+  gpo2Level = LOW;
+  currentMode = MODE_MANUAL;
+  cycleDirection = CYCLE_STOPPED;
 
-    // Only extend if end stop OUT is NOT triggered
-    if (!endStopOut) {
-       digitalWrite(GPO2_PIN, HIGH);
-       cycleDirection = CYCLE_OUT;
-    } else {
-       // Safety block
-       digitalWrite(GPO2_PIN, LOW);
-    }
-  } 
-  // Input B controls GPO1 (Retract / IN)
-  else if (inputBPressed) {
-    digitalWrite(GPO2_PIN, LOW);  // Ensure other output is off
+  simEnabled = (request == 1);
+  if (simEnabled) simReset();
+  valveResetStats();
+  Serial.println(simEnabled ? "SIMULATION mode enabled - SSR outputs masked" : "SIMULATION mode disabled");
+}
 
-    // Only retract if end stop IN is NOT triggered
-    if (!endStopIn) {
-       digitalWrite(GPO1_PIN, HIGH);
-       cycleDirection = CYCLE_IN;
-    } else {
-       // Safety block
-       digitalWrite(GPO1_PIN, LOW);
-    }
-  } 
-  // No input pressed
-  else {
-    digitalWrite(GPO1_PIN, LOW);
-    digitalWrite(GPO2_PIN, LOW);
+// I/O layer entry points (see I/O LAYER above)
+void writeOutput(int pin, int level) {
+  // Never energize a valve into a line already over the trip pressure
+  if (level == HIGH && pressureBlocksOutput()) level = LOW;
+  if (pin == GPO1_PIN) {
+    if (!simEnabled) outputCountSwitch(0, gpo1Level, level);
+    if (gpo1Level == LOW && level == HIGH) outputOnUs[0] = esp_timer_get_time();
+    gpo1Level = level;
+  } else if (pin == GPO2_PIN) {
+    if (!simEnabled) outputCountSwitch(1, gpo2Level, level);
+    if (gpo2Level == LOW && level == HIGH) outputOnUs[1] = esp_timer_get_time();
+    gpo2Level = level;
   }
+  if (!simEnabled) digitalWrite(pin, level);
 }
 
-// ========== AUTO LOOP MODE HANDLER ==========
-void handleAutoLoopMode() {
-  // Endstops are Normally Closed (NC): HIGH = Triggered (Open Switch), LOW = Safe (Closed Switch)
-  bool endStopIn = (digitalRead(ENDSTOP_IN_PIN) == HIGH);
-  bool endStopOut = (digitalRead(ENDSTOP_OUT_PIN) == HIGH);
-  
-  // Safety check: Both end stops triggered simultaneously (sensor malfunction)
-  if (endStopIn && endStopOut) {
-    Serial.println("ERROR: Both end stops triggered! Stopping all outputs.");
-    digitalWrite(GPO1_PIN, LOW);
-    digitalWrite(GPO2_PIN, LOW);
-    cycleDirection = CYCLE_STOPPED;
-    currentMode = MODE_MANUAL;  // Return to manual mode for safety
-    inputC.pressed = false;
-    inputD.pressed = false;
+int readOutput(int pin) {
+  return (pin == GPO1_PIN) ? gpo1Level : gpo2Level;
+}
+
+int readInput(int pin) {
+  if (!simEnabled) return digitalRead(pin);
+
+  unsigned long now = millis();
+  switch (pin) {
+    case ENDSTOP_IN_PIN:  return simEndStopLevel(true);
+    case ENDSTOP_OUT_PIN: return simEndStopLevel(false);
+    case ESTOP_PIN:       return (simFault == SIM_FAULT_ESTOP) ? HIGH : LOW;
+    case INPUT_A_PIN:     if ((long)(simPressUntil[0] - now) > 0) return LOW; break;
+    case INPUT_B_PIN:     if ((long)(simPressUntil[1] - now) > 0) return LOW; break;
+    case INPUT_C_PIN:     if ((long)(simPressUntil[2] - now) > 0) return LOW; break;
+    case INPUT_D_PIN:     if ((long)(simPressUntil[3] - now) > 0) return LOW; break;
+  }
+  return digitalRead(pin);
+}
+
+
+// ========== STREAMED EXPORTS ==========
+// Diagnostic downloads are generated a piece at a time into a small buffer and
+// copied out as the chunked response asks for data, so dumps of any size go
+// out without a full-size copy in RAM.
+typedef size_t (*ExportNextFn)(char* out, size_t cap);  // Returns 0 when finished
+
+struct ChunkedExport {
+  ExportNextFn next;
+  char pending[192];
+  size_t pendingLen;
+  size_t pendingOff;
+};
+
+void chunkedExportBegin(ChunkedExport& x, ExportNextFn next) {
+  x.next = next;
+  x.pendingLen = x.pendingOff = 0;
+}
+
+// Fill a chunked-response buffer. Returns 0 once the generator is exhausted.
+size_t chunkedExportFill(ChunkedExport& x, uint8_t* buffer, size_t maxLen) {
+  size_t written = 0;
+  while (written < maxLen) {
+    if (x.pendingOff == x.pendingLen) {
+      x.pendingOff = 0;
+      x.pendingLen = x.next(x.pending, sizeof(x.pending));
+      if (x.pendingLen == 0) break;
+      if (x.pendingLen >= sizeof(x.pending)) x.pendingLen = sizeof(x.pending) - 1;  // snprintf truncated
+    }
+    size_t n = min(maxLen - written, x.pendingLen - x.pendingOff);
+    memcpy(buffer + written, x.pending + x.pendingOff, n);
+    x.pendingOff += n;
+    written += n;
+  }
+  return written;
+}
+
+// ---- Stroke history export ----
+// GET /history streams every stored stroke duration (oldest first), or with
+// ?series=pressurePeak / pressureMean the per-stroke pressure, or with
+// ?series=valveResponseIn etc. the per-travel valve timing. It decodes a
+// copy of the compressed ring taken under statusLock, so strokes recorded
+// during the download can't evict blocks that are still being read.
+struct HistorySeries {
+  const char* name;
+  const char* unit;
+  StrokeHistory* const* source;
+};
+
+StrokeHistory* const strokeHistoryPtr = &strokeHistory;
+const HistorySeries HISTORY_SERIES[] = {
+  {"duration",     "ms",      &strokeHistoryPtr},
+  {"pressurePeak", "0.1 bar", &pressurePeakHistory},
+  {"pressureMean", "0.1 bar", &pressureMeanHistory},
+  {"valveResponseIn",  "us", &valveHistory[0][0]},
+  {"valveTravelIn",    "us", &valveHistory[0][1]},
+  {"valveResponseOut", "us", &valveHistory[1][0]},
+  {"valveTravelOut",   "us", &valveHistory[1][1]},
+};
+const int HISTORY_SERIES_COUNT = sizeof(HISTORY_SERIES) / sizeof(HISTORY_SERIES[0]);
+
+struct HistoryExport {
+  bool active;
+  int stage;            // 0 header, 1 values, 2 footer, 3 done
+  uint32_t index;
+  const HistorySeries* series;
+  StrokeHistory copy;
+  ChunkedExport stream;
+};
+
+HistoryExport historyExport;
+
+// Next piece of JSON. Returns 0 at the end.
+size_t historyExportNext(char* out, size_t cap) {
+  HistoryExport& x = historyExport;
+  if (x.stage == 0) {
+    x.stage = 1;
+    uint32_t n = x.copy.count();
+    return snprintf(out, cap, "{\"series\":\"%s\",\"unit\":\"%s\",\"count\":%lu,\"total\":%lu,\"bytes\":%u,\"capacity\":%u,\"bytesPerStroke\":%.2f,\"history\":[",
+                    x.series->name, x.series->unit, (unsigned long)n, (unsigned long)x.copy.total(), (unsigned)x.copy.bytesUsed(),
+                    (unsigned)StrokeHistory::capacityBytes(), n ? (double)x.copy.bytesUsed() / n : 0.0);
+  }
+  if (x.stage == 1) {
+    // As many values as fit; each piece re-seeks from the nearest keyframe
+    StrokeHistory::Reader reader(x.copy, x.index);
+    size_t len = 0;
+    uint32_t v;
+    while (cap - len > 16 && reader.next(&v)) {
+      len += snprintf(out + len, cap - len, "%s%lu", x.index ? "," : "", (unsigned long)v);
+      x.index++;
+    }
+    if (reader.remaining() == 0) x.stage = 2;
+    if (len > 0) return len;
+  }
+  if (x.stage == 2) {
+    x.stage = 3;
+    return snprintf(out, cap, "]}");
+  }
+  return 0;
+}
+
+size_t historyExportFill(uint8_t* buffer, size_t maxLen, size_t index) {
+  size_t written = chunkedExportFill(historyExport.stream, buffer, maxLen);
+  if (written == 0) historyExport.active = false;
+  return written;
+}
+
+void handleHistoryDownload(AsyncWebServerRequest *request) {
+  if (historyExport.active) {
+    request->send(409, "text/plain", "History export already in progress");
     return;
   }
-  
-  // Safety check: Timeout if end-stop not reached within expected time
-  if (timeoutEnabled && (millis() - cycleStartTime > cycleTimeout)) {
-    Serial.println("ERROR: Cycle timeout! End-stop not reached within " + String(cycleTimeout) + "ms");
-    Serial.println("Stopping all outputs and returning to manual mode.");
-    digitalWrite(GPO1_PIN, LOW);
-    digitalWrite(GPO2_PIN, LOW);
-    cycleDirection = CYCLE_STOPPED;
-    currentMode = MODE_MANUAL;  // Return to manual mode for safety
-    inputC.pressed = false;
-    inputD.pressed = false;
+  const HistorySeries* series = &HISTORY_SERIES[0];
+  if (request->hasArg("series")) {
+    series = NULL;
+    for (int i = 0; i < HISTORY_SERIES_COUNT; i++) {
+      if (request->arg("series") == HISTORY_SERIES[i].name) series = &HISTORY_SERIES[i];
+    }
+    if (!series) {
+      request->send(400, "text/plain", "series must be duration, pressurePeak, pressureMean, valveResponseIn, valveTravelIn, valveResponseOut or valveTravelOut");
+      return;
+    }
+  }
+  if (!*series->source) {
+    request->send(507, "text/plain", "History not allocated (memory arena)");
+    return;
+  }
+  HistoryExport& x = historyExport;
+  x.series = series;
+  xSemaphoreTake(statusLock, portMAX_DELAY);
+  x.copy = **series->source;
+  xSemaphoreGive(statusLock);
+  x.active = true;
+  x.stage = 0;
+  x.index = 0;
+  chunkedExportBegin(x.stream, historyExportNext);
+
+  AsyncWebServerResponse *response = request->beginChunkedResponse("application/json", historyExportFill);
+  request->onDisconnect([]() { historyExport.active = false; });
+  request->send(response);
+}
+
+// ========== TRACING ==========
+// Lightweight trace points recorded into a RAM ring with CPU cycle-counter
+// timestamps and exported as Chrome Trace Event JSON (GET /diag/trace, open in
+// ui.perfetto.dev or chrome://tracing). Scopes are stored as single complete
+// ("X") events, so long-running work can be kept while short control ticks
+// are filtered out. With tracing off every trace point is one branch on
+// traceEnabled. While an export streams the ring, new events are dropped and
+// a restart is refused, so the download is one consistent snapshot.
+const int TRACE_RING_EVENTS = 1024;            // 20 bytes each, from the boot arena
+const int TRACE_CALIB_SLOTS = 32;
+const int TRACE_MAX_TASKS = 12;
+const unsigned long TRACE_RECALIBRATE_MS = 8000;  // Well inside the 32-bit CCOUNT wrap (17.9 s @ 240 MHz)
+const unsigned long TRACE_TICK_MIN_US = 100;   // Control ticks shorter than this aren't recorded
+const unsigned long TRACE_COUNTER_INTERVAL = 100;  // Periodic counters (ms)
+
+enum TracePhase { TRACE_PH_COMPLETE = 'X', TRACE_PH_COUNTER = 'C', TRACE_PH_INSTANT = 'i' };
+
+struct TraceEvent {
+  uint32_t ccount;       // Cycle counter at event (start of scope for complete events)
+  const char* name;      // Must be a string literal
+  int32_t value;         // Duration in cycles (X) or counter value (C)
+  uint16_t calib;        // Calibration sequence used to convert ccount to time
+  uint8_t phase;
+  uint8_t core;
+  uint8_t task;          // Index into traceTasks
+};
+
+// Pairs a core's cycle counter with esp_timer time so cycle stamps from both
+// cores land on one timeline (each core's CCOUNT starts at a different time).
+struct TraceCalib {
+  uint32_t ccount;
+  int64_t us;
+  uint16_t seq;
+  uint8_t core;
+};
+
+struct TraceTask {
+  TaskHandle_t handle;
+  char name[16];
+};
+
+volatile bool traceEnabled = false;
+TraceEvent* traceRing = NULL;
+uint32_t traceHead = 0;        // Next write position
+uint32_t traceCount = 0;       // Valid events in the ring
+uint32_t traceTotal = 0;       // Events recorded since start (including overwritten)
+uint32_t traceCpuMHz = 240;
+TraceCalib traceCalib[TRACE_CALIB_SLOTS];
+uint16_t traceCalibSeq = 0;
+int32_t traceCoreCalib[2] = {-1, -1};  // Current calibration seq per core
+TickType_t traceCoreCalibTick[2] = {0, 0};
+TraceTask traceTasks[TRACE_MAX_TASKS];
+int traceTaskCount = 0;
+portMUX_TYPE traceMux = portMUX_INITIALIZER_UNLOCKED;
+uint32_t traceLoopTicks = 0;
+unsigned long lastTraceCounters = 0;
+
+struct TraceExport {
+  volatile bool active;  // Set under traceMux; the ring is frozen while true
+  bool wasEnabled;
+  int stage;            // 0 header, 1 thread names, 2 events, 3 footer, 4 done
+  uint32_t index;
+  uint32_t first;
+  bool needComma;
+  int64_t originUs;
+  ChunkedExport stream;
+};
+
+TraceExport traceExport;
+
+// Called with traceMux held.
+uint8_t traceTaskIndex(TaskHandle_t handle) {
+  for (int i = 0; i < traceTaskCount; i++) {
+    if (traceTasks[i].handle == handle) return i;
+  }
+  if (traceTaskCount == TRACE_MAX_TASKS) return TRACE_MAX_TASKS - 1;  // Lump extras together
+  traceTasks[traceTaskCount].handle = handle;
+  strlcpy(traceTasks[traceTaskCount].name, pcTaskGetName(handle), sizeof(traceTasks[0].name));
+  return traceTaskCount++;
+}
+
+void traceRecord(uint8_t phase, const char* name, uint32_t ccount, int32_t value) {
+  uint8_t core = xPortGetCoreID();
+  TaskHandle_t task = xTaskGetCurrentTaskHandle();
+
+  portENTER_CRITICAL(&traceMux);
+  if (!traceRing || traceExport.active) {   // Scopes opened before an export began end here
+    portEXIT_CRITICAL(&traceMux);
+    return;
+  }
+  TickType_t tick = xTaskGetTickCount();
+  if (traceCoreCalib[core] < 0 || (tick - traceCoreCalibTick[core]) * portTICK_PERIOD_MS > TRACE_RECALIBRATE_MS) {
+    TraceCalib& c = traceCalib[traceCalibSeq % TRACE_CALIB_SLOTS];
+    c.ccount = ESP.getCycleCount();
+    c.us = esp_timer_get_time();
+    c.seq = traceCalibSeq;
+    c.core = core;
+    traceCoreCalib[core] = traceCalibSeq++;
+    traceCoreCalibTick[core] = tick;
+  }
+
+  TraceEvent& e = traceRing[traceHead];
+  e.ccount = ccount;
+  e.name = name;
+  e.value = value;
+  e.calib = traceCoreCalib[core];
+  e.phase = phase;
+  e.core = core;
+  e.task = traceTaskIndex(task);
+  traceHead = (traceHead + 1) % TRACE_RING_EVENTS;
+  if (traceCount < TRACE_RING_EVENTS) traceCount++;
+  traceTotal++;
+  portEXIT_CRITICAL(&traceMux);
+}
+
+// Records a complete event covering the enclosing C++ scope.
+class TraceScope {
+ public:
+  TraceScope(const char* name, uint32_t minCycles = 0) : name_(name), minCycles_(minCycles), active_(traceEnabled) {
+    if (active_) start_ = ESP.getCycleCount();
+  }
+  ~TraceScope() {
+    if (!active_) return;
+    uint32_t dur = ESP.getCycleCount() - start_;
+    if (dur >= minCycles_) traceRecord(TRACE_PH_COMPLETE, name_, start_, dur);
+  }
+ private:
+  const char* name_;
+  uint32_t minCycles_;
+  bool active_;
+  uint32_t start_;
+};
+
+#define TRACE_SCOPE(name) TraceScope _traceScope(name)
+#define TRACE_SCOPE_MIN_US(name, us) TraceScope _traceScope(name, (us) * traceCpuMHz)
+#define TRACE_COUNTER(name, v) do { if (traceEnabled) traceRecord(TRACE_PH_COUNTER, name, ESP.getCycleCount(), (v)); } while (0)
+#define TRACE_INSTANT(name) do { if (traceEnabled) traceRecord(TRACE_PH_INSTANT, name, ESP.getCycleCount(), 0); } while (0)
+
+void traceInit() {
+  traceRing = (TraceEvent*)arenaAlloc("traceRing", TRACE_RING_EVENTS * sizeof(TraceEvent));
+}
+
+// Caller checks traceExport.active first
+bool traceStart() {
+  if (!traceRing) return false;
+  portENTER_CRITICAL(&traceMux);
+  traceHead = traceCount = traceTotal = 0;
+  traceCoreCalib[0] = traceCoreCalib[1] = -1;
+  traceTaskCount = 0;
+  portEXIT_CRITICAL(&traceMux);
+  traceCpuMHz = ESP.getCpuFreqMHz();
+  traceEnabled = true;
+  return true;
+}
+
+void traceStop() {
+  traceEnabled = false;
+  traceExport.wasEnabled = false;   // Don't resume once an export finishes
+}
+
+// ---- Chrome Trace Event JSON export (streamed, one event per piece) ----
+
+double traceEventUs(const TraceEvent& e) {
+  const TraceCalib& c = traceCalib[e.calib % TRACE_CALIB_SLOTS];
+  return (c.us - traceExport.originUs) + (double)(int32_t)(e.ccount - c.ccount) / traceCpuMHz;
+}
+
+// Next piece of JSON. Returns 0 at the end.
+size_t traceExportNext(char* out, size_t cap) {
+  TraceExport& x = traceExport;
+  int len = 0;
+
+  while (len <= 0) {
+    if (x.stage == 0) {
+      len = snprintf(out, cap, "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"cpuMHz\":%lu,\"recorded\":%lu},\"traceEvents\":[",
+                     (unsigned long)traceCpuMHz, (unsigned long)traceTotal);
+      x.stage = 1;
+      x.index = 0;
+    } else if (x.stage == 1) {
+      if (x.index >= (uint32_t)traceTaskCount) {
+        x.stage = 2;
+        x.index = 0;
+        continue;
+      }
+      len = snprintf(out, cap, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%lu,\"args\":{\"name\":\"%s\"}}",
+                     x.needComma ? "," : "", (unsigned long)x.index, traceTasks[x.index].name);
+      x.needComma = true;
+      x.index++;
+    } else if (x.stage == 2) {
+      if (x.index >= traceCount) {
+        x.stage = 3;
+        continue;
+      }
+      const TraceEvent& e = traceRing[(x.first + x.index++) % TRACE_RING_EVENTS];
+      const TraceCalib& c = traceCalib[e.calib % TRACE_CALIB_SLOTS];
+      if (c.seq != e.calib || c.core != e.core) continue;  // Calibration overwritten; timestamp unknown
+      double ts = traceEventUs(e);
+      const char* sep = x.needComma ? "," : "";
+      if (e.phase == TRACE_PH_COMPLETE) {
+        len = snprintf(out, cap, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u,\"args\":{\"core\":%u}}",
+                       sep, e.name, ts, (double)(uint32_t)e.value / traceCpuMHz, e.task, e.core);
+      } else if (e.phase == TRACE_PH_COUNTER) {
+        len = snprintf(out, cap, "%s{\"name\":\"%s\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":1,\"tid\":%u,\"args\":{\"value\":%ld}}",
+                       sep, e.name, ts, e.task, (long)e.value);
+      } else {
+        len = snprintf(out, cap, "%s{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":1,\"tid\":%u,\"args\":{\"core\":%u}}",
+                       sep, e.name, ts, e.task, e.core);
+      }
+      x.needComma = true;
+    } else if (x.stage == 3) {
+      len = snprintf(out, cap, "]}");
+      x.stage = 4;
+    } else {
+      return 0;
+    }
+  }
+  return len;
+}
+
+size_t traceExportFill(uint8_t* buffer, size_t maxLen, size_t index) {
+  size_t written = chunkedExportFill(traceExport.stream, buffer, maxLen);
+  if (written == 0) {
+    // Export finished: resume recording if it was running
+    traceExport.active = false;
+    if (traceExport.wasEnabled) traceEnabled = true;
+  }
+  return written;
+}
+
+void handleTraceDownload(AsyncWebServerRequest *request) {
+  if (!traceRing || traceCount == 0) {
+    request->send(404, "text/plain", "No trace recorded. POST /diag/trace?action=start first.");
+    return;
+  }
+  if (traceExport.active) {
+    request->send(409, "text/plain", "Trace export already in progress");
+    return;
+  }
+
+  // Pause recording so the ring is stable while it streams out
+  TraceExport& x = traceExport;
+  x.wasEnabled = traceEnabled;
+  traceEnabled = false;
+  portENTER_CRITICAL(&traceMux);   // Waits out a record in progress on the other core
+  x.active = true;
+  portEXIT_CRITICAL(&traceMux);
+  x.stage = 0;
+  x.needComma = false;
+  chunkedExportBegin(x.stream, traceExportNext);
+  x.first = (traceHead + TRACE_RING_EVENTS - traceCount) % TRACE_RING_EVENTS;
+  x.originUs = 0;
+  // Origin = earliest calibration still referenced, keeps timestamps small
+  for (uint32_t i = 0; i < traceCount; i++) {
+    const TraceCalib& c = traceCalib[traceRing[(x.first + i) % TRACE_RING_EVENTS].calib % TRACE_CALIB_SLOTS];
+    if (x.originUs == 0 || c.us < x.originUs) x.originUs = c.us;
+  }
+
+  AsyncWebServerResponse *response = request->beginChunkedResponse("application/json", traceExportFill);
+  response->addHeader("Content-Disposition", "attachment; filename=\"groutpump-trace.json\"");
+  request->onDisconnect([]() {
+    if (traceExport.active) {
+      traceExport.active = false;
+      if (traceExport.wasEnabled) traceEnabled = true;
+    }
+  });
+  request->send(response);
+}
+
+// POST /diag/trace?action=start|stop
+void handleTraceControl(AsyncWebServerRequest *request) {
+  const String& action = request->arg("action");
+  if (action == "start") {
+    if (traceExport.active) {
+      request->send(409, "text/plain", "Trace export in progress; start again once it finishes");
+      return;
+    }
+    if (!traceStart()) {
+      request->send(507, "text/plain", "Trace ring not allocated (memory arena)");
+      return;
+    }
+  } else if (action == "stop") {
+    traceStop();
+  } else {
+    request->send(400, "text/plain", "action must be start or stop");
+    return;
+  }
+  char json[96];
+  snprintf(json, sizeof(json), "{\"enabled\":%s,\"events\":%lu,\"recorded\":%lu}",
+           traceEnabled ? "true" : "false", (unsigned long)traceCount, (unsigned long)traceTotal);
+  request->send(200, "application/json", json);
+}
+
+
+// ========== SAMPLING PROFILER ==========
+// Statistical CPU profiler. A hardware timer interrupt on each core reads the
+// program counter the core was interrupted at, plus the interrupted function's
+// return address and the running task, and counts it in a fixed hash table.
+// GET /diag/profile dumps the table as text; tools/profile/profile.py
+// symbolizes it against firmware.elf into folded stacks for a flame graph.
+// Counting in place keeps memory fixed however long the profile runs.
+const int PROFILE_TABLE_SLOTS = 1024;        // Power of two, 20 bytes each, from the boot arena
+const int PROFILE_MAX_PROBES = 8;
+const uint32_t PROFILE_DEFAULT_HZ = 997;     // Per core; off the 1 kHz tick so samples don't lock step with it
+const uint32_t PROFILE_MAX_HZ = 5000;
+const uint8_t PROFILE_TIMER_BASE = 2;        // Hardware timers 2 (core 0) and 3 (core 1)
+const uint32_t PROFILE_PC_NESTED = 1;        // Sample landed inside another interrupt handler
+
+// The interrupt dispatcher pushes an exception frame (XtExcFrame) onto the
+// interrupted task's stack and, for a first-level interrupt, stores that stack
+// pointer in the TCB's first word (pxTopOfStack).
+const int XT_FRAME_PC = 1;
+const int XT_FRAME_A0 = 3;
+extern "C" void* volatile pxCurrentTCB[];
+extern "C" volatile unsigned port_interruptNesting[];
+
+struct ProfileSlot {
+  uint32_t pc;
+  uint32_t caller;      // Call site in the interrupted function's caller (0 if unknown)
+  void* task;           // TCB of the interrupted task
+  uint32_t count;       // 0 = free slot
+  uint32_t core;
+};
+
+ProfileSlot* profileTable = NULL;   // Internal RAM (arena): the ISR also runs while the flash cache is off
+volatile bool profileRunning = false;
+uint32_t profileHz = PROFILE_DEFAULT_HZ;
+volatile uint32_t profileSamples = 0;
+volatile uint32_t profileDropped = 0;    // Table full
+volatile uint32_t profileSlotsUsed = 0;
+int64_t profileStartUs = 0;
+int64_t profileElapsedUs = 0;
+hw_timer_t* profileTimers[2] = {NULL, NULL};
+portMUX_TYPE profileMux = portMUX_INITIALIZER_UNLOCKED;
+
+void IRAM_ATTR profileSample() {
+  uint32_t core = xPortGetCoreID();
+  void* task = pxCurrentTCB[core];
+  uint32_t pc = PROFILE_PC_NESTED;
+  uint32_t caller = 0;
+  if (task && port_interruptNesting[core] == 1) {
+    const uint32_t* frame = *(const uint32_t* const*)task;
+    pc = frame[XT_FRAME_PC];
+    uint32_t a0 = frame[XT_FRAME_A0];
+    // Windowed ABI: the top two bits of a0 hold the call window size, the
+    // call instruction is the 3 bytes before the return address
+    if (a0) caller = ((a0 & 0x3FFFFFFF) | 0x40000000) - 3;
+  } else {
+    task = NULL;
+  }
+
+  uint32_t h = pc * 2654435761u ^ caller ^ ((uint32_t)(uintptr_t)task >> 2) ^ core;
+  h ^= h >> 15;
+  portENTER_CRITICAL_ISR(&profileMux);
+  profileSamples++;
+  for (int probe = 0; probe < PROFILE_MAX_PROBES; probe++) {
+    ProfileSlot& slot = profileTable[(h + probe) & (PROFILE_TABLE_SLOTS - 1)];
+    if (slot.count == 0) {
+      slot.pc = pc;
+      slot.caller = caller;
+      slot.task = task;
+      slot.core = core;
+      slot.count = 1;
+      profileSlotsUsed++;
+      portEXIT_CRITICAL_ISR(&profileMux);
+      return;
+    }
+    if (slot.pc == pc && slot.caller == caller && slot.task == task && slot.core == core) {
+      slot.count++;
+      portEXIT_CRITICAL_ISR(&profileMux);
+      return;
+    }
+  }
+  profileDropped++;
+  portEXIT_CRITICAL_ISR(&profileMux);
+}
+
+// An interrupt is bound to the core that allocates it and must be freed there
+// too, so each core's timer is set up and torn down by a short-lived task
+// pinned to that core.
+struct ProfileTimerJob {
+  int core;
+  bool start;
+  SemaphoreHandle_t done;
+};
+
+void profileTimerTask(void* arg) {
+  ProfileTimerJob* job = (ProfileTimerJob*)arg;
+  hw_timer_t*& timer = profileTimers[job->core];
+  if (job->start && !timer) {
+    timer = timerBegin(PROFILE_TIMER_BASE + job->core, 80, true);  // 1 MHz from the 80 MHz APB clock
+    timerAttachInterrupt(timer, profileSample, true);
+    timerAlarmWrite(timer, 1000000 / profileHz, true);
+    timerAlarmEnable(timer);
+  } else if (!job->start && timer) {
+    timerAlarmDisable(timer);
+    timerDetachInterrupt(timer);
+    timerEnd(timer);
+    timer = NULL;
+  }
+  xSemaphoreGive(job->done);
+  vTaskDelete(NULL);
+}
+
+void profileSetTimers(bool start) {
+  SemaphoreHandle_t done = xSemaphoreCreateBinary();
+  for (int core = 0; core < 2; core++) {
+    ProfileTimerJob job = {core, start, done};
+    if (xTaskCreatePinnedToCore(profileTimerTask, "profTimer", 2048, &job, 5, NULL, core) == pdPASS) {
+      xSemaphoreTake(done, portMAX_DELAY);
+    }
+  }
+  vSemaphoreDelete(done);
+}
+
+void profileStop() {
+  if (!profileRunning) return;
+  profileSetTimers(false);
+  profileRunning = false;
+  profileElapsedUs += esp_timer_get_time() - profileStartUs;
+}
+
+void profileInit() {
+  profileTable = (ProfileSlot*)arenaAlloc("profileTable", PROFILE_TABLE_SLOTS * sizeof(ProfileSlot));
+}
+
+// Clears the table and starts sampling at `hz` per core.
+bool profileStart(uint32_t hz) {
+  profileStop();
+  if (!profileTable) return false;
+  memset(profileTable, 0, PROFILE_TABLE_SLOTS * sizeof(ProfileSlot));
+  profileSamples = profileDropped = profileSlotsUsed = 0;
+  profileElapsedUs = 0;
+  profileHz = hz;
+  profileStartUs = esp_timer_get_time();
+  profileRunning = true;
+  profileSetTimers(true);
+  return true;
+}
+
+// ---- Text export: one "core task pc caller count" line per slot ----
+struct ProfileExport {
+  bool active;
+  int stage;            // 0 header, 1 slots, 2 done
+  uint32_t index;
+  ChunkedExport stream;
+};
+
+ProfileExport profileExport;
+
+// Task names are looked up at export time. A task deleted since it was
+// sampled leaves a stale TCB behind, so names are filtered to printable
+// characters rather than trusted.
+void profileTaskName(void* task, char* out, size_t cap) {
+  if (!task) {
+    strlcpy(out, "[isr]", cap);
+    return;
+  }
+  const char* name = pcTaskGetName((TaskHandle_t)task);
+  size_t i = 0;
+  for (; i + 1 < cap && i < 15 && name[i]; i++) {
+    char c = name[i];
+    out[i] = (isalnum((unsigned char)c) || c == '_' || c == '.' || c == '-') ? c : '?';
+  }
+  out[i] = '\0';
+  if (i == 0) strlcpy(out, "?", cap);
+}
+
+size_t profileExportNext(char* out, size_t cap) {
+  ProfileExport& x = profileExport;
+  int64_t elapsedUs = profileElapsedUs + (profileRunning ? esp_timer_get_time() - profileStartUs : 0);
+  int len = 0;
+
+  while (len <= 0) {
+    if (x.stage == 0) {
+      len = snprintf(out, cap, "# groutpump-profile v1\n# hz %lu\n# duration_ms %lu\n# samples %lu\n# dropped %lu\ncore task pc caller count\n",
+                     (unsigned long)profileHz, (unsigned long)(elapsedUs / 1000),
+                     (unsigned long)profileSamples, (unsigned long)profileDropped);
+      x.stage = 1;
+      x.index = 0;
+    } else if (x.stage == 1) {
+      if (x.index >= (uint32_t)PROFILE_TABLE_SLOTS) {
+        x.stage = 2;
+        continue;
+      }
+      portENTER_CRITICAL(&profileMux);
+      ProfileSlot slot = profileTable[x.index++];
+      portEXIT_CRITICAL(&profileMux);
+      if (slot.count == 0) continue;
+      char name[16];
+      profileTaskName(slot.task, name, sizeof(name));
+      len = snprintf(out, cap, "%lu %s 0x%08lx 0x%08lx %lu\n", (unsigned long)slot.core, name,
+                     (unsigned long)slot.pc, (unsigned long)slot.caller, (unsigned long)slot.count);
+    } else {
+      return 0;
+    }
+  }
+  return len;
+}
+
+size_t profileExportFill(uint8_t* buffer, size_t maxLen, size_t index) {
+  size_t written = chunkedExportFill(profileExport.stream, buffer, maxLen);
+  if (written == 0) profileExport.active = false;
+  return written;
+}
+
+// GET /diag/profile - sampling keeps running while the table streams out;
+// each slot is copied under the lock so lines are never torn.
+void handleProfileDownload(AsyncWebServerRequest *request) {
+  if (!profileTable || profileSamples == 0) {
+    request->send(404, "text/plain", "No profile recorded. POST /diag/profile?action=start first.");
+    return;
+  }
+  if (profileExport.active) {
+    request->send(409, "text/plain", "Profile export already in progress");
+    return;
+  }
+  profileExport.active = true;
+  profileExport.stage = 0;
+  chunkedExportBegin(profileExport.stream, profileExportNext);
+
+  AsyncWebServerResponse *response = request->beginChunkedResponse("text/plain", profileExportFill);
+  response->addHeader("Content-Disposition", "attachment; filename=\"groutpump-profile.txt\"");
+  request->onDisconnect([]() { profileExport.active = false; });
+  request->send(response);
+}
+
+// POST /diag/profile?action=start[&hz=N]|stop
+void handleProfileControl(AsyncWebServerRequest *request) {
+  const String& action = request->arg("action");
+  if (action == "start") {
+    if (profileExport.active) {
+      request->send(409, "text/plain", "Profile export in progress");
+      return;
+    }
+    uint32_t hz = PROFILE_DEFAULT_HZ;
+    if (request->hasArg("hz")) hz = constrain(request->arg("hz").toInt(), 1, (long)PROFILE_MAX_HZ);
+    if (!profileStart(hz)) {
+      request->send(507, "text/plain", "Profile table not allocated (memory arena)");
+      return;
+    }
+  } else if (action == "stop") {
+    profileStop();
+  } else {
+    request->send(400, "text/plain", "action must be start or stop");
     return;
   }
+  char json[128];
+  snprintf(json, sizeof(json), "{\"running\":%s,\"hz\":%lu,\"samples\":%lu,\"dropped\":%lu,\"slotsUsed\":%lu}",
+           profileRunning ? "true" : "false", (unsigned long)profileHz, (unsigned long)profileSamples,
+           (unsigned long)profileDropped, (unsigned long)profileSlotsUsed);
+  request->send(200, "application/json", json);
+}
+
+
+// ========== FORWARD DECLARATIONS ==========
+void updateButtonState(ButtonState* btn, int pin, int id);
+void debounceTick();
+void handleManualMode();
+void handleAutoLoopMode();
+void handleSaveSettings(AsyncWebServerRequest *request);
+void handleSetWiFi(AsyncWebServerRequest *request);
+void handleSimSettings(AsyncWebServerRequest *request);
+void handleSimPress(AsyncWebServerRequest *request);
+void handleHistoryDownload(AsyncWebServerRequest *request);
+size_t getSimJson(char* out, size_t cap);
+void captureStatus(StatusSnapshot& s);
+void notifyClients();
+void markStatusEdge(const char* source, uint64_t us = 0);
+void onWsEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len);
+void loadSettings();
+void saveSettings(bool force = false);
+void flashWearInit();
+void flashService();
+void setupWiFi();
+void setupOTA();
+void setupWebServer();
+void assetCacheWarm();
+void printMemoryMap();
+void bootMark(const char* name);
+bool fsStartMount(bool format);
+bool fsReady();
+void printBootTiming();
+void sensorHealthInit();
+void sensorHealthEdge(int id, bool active);
+void sensorHealthTick();
+void outputWearInit();
+void outputWearService();
+void valveInit();
+void otaInit();
+void otaService();
+void otaDiscard(const char* why);
+void snapshotService();
+void wifiService();
+void pressureInit();
+bool pressureService();
+void publishScope();
+void diagLoopTick();
+void publishDiagnostics();
+void handlePressureSettings(AsyncWebServerRequest *request);
+void alarmEvent(int id, float value);
+void alarmService();
+void webhookInit();
+void webhookService();
+void handleAlarmControl(AsyncWebServerRequest *request);
+void handleAlarmRule(AsyncWebServerRequest *request);
+void handleWebhookSettings(AsyncWebServerRequest *request);
+void motionService();
+void utilService();
+void utilFault();
+void recorderInit();
+void recorderTick();
+void recorderTrigger(const char* reason);
+void handleUtilization(AsyncWebServerRequest *request);
+
+// ========== SETUP ==========
+void setup() {
+  // Outputs off before anything else
+  pinMode(GPO1_PIN, OUTPUT);
+  pinMode(GPO2_PIN, OUTPUT);
+  digitalWrite(GPO1_PIN, LOW);
+  digitalWrite(GPO2_PIN, LOW);
+  bootMark("core");  // Reset to setup(): bootloader and core startup
+
+  // Initialize serial for debugging
+  Serial.begin(115200);
+  allocLoopTask = xTaskGetCurrentTaskHandle();  // Boot allocations count as "other"
+
+  // Claim the memory arena before anything else fragments the heap
+  memoryArenaInit();
+  traceInit();
+  profileInit();
+  Serial.println("ESP32 Grout Pump Control System Starting...");
+  bootMark("arena");
   
-  // Check for end stop triggers and reverse direction
-  if (cycleDirection == CYCLE_IN && endStopIn) {
-    Serial.println("End stop IN reached - switching to OUT cycle");
-    
-    // Calculate cycle time (subtracting the delay at the start of movement)
-    // Note: cycleStartTime was reset when previous end stop was hit.
-    unsigned long rawDuration = millis() - cycleStartTime;
-    // The previous cycle included a CYCLE_DELAY wait before moving.
-    // If we want pure "stroke time", subtract CYCLE_DELAY (if duration > delay).
-    if (rawDuration > CYCLE_DELAY) {
-        updateStats(rawDuration - CYCLE_DELAY);
+  // Configure GPI pins as inputs with internal pull-up resistors
+  // All pins now support internal pull-ups - no external resistors needed!
+  pinMode(INPUT_A_PIN, INPUT_PULLUP);
+  pinMode(INPUT_B_PIN, INPUT_PULLUP);
+  pinMode(INPUT_C_PIN, INPUT_PULLUP);
+  pinMode(INPUT_D_PIN, INPUT_PULLUP);
+  pinMode(ENDSTOP_IN_PIN, INPUT_PULLUP);
+  pinMode(ENDSTOP_OUT_PIN, INPUT_PULLUP);
+  pinMode(ESTOP_PIN, INPUT_PULLUP);
+  
+  Serial.println("System initialized in MANUAL mode");
+  Serial.println("Pin Configuration:");
+  logLine("  GPO1 (SSR1): GPIO %d", GPO1_PIN);
+  logLine("  GPO2 (SSR2): GPIO %d", GPO2_PIN);
+  logLine("  Input A (Manual GPO1): GPIO %d", INPUT_A_PIN);
+  logLine("  Input B (Manual GPO2): GPIO %d", INPUT_B_PIN);
+  logLine("  Input C (Start Loop): GPIO %d", INPUT_C_PIN);
+  logLine("  Input D (Stop Loop): GPIO %d", INPUT_D_PIN);
+  logLine("  End Stop IN: GPIO %d", ENDSTOP_IN_PIN);
+  logLine("  End Stop OUT: GPIO %d", ENDSTOP_OUT_PIN);
+  logLine("  E-STOP (NC): GPIO %d", ESTOP_PIN);
+  Serial.println("  All inputs use internal pull-ups - no external resistors needed!");
+  sensorHealthInit();
+  bootMark("io");
+  
+  // Load settings from flash (NVS; independent of LittleFS)
+  flashWearInit();
+  loadSettings();
+  outputWearInit();
+  otaInit();
+  valveInit();     // After output wear: loads the saved baselines
+  recorderInit();
+  pressureInit();  // After settings: the task picks up pin and calibration
+  webhookInit();
+  bootMark("settings");
+
+  // Web files: mounted in the background, never formatted implicitly
+  fsStartMount(false);
+  
+  // Setup WiFi connection
+  setupWiFi();
+  bootMark("wifi");
+  
+  // Setup OTA updates
+  setupOTA();
+  bootMark("ota");
+  
+  // Setup web server
+  statusLock = xSemaphoreCreateMutex();
+  setupWebServer();
+  bootMark("web");
+  
+  printMemoryMap();
+  printBootTiming();
+  Serial.println("Setup complete!");
+}
+
+// ========== MAIN LOOP ==========
+void loop() {
+  TRACE_SCOPE_MIN_US("controlTick", TRACE_TICK_MIN_US);
+  ALLOC_SECTION(ALLOC_CONTROL);
+  diagLoopTick();
+  recorderTick();
+  bool stateChanged = false;
+
+  // Handle OTA updates
+  {
+    TRACE_SCOPE("ota.handle");
+    ArduinoOTA.handle();
+  }
+
+  // Periodic trace counters
+  if (traceEnabled) {
+    traceLoopTicks++;
+    if (millis() - lastTraceCounters >= TRACE_COUNTER_INTERVAL) {
+      lastTraceCounters = millis();
+      TRACE_COUNTER("loop.ticks", traceLoopTicks);
+      TRACE_COUNTER("heap.free", ESP.getFreeHeap());
+      TRACE_COUNTER("ws.clients", ws.count());
+      traceLoopTicks = 0;
     }
+  }
+  
+  // WebSocket cleanup
+  ws.cleanupClients();
+
+  // Deferred flash writes and wear totals
+  flashService();
+  outputWearService();
+
+  // Restart into a verified chunked upload once its reply has gone out
+  otaService();
+  snapshotService();
+
+  // Time WiFi outages and steer the reconnect (cached AP first)
+  wifiService();
+
+  // Alarm rules and webhook delivery (before the E-stop early return)
+  alarmService();
+  webhookService();
+
+  // Simulation: apply mode switches and advance the cylinder model
+  simApplyRequest();
+  if (simEnabled) simUpdate();
+  
+  // Check Emergency Stop (Normal Open logic for NC switch: HIGH = Open/Triggered)
+  if (readInput(ESTOP_PIN) == HIGH) {
+    if (!isEstopActive) {
+      Serial.println("!!! EMERGENCY STOP ACTIVATED !!!");
+      TRACE_INSTANT("estop");
+      markStatusEdge("estop");
+      recorderTrigger("estop");
+      isEstopActive = true;
+      stateChanged = true;
+    }
+    
+    // Safety: Force everything off immediately
+    writeOutput(GPO1_PIN, LOW);
+    writeOutput(GPO2_PIN, LOW);
+    currentMode = MODE_MANUAL;
+    cycleDirection = CYCLE_STOPPED;
+    
+    // Immediately notify on ESTOP
+    if (stateChanged) notifyClients();
+    motionService();
+    utilService();
+
+    // Skip remaining logic
+    return;
+  } else {
+    // ESTOP Released
+    if (isEstopActive) {
+      Serial.println("Emergency Stop Released - Returning to MANUAL mode");
+      isEstopActive = false;
+      stateChanged = true;
+    }
+  }
+
+  // Overpressure trip raised by the pressure task
+  if (pressureService()) stateChanged = true;
+
+  // Read and debounce all inputs
+  updateButtonState(&inputA, INPUT_A_PIN, REMOTE_A);
+  updateButtonState(&inputB, INPUT_B_PIN, REMOTE_B);
+  updateButtonState(&inputC, INPUT_C_PIN, REMOTE_C);
+  updateButtonState(&inputD, INPUT_D_PIN, REMOTE_D);
+  debounceTick();
+
+  // Debug Output for Endstops
+  bool currentEndStopIn = readInput(ENDSTOP_IN_PIN);
+  bool currentEndStopOut = readInput(ENDSTOP_OUT_PIN);
+
+  if (currentEndStopIn != lastEndStopIn) {
+    if (currentEndStopIn == HIGH) Serial.println("DEBUG: End Stop IN Triggered!");
+    else Serial.println("DEBUG: End Stop IN Released.");
+    lastEndStopIn = currentEndStopIn;
+    sensorHealthEdge(SENSOR_ENDSTOP_IN, currentEndStopIn == HIGH);
+    markStatusEdge("endStopIn");
+    stateChanged = true;
+  }
+
+  if (currentEndStopOut != lastEndStopOut) {
+    if (currentEndStopOut == HIGH) Serial.println("DEBUG: End Stop OUT Triggered!");
+    else Serial.println("DEBUG: End Stop OUT Released.");
+    lastEndStopOut = currentEndStopOut;
+    sensorHealthEdge(SENSOR_ENDSTOP_OUT, currentEndStopOut == HIGH);
+    markStatusEdge("endStopOut");
+    stateChanged = true;
+  }
+  sensorHealthTick();
+  
+  // Check for mode change requests
+  // Start AUTO loop
+  if (inputC.pressed) {
+    if (currentMode != MODE_AUTO_LOOP) {
+      currentMode = MODE_AUTO_LOOP;
+      // Resume from last direction, or default to OUT if unknown
+      if (cycleDirection == CYCLE_STOPPED) {
+        cycleDirection = CYCLE_OUT;
+      }
+      lastCycleTime = millis();
+      cycleStartTime = millis();  // Start timeout timer
+      pressureLatched = false;
+      Serial.println("Switched to AUTO LOOP mode");
+      stateChanged = true;
+    }
+    inputC.pressed = false;
+  }
+  
+  // Stop AUTO loop
+  if (inputD.pressed || ((currentMode == MODE_AUTO_LOOP) && (inputA.pressed || inputB.pressed))) {
+    if (currentMode == MODE_AUTO_LOOP) {
+      currentMode = MODE_MANUAL;
+      // Do NOT reset cycleDirection -> Keep it for resuming later
+      writeOutput(GPO1_PIN, LOW);
+      writeOutput(GPO2_PIN, LOW);
+      Serial.println("Switched to MANUAL mode");
+      stateChanged = true;
+    }
+    inputD.pressed = false;
+  }
+  
+  // Capture Pre-Execution State
+  int prevGPO1 = readOutput(GPO1_PIN);
+  int prevGPO2 = readOutput(GPO2_PIN);
+  CycleDirection prevCycleDir = cycleDirection;
+
+  // Execute based on current mode
+  if (currentMode == MODE_MANUAL) {
+    handleManualMode();
+  } else {
+    handleAutoLoopMode();
+  }
+
+  // Check Post-Execution State for changes
+  if (readOutput(GPO1_PIN) != prevGPO1) stateChanged = true;
+  if (readOutput(GPO2_PIN) != prevGPO2) stateChanged = true;
+  if (cycleDirection != prevCycleDir) stateChanged = true;
+  motionService();
+  utilService();
+
+  // Broadcast status via WebSocket if Changed OR Timer Expired
+  if (stateChanged || (millis() - lastStatusUpdate > STATUS_UPDATE_INTERVAL)) {
+    notifyClients();
+    lastStatusUpdate = millis();
+  }
+  publishScope();
+  publishDiagnostics();
+}
+
+// ========== BUTTON DEBOUNCING ==========
+// Each remote input has its own window: a change is accepted once the raw
+// level has been stable that long. Windows start at DEBOUNCE_DELAY and are
+// calibrated from the inputs' own bounce. While calibrating, each burst of
+// raw edges (closed by DEBOUNCE_MAX_MS of quiet) is timed from its first to
+// its last edge; an input's window becomes its longest burst plus
+// DEBOUNCE_MARGIN_PCT, rounded up, plus one millis() tick. A raw edge within
+// DEBOUNCE_RESIDUAL_MS of an accepted change is residual bounce, i.e. the
+// window is too short. Edges are seen once per loop pass, which bounds the
+// resolution of both. Jogging reads the raw levels and is not delayed.
+const unsigned long DEBOUNCE_MIN_MS = 2;
+const unsigned long DEBOUNCE_MAX_MS = 50;
+const unsigned long DEBOUNCE_MARGIN_PCT = 50;
+const unsigned long DEBOUNCE_RESIDUAL_MS = 20;
+const unsigned long DEBOUNCE_CAL_MS = 120000;   // Calibration finishes itself after this
+const uint16_t DEBOUNCE_CAL_MIN_BURSTS = 6;     // Bursts an input needs to get a new window (3 presses)
+
+const char* const REMOTE_NAMES[REMOTE_COUNT] = {"inputA", "inputB", "inputC", "inputD"};
+
+struct DebounceInput {
+  uint16_t windowMs;
+  bool residualSeen;            // Counted once per accepted change
+  uint32_t changedMs;           // Last accepted change (0 = none yet)
+  uint32_t changes;
+  uint32_t residual;
+  // Calibration: burst being timed, and the results so far
+  bool burstOpen;
+  uint16_t burstEdges;
+  uint32_t burstStartUs;
+  uint32_t lastEdgeUs;
+  uint16_t calBursts;
+  uint16_t calEdgesMax;
+  uint32_t calBounceMaxUs;
+};
+
+enum DebounceRequest {
+  DEBOUNCE_REQ_NONE,
+  DEBOUNCE_REQ_CALIBRATE,
+  DEBOUNCE_REQ_FINISH,
+  DEBOUNCE_REQ_CANCEL,
+  DEBOUNCE_REQ_RESET
+};
+
+DebounceInput debounce[REMOTE_COUNT];
+bool debounceCalibrating = false;
+unsigned long debounceCalStartMs = 0;
+volatile int debounceRequest = DEBOUNCE_REQ_NONE;  // From the web task, applied in debounceTick()
+
+unsigned long debounceCalibratedWindow(uint32_t bounceUs) {
+  unsigned long ms = (bounceUs * (100 + DEBOUNCE_MARGIN_PCT) / 100 + 999) / 1000 + 1;
+  return constrain(ms, DEBOUNCE_MIN_MS, DEBOUNCE_MAX_MS);
+}
+
+// Raw edge on a remote input (loop task)
+void debounceEdge(int id, unsigned long nowMs) {
+  DebounceInput& d = debounce[id];
+  if (d.changedMs && !d.residualSeen && nowMs - d.changedMs < DEBOUNCE_RESIDUAL_MS) {
+    d.residualSeen = true;
+    d.residual++;
+    logLine("DEBOUNCE: %s bounced %lu ms after a change, %u ms window too short", REMOTE_NAMES[id],
+            nowMs - d.changedMs, d.windowMs);
+  }
+  if (!debounceCalibrating) return;
+  uint32_t us = (uint32_t)esp_timer_get_time();
+  if (!d.burstOpen) {
+    d.burstOpen = true;
+    d.burstEdges = 0;
+    d.burstStartUs = us;
+  }
+  d.burstEdges++;
+  d.lastEdgeUs = us;
+}
+
+void debounceStartCalibration() {
+  for (int i = 0; i < REMOTE_COUNT; i++) {
+    DebounceInput& d = debounce[i];
+    d.burstOpen = false;
+    d.calBursts = 0;
+    d.calEdgesMax = 0;
+    d.calBounceMaxUs = 0;
+  }
+  debounceCalibrating = true;
+  debounceCalStartMs = millis();
+  logLine("DEBOUNCE: calibrating for %lu s, press and release each remote button a few times",
+          DEBOUNCE_CAL_MS / 1000);
+}
+
+void debounceFinishCalibration() {
+  debounceCalibrating = false;
+  bool changed = false;
+  for (int i = 0; i < REMOTE_COUNT; i++) {
+    DebounceInput& d = debounce[i];
+    d.burstOpen = false;          // A burst still open was cut short; ignore it
+    if (d.calBursts < DEBOUNCE_CAL_MIN_BURSTS) {
+      logLine("DEBOUNCE: %s kept %u ms (%u of %u edge bursts seen)", REMOTE_NAMES[i], d.windowMs,
+              d.calBursts, DEBOUNCE_CAL_MIN_BURSTS);
+      continue;
+    }
+    uint16_t window = debounceCalibratedWindow(d.calBounceMaxUs);
+    logLine("DEBOUNCE: %s %u -> %u ms (longest bounce %lu us, %u edges, %u bursts)", REMOTE_NAMES[i],
+            d.windowMs, window, (unsigned long)d.calBounceMaxUs, d.calEdgesMax, d.calBursts);
+    if (window != d.windowMs) changed = true;
+    d.windowMs = window;
+    d.residual = 0;               // Count against the new window only
+  }
+  if (changed) saveSettings();
+}
+
+// Loop task, after the inputs are read: apply web requests, close quiet
+// calibration bursts, finish calibration on time
+void debounceTick() {
+  int req = debounceRequest;
+  if (req != DEBOUNCE_REQ_NONE) {
+    debounceRequest = DEBOUNCE_REQ_NONE;
+    if (req == DEBOUNCE_REQ_CALIBRATE) {
+      debounceStartCalibration();
+    } else if (req == DEBOUNCE_REQ_FINISH && debounceCalibrating) {
+      debounceFinishCalibration();
+    } else if (req == DEBOUNCE_REQ_CANCEL && debounceCalibrating) {
+      debounceCalibrating = false;
+      logLine("DEBOUNCE: calibration cancelled");
+    } else if (req == DEBOUNCE_REQ_RESET) {
+      debounceCalibrating = false;
+      for (int i = 0; i < REMOTE_COUNT; i++) {
+        debounce[i].windowMs = DEBOUNCE_DELAY;
+        debounce[i].residual = 0;
+      }
+      logLine("DEBOUNCE: windows reset to %lu ms", DEBOUNCE_DELAY);
+      saveSettings();
+    }
+  }
+  if (!debounceCalibrating) return;
+
+  uint32_t us = (uint32_t)esp_timer_get_time();
+  for (int i = 0; i < REMOTE_COUNT; i++) {
+    DebounceInput& d = debounce[i];
+    if (!d.burstOpen || us - d.lastEdgeUs < DEBOUNCE_MAX_MS * 1000) continue;
+    d.burstOpen = false;
+    d.calBursts++;
+    if (d.burstEdges > d.calEdgesMax) d.calEdgesMax = d.burstEdges;
+    uint32_t bounce = d.lastEdgeUs - d.burstStartUs;
+    if (bounce > d.calBounceMaxUs) d.calBounceMaxUs = bounce;
+  }
+  if (millis() - debounceCalStartMs >= DEBOUNCE_CAL_MS) debounceFinishCalibration();
+}
+
+size_t getDebounceJson(char* out, size_t cap) {
+  StaticJsonDocument<1280> doc;
+  doc["calibrating"] = debounceCalibrating;
+  if (debounceCalibrating) doc["remainingS"] = (DEBOUNCE_CAL_MS - (millis() - debounceCalStartMs)) / 1000;
+  doc["defaultMs"] = DEBOUNCE_DELAY;
+  doc["minMs"] = DEBOUNCE_MIN_MS;
+  doc["maxMs"] = DEBOUNCE_MAX_MS;
+  doc["marginPct"] = DEBOUNCE_MARGIN_PCT;
+  doc["residualMs"] = DEBOUNCE_RESIDUAL_MS;
+  doc["minBursts"] = DEBOUNCE_CAL_MIN_BURSTS;
+  JsonArray arr = doc.createNestedArray("inputs");
+  for (int i = 0; i < REMOTE_COUNT; i++) {
+    const DebounceInput& d = debounce[i];
+    JsonObject o = arr.createNestedObject();
+    o["name"] = REMOTE_NAMES[i];
+    o["windowMs"] = d.windowMs;
+    o["changes"] = d.changes;
+    o["residual"] = d.residual;
+    if (d.calBursts > 0) {
+      JsonObject c = o.createNestedObject("calibration");
+      c["bursts"] = d.calBursts;
+      c["edgesMax"] = d.calEdgesMax;
+      c["bounceMaxUs"] = d.calBounceMaxUs;
+      c["windowMs"] = debounceCalibratedWindow(d.calBounceMaxUs);
+    }
+  }
+  return serializeJson(doc, out, cap);
+}
+
+// POST /diag/debounce?action=calibrate|finish|cancel|reset
+// POST /diag/debounce?input=inputA&windowMs=5   (set by hand, saved)
+void handleDebounceControl(AsyncWebServerRequest *request) {
+  String action = request->arg("action");
+  int req = action == "calibrate" ? DEBOUNCE_REQ_CALIBRATE :
+            action == "finish" ? DEBOUNCE_REQ_FINISH :
+            action == "cancel" ? DEBOUNCE_REQ_CANCEL :
+            action == "reset" ? DEBOUNCE_REQ_RESET : DEBOUNCE_REQ_NONE;
+  if (req != DEBOUNCE_REQ_NONE) {
+    debounceRequest = req;
+    request->send(200, "text/plain", "OK");
+    return;
+  }
+  int idx = -1;
+  for (int i = 0; i < REMOTE_COUNT; i++) {
+    if (request->arg("input") == REMOTE_NAMES[i]) idx = i;
+  }
+  if (idx < 0 || !request->hasArg("windowMs")) {
+    request->send(400, "text/plain", "action must be calibrate, finish, cancel or reset, or give input and windowMs");
+    return;
+  }
+  long v = request->arg("windowMs").toInt();
+  if (v < (long)DEBOUNCE_MIN_MS || v > (long)DEBOUNCE_MAX_MS) {
+    request->send(400, "text/plain", "windowMs must be between 2 and 50");
+    return;
+  }
+  debounce[idx].windowMs = v;
+  debounce[idx].residual = 0;
+  saveSettings();
+  request->send(200, "text/plain", "OK");
+}
+
+void updateButtonState(ButtonState* btn, int pin, int id) {
+  bool reading = readInput(pin);
+  
+  // If the switch changed, due to noise or pressing
+  if (reading != btn->lastState) {
+    btn->lastDebounceTime = millis();
+    debounceEdge(id, btn->lastDebounceTime);
+  }
+  
+  // Check if the level has been stable for this input's window
+  if ((millis() - btn->lastDebounceTime) > debounce[id].windowMs) {
+    // If the button state has changed
+    if (reading != btn->currentState) {
+      btn->currentState = reading;
+      debounce[id].changedMs = millis();
+      debounce[id].residualSeen = false;
+      debounce[id].changes++;
+      
+      // Detect button press event (transition from HIGH to LOW for active-low)
+      // This is edge-triggered - the flag is set on press and must be cleared by handler
+      if (btn->currentState == LOW) {
+        btn->pressed = true;
+        btn->lastPressTime = millis(); // Record timestamp for UI
+        // The edge is the first raw change, so the debounce delay counts too
+        markStatusEdge("input", (uint64_t)btn->lastDebounceTime * 1000);
+        notifyClients();
+      } else {
+        // Clear pressed flag when button is released
+        btn->pressed = false;
+      }
+    }
+  }
+  
+  btn->lastState = reading;
+}
+
+// ========== SENSOR HEALTH ==========
+// End-stop health scored from the raw edge stream the loop already samples.
+// Edges arriving within SENSOR_SETTLE_MS of each other form one burst; once
+// the line has been quiet that long the burst settles into an actuation
+// (or release), a glitch (back to where it started), bounce count and settle
+// time. A settled transition is "out of window" when the cylinder wasn't
+// being driven onto (or off) the sensor, or arrived implausibly early in
+// auto mode. "Stuck" is time spent triggered while being driven away.
+// Everything is O(1) per edge and per loop; averages are EWMAs.
+const unsigned long SENSOR_SETTLE_MS = 20;    // Quiet time that ends an edge burst
+const unsigned long SENSOR_COAST_MS = 1000;   // Edges this long after the drive stops are still expected
+const unsigned long SENSOR_STUCK_MS = 1000;   // Triggered this long while driven away = stuck
+const int SENSOR_WARN_SCORE = 75;
+const int SENSOR_FAIL_SCORE = 40;
+const char* const SENSOR_LEVEL_NAMES[] = {"ok", "warning", "failing"};
+
+struct SensorConfig {
+  const char* name;
+  int towardPin;                // Output that drives the cylinder onto the sensor
+  int awayPin;                  // Output that drives it off
+};
+
+const SensorConfig SENSOR_CONFIG[SENSOR_COUNT] = {
+  {"endStopIn",  GPO1_PIN, GPO2_PIN},
+  {"endStopOut", GPO2_PIN, GPO1_PIN},
+};
+
+struct SensorHealth {
+  bool active;                  // Raw level, true = triggered
+  // Edge burst being settled
+  bool burstOpen;
+  bool burstFromActive;
+  bool burstExpected;           // Drive state at the first edge allowed the transition
+  uint16_t burstEdges;
+  unsigned long burstStartMs;
+  unsigned long lastEdgeMs;
+  // Drive tracking
+  bool towardOn;
+  bool awayOn;
+  unsigned long towardSinceMs;
+  unsigned long towardLastMs;
+  unsigned long awaySinceMs;
+  unsigned long awayLastMs;
+  // Totals since boot (or reset)
+  uint32_t edges;
+  uint32_t actuations;
+  uint32_t glitches;
+  uint32_t outOfWindow;
+  uint32_t stuckEvents;
+  uint16_t bouncesMax;
+  unsigned long settleMaxMs;
+  unsigned long stuckMs;        // Current stuck-active duration (0 = not stuck)
+  unsigned long stuckMaxMs;
+  // EWMAs, x16 fixed point
+  int32_t bouncesAvg16;
+  int32_t settleAvg16;          // ms
+  int32_t missPct16;            // % of settled transitions that were glitches or out of window
+  int score;                    // 0-100
+  int level;                    // Index into SENSOR_LEVEL_NAMES
+};
+
+SensorHealth sensorHealth[SENSOR_COUNT];
+uint32_t sensorBothActiveEvents = 0;
+bool sensorBothActive = false;
+volatile bool sensorResetRequest = false;  // From the web task, applied in sensorHealthTick()
+
+void sensorEwma(int32_t& avg16, int32_t sample) {
+  avg16 += (sample * 16 - avg16) / 8;
+}
+
+void sensorHealthReset() {
+  for (int i = 0; i < SENSOR_COUNT; i++) {
+    bool active = sensorHealth[i].active;
+    memset(&sensorHealth[i], 0, sizeof(SensorHealth));
+    sensorHealth[i].active = active;
+    sensorHealth[i].score = 100;
+  }
+  sensorBothActiveEvents = 0;
+}
+
+void sensorHealthInit() {
+  sensorHealthReset();
+  sensorHealth[SENSOR_ENDSTOP_IN].active = (readInput(ENDSTOP_IN_PIN) == HIGH);
+  sensorHealth[SENSOR_ENDSTOP_OUT].active = (readInput(ENDSTOP_OUT_PIN) == HIGH);
+}
+
+// Was a transition to `active` plausible given what the outputs were doing?
+bool sensorTransitionExpected(const SensorHealth& s, bool active, unsigned long now) {
+  if (active) {
+    bool driven = s.towardOn || (s.towardLastMs && now - s.towardLastMs < SENSOR_COAST_MS);
+    if (!driven) return false;
+    // In auto mode a full stroke is expected; arriving in under a quarter of
+    // the average stroke time means a false trigger
+    if (currentMode == MODE_AUTO_LOOP && s.towardOn && avgDuration > 0 &&
+        now - s.towardSinceMs < avgDuration / 4) {
+      return false;
+    }
+    return true;
+  }
+  return s.awayOn || (s.awayLastMs && now - s.awayLastMs < SENSOR_COAST_MS);
+}
+
+// Input path: called by loop() for every raw end-stop edge
+void sensorHealthEdge(int id, bool active) {
+  SensorHealth& s = sensorHealth[id];
+  if (active == s.active) return;
+  unsigned long now = millis();
+  s.active = active;
+  s.edges++;
+  if (!s.burstOpen) {
+    s.burstOpen = true;
+    s.burstFromActive = !active;
+    s.burstExpected = sensorTransitionExpected(s, active, now);
+    s.burstEdges = 0;
+    s.burstStartMs = now;
+  }
+  s.burstEdges++;
+  s.lastEdgeMs = now;
+}
+
+void sensorBurstSettle(SensorHealth& s) {
+  s.burstOpen = false;
+  if (s.active == s.burstFromActive) {
+    // Went back to where it started: a spike or dropout, not a transition
+    s.glitches++;
+    sensorEwma(s.missPct16, 100);
+    return;
+  }
+  uint16_t bounces = s.burstEdges - 1;
+  unsigned long settle = s.lastEdgeMs - s.burstStartMs;
+  if (s.active) s.actuations++;
+  if (bounces > s.bouncesMax) s.bouncesMax = bounces;
+  if (settle > s.settleMaxMs) s.settleMaxMs = settle;
+  sensorEwma(s.bouncesAvg16, bounces);
+  sensorEwma(s.settleAvg16, settle);
+  if (!s.burstExpected) s.outOfWindow++;
+  sensorEwma(s.missPct16, s.burstExpected ? 0 : 100);
+}
+
+int sensorScore(const SensorHealth& s) {
+  int score = 100;
+  score -= min(30, (int)(s.bouncesAvg16 * 5 / 16));   // 5 per average bounce
+  score -= min(25, (int)(s.settleAvg16 / 32));        // 1 per 2 ms of settling
+  score -= (int)(s.missPct16 * 40 / (16 * 100));      // Up to 40 for unexpected edges
+  if (s.stuckMs > 0) score -= 40;
+  return max(0, score);
+}
+
+// Loop task, once per pass: settle quiet bursts, track drive and stuck time
+void sensorHealthTick() {
+  if (sensorResetRequest) {
+    sensorResetRequest = false;
+    sensorHealthReset();
+  }
+  unsigned long now = millis();
+  for (int i = 0; i < SENSOR_COUNT; i++) {
+    SensorHealth& s = sensorHealth[i];
+
+    bool toward = (readOutput(SENSOR_CONFIG[i].towardPin) == HIGH);
+    if (toward && !s.towardOn) s.towardSinceMs = now;
+    if (toward) s.towardLastMs = now;
+    s.towardOn = toward;
+    bool away = (readOutput(SENSOR_CONFIG[i].awayPin) == HIGH);
+    if (away && !s.awayOn) s.awaySinceMs = now;
+    if (away) s.awayLastMs = now;
+    s.awayOn = away;
+
+    if (s.burstOpen && now - s.lastEdgeMs >= SENSOR_SETTLE_MS) sensorBurstSettle(s);
+
+    if (s.active && s.awayOn && now - s.awaySinceMs >= SENSOR_STUCK_MS) {
+      if (s.stuckMs == 0) {
+        s.stuckEvents++;
+        logLine("SENSOR: %s still triggered %lu ms after driving away", SENSOR_CONFIG[i].name, SENSOR_STUCK_MS);
+      }
+      s.stuckMs = now - s.awaySinceMs;
+      if (s.stuckMs > s.stuckMaxMs) s.stuckMaxMs = s.stuckMs;
+    } else {
+      s.stuckMs = 0;
+    }
+
+    s.score = sensorScore(s);
+    int level = (s.score < SENSOR_FAIL_SCORE) ? 2 : (s.score < SENSOR_WARN_SCORE) ? 1 : 0;
+    if (level != s.level) {
+      logLine("SENSOR: %s health %s (score %d)", SENSOR_CONFIG[i].name, SENSOR_LEVEL_NAMES[level], s.score);
+      TRACE_INSTANT(level > s.level ? "sensor.degraded" : "sensor.recovered");
+      s.level = level;
+    }
+  }
+
+  bool both = sensorHealth[SENSOR_ENDSTOP_IN].active && sensorHealth[SENSOR_ENDSTOP_OUT].active;
+  if (both && !sensorBothActive) sensorBothActiveEvents++;
+  sensorBothActive = both;
+}
+
+size_t getSensorHealthJson(char* out, size_t cap) {
+  StaticJsonDocument<1024> doc;
+  JsonArray arr = doc.createNestedArray("sensors");
+  for (int i = 0; i < SENSOR_COUNT; i++) {
+    const SensorHealth& s = sensorHealth[i];
+    JsonObject o = arr.createNestedObject();
+    o["name"] = SENSOR_CONFIG[i].name;
+    o["active"] = s.active;
+    o["score"] = s.score;
+    o["level"] = SENSOR_LEVEL_NAMES[s.level];
+    o["actuations"] = s.actuations;
+    o["edges"] = s.edges;
+    o["bouncesAvg"] = s.bouncesAvg16 / 16.0;
+    o["bouncesMax"] = s.bouncesMax;
+    o["settleAvgMs"] = s.settleAvg16 / 16.0;
+    o["settleMaxMs"] = s.settleMaxMs;
+    o["outOfWindow"] = s.outOfWindow;
+    o["glitches"] = s.glitches;
+    o["unexpectedPct"] = s.missPct16 / 16.0;
+    o["stuckMs"] = s.stuckMs;
+    o["stuckMaxMs"] = s.stuckMaxMs;
+    o["stuckEvents"] = s.stuckEvents;
+  }
+  doc["bothActiveEvents"] = sensorBothActiveEvents;
+  doc["warnScore"] = SENSOR_WARN_SCORE;
+  doc["failScore"] = SENSOR_FAIL_SCORE;
+  return serializeJson(doc, out, cap);
+}
+
+// ========== PRESSURE MONITORING ==========
+// Line pressure from an analog transducer wired (through a divider) to an
+// ADC1 pin; ADC2 can't be used while WiFi is on. The ADC runs in continuous
+// (DMA) mode on a task pinned to core 0, so sampling costs the control loop
+// nothing. Each PRESSURE_DECIMATION raw samples are averaged (the boxcar is
+// also the anti-alias filter), scaled to bar and low-pass filtered. The
+// filtered stream feeds the overpressure trip, the per-stroke peak/mean and
+// the scope topic. In simulation the task synthesizes raw samples from the
+// cylinder model and runs them through the same pipeline.
+const uint32_t PRESSURE_SAMPLE_HZ = 20000;          // ESP32 continuous-mode minimum
+const uint32_t PRESSURE_DECIMATION = 200;
+const uint32_t PRESSURE_OUTPUT_HZ = PRESSURE_SAMPLE_HZ / PRESSURE_DECIMATION;  // 100 Hz
+const uint32_t PRESSURE_FRAME_SAMPLES = 256;        // Per DMA read (12.8 ms)
+const uint32_t PRESSURE_READ_TIMEOUT_MS = 100;
+const float PRESSURE_FILTER_ALPHA = 0.25f;          // IIR on the 100 Hz stream (~35 ms time constant)
+const int PRESSURE_TRIP_SAMPLES = 3;                // Consecutive filtered samples over the limit (30 ms)
+const float PRESSURE_TRIP_REARM = 0.9f;             // New trip events (alarm, log) re-arm below this fraction
+const size_t PRESSURE_SCOPE_LEN = 64;               // Filtered samples buffered for the scope topic
+const unsigned long PRESSURE_SCOPE_INTERVAL = 200;  // ms between scope frames
+
+const int DEFAULT_PRESSURE_PIN = 34;
+const int DEFAULT_PRESSURE_ZERO = 410;              // Raw counts at 0 bar
+const int DEFAULT_PRESSURE_FULL = 3686;             // Raw counts at full scale
+const unsigned long DEFAULT_PRESSURE_FULL_SCALE_BAR = 250;
+const unsigned long DEFAULT_PRESSURE_TRIP_BAR = 180;  // 0 = trip off
+
+// Simulated hydraulics (bar); "stall" loses pressure, "clog" builds it
+const float SIM_PRESSURE_IDLE_BAR = 2.0f;
+const float SIM_PRESSURE_STROKE_BAR = 40.0f;        // Rises by half again over the stroke
+const float SIM_PRESSURE_DEADHEAD_BAR = 150.0f;     // Driven against an end stop
+const float SIM_PRESSURE_RELIEF_BAR = 230.0f;       // Blocked line, up to the relief valve
+const float SIM_PRESSURE_TAU_MS = 60.0f;            // Line compliance
+const int SIM_PRESSURE_NOISE_COUNTS = 24;
+
+bool pressureEnabled = false;
+int pressurePin = DEFAULT_PRESSURE_PIN;
+int pressureZeroCounts = DEFAULT_PRESSURE_ZERO;
+int pressureFullCounts = DEFAULT_PRESSURE_FULL;
+unsigned long pressureFullScaleBar = DEFAULT_PRESSURE_FULL_SCALE_BAR;
+unsigned long pressureTripBar = DEFAULT_PRESSURE_TRIP_BAR;
+
+enum PressureSource {
+  PRESSURE_SRC_OFF,
+  PRESSURE_SRC_ADC,
+  PRESSURE_SRC_SIM,
+  PRESSURE_SRC_ERROR    // Enabled, but the pin couldn't be set up for DMA
+};
+const char* const PRESSURE_SOURCE_NAMES[] = {"off", "adc", "sim", "error"};
+
+// Written by the pressure task; loop and web tasks only read, except the
+// stroke accumulators, which are shared under pressureMux
+struct PressureState {
+  volatile int source;
+  float filteredBar;
+  float rawCounts;              // Last decimated average
+  float maxBar;                 // Since boot
+  uint32_t blockSum;
+  uint32_t blockCount;
+  uint32_t outputs;             // Filtered samples produced
+  uint32_t dmaReads;
+  uint32_t dmaOverruns;         // Driver ring overflowed (task fell behind)
+  uint32_t dmaErrors;
+  int overCount;
+  bool tripArmed;
+  uint32_t trips;
+  float lastTripBar;
+  unsigned long lastTripMs;
+  // Current stroke (while an output is energized)
+  float strokePeak;
+  float strokeSum;
+  uint32_t strokeCount;
+  // Last completed stroke (loop task)
+  float lastStrokePeak;
+  float lastStrokeMean;
+};
+
+PressureState pressure;
+portMUX_TYPE pressureMux = portMUX_INITIALIZER_UNLOCKED;
+volatile bool pressureTripPending = false;  // Set by the pressure task, handled in loop()
+volatile bool pressureTripIsNew = false;    // Pending trip is a new event, not a repeat while still high
+int8_t pressureAdcChannel = -1;
+uint8_t pressureDmaBuf[PRESSURE_FRAME_SAMPLES * SOC_ADC_DIGI_RESULT_BYTES];
+uint16_t pressureSamples[PRESSURE_FRAME_SAMPLES];
+float pressureSimBar = 0.0f;
+uint32_t pressureSimSeed = 1;
+
+// Filtered samples (0.1 bar) for the scope topic; the task writes ahead of head
+int16_t pressureScope[PRESSURE_SCOPE_LEN];
+volatile uint32_t pressureScopeHead = 0;
+
+const size_t PRESSURE_HISTORY_ARENA_BYTES = 2 * sizeof(StrokeHistory);
+
+bool pressureAdcStart(int pin) {
+  int8_t ch = digitalPinToAnalogChannel(pin);
+  if (ch < 0 || ch > 7) return false;  // ADC1 channels only
+
+  adc_digi_init_config_t init = {};
+  init.max_store_buf_size = 4 * sizeof(pressureDmaBuf);
+  init.conv_num_each_intr = sizeof(pressureDmaBuf);
+  init.adc1_chan_mask = BIT(ch);
+  init.adc2_chan_mask = 0;
+  if (adc_digi_initialize(&init) != ESP_OK) return false;
+
+  adc_digi_pattern_config_t pattern = {};
+  pattern.atten = ADC_ATTEN_DB_11;
+  pattern.channel = ch;
+  pattern.unit = 0;
+  pattern.bit_width = SOC_ADC_DIGI_MAX_BITWIDTH;
+  adc_digi_configuration_t cfg = {};
+  cfg.conv_limit_en = true;
+  cfg.conv_limit_num = 250;
+  cfg.pattern_num = 1;
+  cfg.adc_pattern = &pattern;
+  cfg.sample_freq_hz = PRESSURE_SAMPLE_HZ;
+  cfg.conv_mode = ADC_CONV_SINGLE_UNIT_1;
+  cfg.format = ADC_DIGI_OUTPUT_FORMAT_TYPE1;
+  if (adc_digi_controller_configure(&cfg) != ESP_OK || adc_digi_start() != ESP_OK) {
+    adc_digi_deinitialize();
+    return false;
+  }
+  pressureAdcChannel = ch;
+  return true;
+}
+
+void pressureAdcStop() {
+  adc_digi_stop();
+  adc_digi_deinitialize();
+  pressureAdcChannel = -1;
+}
+
+// One DMA frame of raw 12-bit samples. Blocks until the driver has one.
+size_t pressureAdcRead(uint16_t* out, size_t max) {
+  uint32_t got = 0;
+  esp_err_t err = adc_digi_read_bytes(pressureDmaBuf, sizeof(pressureDmaBuf), &got, PRESSURE_READ_TIMEOUT_MS);
+  if (err == ESP_ERR_INVALID_STATE) {
+    pressure.dmaOverruns++;  // Data is still valid, older frames were dropped
+  } else if (err != ESP_OK) {
+    pressure.dmaErrors++;
+    return 0;
+  }
+  pressure.dmaReads++;
+  size_t n = 0;
+  for (uint32_t i = 0; i + SOC_ADC_DIGI_RESULT_BYTES <= got && n < max; i += SOC_ADC_DIGI_RESULT_BYTES) {
+    const adc_digi_output_data_t* d = (const adc_digi_output_data_t*)&pressureDmaBuf[i];
+    if (d->type1.channel == pressureAdcChannel) out[n++] = d->type1.data;
+  }
+  return n;
+}
+
+// Simulated line pressure for the cylinder model's current state
+float pressureSimTarget() {
+  int dir = simCylinder.lastDir;
+  if (dir == 0 || simFault == SIM_FAULT_STALL) return SIM_PRESSURE_IDLE_BAR;
+  if (simFault == SIM_FAULT_CLOG) return SIM_PRESSURE_RELIEF_BAR;
+  float travel = (dir > 0) ? simCylinder.position : 1.0f - simCylinder.position;
+  if (travel >= 1.0f) return SIM_PRESSURE_DEADHEAD_BAR;
+  return SIM_PRESSURE_STROKE_BAR * (1.0f + 0.5f * travel);
+}
+
+int pressureSimNoise(int amp) {
+  pressureSimSeed = pressureSimSeed * 1664525u + 1013904223u;  // LCG, cheaper than random()
+  return (int)((pressureSimSeed >> 16) % (2 * amp + 1)) - amp;
+}
+
+// Synthetic raw samples at the real sample rate, paced like a DMA read
+size_t pressureSimRead(uint16_t* out, size_t max) {
+  const uint32_t frameMs = max * 1000 / PRESSURE_SAMPLE_HZ;
+  vTaskDelay(pdMS_TO_TICKS(frameMs));
+  float target = pressureSimTarget();
+  pressureSimBar += (target - pressureSimBar) * frameMs / (SIM_PRESSURE_TAU_MS + frameMs);
+  float counts = pressureZeroCounts + pressureSimBar * (pressureFullCounts - pressureZeroCounts) / pressureFullScaleBar;
+  size_t n = PRESSURE_SAMPLE_HZ * frameMs / 1000;
+  for (size_t i = 0; i < n; i++) {
+    out[i] = (uint16_t)constrain((int)counts + pressureSimNoise(SIM_PRESSURE_NOISE_COUNTS), 0, 4095);
+  }
+  return n;
+}
+
+// One decimated sample: scale, filter, then trip / stroke / scope
+void pressureOutput(float raw) {
+  PressureState& p = pressure;
+  float bar = (raw - pressureZeroCounts) * pressureFullScaleBar / (float)(pressureFullCounts - pressureZeroCounts);
+  p.filteredBar += (bar - p.filteredBar) * PRESSURE_FILTER_ALPHA;
+  float v = p.filteredBar;
+  p.rawCounts = raw;
+  p.outputs++;
+  if (v > p.maxBar) p.maxBar = v;
+
+  if (gpo1Level == HIGH || gpo2Level == HIGH) {
+    portENTER_CRITICAL(&pressureMux);
+    if (p.strokeCount == 0 || v > p.strokePeak) p.strokePeak = v;
+    p.strokeSum += v;
+    p.strokeCount++;
+    portEXIT_CRITICAL(&pressureMux);
+  }
+
+  // The trip acts on the level every time: an energized output over the
+  // limit is always cut. The re-arm hysteresis only keeps a line that stays
+  // high from raising a new alarm on every attempt.
+  float trip = (float)pressureTripBar;
+  if (trip > 0 && v > trip) {
+    if (++p.overCount >= PRESSURE_TRIP_SAMPLES) {
+      p.overCount = 0;
+      if (p.tripArmed) {
+        p.tripArmed = false;
+        p.trips++;
+        p.lastTripBar = v;
+        p.lastTripMs = millis();
+        pressureTripIsNew = true;
+        pressureTripPending = true;
+      } else if (gpo1Level == HIGH || gpo2Level == HIGH) {
+        pressureTripPending = true;
+      }
+    }
+  } else {
+    p.overCount = 0;
+    if (trip <= 0 || v < trip * PRESSURE_TRIP_REARM) p.tripArmed = true;
+  }
+
+  pressureScope[pressureScopeHead % PRESSURE_SCOPE_LEN] = (int16_t)constrain(lroundf(v * 10), -32768L, 32767L);
+  pressureScopeHead++;
+}
+
+void pressureFeed(const uint16_t* samples, size_t n) {
+  PressureState& p = pressure;
+  for (size_t i = 0; i < n; i++) {
+    p.blockSum += samples[i];
+    if (++p.blockCount == PRESSURE_DECIMATION) {
+      pressureOutput((float)p.blockSum / PRESSURE_DECIMATION);
+      p.blockSum = 0;
+      p.blockCount = 0;
+    }
+  }
+}
+
+// Core 0. Follows the enabled/pin/simulation settings, restarting the ADC
+// when they change; an unusable pin is reported once and not retried.
+void pressureTask(void* arg) {
+  int adcPin = -1;
+  int failedPin = -1;
+  for (;;) {
+    bool wantAdc = pressureEnabled && !simEnabled;
+    if (adcPin >= 0 && (!wantAdc || adcPin != pressurePin)) {
+      pressureAdcStop();
+      adcPin = -1;
+    }
+    if (wantAdc && adcPin < 0 && pressurePin != failedPin) {
+      if (pressureAdcStart(pressurePin)) {
+        adcPin = pressurePin;
+        failedPin = -1;
+        logLine("Pressure: ADC DMA on GPIO %d at %lu Hz", adcPin, (unsigned long)PRESSURE_SAMPLE_HZ);
+      } else {
+        failedPin = pressurePin;
+        logLine("ERROR: pressure input GPIO %d can't be sampled (ADC1 pins only)", failedPin);
+      }
+    }
+
+    size_t n;
+    if (adcPin >= 0) {
+      pressure.source = PRESSURE_SRC_ADC;
+      n = pressureAdcRead(pressureSamples, PRESSURE_FRAME_SAMPLES);
+    } else if (pressureEnabled && simEnabled) {
+      pressure.source = PRESSURE_SRC_SIM;
+      n = pressureSimRead(pressureSamples, PRESSURE_FRAME_SAMPLES);
+    } else {
+      pressure.source = pressureEnabled ? PRESSURE_SRC_ERROR : PRESSURE_SRC_OFF;
+      vTaskDelay(pdMS_TO_TICKS(100));
+      continue;
+    }
+    pressureFeed(pressureSamples, n);
+  }
+}
+
+void pressureInit() {
+  memset(&pressure, 0, sizeof(pressure));
+  pressure.tripArmed = true;
+  StrokeHistory* h = (StrokeHistory*)arenaAlloc("pressureHistory", PRESSURE_HISTORY_ARENA_BYTES);
+  if (h) {
+    pressurePeakHistory = new (h) StrokeHistory();
+    pressureMeanHistory = new (h + 1) StrokeHistory();
+  }
+  xTaskCreatePinnedToCore(pressureTask, "pressure", 4096, NULL, 3, NULL, 0);
+}
+
+// writeOutput(): refuse to energize while the filtered pressure is over the
+// limit, and have the loop drop AUTO as for a trip
+bool pressureBlocksOutput() {
+  int src = pressure.source;
+  if (src != PRESSURE_SRC_ADC && src != PRESSURE_SRC_SIM) return false;
+  if (pressureTripBar == 0 || pressure.filteredBar <= (float)pressureTripBar) return false;
+  pressureTripPending = true;
+  return true;
+}
+
+// Loop task: stop everything on an overpressure trip. Returns true if it did.
+bool pressureService() {
+  if (!pressureTripPending) return false;
+  pressureTripPending = false;
+  bool isNew = pressureTripIsNew;
+  pressureTripIsNew = false;
+  writeOutput(GPO1_PIN, LOW);
+  writeOutput(GPO2_PIN, LOW);
+  currentMode = MODE_MANUAL;
+  cycleDirection = CYCLE_STOPPED;
+  inputC.pressed = false;
+  inputD.pressed = false;
+  pressureLatched = true;
+  if (!isNew) {
+    // Same episode: outputs held off, the alarm and capture already went out
+    logLine("OVERPRESSURE: still %.1f bar (limit %lu bar) - outputs held off", pressure.filteredBar, pressureTripBar);
+    return true;
+  }
+  logLine("!!! OVERPRESSURE: %.1f bar (limit %lu bar) - outputs off, MANUAL mode",
+          pressure.lastTripBar, pressureTripBar);
+  TRACE_INSTANT("fault.overpressure");
+  markStatusEdge("overpressure");
+  alarmEvent(ALARM_OVERPRESSURE, pressure.lastTripBar);
+  utilFault();
+  recorderTrigger("overpressure");
+  return true;
+}
+
+// Loop task, at the end of each travel: close the stroke's pressure window.
+// A partial travel's samples are dropped rather than left to leak into the
+// next full stroke.
+void pressureStrokeEnd(bool record) {
+  portENTER_CRITICAL(&pressureMux);
+  float peak = pressure.strokePeak;
+  float sum = pressure.strokeSum;
+  uint32_t n = pressure.strokeCount;
+  pressure.strokePeak = 0.0f;
+  pressure.strokeSum = 0.0f;
+  pressure.strokeCount = 0;
+  portEXIT_CRITICAL(&pressureMux);
+  if (!record || n == 0) return;
+
+  pressure.lastStrokePeak = peak;
+  pressure.lastStrokeMean = sum / n;
+  if (!pressurePeakHistory) return;
+  xSemaphoreTake(statusLock, portMAX_DELAY);
+  pressurePeakHistory->append((uint32_t)max(0L, lroundf(peak * 10)));
+  pressureMeanHistory->append((uint32_t)max(0L, lroundf(pressure.lastStrokeMean * 10)));
+  xSemaphoreGive(statusLock);
+}
+
+size_t getPressureJson(char* out, size_t cap) {
+  const PressureState& p = pressure;
+  StaticJsonDocument<768> doc;
+  doc["enabled"] = pressureEnabled;
+  doc["source"] = PRESSURE_SOURCE_NAMES[p.source];
+  doc["pin"] = pressurePin;
+  doc["bar"] = p.filteredBar;
+  doc["raw"] = p.rawCounts;
+  doc["maxBar"] = p.maxBar;
+  doc["zero"] = pressureZeroCounts;
+  doc["full"] = pressureFullCounts;
+  doc["fullScaleBar"] = pressureFullScaleBar;
+  doc["tripBar"] = pressureTripBar;
+  doc["trips"] = p.trips;
+  doc["latched"] = pressureLatched;
+  if (p.trips) {
+    JsonObject t = doc.createNestedObject("lastTrip");
+    t["bar"] = p.lastTripBar;
+    t["agoMs"] = millis() - p.lastTripMs;
+  }
+  JsonObject s = doc.createNestedObject("lastStroke");
+  s["peakBar"] = p.lastStrokePeak;
+  s["meanBar"] = p.lastStrokeMean;
+  doc["strokes"] = pressurePeakHistory ? pressurePeakHistory->total() : 0;
+  doc["sampleHz"] = PRESSURE_SAMPLE_HZ;
+  doc["outputHz"] = PRESSURE_OUTPUT_HZ;
+  doc["outputs"] = p.outputs;
+  JsonObject dma = doc.createNestedObject("dma");
+  dma["reads"] = p.dmaReads;
+  dma["overruns"] = p.dmaOverruns;
+  dma["errors"] = p.dmaErrors;
+  return serializeJson(doc, out, cap);
+}
+
+// ========== ALARMS ==========
+// Rules on live metrics (stroke time, stroke rate, sensor health, pressure,
+// valve response) and on discrete faults. Level rules raise after the condition has held
+// for delayMs and clear only once the value leaves the hysteresis band.
+// Fault events raise straight into "returned to normal" and stay listed
+// until acknowledged. Every metric is already maintained incrementally
+// elsewhere, so evaluating all rules is a handful of compares per tick.
+// States follow ISA-18.2: normal, unackActive, ackActive, unackRtn.
+// Shelved alarms are still tracked but not notified. Transitions are logged
+// and queued for the webhook (see WEBHOOK DELIVERY).
+enum AlarmKind {
+  ALARM_ABOVE,
+  ALARM_BELOW,
+  ALARM_EVENT
+};
+
+enum AlarmStateId {
+  ALARM_NORMAL,
+  ALARM_UNACK_ACTIVE,
+  ALARM_ACK_ACTIVE,
+  ALARM_UNACK_RTN
+};
+const char* const ALARM_STATE_NAMES[] = {"normal", "unackActive", "ackActive", "unackRtn"};
+const char* const ALARM_SEVERITY_NAMES[] = {"low", "medium", "high"};
+
+struct AlarmDef {
+  const char* name;
+  const char* unit;
+  AlarmKind kind;
+  int severity;                 // Index into ALARM_SEVERITY_NAMES
+  long setpoint;                // Defaults for the configurable AlarmRule
+  long hysteresis;
+  unsigned long delayMs;
+};
+
+const AlarmDef ALARM_DEFS[ALARM_COUNT] = {
+  {"strokeTime",   "ms",    ALARM_ABOVE, 1, 20000, 1000, 0},
+  {"strokeRate",   "/min",  ALARM_BELOW, 0, 4, 1, 30000},
+  {"sensorHealth", "score", ALARM_BELOW, 1, SENSOR_WARN_SCORE, 5, 5000},
+  {"pressureHigh", "bar",   ALARM_ABOVE, 1, 150, 10, 500},
+  {"valveResponse", "%",    ALARM_ABOVE, 1, 150, 10, 0},   // Slowest valve vs its baseline
+  {"estop",        "",      ALARM_ABOVE, 2, 0, 0, 0},
+  {"timeout",      "ms",    ALARM_EVENT, 2, 0, 0, 0},
+  {"bothEndStops", "",      ALARM_EVENT, 2, 0, 0, 0},
+  {"overpressure", "bar",   ALARM_EVENT, 2, 0, 0, 0},
+};
+
+struct AlarmRule {
+  bool enabled;
+  long setpoint;
+  long hysteresis;
+  unsigned long delayMs;
+};
+
+struct AlarmState {
+  uint8_t state;                // AlarmStateId
+  bool pending;                 // Condition true, delay still running
+  float value;                  // Last evaluated (or event) value
+  unsigned long pendingSinceMs;
+  unsigned long changedMs;
+  unsigned long shelvedUntilMs; // 0 = not shelved
+  uint32_t raised;              // Since boot
+};
+
+AlarmRule alarmRules[ALARM_COUNT];  // Loaded in loadSettings()
+AlarmState alarmStates[ALARM_COUNT];
+
+// Requests from the web task, applied in alarmService()
+const int ALARM_TARGET_ALL = ALARM_COUNT;
+volatile int alarmAckRequest = -1;      // Alarm index or ALARM_TARGET_ALL
+volatile int alarmShelveRequest = -1;
+volatile unsigned long alarmShelveMinutes = 0;  // 0 = unshelve
+const unsigned long ALARM_MAX_SHELVE_MINUTES = 8 * 60;
+
+// Strokes per minute from 10 s buckets, valid after a full minute in AUTO
+const unsigned long ALARM_RATE_BUCKET_MS = 10000;
+const int ALARM_RATE_SLOTS = 7;         // Oldest slot is one minute old
+
+struct AlarmRateWindow {
+  uint32_t totals[ALARM_RATE_SLOTS];
+  int next;
+  unsigned long lastMs;
+  unsigned long autoSinceMs;
+  bool inAuto;
+};
+
+AlarmRateWindow alarmRate;
+
+void webhookEnqueue(int id, const char* event);
+bool valveResponsePct(float* pct);
+
+void alarmRateTick(unsigned long now) {
+  AlarmRateWindow& w = alarmRate;
+  bool inAuto = (currentMode == MODE_AUTO_LOOP);
+  if (inAuto && !w.inAuto) {
+    for (int i = 0; i < ALARM_RATE_SLOTS; i++) w.totals[i] = strokeHistory.total();
+    w.autoSinceMs = now;
+    w.lastMs = now;
+  }
+  w.inAuto = inAuto;
+  if (!inAuto || now - w.lastMs < ALARM_RATE_BUCKET_MS) return;
+  w.lastMs = now;
+  w.totals[w.next] = strokeHistory.total();
+  w.next = (w.next + 1) % ALARM_RATE_SLOTS;
+}
+
+// Current value of a level rule's metric; false when it doesn't apply now
+bool alarmMetric(int id, unsigned long now, float* value) {
+  switch (id) {
+    case ALARM_STROKE_TIME:
+      *value = lastDuration;
+      return lastDuration > 0;
+    case ALARM_STROKE_RATE:
+      *value = strokeHistory.total() - alarmRate.totals[alarmRate.next];
+      return alarmRate.inAuto && now - alarmRate.autoSinceMs >= (ALARM_RATE_SLOTS - 1) * ALARM_RATE_BUCKET_MS;
+    case ALARM_SENSOR_HEALTH:
+      *value = min(sensorHealth[SENSOR_ENDSTOP_IN].score, sensorHealth[SENSOR_ENDSTOP_OUT].score);
+      return true;
+    case ALARM_PRESSURE_HIGH:
+      *value = pressure.filteredBar;
+      return pressure.source == PRESSURE_SRC_ADC || pressure.source == PRESSURE_SRC_SIM;
+    case ALARM_VALVE_RESPONSE:
+      return valveResponsePct(value);
+    case ALARM_ESTOP:
+      *value = isEstopActive ? 1 : 0;
+      return true;
+  }
+  return false;
+}
+
+bool alarmShelved(int id, unsigned long now) {
+  return alarmStates[id].shelvedUntilMs && (long)(alarmStates[id].shelvedUntilMs - now) > 0;
+}
+
+void alarmSetState(int id, uint8_t state, const char* event) {
+  AlarmState& s = alarmStates[id];
+  s.state = state;
+  s.changedMs = millis();
+  if (strcmp(event, "raised") == 0) {
+    s.raised++;
+    TRACE_INSTANT("alarm.raised");
+  }
+  bool shelved = alarmShelved(id, s.changedMs);
+  logLine("ALARM: %s %s%s (value %.1f%s%s)", ALARM_DEFS[id].name, event, shelved ? " [shelved]" : "",
+          s.value, *ALARM_DEFS[id].unit ? " " : "", ALARM_DEFS[id].unit);
+  if (!shelved) webhookEnqueue(id, event);
+}
+
+// Fault sites call this: raise an event alarm with the value that caused it
+void alarmEvent(int id, float value) {
+  if (!alarmRules[id].enabled) return;
+  alarmStates[id].value = value;
+  alarmSetState(id, ALARM_UNACK_RTN, "raised");
+}
+
+void alarmEvaluate(int id, unsigned long now) {
+  const AlarmDef& d = ALARM_DEFS[id];
+  const AlarmRule& r = alarmRules[id];
+  AlarmState& s = alarmStates[id];
+  float v;
+  bool valid = alarmMetric(id, now, &v);
+  if (valid) s.value = v;
+
+  bool active = (s.state == ALARM_UNACK_ACTIVE || s.state == ALARM_ACK_ACTIVE);
+  bool condition = false;
+  if (r.enabled && valid) {
+    // Raise past the setpoint; once active, stay active inside the band
+    long limit = active ? (d.kind == ALARM_ABOVE ? r.setpoint - r.hysteresis : r.setpoint + r.hysteresis) : r.setpoint;
+    condition = (d.kind == ALARM_ABOVE) ? v > limit : v < limit;
+  }
+
+  if (condition && !active) {
+    if (!s.pending) {
+      s.pending = true;
+      s.pendingSinceMs = now;
+    }
+    if (now - s.pendingSinceMs >= r.delayMs) {
+      s.pending = false;
+      alarmSetState(id, ALARM_UNACK_ACTIVE, "raised");
+    }
+  } else if (!condition) {
+    s.pending = false;
+    if (active) alarmSetState(id, s.state == ALARM_UNACK_ACTIVE ? ALARM_UNACK_RTN : ALARM_NORMAL, "cleared");
+  }
+}
+
+void alarmAck(int id) {
+  AlarmState& s = alarmStates[id];
+  if (s.state == ALARM_UNACK_ACTIVE) alarmSetState(id, ALARM_ACK_ACTIVE, "acked");
+  else if (s.state == ALARM_UNACK_RTN) alarmSetState(id, ALARM_NORMAL, "acked");
+}
+
+void alarmShelve(int id, unsigned long minutes, unsigned long now) {
+  AlarmState& s = alarmStates[id];
+  s.shelvedUntilMs = minutes ? (now + minutes * 60000UL) | 1 : 0;  // Never 0 while shelved
+  logLine("ALARM: %s %s", ALARM_DEFS[id].name, minutes ? "shelved" : "unshelved");
+}
+
+void alarmApplyRequests(unsigned long now) {
+  int ack = alarmAckRequest;
+  if (ack >= 0) {
+    alarmAckRequest = -1;
+    for (int i = 0; i < ALARM_COUNT; i++) {
+      if (ack == ALARM_TARGET_ALL || ack == i) alarmAck(i);
+    }
+  }
+  int shelve = alarmShelveRequest;
+  if (shelve >= 0) {
+    alarmShelveRequest = -1;
+    for (int i = 0; i < ALARM_COUNT; i++) {
+      if (shelve == ALARM_TARGET_ALL || shelve == i) alarmShelve(i, alarmShelveMinutes, now);
+    }
+  }
+}
+
+// Loop task, every pass (also while the E-stop holds the rest of loop() off)
+void alarmService() {
+  unsigned long now = millis();
+  alarmApplyRequests(now);
+  alarmRateTick(now);
+  for (int i = 0; i < ALARM_COUNT; i++) {
+    AlarmState& s = alarmStates[i];
+    if (s.shelvedUntilMs && !alarmShelved(i, now)) {
+      // Shelf time ran out: report anything that is still waiting for an operator
+      s.shelvedUntilMs = 0;
+      if (s.state != ALARM_NORMAL) webhookEnqueue(i, "unshelved");
+    }
+    if (ALARM_DEFS[i].kind != ALARM_EVENT) alarmEvaluate(i, now);
+  }
+}
+
+int alarmFind(const String& name) {
+  if (name == "all") return ALARM_TARGET_ALL;
+  for (int i = 0; i < ALARM_COUNT; i++) {
+    if (name == ALARM_DEFS[i].name) return i;
+  }
+  return -1;
+}
+
+// ========== WEBHOOK DELIVERY ==========
+// Alarm transitions are POSTed as JSON to a plain-HTTP URL (e.g. a local
+// relay or chat bridge). Messages wait in a ring carved from the arena; one
+// request is in flight at a time on an AsyncClient, so the loop never
+// blocks on DNS, connect or the reply. A non-2xx reply, error or timeout
+// retries with exponential backoff. When the ring is full, new messages
+// are dropped and counted. tools/webhook/receiver.py is a local receiver
+// that can inject failures.
+const int WEBHOOK_QUEUE_LEN = 8;
+const size_t WEBHOOK_BODY_MAX = 232;
+const unsigned long WEBHOOK_TIMEOUT_MS = 10000;
+const unsigned long WEBHOOK_RETRY_BASE_MS = 2000;
+const unsigned long WEBHOOK_RETRY_MAX_MS = 120000;
+const uint8_t WEBHOOK_MAX_ATTEMPTS = 10;
+
+typedef FixedString<97> WebhookUrlString;
+typedef FixedString<64> WebhookHostString;
+
+struct WebhookMessage {
+  unsigned long nextAttemptMs;
+  uint8_t attempts;
+  uint16_t len;
+  char body[WEBHOOK_BODY_MAX];
+};
+
+struct WebhookStats {
+  uint32_t queued;
+  uint32_t sent;
+  uint32_t retries;
+  uint32_t failed;              // Gave up after WEBHOOK_MAX_ATTEMPTS
+  uint32_t dropped;             // Ring full
+  int lastStatus;               // HTTP status of the last reply, 0 = none
+  int8_t lastError;             // AsyncTCP error of the last attempt
+};
+
+WebhookUrlString webhookUrl;    // Empty = delivery off (settings)
+WebhookHostString webhookHost;
+WebhookHostString webhookPath;
+uint16_t webhookPort = 80;
+
+WebhookMessage* webhookQueue = NULL;  // Arena ring
+const size_t WEBHOOK_QUEUE_BYTES = WEBHOOK_QUEUE_LEN * sizeof(WebhookMessage);
+int webhookHead = 0;
+int webhookCount = 0;
+uint32_t webhookSeq = 0;
+WebhookStats webhookStats;
+
+AsyncClient webhookClient;
+bool webhookInFlight = false;
+unsigned long webhookStartMs = 0;
+volatile bool webhookUrlChanged = false;  // Set by the web task with a new webhookUrl
+volatile bool webhookTestRequest = false;
+volatile bool webhookBusy = false;    // Cleared by the AsyncTCP task when the attempt ends
+volatile int webhookReplyStatus = 0;
+volatile int8_t webhookReplyError = 0;
+
+// "http://host[:port][/path]"; an empty URL parses to an empty host (off)
+bool webhookParseUrl(const char* url, WebhookHostString& host, uint16_t& port, WebhookHostString& path) {
+  host.clear();
+  path.clear();
+  port = 80;
+  if (!*url) return true;
+  if (strncmp(url, "http://", 7) != 0) return false;
+  const char* h = url + 7;
+  const char* end = h + strcspn(h, ":/");
+  if (end == h || (size_t)(end - h) > WebhookHostString::CAPACITY) return false;
+  host.assign(h, end - h);
+  if (*end == ':') {
+    char* after;
+    long p = strtol(end + 1, &after, 10);
+    if (p < 1 || p > 65535) return false;
+    port = (uint16_t)p;
+    end = after;
+  }
+  if (strlen(end) > WebhookHostString::CAPACITY) return false;
+  path.assign(*end == '/' ? end : "/");
+  return true;
+}
+
+// Takes the configured URL into use (loop task, nothing in flight)
+void webhookApplyUrl() {
+  if (!webhookParseUrl(webhookUrl.c_str(), webhookHost, webhookPort, webhookPath)) {
+    logLine("ERROR: webhook URL not usable: %s", webhookUrl.c_str());
+    webhookHost.clear();
+  }
+}
+
+// Loop task. Formats the message straight into the next free slot.
+void webhookPush(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+void webhookPush(const char* fmt, ...) {
+  if (webhookHost.empty() || !webhookQueue) return;
+  if (webhookCount == WEBHOOK_QUEUE_LEN) {
+    webhookStats.dropped++;
+    return;
+  }
+  WebhookMessage& m = webhookQueue[(webhookHead + webhookCount) % WEBHOOK_QUEUE_LEN];
+  va_list ap;
+  va_start(ap, fmt);
+  int len = vsnprintf(m.body, sizeof(m.body), fmt, ap);
+  va_end(ap);
+  if (len <= 0 || (size_t)len >= sizeof(m.body)) return;
+  m.len = len;
+  m.attempts = 0;
+  m.nextAttemptMs = millis();
+  webhookCount++;
+  webhookStats.queued++;
+}
+
+void webhookEnqueue(int id, const char* event) {
+  const AlarmState& s = alarmStates[id];
+  webhookPush("{\"device\":\"groutpump\",\"seq\":%lu,\"alarm\":\"%s\",\"event\":\"%s\",\"state\":\"%s\","
+              "\"severity\":\"%s\",\"value\":%.1f,\"setpoint\":%ld,\"unit\":\"%s\",\"uptimeMs\":%lu}",
+              (unsigned long)++webhookSeq, ALARM_DEFS[id].name, event, ALARM_STATE_NAMES[s.state],
+              ALARM_SEVERITY_NAMES[ALARM_DEFS[id].severity], s.value, alarmRules[id].setpoint,
+              ALARM_DEFS[id].unit, millis());
+}
+
+// AsyncTCP task callbacks: only touch the volatile reply fields
+void webhookOnConnect(void* arg, AsyncClient* client) {
+  const WebhookMessage& m = webhookQueue[webhookHead];
+  char header[192];
+  int n = snprintf(header, sizeof(header),
+                   "POST %s HTTP/1.1\r\nHost: %s\r\nContent-Type: application/json\r\n"
+                   "Content-Length: %u\r\nConnection: close\r\n\r\n",
+                   webhookPath.c_str(), webhookHost.c_str(), (unsigned)m.len);
+  client->add(header, min((size_t)n, sizeof(header) - 1));
+  client->add(m.body, m.len);
+  client->send();
+}
+
+void webhookOnData(void* arg, AsyncClient* client, void* data, size_t len) {
+  // Only the status line matters: "HTTP/1.1 200 OK"
+  const char* p = (const char*)data;
+  if (webhookReplyStatus == 0 && len >= 12 && strncmp(p, "HTTP/1.", 7) == 0) {
+    webhookReplyStatus = atoi(p + 9);
+  }
+  client->close();
+}
+
+void webhookOnDisconnect(void* arg, AsyncClient* client) {
+  webhookBusy = false;
+}
+
+void webhookOnError(void* arg, AsyncClient* client, int8_t error) {
+  webhookReplyError = error;
+  webhookBusy = false;
+}
+
+void webhookInit() {
+  webhookQueue = (WebhookMessage*)arenaAlloc("webhookQueue", WEBHOOK_QUEUE_BYTES);
+  webhookApplyUrl();
+  webhookClient.onConnect(webhookOnConnect);
+  webhookClient.onData(webhookOnData);
+  webhookClient.onDisconnect(webhookOnDisconnect);
+  webhookClient.onError(webhookOnError);
+}
+
+void webhookFinishAttempt(unsigned long now) {
+  webhookInFlight = false;
+  int status = webhookReplyStatus;
+  webhookStats.lastStatus = status;
+  webhookStats.lastError = webhookReplyError;
+  WebhookMessage& m = webhookQueue[webhookHead];
+  if (status >= 200 && status < 300) {
+    webhookStats.sent++;
+  } else if (++m.attempts < WEBHOOK_MAX_ATTEMPTS) {
+    webhookStats.retries++;
+    m.nextAttemptMs = now + min(WEBHOOK_RETRY_MAX_MS, WEBHOOK_RETRY_BASE_MS << (m.attempts - 1));
+    return;
+  } else {
+    webhookStats.failed++;
+    logLine("Webhook: giving up after %u attempts (status %d)", (unsigned)m.attempts, status);
+  }
+  webhookHead = (webhookHead + 1) % WEBHOOK_QUEUE_LEN;
+  webhookCount--;
+}
+
+// Loop task: finish the attempt in flight, or start the next one that's due
+void webhookService() {
+  unsigned long now = millis();
+  if (webhookInFlight) {
+    if (webhookBusy) {
+      if (now - webhookStartMs > WEBHOOK_TIMEOUT_MS) webhookClient.close(true);
+      return;
+    }
+    webhookFinishAttempt(now);
+  }
+  if (webhookUrlChanged) {
+    webhookUrlChanged = false;
+    webhookApplyUrl();
+  }
+  if (webhookTestRequest) {
+    webhookTestRequest = false;
+    webhookPush("{\"device\":\"groutpump\",\"seq\":%lu,\"event\":\"test\",\"uptimeMs\":%lu}",
+                (unsigned long)++webhookSeq, millis());
+  }
+  if (webhookCount == 0 || webhookHost.empty() || WiFi.status() != WL_CONNECTED) return;
+  if ((long)(now - webhookQueue[webhookHead].nextAttemptMs) < 0) return;
+
+  webhookReplyStatus = 0;
+  webhookReplyError = 0;
+  webhookBusy = true;
+  webhookInFlight = true;
+  webhookStartMs = now;
+  TRACE_INSTANT("webhook.send");
+  if (!webhookClient.connect(webhookHost.c_str(), webhookPort)) webhookBusy = false;
+}
+
+size_t getAlarmsJson(char* out, size_t cap) {
+  unsigned long now = millis();
+  StaticJsonDocument<3072> doc;
+  JsonArray arr = doc.createNestedArray("alarms");
+  int active = 0, unacked = 0;
+  for (int i = 0; i < ALARM_COUNT; i++) {
+    const AlarmDef& d = ALARM_DEFS[i];
+    const AlarmRule& r = alarmRules[i];
+    const AlarmState& s = alarmStates[i];
+    bool shelved = alarmShelved(i, now);
+    if (!shelved && (s.state == ALARM_UNACK_ACTIVE || s.state == ALARM_ACK_ACTIVE)) active++;
+    if (!shelved && (s.state == ALARM_UNACK_ACTIVE || s.state == ALARM_UNACK_RTN)) unacked++;
+    JsonObject o = arr.createNestedObject();
+    o["name"] = d.name;
+    o["state"] = ALARM_STATE_NAMES[s.state];
+    o["severity"] = ALARM_SEVERITY_NAMES[d.severity];
+    o["enabled"] = r.enabled;
+    o["value"] = s.value;
+    o["unit"] = d.unit;
+    if (d.kind != ALARM_EVENT) {
+      o["type"] = (d.kind == ALARM_ABOVE) ? "above" : "below";
+      o["setpoint"] = r.setpoint;
+      o["hysteresis"] = r.hysteresis;
+      o["delayMs"] = r.delayMs;
+    } else {
+      o["type"] = "event";
+    }
+    o["raised"] = s.raised;
+    if (s.changedMs) o["sinceMs"] = now - s.changedMs;
+    if (shelved) o["shelvedMs"] = s.shelvedUntilMs - now;
+  }
+  doc["active"] = active;
+  doc["unacked"] = unacked;
+  JsonObject w = doc.createNestedObject("webhook");
+  w["url"] = webhookUrl.c_str();
+  w["pending"] = webhookCount;
+  w["queued"] = webhookStats.queued;
+  w["sent"] = webhookStats.sent;
+  w["retries"] = webhookStats.retries;
+  w["failed"] = webhookStats.failed;
+  w["dropped"] = webhookStats.dropped;
+  w["lastStatus"] = webhookStats.lastStatus;
+  if (webhookStats.lastError) w["lastError"] = webhookClient.errorToString(webhookStats.lastError);
+  return serializeJson(doc, out, cap);
+}
+
+// ========== MANUAL MODE HANDLER ==========
+void handleManualMode() {
+  bool inputAPressed = (readInput(INPUT_A_PIN) == LOW);
+  bool inputBPressed = (readInput(INPUT_B_PIN) == LOW);
+
+  // Read endstops to update direction logic even in manual mode
+  bool endStopIn = (readInput(ENDSTOP_IN_PIN) == HIGH);
+  bool endStopOut = (readInput(ENDSTOP_OUT_PIN) == HIGH);
+
+  // Update direction based on End Stops (Top Priority)
+  // If we hit an end stop in manual mode, the NEXT auto-move must be the opposite way.
+  if (endStopIn) {
+    cycleDirection = CYCLE_OUT;
+  } else if (endStopOut) {
+    cycleDirection = CYCLE_IN;
+  }
+
+  // After an overpressure trip, hold off until both jog buttons are released
+  if (pressureLatched) {
+    if (inputAPressed || inputBPressed) {
+      writeOutput(GPO1_PIN, LOW);
+      writeOutput(GPO2_PIN, LOW);
+      return;
+    }
+    pressureLatched = false;
+  }
+
+  // Safety: Prevent simultaneous activation of both outputs
+  if (inputAPressed && inputBPressed) {
+    // If both buttons pressed, turn off both outputs
+    writeOutput(GPO1_PIN, LOW);
+    writeOutput(GPO2_PIN, LOW);
+    return;
+  }
+  
+  // Input A controls GPO2 (Extend / OUT)
+  if (inputAPressed) {
+    writeOutput(GPO1_PIN, LOW);  // Ensure other output is off
+
+    // Only extend if end stop OUT is NOT triggered
+    if (!endStopOut) {
+       writeOutput(GPO2_PIN, HIGH);
+       cycleDirection = CYCLE_OUT;
+    } else {
+       // Safety block
+       writeOutput(GPO2_PIN, LOW);
+    }
+  } 
+  // Input B controls GPO1 (Retract / IN)
+  else if (inputBPressed) {
+    writeOutput(GPO2_PIN, LOW);  // Ensure other output is off
+
+    // Only retract if end stop IN is NOT triggered
+    if (!endStopIn) {
+       writeOutput(GPO1_PIN, HIGH);
+       cycleDirection = CYCLE_IN;
+    } else {
+       // Safety block
+       writeOutput(GPO1_PIN, LOW);
+    }
+  } 
+  // No input pressed
+  else {
+    writeOutput(GPO1_PIN, LOW);
+    writeOutput(GPO2_PIN, LOW);
+  }
+}
+
+// ========== AUTO LOOP MODE HANDLER ==========
+void handleAutoLoopMode() {
+  // Endstops are Normally Closed (NC): HIGH = Triggered (Open Switch), LOW = Safe (Closed Switch)
+  bool endStopIn = (readInput(ENDSTOP_IN_PIN) == HIGH);
+  bool endStopOut = (readInput(ENDSTOP_OUT_PIN) == HIGH);
+  
+  // Safety check: Both end stops triggered simultaneously (sensor malfunction)
+  if (endStopIn && endStopOut) {
+    Serial.println("ERROR: Both end stops triggered! Stopping all outputs.");
+    TRACE_INSTANT("fault.bothEndStops");
+    alarmEvent(ALARM_BOTH_END_STOPS, 1);
+    utilFault();
+    recorderTrigger("bothEndStops");
+    writeOutput(GPO1_PIN, LOW);
+    writeOutput(GPO2_PIN, LOW);
+    cycleDirection = CYCLE_STOPPED;
+    currentMode = MODE_MANUAL;  // Return to manual mode for safety
+    inputC.pressed = false;
+    inputD.pressed = false;
+    return;
+  }
+  
+  // Safety check: Timeout if end-stop not reached within expected time
+  if (timeoutEnabled && (millis() - cycleStartTime > cycleTimeout)) {
+    logLine("ERROR: Cycle timeout! End-stop not reached within %lums", cycleTimeout);
+    TRACE_INSTANT("fault.timeout");
+    alarmEvent(ALARM_TIMEOUT, millis() - cycleStartTime);
+    utilFault();
+    recorderTrigger("timeout");
+    Serial.println("Stopping all outputs and returning to manual mode.");
+    writeOutput(GPO1_PIN, LOW);
+    writeOutput(GPO2_PIN, LOW);
+    cycleDirection = CYCLE_STOPPED;
+    currentMode = MODE_MANUAL;  // Return to manual mode for safety
+    inputC.pressed = false;
+    inputD.pressed = false;
+    return;
+  }
+  
+  // Check for end stop triggers and reverse direction
+  if (cycleDirection == CYCLE_IN && endStopIn) {
+    Serial.println("End stop IN reached - switching to OUT cycle");
+    TRACE_INSTANT("reversal.toOut");
+    // Stroke time is recorded by the motion tracker (see MOTION TRACKER)
+
+    cycleDirection = CYCLE_OUT;
+    lastCycleTime = millis();
+    cycleStartTime = millis();  // Reset timeout timer for new cycle
+  } else if (cycleDirection == CYCLE_OUT && endStopOut) {
+    Serial.println("End stop OUT reached - switching to IN cycle");
+    TRACE_INSTANT("reversal.toIn");
+
+    cycleDirection = CYCLE_IN;
+    lastCycleTime = millis();
+    cycleStartTime = millis();  // Reset timeout timer for new cycle
+  }
+  
+  // Apply cycle delay after direction change to prevent immediate reversal
+  // This also ensures both outputs are never active simultaneously
+  if (millis() - lastCycleTime < CYCLE_DELAY) {
+    writeOutput(GPO1_PIN, LOW);
+    writeOutput(GPO2_PIN, LOW);
+    return;
+  }
+  
+  // Control outputs based on cycle direction
+  // Safety: Explicitly ensure only one output is active at a time
+  if (cycleDirection == CYCLE_IN) {
+    writeOutput(GPO2_PIN, LOW);  // Turn off GPO2 first
+    writeOutput(GPO1_PIN, HIGH);  // Then turn on GPO1
+  } else if (cycleDirection == CYCLE_OUT) {
+    writeOutput(GPO1_PIN, LOW);  // Turn off GPO1 first
+    writeOutput(GPO2_PIN, HIGH);  // Then turn on GPO2
+  } else {
+    writeOutput(GPO1_PIN, LOW);
+    writeOutput(GPO2_PIN, LOW);
+  }
+}
+
+// ========== VALVE RESPONSE ==========
+// Every travel that leaves an end stop is split in two, per direction:
+// response (output commanded on -> departure end stop released: the spool
+// shifting and pressure building) and travel (released -> arrival end stop).
+// The command is stamped in writeOutput(); release and arrival are seen by
+// motionService() once per loop pass, so resolution is the loop period.
+// Each figure keeps last/min/max and an EWMA. The first
+// VALVE_BASELINE_SAMPLES of each after a valve is replaced (or on
+// POST /diag/valves) become its baseline, persisted with the output wear
+// totals; simulation learns its own and never saves it. The valveResponse
+// alarm rates the slower valve's EWMA against its baseline, so a sticking
+// spool or weak coil shows while it costs milliseconds per stroke, long
+// before the stroke rate drops. Stats are under statusLock.
+enum ValveFigure {
+  VALVE_RESPONSE,
+  VALVE_TRAVEL
+};
+
+const char* const VALVE_DIR_NAMES[] = {"IN", "OUT"};   // Index = output (gpo1 = IN)
+const char* const VALVE_FIGURE_NAMES[] = {"response", "travel"};
+const uint32_t VALVE_BASELINE_SAMPLES = 20;
+const uint32_t VALVE_MIN_SAMPLES = 8;      // Before the EWMA is rated
+const float VALVE_EWMA_ALPHA = 0.125f;
+const size_t VALVE_HISTORY_ARENA_BYTES = 4 * sizeof(StrokeHistory);
+
+struct ValveStats {
+  uint32_t count;           // Since boot or simulation toggle
+  uint32_t lastUs;
+  uint32_t minUs;
+  uint32_t maxUs;
+  float ewmaUs;
+  uint32_t baselineUs;      // 0 = learning
+  uint32_t learnCount;
+  uint64_t learnSumUs;
+};
+
+ValveStats valveStats[2][2];                 // [IN, OUT][ValveFigure]
+uint32_t valveSavedBaseline[2][2];           // Hardware baselines, persisted (see OUTPUT WEAR)
+bool valveBaselineDirty = false;             // Saved by outputWearService()
+volatile bool valveRelearnRequest = false;   // From the web task, applied in outputWearService()
+
+void valveInit() {
+  for (int d = 0; d < 2; d++) {
+    for (int f = 0; f < 2; f++) valveStats[d][f].baselineUs = valveSavedBaseline[d][f];
+  }
+  StrokeHistory* h = (StrokeHistory*)arenaAlloc("valveHistory", VALVE_HISTORY_ARENA_BYTES);
+  if (!h) return;
+  for (int i = 0; i < 4; i++) valveHistory[i / 2][i % 2] = new (h + i) StrokeHistory();
+}
+
+// Loop task, on a simulation toggle: start over with the saved hardware
+// baselines, or in simulation with none
+void valveResetStats() {
+  xSemaphoreTake(statusLock, portMAX_DELAY);
+  memset(valveStats, 0, sizeof(valveStats));
+  for (int d = 0; d < 2; d++) {
+    for (int f = 0; f < 2; f++) valveStats[d][f].baselineUs = simEnabled ? 0 : valveSavedBaseline[d][f];
+  }
+  xSemaphoreGive(statusLock);
+}
+
+// Forget a direction's baselines so the next travels set new ones.
+// Caller holds statusLock.
+void valveRelearn(int dir) {
+  for (int f = 0; f < 2; f++) {
+    ValveStats& v = valveStats[dir][f];
+    v.baselineUs = 0;
+    v.learnCount = 0;
+    v.learnSumUs = 0;
+    if (!simEnabled) valveSavedBaseline[dir][f] = 0;
+  }
+  if (!simEnabled) valveBaselineDirty = true;
+}
+
+// Loop task, from motionService()
+void valveRecord(int dir, ValveFigure fig, int64_t us) {
+  if (us <= 0) return;
+  uint32_t v = (uint32_t)min(us, (int64_t)UINT32_MAX);
+  bool learned = false;
+
+  xSemaphoreTake(statusLock, portMAX_DELAY);
+  ValveStats& s = valveStats[dir][fig];
+  if (s.count == 0 || v < s.minUs) s.minUs = v;
+  if (v > s.maxUs) s.maxUs = v;
+  s.ewmaUs = s.count ? s.ewmaUs + VALVE_EWMA_ALPHA * ((float)v - s.ewmaUs) : v;
+  s.lastUs = v;
+  s.count++;
+  if (!s.baselineUs) {
+    s.learnSumUs += v;
+    if (++s.learnCount >= VALVE_BASELINE_SAMPLES) {
+      s.baselineUs = s.learnSumUs / s.learnCount;
+      learned = true;
+      if (!simEnabled) {
+        valveSavedBaseline[dir][fig] = s.baselineUs;
+        valveBaselineDirty = true;
+      }
+    }
+  }
+  if (valveHistory[dir][fig]) valveHistory[dir][fig]->append(v);
+  xSemaphoreGive(statusLock);
+
+  if (learned) {
+    logLine("VALVE: %s %s baseline %lu us", VALVE_DIR_NAMES[dir], VALVE_FIGURE_NAMES[fig],
+            (unsigned long)valveStats[dir][fig].baselineUs);
+  }
+}
+
+// EWMA as % of baseline; -1 while learning or short of samples
+float valvePct(const ValveStats& s) {
+  if (!s.baselineUs || s.count < VALVE_MIN_SAMPLES) return -1;
+  return 100.0f * s.ewmaUs / s.baselineUs;
+}
+
+bool valveSlow(const ValveStats& s) {
+  return valvePct(s) > alarmRules[ALARM_VALVE_RESPONSE].setpoint;
+}
+
+size_t valveHistoryBytesUsed() {
+  size_t used = 0;
+  for (int d = 0; d < 2; d++) {
+    for (int f = 0; f < 2; f++) used += valveHistory[d][f] ? valveHistory[d][f]->bytesUsed() : 0;
+  }
+  return used;
+}
+
+// Alarm metric: the slower valve's response vs its baseline
+bool valveResponsePct(float* pct) {
+  *pct = max(valvePct(valveStats[0][VALVE_RESPONSE]), valvePct(valveStats[1][VALVE_RESPONSE]));
+  return *pct >= 0;
+}
+
+size_t getValvesJson(char* out, size_t cap) {
+  ValveStats stats[2][2];
+  xSemaphoreTake(statusLock, portMAX_DELAY);
+  memcpy(stats, valveStats, sizeof(stats));
+  xSemaphoreGive(statusLock);
+
+  StaticJsonDocument<1024> doc;
+  for (int d = 0; d < 2; d++) {
+    JsonObject o = doc.createNestedObject(VALVE_DIR_NAMES[d]);
+    for (int f = 0; f < 2; f++) {
+      const ValveStats& s = stats[d][f];
+      JsonObject fo = o.createNestedObject(VALVE_FIGURE_NAMES[f]);
+      fo["count"] = s.count;
+      fo["lastUs"] = s.lastUs;
+      fo["minUs"] = s.minUs;
+      fo["maxUs"] = s.maxUs;
+      fo["avgUs"] = (unsigned long)lroundf(s.ewmaUs);
+      if (s.baselineUs) fo["baselineUs"] = s.baselineUs;
+      else fo["learning"] = s.learnCount;
+      float pct = valvePct(s);
+      if (pct >= 0) fo["pctOfBaseline"] = roundf(pct * 10) / 10;
+    }
+    o["slow"] = valveSlow(stats[d][VALVE_RESPONSE]);
+  }
+  doc["baselineSamples"] = VALVE_BASELINE_SAMPLES;
+  doc["slowPct"] = alarmRules[ALARM_VALVE_RESPONSE].setpoint;
+  return serializeJson(doc, out, cap);
+}
+
+// ========== MOTION TRACKER ==========
+// Times every travel in both modes from the output commands and end stops.
+// A travel starts when an output is commanded on and ends when its end stop
+// is reached (full) or the command drops or reverses first (partial). Only a
+// travel that started on the opposite end stop counts as full; a jog from
+// mid-stroke that reaches its end stop is partial. Full travels feed the
+// stroke statistics (which drop noise under 100 ms) and pressure windows,
+// so manual jogs show up like auto ones. Every travel is counted per mode and direction
+// and kept in a short log for GET /motion. Travels that leave an end stop
+// are also timed for the valve response (see VALVE RESPONSE). Counters and
+// log are under statusLock.
+enum MotionDir {
+  MOTION_IN,
+  MOTION_OUT,
+  MOTION_NONE
+};
+
+const char* const MOTION_DIR_NAMES[] = {"IN", "OUT"};
+const char* const MOTION_MODE_NAMES[] = {"manual", "auto"};   // By SystemMode
+const int MOTION_LOG_LEN = 16;
+
+struct MotionTravel {
+  uint32_t endMs;         // millis() when it ended
+  uint32_t durationMs;
+  uint8_t mode;           // SystemMode when it started
+  uint8_t dir;            // MotionDir
+  bool full;              // End stop to end stop
+};
+
+struct MotionCounters {
+  uint32_t full;
+  uint32_t partial;
+  uint64_t fullMs;
+  uint64_t travelMs;      // Full and partial
+};
+
+MotionDir motionCommand = MOTION_NONE;   // Output command on the previous pass
+bool motionActive = false;
+MotionDir motionDir = MOTION_NONE;
+SystemMode motionMode = MODE_MANUAL;
+unsigned long motionStartMs = 0;
+int64_t motionCommandUs = 0;             // Output on command (VALVE RESPONSE)
+bool motionFromStop = false;             // Started on the departure end stop
+int64_t motionReleaseUs = 0;             // Departure end stop released; 0 = not yet
+MotionCounters motionCounters[2][2];     // [SystemMode][MotionDir]
+MotionTravel motionLog[MOTION_LOG_LEN];
+uint32_t motionLogTotal = 0;             // Travels logged since boot
+
+// arrived: the travel's own end stop was reached
+void motionFinish(bool arrived) {
+  uint32_t duration = millis() - motionStartMs;
+  motionActive = false;
+  bool full = arrived && motionFromStop;
+  pressureStrokeEnd(full);
+  if (full) {
+    updateStats(duration);
+    if (motionReleaseUs) valveRecord(motionDir, VALVE_TRAVEL, esp_timer_get_time() - motionReleaseUs);
+  }
+
+  xSemaphoreTake(statusLock, portMAX_DELAY);
+  MotionCounters& c = motionCounters[motionMode][motionDir];
+  if (full) {
+    c.full++;
+    c.fullMs += duration;
+  } else {
+    c.partial++;
+  }
+  c.travelMs += duration;
+  MotionTravel& t = motionLog[motionLogTotal++ % MOTION_LOG_LEN];
+  t.endMs = millis();
+  t.durationMs = duration;
+  t.mode = motionMode;
+  t.dir = motionDir;
+  t.full = full;
+  xSemaphoreGive(statusLock);
+
+  logLine("Travel %s (%s) %s: %lu ms", MOTION_DIR_NAMES[motionDir], MOTION_MODE_NAMES[motionMode],
+          full ? "end stop to end stop" : arrived ? "reached end stop from mid-stroke" : "stopped short",
+          (unsigned long)duration);
+  TRACE_INSTANT(full ? "travel.full" : "travel.partial");
+}
+
+// Loop task, after the mode handlers have set the outputs
+void motionService() {
+  MotionDir cmd = readOutput(GPO2_PIN) == HIGH ? MOTION_OUT :
+                  readOutput(GPO1_PIN) == HIGH ? MOTION_IN : MOTION_NONE;
+  if (motionActive) {
+    int endStop = (motionDir == MOTION_OUT) ? ENDSTOP_OUT_PIN : ENDSTOP_IN_PIN;
+    int departure = (motionDir == MOTION_OUT) ? ENDSTOP_IN_PIN : ENDSTOP_OUT_PIN;
+    if (motionFromStop && !motionReleaseUs && readInput(departure) == LOW) {
+      motionReleaseUs = esp_timer_get_time();
+      valveRecord(motionDir, VALVE_RESPONSE, motionReleaseUs - motionCommandUs);
+    }
+    if (readInput(endStop) == HIGH) motionFinish(true);
+    else if (cmd != motionDir) motionFinish(false);
+  }
+  // Only a fresh command starts a travel, so an output still on at its end
+  // stop doesn't count again
+  if (!motionActive && cmd != MOTION_NONE && cmd != motionCommand) {
+    motionActive = true;
+    motionDir = cmd;
+    motionMode = currentMode;
+    motionStartMs = millis();
+    motionCommandUs = outputOnUs[cmd == MOTION_OUT ? 1 : 0];
+    motionFromStop = readInput(cmd == MOTION_OUT ? ENDSTOP_IN_PIN : ENDSTOP_OUT_PIN) == HIGH;
+    motionReleaseUs = 0;
+  }
+  motionCommand = cmd;
+}
+
+size_t getMotionJson(char* out, size_t cap) {
+  xSemaphoreTake(statusLock, portMAX_DELAY);
+  MotionCounters counters[2][2];
+  memcpy(counters, motionCounters, sizeof(counters));
+  MotionTravel log[MOTION_LOG_LEN];
+  memcpy(log, motionLog, sizeof(log));
+  uint32_t total = motionLogTotal;
+  xSemaphoreGive(statusLock);
+
+  StaticJsonDocument<2560> doc;
+  if (motionActive) {
+    JsonObject a = doc.createNestedObject("active");
+    a["dir"] = MOTION_DIR_NAMES[motionDir];
+    a["mode"] = MOTION_MODE_NAMES[motionMode];
+    a["elapsedMs"] = millis() - motionStartMs;
+  }
+  JsonObject modes = doc.createNestedObject("counters");
+  for (int m = 0; m < 2; m++) {
+    JsonObject mo = modes.createNestedObject(MOTION_MODE_NAMES[m]);
+    for (int d = 0; d < 2; d++) {
+      const MotionCounters& c = counters[m][d];
+      JsonObject o = mo.createNestedObject(MOTION_DIR_NAMES[d]);
+      o["full"] = c.full;
+      o["partial"] = c.partial;
+      o["travelS"] = (unsigned long)(c.travelMs / 1000);
+      o["avgFullMs"] = c.full ? (unsigned long)(c.fullMs / c.full) : 0;
+    }
+  }
+
+  // Newest first
+  JsonArray travels = doc.createNestedArray("recent");
+  uint32_t n = min(total, (uint32_t)MOTION_LOG_LEN);
+  for (uint32_t i = 0; i < n; i++) {
+    const MotionTravel& t = log[(total - 1 - i) % MOTION_LOG_LEN];
+    JsonObject o = travels.createNestedObject();
+    o["ageS"] = (millis() - t.endMs) / 1000;
+    o["mode"] = MOTION_MODE_NAMES[t.mode];
+    o["dir"] = MOTION_DIR_NAMES[t.dir];
+    o["full"] = t.full;
+    o["ms"] = t.durationMs;
+  }
+  doc["total"] = total;
+  return serializeJson(doc, out, cap);
+}
+
+// ========== UTILIZATION ==========
+// Where the shift goes: elapsed time split into pumping (auto, per
+// direction), CYCLE_DELAY dwell, manual jogging, idle, fault hold and E-stop.
+// The loop derives the state every pass but only charges time when it
+// changes (or a report needs current figures), so totals are exact
+// intervals, not samples. Kept since boot, for the current and previous job,
+// and in 5-minute buckets for rolling windows. Under statusLock.
+enum UtilState {
+  UTIL_PUMP_OUT,
+  UTIL_PUMP_IN,
+  UTIL_DWELL,         // AUTO with both outputs off (CYCLE_DELAY between strokes)
+  UTIL_JOG_OUT,
+  UTIL_JOG_IN,
+  UTIL_IDLE,          // MANUAL, nothing moving
+  UTIL_FAULT,         // MANUAL after a timeout/end-stop/overpressure fault, until restarted
+  UTIL_ESTOP,
+  UTIL_STATE_COUNT
+};
+
+const char* const UTIL_STATE_NAMES[UTIL_STATE_COUNT] = {
+  "pumpOut", "pumpIn", "dwell", "jogOut", "jogIn", "idle", "fault", "estop"
+};
+
+const uint64_t UTIL_BUCKET_MS = 5 * 60 * 1000UL;
+const int UTIL_BUCKETS = 12;                       // One hour
+const int UTIL_WINDOW_MINUTES[] = {15, 60};
+
+struct UtilTotals {
+  uint64_t ms[UTIL_STATE_COUNT];
+};
+
+struct UtilBucket {
+  uint32_t index;                                  // Clock ms / UTIL_BUCKET_MS
+  uint32_t ms[UTIL_STATE_COUNT];
+};
+
+struct UtilJob {
+  bool active;
+  char name[32];
+  uint64_t startMs;
+  uint64_t endMs;
+  UtilTotals totals;
+};
+
+UtilState utilState = UTIL_IDLE;
+uint64_t utilSinceMs = 0;       // Time charged up to here
+bool utilFaultHold = false;
+UtilTotals utilBoot;
+UtilBucket utilBuckets[UTIL_BUCKETS];
+UtilJob utilJob;
+UtilJob utilLastJob;
+
+uint64_t utilNowMs() { return esp_timer_get_time() / 1000; }
+
+// Charge the current state up to `now`
+void utilCharge(uint64_t now) {
+  uint64_t t = utilSinceMs;
+  utilSinceMs = now;
+  if (now <= t) return;
+  utilBoot.ms[utilState] += now - t;
+  if (utilJob.active) utilJob.totals.ms[utilState] += now - t;
+  while (t < now) {
+    uint32_t index = t / UTIL_BUCKET_MS;
+    uint64_t end = (uint64_t)(index + 1) * UTIL_BUCKET_MS;
+    if (end > now) end = now;
+    UtilBucket& b = utilBuckets[index % UTIL_BUCKETS];
+    if (b.index != index) {
+      memset(&b, 0, sizeof(b));
+      b.index = index;
+    }
+    b.ms[utilState] += end - t;
+    t = end;
+  }
+}
+
+UtilState utilDerive() {
+  if (isEstopActive) return UTIL_ESTOP;
+  bool out = readOutput(GPO2_PIN) == HIGH;
+  bool in = readOutput(GPO1_PIN) == HIGH;
+  if (currentMode == MODE_AUTO_LOOP) {
+    utilFaultHold = false;
+    return out ? UTIL_PUMP_OUT : in ? UTIL_PUMP_IN : UTIL_DWELL;
+  }
+  if (out || in) {
+    utilFaultHold = false;
+    return out ? UTIL_JOG_OUT : UTIL_JOG_IN;
+  }
+  return utilFaultHold ? UTIL_FAULT : UTIL_IDLE;
+}
+
+// Loop task, once per pass
+void utilService() {
+  UtilState s = utilDerive();
+  if (s == utilState) return;
+  xSemaphoreTake(statusLock, portMAX_DELAY);
+  utilCharge(utilNowMs());
+  utilState = s;
+  xSemaphoreGive(statusLock);
+}
+
+// Loop task, at each fault that drops to MANUAL
+void utilFault() {
+  utilFaultHold = true;
+}
+
+void utilAddTotals(JsonObject o, const uint64_t* ms, uint64_t spanMs) {
+  uint64_t pumping = ms[UTIL_PUMP_OUT] + ms[UTIL_PUMP_IN] + ms[UTIL_JOG_OUT] + ms[UTIL_JOG_IN];
+  o["totalS"] = (unsigned long)(spanMs / 1000);
+  o["pumpingS"] = (unsigned long)(pumping / 1000);
+  // Share of elapsed time the cylinder was actually moving
+  o["efficiency"] = spanMs ? roundf(pumping * 1000.0f / spanMs) / 10 : 0;
+  JsonObject t = o.createNestedObject("seconds");
+  for (int i = 0; i < UTIL_STATE_COUNT; i++) t[UTIL_STATE_NAMES[i]] = (unsigned long)(ms[i] / 1000);
+}
+
+void utilAddJob(JsonObject o, const UtilJob& job, uint64_t now) {
+  uint64_t span = 0;
+  for (int i = 0; i < UTIL_STATE_COUNT; i++) span += job.totals.ms[i];
+  o["name"] = job.name;
+  o["active"] = job.active;
+  o["ageS"] = (unsigned long)(((job.active ? now : job.endMs) - job.startMs) / 1000);
+  utilAddTotals(o, job.totals.ms, span);
+}
+
+size_t getUtilizationJson(char* out, size_t cap) {
+  xSemaphoreTake(statusLock, portMAX_DELAY);
+  uint64_t now = utilNowMs();
+  utilCharge(now);
+  UtilTotals boot = utilBoot;
+  UtilBucket buckets[UTIL_BUCKETS];
+  memcpy(buckets, utilBuckets, sizeof(buckets));
+  UtilJob job = utilJob;
+  UtilJob lastJob = utilLastJob;
+  UtilState state = utilState;
+  xSemaphoreGive(statusLock);
+
+  StaticJsonDocument<2048> doc;
+  doc["state"] = UTIL_STATE_NAMES[state];
+  uint64_t bootSpan = 0;
+  for (int i = 0; i < UTIL_STATE_COUNT; i++) bootSpan += boot.ms[i];
+  utilAddTotals(doc.createNestedObject("sinceBoot"), boot.ms, bootSpan);
+
+  // Rolling windows: the current (partial) bucket plus the ones before it
+  uint32_t current = now / UTIL_BUCKET_MS;
+  JsonArray windows = doc.createNestedArray("windows");
+  for (size_t w = 0; w < sizeof(UTIL_WINDOW_MINUTES) / sizeof(UTIL_WINDOW_MINUTES[0]); w++) {
+    uint32_t count = UTIL_WINDOW_MINUTES[w] * 60000UL / UTIL_BUCKET_MS;
+    uint64_t ms[UTIL_STATE_COUNT] = {0};
+    uint64_t span = 0;
+    for (int i = 0; i < UTIL_BUCKETS; i++) {
+      const UtilBucket& b = buckets[i];
+      if (b.index > current || current - b.index >= count) continue;
+      for (int k = 0; k < UTIL_STATE_COUNT; k++) {
+        ms[k] += b.ms[k];
+        span += b.ms[k];
+      }
+    }
+    JsonObject o = windows.createNestedObject();
+    o["minutes"] = UTIL_WINDOW_MINUTES[w];
+    utilAddTotals(o, ms, span);
+  }
+
+  if (job.active) utilAddJob(doc.createNestedObject("job"), job, now);
+  if (lastJob.startMs) utilAddJob(doc.createNestedObject("lastJob"), lastJob, now);
+  return serializeJson(doc, out, cap);
+}
+
+// POST /utilization?action=start[&name=...] | action=end. Starting a job
+// ends the one in progress.
+void handleUtilization(AsyncWebServerRequest *request) {
+  String action = request->arg("action");
+  if (action != "start" && action != "end") {
+    request->send(400, "text/plain", "action must be start or end");
+    return;
+  }
+  xSemaphoreTake(statusLock, portMAX_DELAY);
+  uint64_t now = utilNowMs();
+  utilCharge(now);
+  bool ended = utilJob.active;
+  if (ended) {
+    utilJob.active = false;
+    utilJob.endMs = now;
+    utilLastJob = utilJob;
+  }
+  if (action == "start") {
+    memset(&utilJob, 0, sizeof(utilJob));
+    utilJob.active = true;
+    utilJob.startMs = now;
+    strlcpy(utilJob.name, request->hasArg("name") && request->arg("name").length() ? request->arg("name").c_str() : "job",
+            sizeof(utilJob.name));
+  }
+  xSemaphoreGive(statusLock);
+
+  if (ended) logLine("Job ended: %s", utilLastJob.name);
+  if (action == "start") logLine("Job started: %s", utilJob.name);
+  request->send(200, "text/plain", "OK");
+}
+
+// ========== FLASH WEAR ACCOUNTING ==========
+// NVS and LittleFS writes go through this layer. Per subsystem it counts bytes
+// and estimated sector erases, and enforces a write-rate budget (token bucket
+// in bytes/hour): a write requested while the bucket is empty is deferred, and
+// further requests are coalesced into that one pending write, which
+// flashService() performs once budget has refilled. Lifetime totals are
+// persisted hourly in the "flashwear" namespace so the remaining-life
+// estimate survives reboots. Served from GET /diag/flash.
+enum FlashStore {
+  FLASH_STORE_NVS,
+  FLASH_STORE_FS,
+  FLASH_STORE_COUNT
+};
+
+enum FlashSubsystem {
+  FLASH_SETTINGS,       // "groutpump" settings namespace
+  FLASH_WEAR_LOG,       // Lifetime totals in "flashwear"
+  FLASH_FS_IMAGE,       // LittleFS images uploaded via /update
+  FLASH_OUTPUT_WEAR,    // SSR/valve switching totals in "outputwear"
+  FLASH_CAPTURES,       // Flight recorder captures in /captures
+  FLASH_OTA_PROGRESS,   // Chunked firmware upload progress in "ota"
+  FLASH_SNAPSHOT,       // Snapshot restores staged in LittleFS
+  FLASH_WIFI_CACHE,     // Last AP, DHCP lease and static IP in "wifinet"
+  FLASH_SUBSYSTEM_COUNT
+};
+
+typedef void (*FlashWriteFn)();
+
+struct FlashSubsystemState {
+  const char* name;
+  FlashStore store;
+  uint32_t budgetPerHour;   // Bytes; 0 = unlimited
+  FlashWriteFn write;       // Performs the write (NULL: accounting only)
+  int32_t tokens;           // Bytes available now; negative after a large write
+  unsigned long lastRefill;
+  bool pending;             // Deferred write waiting for budget
+  uint32_t writes;          // Writes that reached flash
+  uint32_t bytes;           // Bytes written (NVS: whole 32-byte entries)
+  uint32_t units;           // NVS entries or LittleFS blocks written
+  uint32_t skipped;         // Unchanged NVS keys not rewritten
+  uint32_t deferred;        // Requests held back by the budget
+  uint32_t coalesced;       // Requests merged into a pending write
+};
+
+const uint32_t FLASH_SECTOR_BYTES = 4096;
+const uint32_t FLASH_ENDURANCE_CYCLES = 100000;  // Erase cycles per sector (datasheet minimum)
+const uint32_t NVS_ENTRY_BYTES = 32;
+const uint32_t NVS_ENTRIES_PER_PAGE = 126;         // A page is erased once all its entries are used
+const uint32_t FLASH_SETTINGS_BUDGET = 4096;       // Bytes/hour (~10 full settings rewrites)
+const uint32_t FLASH_WEAR_LOG_BUDGET = 1024;
+const uint32_t FLASH_CAPTURES_BUDGET = 65536;       // ~5 full captures per hour
+const uint32_t FLASH_OUTPUT_WEAR_BUDGET = 1024;     // 5 changing keys every 15 min, rare baselines
+const unsigned long FLASH_SERVICE_INTERVAL = 1000;          // Deferred-write retry period (ms)
+const unsigned long FLASH_WEAR_SAVE_INTERVAL = 3600000UL;   // Lifetime totals persisted hourly
+
+void writeSettings();
+void writeWearTotals();
+void writeOutputWear();
+void outputWearSave(bool force);
+
+FlashSubsystemState flashSubsystems[FLASH_SUBSYSTEM_COUNT] = {
+  {"settings", FLASH_STORE_NVS, FLASH_SETTINGS_BUDGET, writeSettings,   0, 0, false, 0, 0, 0, 0, 0, 0},
+  {"wearLog",  FLASH_STORE_NVS, FLASH_WEAR_LOG_BUDGET, writeWearTotals, 0, 0, false, 0, 0, 0, 0, 0, 0},
+  {"fsImage",  FLASH_STORE_FS,  0,                     NULL,            0, 0, false, 0, 0, 0, 0, 0, 0},
+  {"outputWear", FLASH_STORE_NVS, FLASH_OUTPUT_WEAR_BUDGET, writeOutputWear, 0, 0, false, 0, 0, 0, 0, 0, 0},
+  {"captures", FLASH_STORE_FS,  FLASH_CAPTURES_BUDGET, NULL,            0, 0, false, 0, 0, 0, 0, 0, 0},
+  {"otaProgress", FLASH_STORE_NVS, 0,                  NULL,            0, 0, false, 0, 0, 0, 0, 0, 0},
+  {"snapshot", FLASH_STORE_FS,  0,                     NULL,            0, 0, false, 0, 0, 0, 0, 0, 0},
+  {"wifiCache", FLASH_STORE_NVS, 0,                    NULL,            0, 0, false, 0, 0, 0, 0, 0, 0},
+};
+
+// Lifetime totals loaded at boot (NVS entries, LittleFS blocks)
+uint32_t flashBootUnits[FLASH_STORE_COUNT] = {0, 0};
+uint32_t flashSavedUnits[FLASH_STORE_COUNT] = {0, 0};
+unsigned long lastFlashService = 0;
+unsigned long lastWearSave = 0;
+// Held for every flash write and budget decision; writes come from both the
+// loop task (deferred) and the AsyncTCP task (form posts)
+SemaphoreHandle_t flashLock = NULL;
+
+void flashRefill(FlashSubsystemState& f) {
+  unsigned long now = millis();
+  if (f.budgetPerHour == 0) {
+    f.lastRefill = now;
+    return;
+  }
+  int32_t cap = f.budgetPerHour / 4;  // Burst: a quarter hour's budget
+  uint64_t add = (uint64_t)(now - f.lastRefill) * f.budgetPerHour / 3600000UL;
+  if (add == 0) return;
+  if ((int64_t)f.tokens + (int64_t)add >= cap) {
+    f.tokens = cap;
+    f.lastRefill = now;
+    return;
+  }
+  f.tokens += (int32_t)add;
+  f.lastRefill += add * 3600000UL / f.budgetPerHour;
+}
+
+void flashAccount(FlashSubsystem s, uint32_t bytes, uint32_t units) {
+  FlashSubsystemState& f = flashSubsystems[s];
+  f.bytes += bytes;
+  f.units += units;
+  if (f.budgetPerHour) f.tokens -= bytes;
+}
+
+// A whole LittleFS write of `bytes` (each touched block is erased once)
+void flashAccountFs(FlashSubsystem s, uint32_t bytes) {
+  xSemaphoreTake(flashLock, portMAX_DELAY);
+  flashAccount(s, bytes, (bytes + FLASH_SECTOR_BYTES - 1) / FLASH_SECTOR_BYTES);
+  flashSubsystems[s].writes++;
+  xSemaphoreGive(flashLock);
+}
+
+// For writers that can't wait (no write function): true if the budget has
+// room now for a write of `bytes`, which is charged once it lands. A write
+// larger than the burst only needs a full bucket. A refusal counts as
+// deferred.
+bool flashBudgetAvailable(FlashSubsystem s, uint32_t bytes = 1) {
+  FlashSubsystemState& f = flashSubsystems[s];
+  xSemaphoreTake(flashLock, portMAX_DELAY);
+  flashRefill(f);
+  int32_t need = (int32_t)min(bytes, f.budgetPerHour / 4);
+  bool ok = f.budgetPerHour == 0 || f.tokens >= need;
+  if (!ok) f.deferred++;
+  xSemaphoreGive(flashLock);
+  return ok;
+}
+
+// ---- NVS puts that skip unchanged keys (call between preferences.begin/end) ----
+// The get default is chosen to differ from v, so a missing key always writes.
+void nvsPutULong(FlashSubsystem s, const char* key, unsigned long v) {
+  if (preferences.getULong(key, ~v) == v) {
+    flashSubsystems[s].skipped++;
+    return;
+  }
+  preferences.putULong(key, v);
+  flashAccount(s, NVS_ENTRY_BYTES, 1);
+}
+
+void nvsPutInt(FlashSubsystem s, const char* key, int32_t v) {
+  if (preferences.getInt(key, ~v) == v) {
+    flashSubsystems[s].skipped++;
+    return;
+  }
+  preferences.putInt(key, v);
+  flashAccount(s, NVS_ENTRY_BYTES, 1);
+}
+
+void nvsPutBool(FlashSubsystem s, const char* key, bool v) {
+  if (preferences.getBool(key, !v) == v) {
+    flashSubsystems[s].skipped++;
+    return;
+  }
+  preferences.putBool(key, v);
+  flashAccount(s, NVS_ENTRY_BYTES, 1);
+}
+
+// Compare buffer for the longest string key (the webhook URL) and its NUL,
+// plus a spare byte. A value that doesn't fit reads back as missing and is
+// rewritten, so this must cover every string setting.
+const size_t NVS_STR_COMPARE_BYTES = (WebhookUrlString::CAPACITY > PassphraseString::CAPACITY ?
+                                      WebhookUrlString::CAPACITY : PassphraseString::CAPACITY) + 2;
+
+void nvsPutString(FlashSubsystem s, const char* key, const char* v) {
+  char stored[NVS_STR_COMPARE_BYTES];
+  size_t n = preferences.getString(key, stored, sizeof(stored));
+  if (n > 0 ? strcmp(stored, v) == 0 : v[0] == '\0') {
+    flashSubsystems[s].skipped++;
+    return;
+  }
+  preferences.putString(key, v);
+  // Header entry plus the string (with NUL) in 32-byte data entries
+  uint32_t entries = 1 + (strlen(v) + NVS_ENTRY_BYTES) / NVS_ENTRY_BYTES;
+  flashAccount(s, entries * NVS_ENTRY_BYTES, entries);
+}
+
+void flashPerform(FlashSubsystemState& f) {
+  f.pending = false;
+  f.writes++;
+  f.write();
+}
+
+// Write now if within budget, otherwise defer. `force` writes regardless
+// (e.g. right before a restart). Returns true if the write happened.
+bool flashRequestWrite(FlashSubsystem s, bool force) {
+  FlashSubsystemState& f = flashSubsystems[s];
+  xSemaphoreTake(flashLock, portMAX_DELAY);
+  flashRefill(f);
+  bool now = force || f.budgetPerHour == 0 || (!f.pending && f.tokens > 0);
+  if (now) {
+    flashPerform(f);
+  } else if (f.pending) {
+    f.coalesced++;
+  } else {
+    f.pending = true;
+    f.deferred++;
+    logLine("Flash: %s write deferred (budget %lu B/h)", f.name, (unsigned long)f.budgetPerHour);
+  }
+  xSemaphoreGive(flashLock);
+  return now;
+}
+
+uint32_t flashStoreUnits(FlashStore store) {
+  uint32_t units = flashBootUnits[store];
+  for (int i = 0; i < FLASH_SUBSYSTEM_COUNT; i++) {
+    if (flashSubsystems[i].store == store) units += flashSubsystems[i].units;
+  }
+  return units;
+}
+
+void writeWearTotals() {
+  preferences.begin("flashwear", false);
+  // Count this write before saving so the stored total includes it
+  flashAccount(FLASH_WEAR_LOG, 2 * NVS_ENTRY_BYTES, 2);
+  uint32_t nvs = flashStoreUnits(FLASH_STORE_NVS);
+  uint32_t fs = flashStoreUnits(FLASH_STORE_FS);
+  preferences.putUInt("nvsEntries", nvs);
+  preferences.putUInt("fsBlocks", fs);
+  preferences.end();
+  flashSavedUnits[FLASH_STORE_NVS] = nvs;
+  flashSavedUnits[FLASH_STORE_FS] = fs;
+}
+
+void flashWearInit() {
+  flashLock = xSemaphoreCreateMutex();
+  preferences.begin("flashwear", true);
+  flashBootUnits[FLASH_STORE_NVS] = preferences.getUInt("nvsEntries", 0);
+  flashBootUnits[FLASH_STORE_FS] = preferences.getUInt("fsBlocks", 0);
+  preferences.end();
+  for (int i = 0; i < FLASH_STORE_COUNT; i++) flashSavedUnits[i] = flashBootUnits[i];
+  for (int i = 0; i < FLASH_SUBSYSTEM_COUNT; i++) {
+    flashSubsystems[i].tokens = flashSubsystems[i].budgetPerHour / 4;
+    flashSubsystems[i].lastRefill = millis();
+  }
+}
+
+// Loop task: retry deferred writes and persist lifetime totals
+void flashService() {
+  if (millis() - lastFlashService < FLASH_SERVICE_INTERVAL) return;
+  lastFlashService = millis();
+  for (int i = 0; i < FLASH_SUBSYSTEM_COUNT; i++) {
+    FlashSubsystemState& f = flashSubsystems[i];
+    if (!f.pending) continue;
+    xSemaphoreTake(flashLock, portMAX_DELAY);
+    flashRefill(f);
+    if (f.pending && f.tokens > 0) flashPerform(f);
+    xSemaphoreGive(flashLock);
+  }
+  if (millis() - lastWearSave >= FLASH_WEAR_SAVE_INTERVAL) {
+    lastWearSave = millis();
+    if (flashStoreUnits(FLASH_STORE_NVS) != flashSavedUnits[FLASH_STORE_NVS] ||
+        flashStoreUnits(FLASH_STORE_FS) != flashSavedUnits[FLASH_STORE_FS]) {
+      flashRequestWrite(FLASH_WEAR_LOG, false);
+    }
+  }
+}
+
+// Force out deferred writes and unsaved wear totals, e.g. before ESP.restart()
+void flashFlushPending() {
+  outputWearSave(true);
+  for (int i = 0; i < FLASH_SUBSYSTEM_COUNT; i++) {
+    if (flashSubsystems[i].pending) flashRequestWrite((FlashSubsystem)i, true);
+  }
+  if (flashStoreUnits(FLASH_STORE_NVS) != flashSavedUnits[FLASH_STORE_NVS] ||
+      flashStoreUnits(FLASH_STORE_FS) != flashSavedUnits[FLASH_STORE_FS]) {
+    flashRequestWrite(FLASH_WEAR_LOG, true);
+  }
+}
+
+double flashStoreErases(FlashStore store, uint32_t units) {
+  return store == FLASH_STORE_NVS ? (double)units / NVS_ENTRIES_PER_PAGE : (double)units;
+}
+
+uint32_t flashStoreSectors(FlashStore store) {
+  if (store == FLASH_STORE_FS) return fsReady() ? LittleFS.totalBytes() / FLASH_SECTOR_BYTES : 0;
+  const esp_partition_t* p = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_NVS, NULL);
+  return p ? p->size / FLASH_SECTOR_BYTES : 0;
+}
+
+size_t getFlashWearJson(char* out, size_t cap) {
+  static const char* const STORE_NAMES[FLASH_STORE_COUNT] = {"nvs", "littlefs"};
+  StaticJsonDocument<1024> doc;
+  xSemaphoreTake(flashLock, portMAX_DELAY);
+  JsonArray subs = doc.createNestedArray("subsystems");
+  for (int i = 0; i < FLASH_SUBSYSTEM_COUNT; i++) {
+    FlashSubsystemState& f = flashSubsystems[i];
+    flashRefill(f);
+    JsonObject o = subs.createNestedObject();
+    o["name"] = f.name;
+    o["store"] = STORE_NAMES[f.store];
+    o["budgetPerHour"] = f.budgetPerHour;
+    o["tokens"] = f.tokens;
+    o["pending"] = f.pending;
+    o["writes"] = f.writes;
+    o["bytes"] = f.bytes;
+    o["erases"] = flashStoreErases(f.store, f.units);
+    o["skipped"] = f.skipped;
+    o["deferred"] = f.deferred;
+    o["coalesced"] = f.coalesced;
+  }
+  double uptimeDays = millis() / 86400000.0;
+  JsonArray stores = doc.createNestedArray("stores");
+  for (int s = 0; s < FLASH_STORE_COUNT; s++) {
+    FlashStore store = (FlashStore)s;
+    uint32_t units = flashStoreUnits(store);
+    uint32_t sectors = flashStoreSectors(store);
+    double erases = flashStoreErases(store, units);
+    double endurance = (double)sectors * FLASH_ENDURANCE_CYCLES;  // Assumes wear leveling across the partition
+    double perDay = uptimeDays > 0 ? flashStoreErases(store, units - flashBootUnits[s]) / uptimeDays : 0;
+    JsonObject o = stores.createNestedObject();
+    o["name"] = STORE_NAMES[s];
+    o["sectors"] = sectors;
+    o["lifetimeErases"] = erases;
+    o["lifeUsedPct"] = endurance > 0 ? 100.0 * erases / endurance : 0;
+    o["erasesPerDay"] = perDay;
+    // Projection at the rate since boot; -1 = no writes this boot
+    o["yearsLeft"] = (perDay > 0 && endurance > erases) ? (endurance - erases) / perDay / 365.0 : -1;
+  }
+  xSemaphoreGive(flashLock);
+  return serializeJson(doc, out, cap);
+}
+
+// POST /diag/flash?subsystem=settings&budget=8192 (bytes/hour, 0 = unlimited)
+void handleFlashBudget(AsyncWebServerRequest *request) {
+  const String& name = request->arg("subsystem");
+  for (int i = 0; i < FLASH_SUBSYSTEM_COUNT; i++) {
+    FlashSubsystemState& f = flashSubsystems[i];
+    if (name != f.name) continue;
+    if (!request->hasArg("budget") || !f.write) {
+      request->send(400, "text/plain", "budget required; accounting-only subsystems have none");
+      return;
+    }
+    xSemaphoreTake(flashLock, portMAX_DELAY);
+    flashRefill(f);
+    f.budgetPerHour = request->arg("budget").toInt();
+    f.lastRefill = millis();
+    xSemaphoreGive(flashLock);
+    request->send(200, "text/plain", "OK");
+    return;
+  }
+  request->send(404, "text/plain", "Unknown subsystem");
+}
+
+// ========== BOOT TIMING ==========
+// setup() marks the end of each phase; the filesystem mounts concurrently in
+// its own task and reports separately. Printed at the end of setup() and
+// served from GET /diag/boot.
+struct BootPhase {
+  const char* name;
+  uint32_t us;
+};
+
+const int BOOT_PHASE_MAX = 8;
+BootPhase bootPhases[BOOT_PHASE_MAX];
+int bootPhaseCount = 0;
+uint32_t bootPhaseStart = 0;
+
+void bootMark(const char* name) {
+  uint32_t now = micros();
+  if (bootPhaseCount < BOOT_PHASE_MAX) {
+    bootPhases[bootPhaseCount].name = name;
+    bootPhases[bootPhaseCount].us = now - bootPhaseStart;
+    bootPhaseCount++;
+  }
+  bootPhaseStart = now;
+}
+
+// ========== BACKGROUND FILESYSTEM MOUNT ==========
+// LittleFS holds the web UI and fault captures, so control I/O doesn't wait
+// for it: setup() starts the mount in a low-priority task and carries on.
+// Routes that read LittleFS answer 503 until it is ready. A failed mount is
+// never followed by a format; that takes an explicit POST /diag/fs?action=format.
+enum FsState {
+  FS_MOUNTING,
+  FS_READY,
+  FS_FAILED,
+  FS_FORMATTING
+};
+
+const char* const FS_STATE_NAMES[] = {"mounting", "ready", "failed", "formatting"};
+
+volatile FsState fsState = FS_MOUNTING;
+uint32_t fsMountUs = 0;      // LittleFS.begin() (plus format, if requested)
+uint32_t fsWarmUs = 0;       // Asset cache warm-up after mounting
+uint32_t fsFormatCount = 0;  // Explicit formats since boot
+
+bool fsReady() { return fsState == FS_READY; }
+
+void sendFsUnavailable(AsyncWebServerRequest *request) {
+  AsyncWebServerResponse *response = request->beginResponse(503, "text/plain",
+      fsState == FS_FAILED ? "Filesystem unavailable" : "Filesystem not ready, retry shortly");
+  if (fsState != FS_FAILED) response->addHeader("Retry-After", "1");
+  request->send(response);
+}
+
+// arg non-NULL: format before mounting
+void fsMountTask(void* arg) {
+  bool format = (arg != NULL);
+  uint32_t start = micros();
+  bool ok;
+  if (format) {
+    LittleFS.end();
+    ok = LittleFS.format() && LittleFS.begin(false);
+  } else {
+    ok = LittleFS.begin(false);
+  }
+  fsMountUs = micros() - start;
+
+  if (ok) {
+    if (format) {
+      fsFormatCount++;
+      flashAccountFs(FLASH_FS_IMAGE, LittleFS.totalBytes());
+    }
+    start = micros();
+    assetCacheWarm();
+    fsWarmUs = micros() - start;
+    fsState = FS_READY;
+    logLine("LittleFS %s in %lu ms (asset cache %lu ms)", format ? "formatted and mounted" : "mounted",
+            (unsigned long)(fsMountUs / 1000), (unsigned long)(fsWarmUs / 1000));
+  } else {
+    fsState = FS_FAILED;
+    logLine("LittleFS mount failed after %lu ms; web UI unavailable", (unsigned long)(fsMountUs / 1000));
+    Serial.println("Upload filesystem files using: pio run --target uploadfs, or POST /diag/fs?action=format");
+  }
+  vTaskDelete(NULL);
+}
+
+bool fsStartMount(bool format) {
+  fsState = format ? FS_FORMATTING : FS_MOUNTING;
+  // Core 0, below the AsyncTCP task, so it only uses otherwise idle time
+  if (xTaskCreatePinnedToCore(fsMountTask, "fsMount", 4096, format ? (void*)1 : NULL, 1, NULL, 0) != pdPASS) {
+    fsState = FS_FAILED;
+    Serial.println("LittleFS: could not start mount task");
+    return false;
+  }
+  return true;
+}
+
+void printBootTiming() {
+  uint32_t total = 0;
+  Serial.println("Boot timing:");
+  for (int i = 0; i < bootPhaseCount; i++) {
+    logLine("  %-10s %6lu us", bootPhases[i].name, (unsigned long)bootPhases[i].us);
+    total += bootPhases[i].us;
+  }
+  logLine("  %-10s %6lu us (filesystem %s, in background)", "total", (unsigned long)total, FS_STATE_NAMES[fsState]);
+}
+
+size_t getBootJson(char* out, size_t cap) {
+  StaticJsonDocument<512> doc;
+  JsonArray phases = doc.createNestedArray("phases");
+  uint32_t total = 0;
+  for (int i = 0; i < bootPhaseCount; i++) {
+    JsonObject p = phases.createNestedObject();
+    p["name"] = bootPhases[i].name;
+    p["us"] = bootPhases[i].us;
+    total += bootPhases[i].us;
+  }
+  doc["setupUs"] = total;
+  JsonObject fs = doc.createNestedObject("filesystem");
+  fs["state"] = FS_STATE_NAMES[fsState];
+  fs["mountUs"] = fsMountUs;
+  fs["assetWarmUs"] = fsWarmUs;
+  fs["formats"] = fsFormatCount;
+  return serializeJson(doc, out, cap);
+}
+
+// POST /diag/fs?action=format. Only after a failed mount: a mounted
+// filesystem may have open files (static responses, capture and snapshot
+// exports, a recorder save) and a warm asset cache owned by the AsyncTCP task.
+void handleFsControl(AsyncWebServerRequest *request) {
+  if (request->arg("action") != "format") {
+    request->send(400, "text/plain", "action must be format");
+    return;
+  }
+  if (fsState != FS_FAILED) {
+    request->send(409, "text/plain", fsState == FS_READY ? "Filesystem is mounted; format only after a failed mount"
+                                                         : "Filesystem busy");
+    return;
+  }
+  if (!fsStartMount(true)) {
+    request->send(500, "text/plain", "Could not start format");
+    return;
+  }
+  request->send(202, "text/plain", "Formatting; upload the web UI afterwards (pio run --target uploadfs)");
+}
+
+// ========== FLIGHT RECORDER ==========
+// Keeps the last seconds of I/O levels, line pressure and loop timing in an
+// arena ring: a sample whenever an I/O level changes (at loop resolution)
+// and every RECORDER_PERIOD_MS in between. A fault (timeout, both end stops,
+// overpressure), an E-stop or POST /diag/captures?action=trigger marks a
+// trigger. Recording carries on for postMs, then the ring freezes and a
+// low-priority task writes the samples from preMs before the trigger to
+// /captures/<id>.bin (header, then raw samples) within the flash budget.
+// Recording resumes once the file is closed; triggers meanwhile are only
+// counted. The newest RECORDER_MAX_FILES captures are kept.
+// GET /diag/captures lists them and ?id=N streams one as JSON for the
+// diagnostics page and tools/flightrec.
+enum RecorderChannel {
+  REC_GPO1,
+  REC_GPO2,
+  REC_ENDSTOP_IN,
+  REC_ENDSTOP_OUT,
+  REC_ESTOP,
+  REC_INPUT_A,          // Raw remote levels (before debounce), 1 = pressed
+  REC_INPUT_B,
+  REC_INPUT_C,
+  REC_INPUT_D,
+  REC_AUTO,
+  REC_CYCLE_IN,
+  REC_CYCLE_OUT,
+  REC_SIMULATION,
+  REC_CHANNEL_COUNT
+};
+
+const char* const RECORDER_CHANNEL_NAMES[REC_CHANNEL_COUNT] = {
+  "gpo1", "gpo2", "endStopIn", "endStopOut", "estop", "inputA", "inputB", "inputC", "inputD",
+  "auto", "cycleIn", "cycleOut", "simulation"
+};
+
+enum RecorderState {
+  RECORDER_RECORDING,
+  RECORDER_POST_TRIGGER,
+  RECORDER_SAVING
+};
+
+const char* const RECORDER_STATE_NAMES[] = {"recording", "postTrigger", "saving"};
+
+struct RecorderSample {
+  uint32_t us;          // Device clock, low 32 bits
+  uint16_t io;          // Bit per RecorderChannel
+  uint16_t loopMaxUs;   // Longest loop pass since the previous sample (saturates)
+  int16_t pressure;     // 0.1 bar
+  uint16_t loops;       // Loop passes since the previous sample (saturates)
+};
+
+// File layout: RecorderHeader, then `count` RecorderSamples, little-endian
+const uint32_t RECORDER_MAGIC = 0x43455246;   // "FREC"
+const uint16_t RECORDER_VERSION = 1;
+
+struct RecorderHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t sampleBytes;
+  uint32_t count;
+  uint32_t triggerUs;       // Same clock as the samples
+  uint32_t uptimeMs;        // When triggered
+  uint32_t preMs;
+  uint32_t postMs;
+  uint32_t periodMs;
+  uint32_t strokes;         // Strokes since boot
+  uint32_t lastDuration;
+  uint32_t avgDuration;
+  char reason[16];
+  uint8_t mode;             // SystemMode
+  uint8_t cycleDirection;   // CycleDirection
+  uint8_t simulation;
+  uint8_t reserved;
+};
+
+const int RECORDER_RING_SAMPLES = 1024;       // ~10 s at the periodic rate
+const size_t RECORDER_RING_BYTES = RECORDER_RING_SAMPLES * sizeof(RecorderSample);
+const unsigned long RECORDER_PERIOD_MS = 10;  // Matches the 100 Hz pressure stream
+const unsigned long DEFAULT_RECORDER_PRE_MS = 5000;
+const unsigned long DEFAULT_RECORDER_POST_MS = 2000;
+const unsigned long RECORDER_MAX_WINDOW_MS = 8000;   // pre + post, leaves room for edges
+const int RECORDER_MAX_FILES = 8;
+const char* const RECORDER_DIR = "/captures";
+
+struct RecorderStats {
+  uint32_t triggers;
+  uint32_t saved;
+  uint32_t suppressed;      // Triggered while a capture was in progress
+  uint32_t dropped;         // Filesystem not ready, budget exhausted or write failed
+  uint32_t lastId;
+  uint32_t lastSaveMs;      // Time to write the last capture
+};
+
+RecorderSample* recorderRing = NULL;
+uint32_t recorderTotal = 0;                 // Samples appended since boot
+volatile RecorderState recorderState = RECORDER_RECORDING;
+RecorderHeader recorderPending;             // Capture in progress
+uint32_t recorderSaveFirst = 0;             // Its oldest sample (index into the total)
+unsigned long recorderPreMs = DEFAULT_RECORDER_PRE_MS;    // Settings
+unsigned long recorderPostMs = DEFAULT_RECORDER_POST_MS;
+uint16_t recorderLastIo = 0;
+int64_t recorderLastSampleUs = 0;
+int64_t recorderLastLoopUs = 0;
+uint32_t recorderLoopMaxUs = 0;
+uint32_t recorderLoops = 0;
+RecorderStats recorderStats;
+volatile bool recorderTriggerRequest = false;   // From the web task, applied in recorderTick()
+
+void recorderInit() {
+  recorderRing = (RecorderSample*)arenaAlloc("flightRecorder", RECORDER_RING_BYTES);
+  recorderLastLoopUs = esp_timer_get_time();
+}
+
+uint16_t recorderIo() {
+  uint16_t io = 0;
+  if (readOutput(GPO1_PIN) == HIGH) io |= 1 << REC_GPO1;
+  if (readOutput(GPO2_PIN) == HIGH) io |= 1 << REC_GPO2;
+  if (readInput(ENDSTOP_IN_PIN) == HIGH) io |= 1 << REC_ENDSTOP_IN;
+  if (readInput(ENDSTOP_OUT_PIN) == HIGH) io |= 1 << REC_ENDSTOP_OUT;
+  if (readInput(ESTOP_PIN) == HIGH) io |= 1 << REC_ESTOP;
+  if (inputA.lastState == LOW) io |= 1 << REC_INPUT_A;
+  if (inputB.lastState == LOW) io |= 1 << REC_INPUT_B;
+  if (inputC.lastState == LOW) io |= 1 << REC_INPUT_C;
+  if (inputD.lastState == LOW) io |= 1 << REC_INPUT_D;
+  if (currentMode == MODE_AUTO_LOOP) io |= 1 << REC_AUTO;
+  if (cycleDirection == CYCLE_IN) io |= 1 << REC_CYCLE_IN;
+  if (cycleDirection == CYCLE_OUT) io |= 1 << REC_CYCLE_OUT;
+  if (simEnabled) io |= 1 << REC_SIMULATION;
+  return io;
+}
+
+// Capture ids in RECORDER_DIR (files are <id>.bin). Returns how many.
+int recorderScan(uint32_t* oldest, uint32_t* newest) {
+  *oldest = UINT32_MAX;
+  *newest = 0;
+  File dir = LittleFS.open(RECORDER_DIR);
+  if (!dir || !dir.isDirectory()) return 0;
+  int n = 0;
+  for (File f = dir.openNextFile(); f; f = dir.openNextFile()) {
+    uint32_t id = strtoul(f.name(), NULL, 10);
+    if (id == 0) continue;
+    if (id < *oldest) *oldest = id;
+    if (id > *newest) *newest = id;
+    n++;
+  }
+  return n;
+}
+
+void recorderPath(char* out, size_t cap, uint32_t id) {
+  snprintf(out, cap, "%s/%lu.bin", RECORDER_DIR, (unsigned long)id);
+}
+
+// Core 0, priority 1: writes the frozen ring, then lets recording resume
+void recorderSaveTask(void* arg) {
+  uint32_t start = millis();
+  const RecorderHeader& h = recorderPending;
+  LittleFS.mkdir(RECORDER_DIR);
+  uint32_t oldest, newest;
+  int n = recorderScan(&oldest, &newest);
+  char path[32];
+  while (n >= RECORDER_MAX_FILES) {
+    recorderPath(path, sizeof(path), oldest);
+    if (!LittleFS.remove(path)) break;
+    n = recorderScan(&oldest, &newest);
+  }
+  uint32_t id = newest + 1;
+  recorderPath(path, sizeof(path), id);
+
+  File f = LittleFS.open(path, "w");
+  bool ok = f;
+  if (ok) {
+    ok = f.write((const uint8_t*)&h, sizeof(h)) == sizeof(h);
+    uint32_t i = recorderSaveFirst;
+    uint32_t end = i + h.count;
+    while (ok && i < end) {
+      uint32_t slot = i % RECORDER_RING_SAMPLES;
+      uint32_t run = min(end - i, (uint32_t)RECORDER_RING_SAMPLES - slot);
+      size_t bytes = run * sizeof(RecorderSample);
+      ok = f.write((const uint8_t*)&recorderRing[slot], bytes) == bytes;
+      i += run;
+    }
+    f.close();
+  }
+
+  uint32_t bytes = sizeof(h) + h.count * sizeof(RecorderSample);
+  if (ok) {
+    flashAccountFs(FLASH_CAPTURES, bytes);
+    recorderStats.saved++;
+    recorderStats.lastId = id;
+    recorderStats.lastSaveMs = millis() - start;
+    logLine("RECORDER: capture %lu saved (%s, %lu samples, %lu bytes, %lu ms)", (unsigned long)id, h.reason,
+            (unsigned long)h.count, (unsigned long)bytes, (unsigned long)recorderStats.lastSaveMs);
+  } else {
+    LittleFS.remove(path);
+    recorderStats.dropped++;
+    logLine("ERROR: flight recorder could not write %s", path);
+  }
+  recorderState = RECORDER_RECORDING;
+  vTaskDelete(NULL);
+}
+
+// Loop task: the post-trigger window is over
+void recorderFreeze() {
+  RecorderHeader& h = recorderPending;
+  uint32_t first = recorderTotal > (uint32_t)RECORDER_RING_SAMPLES ? recorderTotal - RECORDER_RING_SAMPLES : 0;
+  uint32_t from = h.triggerUs - h.preMs * 1000;
+  while (first < recorderTotal && (int32_t)(recorderRing[first % RECORDER_RING_SAMPLES].us - from) < 0) first++;
+  h.count = recorderTotal - first;
+  recorderSaveFirst = first;
+
+  recorderState = RECORDER_SAVING;
+  uint32_t bytes = sizeof(h) + h.count * sizeof(RecorderSample);
+  if (!fsReady() || !flashBudgetAvailable(FLASH_CAPTURES, bytes)) {
+    recorderStats.dropped++;
+    recorderState = RECORDER_RECORDING;
+    logLine("RECORDER: %s capture dropped (%s)", h.reason, fsReady() ? "flash budget" : "filesystem not ready");
+    return;
+  }
+  if (xTaskCreatePinnedToCore(recorderSaveTask, "recorderSave", 4096, NULL, 1, NULL, 0) != pdPASS) {
+    recorderStats.dropped++;
+    recorderState = RECORDER_RECORDING;
+    logLine("ERROR: flight recorder could not start its save task");
+  }
+}
+
+// Loop task: freeze a window around now. `reason` is copied.
+void recorderTrigger(const char* reason) {
+  if (!recorderRing) return;
+  recorderStats.triggers++;
+  if (recorderState != RECORDER_RECORDING) {
+    recorderStats.suppressed++;
+    logLine("RECORDER: %s trigger ignored, capture in progress", reason);
+    return;
+  }
+  RecorderHeader& h = recorderPending;
+  memset(&h, 0, sizeof(h));
+  h.magic = RECORDER_MAGIC;
+  h.version = RECORDER_VERSION;
+  h.sampleBytes = sizeof(RecorderSample);
+  h.triggerUs = (uint32_t)esp_timer_get_time();
+  h.uptimeMs = millis();
+  h.preMs = recorderPreMs;
+  h.postMs = recorderPostMs;
+  h.periodMs = RECORDER_PERIOD_MS;
+  h.strokes = strokeHistory.total();
+  h.lastDuration = lastDuration;
+  h.avgDuration = avgDuration;
+  strlcpy(h.reason, reason, sizeof(h.reason));
+  h.mode = currentMode;
+  h.cycleDirection = cycleDirection;
+  h.simulation = simEnabled;
+  recorderSaveFirst = recorderTotal;    // Trigger position until frozen
+  recorderState = RECORDER_POST_TRIGGER;
+  logLine("RECORDER: %s, capturing %lu ms before and %lu ms after", reason,
+          (unsigned long)h.preMs, (unsigned long)h.postMs);
+  TRACE_INSTANT("recorder.trigger");
+}
+
+// Loop task, top of every pass (E-stop included)
+void recorderTick() {
+  if (!recorderRing) return;
+  int64_t now = esp_timer_get_time();
+  uint32_t period = (uint32_t)(now - recorderLastLoopUs);
+  recorderLastLoopUs = now;
+  if (period > recorderLoopMaxUs) recorderLoopMaxUs = period;
+  recorderLoops++;
+
+  if (recorderTriggerRequest) {
+    recorderTriggerRequest = false;
+    recorderTrigger("manual");
+  }
+  if (recorderState == RECORDER_SAVING) return;
+  if (recorderState == RECORDER_POST_TRIGGER) {
+    // Frozen early if a chattering input would overwrite the pre-trigger half
+    if ((uint32_t)now - recorderPending.triggerUs >= recorderPending.postMs * 1000 ||
+        recorderTotal - recorderSaveFirst >= (uint32_t)RECORDER_RING_SAMPLES / 2) {
+      recorderFreeze();
+      return;
+    }
+  }
+
+  uint16_t io = recorderIo();
+  if (io == recorderLastIo && now - recorderLastSampleUs < (int64_t)RECORDER_PERIOD_MS * 1000) return;
+  RecorderSample& s = recorderRing[recorderTotal % RECORDER_RING_SAMPLES];
+  s.us = (uint32_t)now;
+  s.io = io;
+  s.loopMaxUs = min(recorderLoopMaxUs, (uint32_t)UINT16_MAX);
+  s.pressure = (int16_t)constrain(lroundf(pressure.filteredBar * 10), -32768L, 32767L);
+  s.loops = min(recorderLoops, (uint32_t)UINT16_MAX);
+  recorderTotal++;
+  recorderLastIo = io;
+  recorderLastSampleUs = now;
+  recorderLoopMaxUs = 0;
+  recorderLoops = 0;
+}
+
+size_t getCapturesJson(char* out, size_t cap) {
+  StaticJsonDocument<1536> doc;
+  doc["state"] = RECORDER_STATE_NAMES[recorderState];
+  doc["preMs"] = recorderPreMs;
+  doc["postMs"] = recorderPostMs;
+  doc["periodMs"] = RECORDER_PERIOD_MS;
+  doc["ringSamples"] = RECORDER_RING_SAMPLES;
+  doc["triggers"] = recorderStats.triggers;
+  doc["saved"] = recorderStats.saved;
+  doc["suppressed"] = recorderStats.suppressed;
+  doc["dropped"] = recorderStats.dropped;
+  doc["lastSaveMs"] = recorderStats.lastSaveMs;
+  JsonArray list = doc.createNestedArray("captures");
+  if (fsReady()) {
+    File dir = LittleFS.open(RECORDER_DIR);
+    if (dir && dir.isDirectory()) {
+      for (File f = dir.openNextFile(); f; f = dir.openNextFile()) {
+        RecorderHeader h;
+        if (f.read((uint8_t*)&h, sizeof(h)) != sizeof(h) || h.magic != RECORDER_MAGIC) continue;
+        JsonObject o = list.createNestedObject();
+        o["id"] = strtoul(f.name(), NULL, 10);
+        o["reason"] = h.reason;       // Copied: h goes out of scope
+        o["uptimeMs"] = h.uptimeMs;
+        o["samples"] = h.count;
+        o["bytes"] = f.size();
+      }
+    }
+  }
+  return serializeJson(doc, out, cap);
+}
+
+// ---- Capture download ----
+// One capture at a time is converted from its file as the response is sent:
+// a JSON header, then one [tUs, io, loopMaxUs, pressure, loops] array per
+// sample, with tUs relative to the trigger.
+struct CaptureExport {
+  bool active;
+  int stage;            // 0-3 header pieces, 4 samples, 5 footer, 6 done
+  uint32_t id;
+  uint32_t index;
+  RecorderHeader header;
+  File file;
+  ChunkedExport stream;
+};
+
+CaptureExport captureExport;
+
+size_t captureExportNext(char* out, size_t cap) {
+  CaptureExport& x = captureExport;
+  const RecorderHeader& h = x.header;
+  if (x.stage == 0) {
+    x.stage = 1;
+    const char* dir = h.cycleDirection == CYCLE_IN ? "IN" : h.cycleDirection == CYCLE_OUT ? "OUT" : "STOPPED";
+    return snprintf(out, cap, "{\"id\":%lu,\"reason\":\"%s\",\"uptimeMs\":%lu,\"triggerUs\":%lu,\"mode\":\"%s\",\"cycleDirection\":\"%s\",\"simulation\":%s,",
+                    (unsigned long)x.id, h.reason, (unsigned long)h.uptimeMs, (unsigned long)h.triggerUs,
+                    h.mode == MODE_MANUAL ? "MANUAL" : "AUTO", dir, h.simulation ? "true" : "false");
+  }
+  if (x.stage == 1) {
+    x.stage = 2;
+    return snprintf(out, cap, "\"strokes\":%lu,\"lastDuration\":%lu,\"avgDuration\":%lu,\"preMs\":%lu,\"postMs\":%lu,\"periodMs\":%lu,\"count\":%lu,",
+                    (unsigned long)h.strokes, (unsigned long)h.lastDuration, (unsigned long)h.avgDuration,
+                    (unsigned long)h.preMs, (unsigned long)h.postMs, (unsigned long)h.periodMs, (unsigned long)h.count);
+  }
+  if (x.stage == 2) {
+    x.stage = 3;
+    size_t len = snprintf(out, cap, "\"channels\":[");
+    for (int i = 0; i < REC_CHANNEL_COUNT; i++) {
+      len += snprintf(out + len, cap - len, "%s\"%s\"", i ? "," : "", RECORDER_CHANNEL_NAMES[i]);
+    }
+    return len + snprintf(out + len, cap - len, "],");
+  }
+  if (x.stage == 3) {
+    x.stage = 4;
+    return snprintf(out, cap, "\"fields\":[\"tUs\",\"io\",\"loopMaxUs\",\"pressure\",\"loops\"],\"samples\":[");
+  }
+  if (x.stage == 4) {
+    RecorderSample s;
+    if (x.index < h.count && x.file.read((uint8_t*)&s, sizeof(s)) == sizeof(s)) {
+      return snprintf(out, cap, "%s[%ld,%u,%u,%d,%u]", x.index++ ? "," : "", (long)(int32_t)(s.us - h.triggerUs),
+                      (unsigned)s.io, (unsigned)s.loopMaxUs, (int)s.pressure, (unsigned)s.loops);
+    }
+    x.stage = 5;
+  }
+  if (x.stage == 5) {
+    x.stage = 6;
+    x.file.close();
+    return snprintf(out, cap, "]}");
+  }
+  return 0;
+}
+
+size_t captureExportFill(uint8_t* buffer, size_t maxLen, size_t index) {
+  size_t written = chunkedExportFill(captureExport.stream, buffer, maxLen);
+  if (written == 0) captureExport.active = false;
+  return written;
+}
+
+// GET /diag/captures                       (recorder state and capture list)
+// GET /diag/captures?id=N[&format=bin]     (one capture as JSON, or the raw file)
+void handleCaptureDownload(AsyncWebServerRequest *request) {
+  if (!request->hasArg("id")) {
+    char json[1536];
+    getCapturesJson(json, sizeof(json));
+    request->send(200, "application/json", json);
+    return;
+  }
+  if (!fsReady()) {
+    sendFsUnavailable(request);
+    return;
+  }
+  uint32_t id = request->arg("id").toInt();
+  char path[32];
+  recorderPath(path, sizeof(path), id);
+  if (!LittleFS.exists(path)) {
+    request->send(404, "text/plain", "No such capture");
+    return;
+  }
+  if (request->arg("format") == "bin") {
+    request->send(LittleFS, path, "application/octet-stream", true);
+    return;
+  }
+  CaptureExport& x = captureExport;
+  if (x.active) {
+    request->send(409, "text/plain", "Capture export already in progress");
+    return;
+  }
+  x.file = LittleFS.open(path, "r");
+  if (!x.file || x.file.read((uint8_t*)&x.header, sizeof(x.header)) != sizeof(x.header) ||
+      x.header.magic != RECORDER_MAGIC || x.header.version != RECORDER_VERSION) {
+    x.file.close();
+    request->send(500, "text/plain", "Unreadable capture");
+    return;
+  }
+  x.id = id;
+  x.stage = 0;
+  x.index = 0;
+  x.active = true;
+  chunkedExportBegin(x.stream, captureExportNext);
+
+  AsyncWebServerResponse *response = request->beginChunkedResponse("application/json", captureExportFill);
+  request->onDisconnect([]() { captureExport.active = false; });
+  request->send(response);
+}
+
+// POST /diag/captures?action=trigger           (capture now)
+// POST /diag/captures?action=delete&id=N
+// POST /diag/captures?action=clear
+// POST /diag/captures?preMs=5000&postMs=2000   (window, saved to flash)
+void handleCaptureControl(AsyncWebServerRequest *request) {
+  String action = request->arg("action");
+  if (action == "trigger") {
+    recorderTriggerRequest = true;
+    request->send(200, "text/plain", "OK");
+    return;
+  }
+  if (action == "delete" || action == "clear") {
+    if (!fsReady()) {
+      sendFsUnavailable(request);
+      return;
+    }
+    if (recorderState == RECORDER_SAVING) {
+      request->send(409, "text/plain", "Capture being saved, retry shortly");
+      return;
+    }
+    char path[32];
+    if (action == "delete") {
+      recorderPath(path, sizeof(path), request->arg("id").toInt());
+      if (!LittleFS.remove(path)) {
+        request->send(404, "text/plain", "No such capture");
+        return;
+      }
+    } else {
+      uint32_t oldest, newest;
+      while (recorderScan(&oldest, &newest) > 0) {
+        recorderPath(path, sizeof(path), oldest);
+        if (!LittleFS.remove(path)) break;
+      }
+    }
+    request->send(200, "text/plain", "OK");
+    return;
+  }
+  if (!request->hasArg("preMs") && !request->hasArg("postMs")) {
+    request->send(400, "text/plain", "action must be trigger, delete or clear");
+    return;
+  }
+  long pre = request->hasArg("preMs") ? request->arg("preMs").toInt() : (long)recorderPreMs;
+  long post = request->hasArg("postMs") ? request->arg("postMs").toInt() : (long)recorderPostMs;
+  if (pre < 0 || post < 0 || pre + post > (long)RECORDER_MAX_WINDOW_MS) {
+    request->send(400, "text/plain", "preMs + postMs must be between 0 and 8000");
+    return;
+  }
+  recorderPreMs = pre;
+  recorderPostMs = post;
+  saveSettings();
+  request->send(200, "text/plain", "OK");
+}
+
+// ========== OUTPUT WEAR ==========
+// Switching wear model for the SSRs and the valve coils they drive. The I/O
+// layer counts energize operations and on-time per output; lifetime totals
+// (since the part was last replaced) are kept in the "outputwear" NVS
+// namespace, saved every 15 minutes through the flash budget. Life used is
+// the larger of cycles/rated cycles and on-hours/rated hours; remaining life
+// is projected from the rate since boot (or replacement). Maintenance is due
+// at OUTPUT_MAINTENANCE_PCT used or when fewer than OUTPUT_MAINTENANCE_LEAD_DAYS
+// remain. Rated values are configurable via POST /diag/wear. The valve
+// response baselines (see VALVE RESPONSE) are kept alongside and relearned
+// when an output is replaced.
+struct OutputWear {
+  uint32_t baseCycles;          // Lifetime totals when counting (re)started
+  uint32_t baseOnSec;
+  uint32_t ratedCycles;         // Wear model, persisted
+  uint32_t ratedHours;
+  unsigned long rateStartMs;    // Boot or replacement
+  bool maintenanceDue;
+};
+
+const uint32_t DEFAULT_RATED_CYCLES = 5000000;    // Typical solenoid valve rating
+const uint32_t DEFAULT_RATED_HOURS = 20000;       // Coil insulation at rated temperature
+const int OUTPUT_MAINTENANCE_PCT = 80;
+const uint32_t OUTPUT_MAINTENANCE_LEAD_DAYS = 14;
+const unsigned long OUTPUT_WEAR_SAVE_INTERVAL = 15 * 60000UL;
+const unsigned long OUTPUT_WEAR_CHECK_INTERVAL = 60000;
+const char* const OUTPUT_WEAR_KEYS[OUTPUT_COUNT][6] = {
+  {"o1cycles", "o1onSec", "o1ratedCyc", "o1ratedHrs", "o1respUs", "o1travelUs"},
+  {"o2cycles", "o2onSec", "o2ratedCyc", "o2ratedHrs", "o2respUs", "o2travelUs"},
+};
+
+OutputWear outputWear[OUTPUT_COUNT];
+uint32_t basePoweredSec = 0;
+unsigned long lastOutputWearSave = 0;
+unsigned long lastOutputWearCheck = 0;
+volatile int outputReplaceRequest = -1;  // From the web task, applied in outputWearService()
+
+uint32_t outputLifetimeCycles(int i) {
+  return outputWear[i].baseCycles + outputCounters[i].cycles;
+}
+
+uint64_t outputSinceMs(int i) {
+  const OutputCounters& c = outputCounters[i];
+  bool on = (i == 0 ? gpo1Level : gpo2Level) == HIGH && !simEnabled;
+  return c.energizedMs + (on ? millis() - c.onSinceMs : 0);
+}
+
+uint32_t outputLifetimeOnSec(int i) {
+  return outputWear[i].baseOnSec + (uint32_t)(outputSinceMs(i) / 1000);
+}
+
+double outputLifeUsedPct(int i) {
+  const OutputWear& w = outputWear[i];
+  double byCycles = w.ratedCycles ? 100.0 * outputLifetimeCycles(i) / w.ratedCycles : 0;
+  double byHours = w.ratedHours ? 100.0 * outputLifetimeOnSec(i) / 3600.0 / w.ratedHours : 0;
+  return max(byCycles, byHours);
+}
+
+// Days until either rating is reached at the current rate; -1 = no usage yet
+double outputDaysLeft(int i) {
+  const OutputWear& w = outputWear[i];
+  double days = (millis() - w.rateStartMs) / 86400000.0;
+  if (days <= 0) return -1;
+  double left = -1;
+  double cyclesPerDay = outputCounters[i].cycles / days;
+  if (cyclesPerDay > 0 && w.ratedCycles) {
+    double remaining = (double)w.ratedCycles - outputLifetimeCycles(i);
+    left = max(0.0, remaining) / cyclesPerDay;
+  }
+  double hoursPerDay = outputSinceMs(i) / 3600000.0 / days;
+  if (hoursPerDay > 0 && w.ratedHours) {
+    double remaining = (double)w.ratedHours - outputLifetimeOnSec(i) / 3600.0;
+    double byHours = max(0.0, remaining) / hoursPerDay;
+    if (left < 0 || byHours < left) left = byHours;
+  }
+  return left;
+}
+
+// Flash subsystem writer (called under flashLock)
+void writeOutputWear() {
+  preferences.begin("outputwear", false);
+  for (int i = 0; i < OUTPUT_COUNT; i++) {
+    nvsPutULong(FLASH_OUTPUT_WEAR, OUTPUT_WEAR_KEYS[i][0], outputLifetimeCycles(i));
+    nvsPutULong(FLASH_OUTPUT_WEAR, OUTPUT_WEAR_KEYS[i][1], outputLifetimeOnSec(i));
+    nvsPutULong(FLASH_OUTPUT_WEAR, OUTPUT_WEAR_KEYS[i][2], outputWear[i].ratedCycles);
+    nvsPutULong(FLASH_OUTPUT_WEAR, OUTPUT_WEAR_KEYS[i][3], outputWear[i].ratedHours);
+    nvsPutULong(FLASH_OUTPUT_WEAR, OUTPUT_WEAR_KEYS[i][4], valveSavedBaseline[i][VALVE_RESPONSE]);
+    nvsPutULong(FLASH_OUTPUT_WEAR, OUTPUT_WEAR_KEYS[i][5], valveSavedBaseline[i][VALVE_TRAVEL]);
+  }
+  nvsPutULong(FLASH_OUTPUT_WEAR, "poweredSec", basePoweredSec + millis() / 1000);
+  preferences.end();
+}
+
+void outputWearInit() {
+  preferences.begin("outputwear", true);
+  for (int i = 0; i < OUTPUT_COUNT; i++) {
+    OutputWear& w = outputWear[i];
+    w.baseCycles = preferences.getULong(OUTPUT_WEAR_KEYS[i][0], 0);
+    w.baseOnSec = preferences.getULong(OUTPUT_WEAR_KEYS[i][1], 0);
+    w.ratedCycles = preferences.getULong(OUTPUT_WEAR_KEYS[i][2], DEFAULT_RATED_CYCLES);
+    w.ratedHours = preferences.getULong(OUTPUT_WEAR_KEYS[i][3], DEFAULT_RATED_HOURS);
+    valveSavedBaseline[i][VALVE_RESPONSE] = preferences.getULong(OUTPUT_WEAR_KEYS[i][4], 0);
+    valveSavedBaseline[i][VALVE_TRAVEL] = preferences.getULong(OUTPUT_WEAR_KEYS[i][5], 0);
+    w.rateStartMs = 0;
+    w.maintenanceDue = false;
+  }
+  basePoweredSec = preferences.getULong("poweredSec", 0);
+  preferences.end();
+}
+
+// Save if anything moved since the last save; force skips the interval
+void outputWearSave(bool force) {
+  if (!force && millis() - lastOutputWearSave < OUTPUT_WEAR_SAVE_INTERVAL) return;
+  lastOutputWearSave = millis();
+  flashRequestWrite(FLASH_OUTPUT_WEAR, force);
+}
+
+// Loop task: apply replacements, check maintenance, persist periodically
+void outputWearService() {
+  bool save = false;
+  if (valveRelearnRequest) {
+    valveRelearnRequest = false;
+    xSemaphoreTake(statusLock, portMAX_DELAY);
+    for (int d = 0; d < 2; d++) valveRelearn(d);
+    xSemaphoreGive(statusLock);
+    logLine("VALVE: relearning baselines");
+  }
+
+  int replace = outputReplaceRequest;
+  if (replace >= 0) {
+    outputReplaceRequest = -1;
+    OutputWear& w = outputWear[replace];
+    OutputCounters& c = outputCounters[replace];
+    w.baseCycles = 0;
+    w.baseOnSec = 0;
+    w.rateStartMs = millis();
+    w.maintenanceDue = false;
+    c.cycles = 0;
+    c.energizedMs = 0;
+    c.onSinceMs = millis();
+    xSemaphoreTake(statusLock, portMAX_DELAY);
+    valveRelearn(replace);
+    xSemaphoreGive(statusLock);
+    logLine("WEAR: %s replaced, counters reset, valve baseline relearning", OUTPUT_NAMES[replace]);
+    save = true;
+  }
+  if (valveBaselineDirty) {
+    valveBaselineDirty = false;
+    save = true;
+  }
+  if (save) flashRequestWrite(FLASH_OUTPUT_WEAR, false);
+
+  if (millis() - lastOutputWearCheck >= OUTPUT_WEAR_CHECK_INTERVAL) {
+    lastOutputWearCheck = millis();
+    for (int i = 0; i < OUTPUT_COUNT; i++) {
+      double daysLeft = outputDaysLeft(i);
+      double used = outputLifeUsedPct(i);
+      bool due = used >= OUTPUT_MAINTENANCE_PCT || (daysLeft >= 0 && daysLeft < OUTPUT_MAINTENANCE_LEAD_DAYS);
+      if (due && !outputWear[i].maintenanceDue) {
+        logLine("WEAR: %s maintenance due (%.1f%% used, %.0f days left)", OUTPUT_NAMES[i], used, daysLeft);
+        TRACE_INSTANT("wear.maintenanceDue");
+      }
+      outputWear[i].maintenanceDue = due;
+    }
+  }
+
+  outputWearSave(false);
+}
+
+size_t getOutputWearJson(char* out, size_t cap) {
+  StaticJsonDocument<1024> doc;
+  JsonArray arr = doc.createNestedArray("outputs");
+  for (int i = 0; i < OUTPUT_COUNT; i++) {
+    const OutputWear& w = outputWear[i];
+    double sinceDays = (millis() - w.rateStartMs) / 86400000.0;
+    JsonObject o = arr.createNestedObject();
+    o["name"] = OUTPUT_NAMES[i];
+    o["cycles"] = outputLifetimeCycles(i);
+    o["onHours"] = outputLifetimeOnSec(i) / 3600.0;
+    o["dutyPct"] = (millis() - w.rateStartMs) ? 100.0 * outputSinceMs(i) / (millis() - w.rateStartMs) : 0;
+    o["cyclesPerDay"] = sinceDays > 0 ? outputCounters[i].cycles / sinceDays : 0;
+    o["ratedCycles"] = w.ratedCycles;
+    o["ratedHours"] = w.ratedHours;
+    o["lifeUsedPct"] = outputLifeUsedPct(i);
+    o["daysLeft"] = outputDaysLeft(i);
+    o["maintenanceDue"] = w.maintenanceDue;
+  }
+  uint32_t poweredSec = basePoweredSec + millis() / 1000;
+  doc["poweredHours"] = poweredSec / 3600.0;
+  doc["maintenancePct"] = OUTPUT_MAINTENANCE_PCT;
+  doc["leadDays"] = OUTPUT_MAINTENANCE_LEAD_DAYS;
+  return serializeJson(doc, out, cap);
+}
+
+// POST /diag/wear?output=gpo1&ratedCycles=..&ratedHours=..  (update the model)
+// POST /diag/wear?output=gpo1&action=replace                 (part replaced)
+void handleOutputWear(AsyncWebServerRequest *request) {
+  int idx = -1;
+  for (int i = 0; i < OUTPUT_COUNT; i++) {
+    if (request->arg("output") == OUTPUT_NAMES[i]) idx = i;
+  }
+  if (idx < 0) {
+    request->send(400, "text/plain", "output must be gpo1 or gpo2");
+    return;
+  }
+  if (request->arg("action") == "replace") {
+    outputReplaceRequest = idx;
+    request->send(200, "text/plain", "OK");
+    return;
+  }
+  if (request->hasArg("ratedCycles")) {
+    long v = request->arg("ratedCycles").toInt();
+    if (v < 1000) {
+      request->send(400, "text/plain", "ratedCycles must be at least 1000");
+      return;
+    }
+    outputWear[idx].ratedCycles = v;
+  }
+  if (request->hasArg("ratedHours")) {
+    long v = request->arg("ratedHours").toInt();
+    if (v < 1) {
+      request->send(400, "text/plain", "ratedHours must be at least 1");
+      return;
+    }
+    outputWear[idx].ratedHours = v;
+  }
+  flashRequestWrite(FLASH_OUTPUT_WEAR, false);
+  request->send(200, "text/plain", "OK");
+}
+
+// ========== SETTINGS MANAGEMENT ==========
+void loadSettings() {
+  preferences.begin("groutpump", false);
+  
+  // Load WiFi credentials
+  char ssid[SsidString::CAPACITY + 1] = "";
+  char password[PassphraseString::CAPACITY + 1] = "";
+  preferences.getString("ssid", ssid, sizeof(ssid));
+  preferences.getString("password", password, sizeof(password));
+  wifiSSID = ssid;
+  wifiPassword = password;
+  
+  // Load timing settings
+  cycleTimeout = preferences.getULong("cycleTimeout", DEFAULT_CYCLE_TIMEOUT);
+  timeoutEnabled = preferences.getBool("timeoutEnabled", true);
+
+  // Load simulation settings (mode is applied on the first loop() pass)
+  if (preferences.getBool("simEnabled", false)) simRequest = 1;
+  simStrokeInMs = preferences.getULong("simStrokeIn", DEFAULT_SIM_STROKE_MS);
+  simStrokeOutMs = preferences.getULong("simStrokeOut", DEFAULT_SIM_STROKE_MS);
+  simJitterPct = preferences.getInt("simJitter", 5);
+  simBounceMs = preferences.getULong("simBounce", 0);
+  simValveMs = preferences.getULong("simValve", 40);
+
+  // Flight recorder window
+  recorderPreMs = preferences.getULong("recPreMs", DEFAULT_RECORDER_PRE_MS);
+  recorderPostMs = preferences.getULong("recPostMs", DEFAULT_RECORDER_POST_MS);
+
+  // Static asset cache size (see STATIC ASSET CACHE)
+  assetCacheBudget = min((size_t)preferences.getULong("assetBudget", ASSET_CACHE_BUDGET), ASSET_CACHE_BUDGET);
+
+  // Remote input debounce windows (see BUTTON DEBOUNCING)
+  for (int i = 0; i < REMOTE_COUNT; i++) {
+    char key[16];
+    snprintf(key, sizeof(key), "db%s", REMOTE_NAMES[i]);
+    debounce[i].windowMs = constrain(preferences.getULong(key, DEBOUNCE_DELAY), DEBOUNCE_MIN_MS, DEBOUNCE_MAX_MS);
+  }
+
+  // Pressure input (the pressure task picks these up on its next pass)
+  pressureEnabled = preferences.getBool("prEnabled", false);
+  pressurePin = preferences.getInt("prPin", DEFAULT_PRESSURE_PIN);
+  pressureZeroCounts = preferences.getInt("prZero", DEFAULT_PRESSURE_ZERO);
+  pressureFullCounts = preferences.getInt("prFull", DEFAULT_PRESSURE_FULL);
+  pressureFullScaleBar = preferences.getULong("prScale", DEFAULT_PRESSURE_FULL_SCALE_BAR);
+  pressureTripBar = preferences.getULong("prTrip", DEFAULT_PRESSURE_TRIP_BAR);
+
+  // Alarm rules, keyed by rule name + suffix; the webhook URL is parsed in webhookInit()
+  for (int i = 0; i < ALARM_COUNT; i++) {
+    const AlarmDef& d = ALARM_DEFS[i];
+    AlarmRule& r = alarmRules[i];
+    char key[16];
+    snprintf(key, sizeof(key), "%sOn", d.name);
+    r.enabled = preferences.getBool(key, true);
+    snprintf(key, sizeof(key), "%sSp", d.name);
+    r.setpoint = preferences.getInt(key, d.setpoint);
+    snprintf(key, sizeof(key), "%sHy", d.name);
+    r.hysteresis = preferences.getInt(key, d.hysteresis);
+    snprintf(key, sizeof(key), "%sDl", d.name);
+    r.delayMs = preferences.getULong(key, d.delayMs);
+  }
+  char hook[WebhookUrlString::CAPACITY + 1] = "";
+  preferences.getString("alarmHook", hook, sizeof(hook));
+  webhookUrl = hook;
+  
+  preferences.end();
+  
+  Serial.println("Settings loaded from flash");
+  logLine("  SSID: %s", wifiSSID.empty() ? "Not configured" : wifiSSID.c_str());
+  logLine("  Cycle Timeout: %lu ms", cycleTimeout);
+  logLine("  Timeout Enabled: %s", timeoutEnabled ? "Yes" : "No");
+  logLine("  Debounce A/B/C/D: %u/%u/%u/%u ms", debounce[REMOTE_A].windowMs, debounce[REMOTE_B].windowMs,
+          debounce[REMOTE_C].windowMs, debounce[REMOTE_D].windowMs);
+  logLine("  Simulation: %s", simRequest == 1 ? "Yes" : "No");
+  if (pressureEnabled) logLine("  Pressure: GPIO %d, trip %lu bar", pressurePin, pressureTripBar);
+  else Serial.println("  Pressure: off");
+}
+
+// Persist settings, subject to the settings flash budget. Pass force when the
+// write must land now (e.g. before a restart).
+void saveSettings(bool force) {
+  if (!flashRequestWrite(FLASH_SETTINGS, force)) {
+    Serial.println("Settings save deferred (flash write budget)");
+  }
+}
+
+// Only keys whose value changed are rewritten (called under flashLock)
+void writeSettings() {
+  TRACE_SCOPE("flash.saveSettings");
+  preferences.begin("groutpump", false);
+  
+  nvsPutString(FLASH_SETTINGS, "ssid", wifiSSID.c_str());
+  nvsPutString(FLASH_SETTINGS, "password", wifiPassword.c_str());
+  nvsPutULong(FLASH_SETTINGS, "cycleTimeout", cycleTimeout);
+  nvsPutBool(FLASH_SETTINGS, "timeoutEnabled", timeoutEnabled);
+  nvsPutBool(FLASH_SETTINGS, "simEnabled", simRequest >= 0 ? simRequest == 1 : simEnabled);
+  nvsPutULong(FLASH_SETTINGS, "simStrokeIn", simStrokeInMs);
+  nvsPutULong(FLASH_SETTINGS, "simStrokeOut", simStrokeOutMs);
+  nvsPutInt(FLASH_SETTINGS, "simJitter", simJitterPct);
+  nvsPutULong(FLASH_SETTINGS, "simBounce", simBounceMs);
+  nvsPutULong(FLASH_SETTINGS, "simValve", simValveMs);
+  nvsPutULong(FLASH_SETTINGS, "recPreMs", recorderPreMs);
+  nvsPutULong(FLASH_SETTINGS, "recPostMs", recorderPostMs);
+  nvsPutULong(FLASH_SETTINGS, "assetBudget", assetCacheBudget);
+  for (int i = 0; i < REMOTE_COUNT; i++) {
+    char key[16];
+    snprintf(key, sizeof(key), "db%s", REMOTE_NAMES[i]);
+    nvsPutULong(FLASH_SETTINGS, key, debounce[i].windowMs);
+  }
+  nvsPutBool(FLASH_SETTINGS, "prEnabled", pressureEnabled);
+  nvsPutInt(FLASH_SETTINGS, "prPin", pressurePin);
+  nvsPutInt(FLASH_SETTINGS, "prZero", pressureZeroCounts);
+  nvsPutInt(FLASH_SETTINGS, "prFull", pressureFullCounts);
+  nvsPutULong(FLASH_SETTINGS, "prScale", pressureFullScaleBar);
+  nvsPutULong(FLASH_SETTINGS, "prTrip", pressureTripBar);
+  for (int i = 0; i < ALARM_COUNT; i++) {
+    const AlarmRule& r = alarmRules[i];
+    char key[16];
+    snprintf(key, sizeof(key), "%sOn", ALARM_DEFS[i].name);
+    nvsPutBool(FLASH_SETTINGS, key, r.enabled);
+    snprintf(key, sizeof(key), "%sSp", ALARM_DEFS[i].name);
+    nvsPutInt(FLASH_SETTINGS, key, r.setpoint);
+    snprintf(key, sizeof(key), "%sHy", ALARM_DEFS[i].name);
+    nvsPutInt(FLASH_SETTINGS, key, r.hysteresis);
+    snprintf(key, sizeof(key), "%sDl", ALARM_DEFS[i].name);
+    nvsPutULong(FLASH_SETTINGS, key, r.delayMs);
+  }
+  nvsPutString(FLASH_SETTINGS, "alarmHook", webhookUrl.c_str());
+  
+  preferences.end();
+  
+  Serial.println("Settings saved to flash");
+}
+
+// ========== WIFI SETUP ==========
+// A cold connect scans every channel for the SSID and then waits for DHCP.
+// That takes several seconds after each restart or OTA. The last good AP
+// (BSSID and channel) is cached in the "wifinet" namespace:
+// - Boot tries a connect pinned to that AP, and falls back to a normal scan
+//   after WIFI_DIRECTED_TIMEOUT_MS.
+// - When the link drops at runtime, the reconnect is pinned the same way.
+// - A static IP set on the settings page replaces DHCP.
+// Lease reuse is optional (reuseLease, off by default). The DHCP lease is
+// kept in RTC memory, which survives ESP.restart(), OTA and watchdog resets
+// but not a power cycle, so a cold start always runs DHCP. A lease is only
+// reused before its renewal time (T1), and only if the gateway then answers
+// ARP. Otherwise, and once T1 comes, the pump hands over to DHCP.
+// The namespace belongs to this unit and is left out of snapshots: a cloned
+// static IP would collide. Connect and reconnect times are logged and
+// served from GET /diag/wifi.
+const unsigned long WIFI_DIRECTED_TIMEOUT_MS = 4000;  // Pinned attempt, then scan
+const unsigned long WIFI_SCAN_TIMEOUT_MS = 10000;     // As long as the old 20 x 500 ms wait
+const unsigned long WIFI_GATEWAY_CHECK_MS = 1500;     // Gateway must answer ARP on a reused lease
+const unsigned long WIFI_GATEWAY_PROBE_MS = 250;      // ARP request interval during the check
+const unsigned long WIFI_LEASE_POLL_MS = 30000;       // Re-read the DHCP lease timers
+const uint32_t WIFI_LEASE_MARGIN_S = 60;              // Hand over to DHCP this long before T1
+const uint32_t WIFI_LEASE_MAX_S = 86400;              // Cap for very long or infinite leases
+const uint32_t WIFI_LEASE_MAGIC = 0x4C454153;         // "LEAS"
+
+enum WifiMethod {
+  WIFI_METHOD_NONE,
+  WIFI_METHOD_DIRECTED,         // Cached BSSID and channel
+  WIFI_METHOD_SCAN
+};
+
+const char* const WIFI_METHOD_NAMES[] = {"none", "directed", "scan"};
+
+struct WifiNet {
+  uint8_t bssid[6];             // Last AP connected to
+  int32_t channel;              // 0 = no cached AP
+  bool reuseLease;              // Apply a still-valid lease on a directed connect, skipping DHCP
+  uint32_t staticIp;            // 0 = DHCP
+  uint32_t staticGateway;
+  uint32_t staticMask;
+  uint32_t staticDns;
+};
+
+// Last DHCP lease, in RTC memory (garbage after power-on, hence the check word)
+struct WifiLease {
+  uint32_t magic;
+  uint32_t ip;
+  uint32_t gateway;
+  uint32_t mask;
+  uint32_t dns;
+  int64_t recordedAtS;          // RTC clock, which keeps counting across software resets
+  int64_t renewAtS;             // T1: stop reusing it from here
+  uint32_t check;
+};
+
+struct WifiLink {
+  int method;                   // How the current (or last) connection was made
+  bool pinned;                  // Driver config is locked to the cached BSSID
+  bool leaseApplied;            // IP taken from the cached lease, no DHCP
+  bool bootFallback;            // The directed connect at boot failed
+  uint32_t bootConnectMs;       // 0 = boot did not connect
+  unsigned long downSinceMs;    // 0 while connected
+  uint32_t reconnects;
+  uint32_t lastReconnectMs;
+  uint32_t maxReconnectMs;
+  unsigned long gatewayCheckUntilMs;  // 0 = no check running
+  unsigned long lastGatewayProbeMs;
+  unsigned long lastLeasePollMs;
+  uint32_t leaseRejects;        // Reused leases dropped (gateway silent)
+};
+
+WifiNet wifiNet = {{0}, 0, false, 0, 0, 0, 0};
+RTC_NOINIT_ATTR WifiLease wifiLease;
+WifiLink wifiLink;
+
+// Written in the lwIP thread by the callbacks below, read by the loop
+volatile bool wifiGatewaySeen = false;
+volatile bool wifiDhcpReady = false;
+volatile uint32_t wifiDhcpT1 = 0;
+volatile uint32_t wifiDhcpUsedS = 0;
+
+// From the web task, applied and saved in wifiService()
+volatile int wifiReuseLeaseRequest = -1;      // 0 or 1
+volatile bool wifiForgetRequest = false;
+volatile bool wifiStaticRequest = false;      // wifiStaticPending holds ip, gateway, mask, dns
+uint32_t wifiStaticPending[4];
+volatile unsigned long wifiRestartAtMs = 0;   // Set by /setwifi once the reply is queued
+
+void wifiFormatBssid(const uint8_t* b, char* out, size_t cap) {
+  snprintf(out, cap, "%02x:%02x:%02x:%02x:%02x:%02x", b[0], b[1], b[2], b[3], b[4], b[5]);
+}
+
+int64_t wifiRtcSeconds() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec;
+}
+
+uint32_t wifiLeaseCheck(const WifiLease& l) {
+  return l.magic ^ l.ip ^ l.gateway ^ l.mask ^ l.dns ^ (uint32_t)l.recordedAtS ^
+         (uint32_t)(l.recordedAtS >> 32) ^ (uint32_t)l.renewAtS ^ (uint32_t)(l.renewAtS >> 32);
+}
+
+// Seconds the cached lease may still be reused, 0 if none
+int64_t wifiLeaseLeftS() {
+  const WifiLease& l = wifiLease;
+  if (l.magic != WIFI_LEASE_MAGIC || l.check != wifiLeaseCheck(l) || l.ip == 0) return 0;
+  int64_t now = wifiRtcSeconds();
+  if (now < l.recordedAtS) return 0;  // Clock went back: can't tell the lease's age
+  int64_t left = l.renewAtS - WIFI_LEASE_MARGIN_S - now;
+  return left > 0 ? left : 0;
+}
+
+void wifiLeaseForget() {
+  wifiLease.magic = 0;
+}
+
+void wifiLoadNet() {
+  preferences.begin("wifinet", true);
+  char bssid[18] = "";
+  preferences.getString("bssid", bssid, sizeof(bssid));
+  unsigned int b[6];
+  wifiNet.channel = 0;
+  if (sscanf(bssid, "%x:%x:%x:%x:%x:%x", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) == 6) {
+    for (int i = 0; i < 6; i++) wifiNet.bssid[i] = b[i];
+    wifiNet.channel = preferences.getULong("channel", 0);
+  }
+  wifiNet.reuseLease = preferences.getBool("reuseLease", false);
+  wifiNet.staticIp = preferences.getULong("staticIp", 0);
+  wifiNet.staticGateway = preferences.getULong("staticGw", 0);
+  wifiNet.staticMask = preferences.getULong("staticMask", 0);
+  wifiNet.staticDns = preferences.getULong("staticDns", 0);
+  preferences.end();
+}
+
+// Unchanged keys are skipped, so a steady network costs no flash writes
+void wifiSaveNet() {
+  char bssid[18] = "";
+  if (wifiNet.channel > 0) wifiFormatBssid(wifiNet.bssid, bssid, sizeof(bssid));
+  xSemaphoreTake(flashLock, portMAX_DELAY);
+  preferences.begin("wifinet", false);
+  nvsPutString(FLASH_WIFI_CACHE, "bssid", bssid);
+  nvsPutULong(FLASH_WIFI_CACHE, "channel", wifiNet.channel);
+  nvsPutBool(FLASH_WIFI_CACHE, "reuseLease", wifiNet.reuseLease);
+  nvsPutULong(FLASH_WIFI_CACHE, "staticIp", wifiNet.staticIp);
+  nvsPutULong(FLASH_WIFI_CACHE, "staticGw", wifiNet.staticGateway);
+  nvsPutULong(FLASH_WIFI_CACHE, "staticMask", wifiNet.staticMask);
+  nvsPutULong(FLASH_WIFI_CACHE, "staticDns", wifiNet.staticDns);
+  preferences.end();
+  xSemaphoreGive(flashLock);
+}
+
+void wifiForgetAp() {
+  wifiNet.channel = 0;
+  memset(wifiNet.bssid, 0, sizeof(wifiNet.bssid));
+  wifiLeaseForget();
+}
+
+struct netif* wifiStaNetif() {
+  esp_netif_t* handle = esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
+  return handle ? (struct netif*)esp_netif_get_netif_impl(handle) : NULL;
+}
+
+// lwIP thread: has the gateway answered ARP yet? If not, ask again.
+void wifiArpProbe(void* arg) {
+  struct netif* nif = wifiStaNetif();
+  if (!nif) return;
+  ip4_addr_t gw;
+  gw.addr = wifiLease.gateway;
+  struct eth_addr* mac;
+  const ip4_addr_t* ip;
+  if (etharp_find_addr(nif, &gw, &mac, &ip) >= 0) wifiGatewaySeen = true;
+  else etharp_request(nif, &gw);
+}
+
+// lwIP thread: the bound lease's renewal time and age
+void wifiDhcpRead(void* arg) {
+  struct netif* nif = wifiStaNetif();
+  if (!nif || !dhcp_supplied_address(nif)) return;
+  struct dhcp* d = netif_dhcp_data(nif);
+  wifiDhcpT1 = d->offered_t1_renew;
+  wifiDhcpUsedS = (uint32_t)d->lease_used * DHCP_COARSE_TIMER_SECS;
+  wifiDhcpReady = true;
+}
+
+// Static IP if configured. Otherwise a still-valid lease when allowed. Otherwise DHCP.
+void wifiApplyIpConfig(bool allowLease) {
+  wifiLink.leaseApplied = false;
+  if (wifiNet.staticIp) {
+    WiFi.config(IPAddress(wifiNet.staticIp), IPAddress(wifiNet.staticGateway), IPAddress(wifiNet.staticMask),
+                IPAddress(wifiNet.staticDns ? wifiNet.staticDns : wifiNet.staticGateway));
+  } else if (allowLease && wifiNet.reuseLease && wifiLeaseLeftS() > 0) {
+    const WifiLease& l = wifiLease;
+    WiFi.config(IPAddress(l.ip), IPAddress(l.gateway), IPAddress(l.mask), IPAddress(l.dns ? l.dns : l.gateway));
+    wifiLink.leaseApplied = true;
+  } else {
+    WiFi.config(IPAddress(), IPAddress(), IPAddress());  // All zero: DHCP
+  }
+}
+
+// The reused lease didn't hold up or has reached T1: run DHCP on the live link
+void wifiLeaseHandOver(const char* why) {
+  logLine("WiFi: %s, switching to DHCP", why);
+  wifiLeaseForget();
+  wifiLink.gatewayCheckUntilMs = 0;
+  wifiApplyIpConfig(false);
+}
+
+void wifiBeginDirected() {
+  wifiApplyIpConfig(true);
+  WiFi.begin(wifiSSID.c_str(), wifiPassword.c_str(), wifiNet.channel, wifiNet.bssid);
+  wifiLink.pinned = true;
+  wifiLink.method = WIFI_METHOD_DIRECTED;
+}
+
+void wifiBeginScan() {
+  wifiApplyIpConfig(false);
+  WiFi.begin(wifiSSID.c_str(), wifiPassword.c_str());
+  wifiLink.pinned = false;
+  wifiLink.method = WIFI_METHOD_SCAN;
+}
+
+bool wifiWait(unsigned long timeoutMs) {
+  unsigned long start = millis();
+  while (WiFi.status() != WL_CONNECTED && millis() - start < timeoutMs) delay(10);
+  return WiFi.status() == WL_CONNECTED;
+}
+
+// Cache the AP just connected to. A reused lease must prove itself first.
+void wifiConnected() {
+  memcpy(wifiNet.bssid, WiFi.BSSID(), sizeof(wifiNet.bssid));
+  wifiNet.channel = WiFi.channel();
+  wifiSaveNet();
+  wifiLink.lastLeasePollMs = millis() - WIFI_LEASE_POLL_MS;  // Read the lease on the next pass
+  if (wifiLink.leaseApplied) {
+    wifiGatewaySeen = false;
+    wifiLink.gatewayCheckUntilMs = millis() + WIFI_GATEWAY_CHECK_MS;
+    if (wifiLink.gatewayCheckUntilMs == 0) wifiLink.gatewayCheckUntilMs = 1;
+    wifiLink.lastGatewayProbeMs = 0;
+  }
+}
+
+// Loop task: keep the RTC copy of the DHCP lease current (RAM only, no flash)
+void wifiLeaseService(unsigned long now) {
+  if (wifiNet.staticIp) return;
+  if (wifiLink.leaseApplied) {
+    if (wifiLink.gatewayCheckUntilMs) {
+      if (wifiGatewaySeen) {
+        logLine("WiFi: gateway answered, keeping the cached lease for %ld s", (long)wifiLeaseLeftS());
+        wifiLink.gatewayCheckUntilMs = 0;
+      } else if ((long)(now - wifiLink.gatewayCheckUntilMs) >= 0) {
+        wifiLink.leaseRejects++;
+        wifiLeaseHandOver("gateway silent on the cached lease");
+      } else if (now - wifiLink.lastGatewayProbeMs >= WIFI_GATEWAY_PROBE_MS) {
+        wifiLink.lastGatewayProbeMs = now;
+        tcpip_callback(wifiArpProbe, NULL);
+      }
+      return;
+    }
+    if (wifiLeaseLeftS() == 0) wifiLeaseHandOver("cached lease reached its renewal time");
+    return;
+  }
+  if (wifiDhcpReady) {
+    wifiDhcpReady = false;
+    uint32_t t1 = wifiDhcpT1;
+    if (t1 > WIFI_LEASE_MAX_S) t1 = WIFI_LEASE_MAX_S;
+    WifiLease& l = wifiLease;
+    l.ip = WiFi.localIP();
+    l.gateway = WiFi.gatewayIP();
+    l.mask = WiFi.subnetMask();
+    l.dns = WiFi.dnsIP(0);
+    l.recordedAtS = wifiRtcSeconds();
+    // Bound time is only known to the coarse DHCP tick; assume the earliest
+    l.renewAtS = l.recordedAtS - wifiDhcpUsedS - DHCP_COARSE_TIMER_SECS + t1;
+    l.magic = WIFI_LEASE_MAGIC;
+    l.check = wifiLeaseCheck(l);
+  }
+  if (now - wifiLink.lastLeasePollMs >= WIFI_LEASE_POLL_MS) {
+    wifiLink.lastLeasePollMs = now;
+    tcpip_callback(wifiDhcpRead, NULL);
+  }
+}
+
+void startSetupAP() {
+  WiFi.mode(WIFI_AP);
+  WiFi.softAP("GroutPump-Setup", "12345678");
+  Serial.println("AP Mode started");
+  logLine("AP IP address: %s", formatIp(WiFi.softAPIP()).c_str());
+}
+
+void setupWiFi() {
+  if (wifiSSID.empty()) {
+    Serial.println("WiFi not configured. Starting in AP mode...");
+    startSetupAP();
+    Serial.println("Connect to 'GroutPump-Setup' (password: 12345678)");
+    Serial.println("Then navigate to http://192.168.4.1 to configure WiFi");
+    return;
+  }
+  
+  wifiLoadNet();
+  logLine("Connecting to WiFi: %s", wifiSSID.c_str());
+  WiFi.persistent(false);  // The driver's own flash copy of the config would duplicate "wifinet"
+  WiFi.mode(WIFI_STA);
+  unsigned long start = millis();
+  bool connected = false;
+  if (wifiNet.channel > 0) {
+    wifiBeginDirected();
+    connected = wifiWait(WIFI_DIRECTED_TIMEOUT_MS);
+    if (!connected) {
+      char bssid[18];
+      wifiFormatBssid(wifiNet.bssid, bssid, sizeof(bssid));
+      logLine("WiFi: cached AP %s on channel %ld not reached in %lu ms, scanning", bssid,
+              (long)wifiNet.channel, WIFI_DIRECTED_TIMEOUT_MS);
+      wifiLink.bootFallback = true;
+      WiFi.disconnect();
+    }
+  }
+  if (!connected) {
+    wifiBeginScan();
+    connected = wifiWait(WIFI_SCAN_TIMEOUT_MS);
+  }
+  
+  if (connected) {
+    wifiLink.bootConnectMs = millis() - start;
+    logLine("WiFi connected in %lu ms (%s, %s)", (unsigned long)wifiLink.bootConnectMs,
+            WIFI_METHOD_NAMES[wifiLink.method],
+            wifiNet.staticIp ? "static IP" : wifiLink.leaseApplied ? "cached lease" : "DHCP");
+    logLine("IP address: %s", formatIp(WiFi.localIP()).c_str());
+    wifiConnected();
+    
+    // Setup mDNS
+    if (MDNS.begin("groutpump")) {
+      Serial.println("mDNS responder started: http://groutpump.local");
+    }
+  } else {
+    wifiLink.method = WIFI_METHOD_NONE;
+    Serial.println("\nWiFi connection failed. Starting in AP mode...");
+    startSetupAP();
+  }
+}
+
+// Loop task: time each outage. A drop is followed by a reconnect pinned to
+// the cached AP, and by a scan if that AP doesn't come back.
+// Loop task: apply the web handlers' requests, then restart if /setwifi asked
+void wifiApplyRequests() {
+  bool save = false;
+  int reuse = wifiReuseLeaseRequest;
+  if (reuse >= 0) {
+    wifiReuseLeaseRequest = -1;
+    wifiNet.reuseLease = reuse == 1;
+    save = true;
+  }
+  if (wifiStaticRequest) {
+    wifiStaticRequest = false;
+    wifiNet.staticIp = wifiStaticPending[0];
+    wifiNet.staticGateway = wifiStaticPending[1];
+    wifiNet.staticMask = wifiStaticPending[2];
+    wifiNet.staticDns = wifiStaticPending[3];
+    save = true;
+  }
+  if (wifiForgetRequest) {
+    wifiForgetRequest = false;
+    wifiForgetAp();
+    logLine("WiFi: cached AP and lease forgotten; next connect scans");
+    save = true;
+  }
+  if (save) wifiSaveNet();
+  if (wifiRestartAtMs && (long)(millis() - wifiRestartAtMs) >= 0) {
+    writeOutput(GPO1_PIN, LOW);
+    writeOutput(GPO2_PIN, LOW);
+    flashFlushPending();
+    ESP.restart();
+  }
+}
+
+void wifiService() {
+  wifiApplyRequests();
+  if (wifiSSID.empty() || WiFi.getMode() != WIFI_STA) return;  // Setup AP
+  unsigned long now = millis();
+  if (WiFi.status() != WL_CONNECTED) {
+    wifiLink.gatewayCheckUntilMs = 0;
+    if (wifiLink.downSinceMs == 0) {
+      wifiLink.downSinceMs = now ? now : 1;
+      logLine("WiFi: link lost");
+      if (wifiNet.channel > 0) wifiBeginDirected();
+    } else if (wifiLink.pinned && now - wifiLink.downSinceMs > WIFI_DIRECTED_TIMEOUT_MS) {
+      logLine("WiFi: cached AP not back in %lu ms, scanning", WIFI_DIRECTED_TIMEOUT_MS);
+      WiFi.disconnect();
+      wifiBeginScan();
+    }
+    return;
+  }
+  if (wifiLink.downSinceMs) {
+    uint32_t ms = now - wifiLink.downSinceMs;
+    wifiLink.downSinceMs = 0;
+    wifiLink.reconnects++;
+    wifiLink.lastReconnectMs = ms;
+    if (ms > wifiLink.maxReconnectMs) wifiLink.maxReconnectMs = ms;
+    logLine("WiFi: reconnected in %lu ms (%s)", (unsigned long)ms, WIFI_METHOD_NAMES[wifiLink.method]);
+    wifiConnected();
+  }
+  wifiLeaseService(now);
+}
+
+// char[] values are copied into the document, unlike const char*
+void wifiJsonIp(JsonObject o, const char* key, uint32_t ip) {
+  char s[16];
+  strlcpy(s, formatIp(IPAddress(ip)).c_str(), sizeof(s));
+  o[key] = s;
+}
+
+size_t getWifiJson(char* out, size_t cap) {
+  StaticJsonDocument<1024> doc;
+  bool sta = WiFi.getMode() == WIFI_STA;
+  bool up = sta && WiFi.status() == WL_CONNECTED;
+  char bssid[18], ip[16];
+  doc["ssid"] = wifiSSID.c_str();
+  doc["mode"] = sta ? "station" : "setupAP";
+  doc["connected"] = up;
+  if (up) {
+    wifiFormatBssid(WiFi.BSSID(), bssid, sizeof(bssid));
+    doc["bssid"] = bssid;
+    doc["channel"] = WiFi.channel();
+    doc["rssi"] = WiFi.RSSI();
+    strlcpy(ip, formatIp(WiFi.localIP()).c_str(), sizeof(ip));
+    doc["ip"] = ip;
+  }
+  doc["method"] = WIFI_METHOD_NAMES[wifiLink.method];
+  doc["pinned"] = wifiLink.pinned;
+  doc["ipSource"] = wifiNet.staticIp ? "static" : wifiLink.leaseApplied ? "cachedLease" : "dhcp";
+  doc["gatewayCheck"] = wifiLink.gatewayCheckUntilMs != 0;
+  doc["leaseRejects"] = wifiLink.leaseRejects;
+  doc["bootConnectMs"] = wifiLink.bootConnectMs;
+  doc["bootFallback"] = wifiLink.bootFallback;
+  doc["reconnects"] = wifiLink.reconnects;
+  doc["lastReconnectMs"] = wifiLink.lastReconnectMs;
+  doc["maxReconnectMs"] = wifiLink.maxReconnectMs;
+  doc["downMs"] = wifiLink.downSinceMs ? millis() - wifiLink.downSinceMs : 0;
+  doc["directedTimeoutMs"] = WIFI_DIRECTED_TIMEOUT_MS;
+
+  JsonObject cache = doc.createNestedObject("cache");
+  if (wifiNet.channel > 0) {
+    char cached[18];
+    wifiFormatBssid(wifiNet.bssid, cached, sizeof(cached));
+    cache["bssid"] = cached;
+    cache["channel"] = wifiNet.channel;
+  }
+  cache["reuseLease"] = wifiNet.reuseLease;
+  int64_t left = wifiLeaseLeftS();
+  if (left > 0) {
+    wifiJsonIp(cache, "ip", wifiLease.ip);
+    wifiJsonIp(cache, "gateway", wifiLease.gateway);
+    wifiJsonIp(cache, "subnet", wifiLease.mask);
+    wifiJsonIp(cache, "dns", wifiLease.dns);
+  }
+  cache["leaseValidS"] = (long)left;
+
+  if (wifiNet.staticIp) {
+    JsonObject st = doc.createNestedObject("static");
+    wifiJsonIp(st, "ip", wifiNet.staticIp);
+    wifiJsonIp(st, "gateway", wifiNet.staticGateway);
+    wifiJsonIp(st, "subnet", wifiNet.staticMask);
+    wifiJsonIp(st, "dns", wifiNet.staticDns);
+  }
+  return serializeJson(doc, out, cap);
+}
+
+// POST /diag/wifi: reuseLease=0|1, action=forget (drop the cached AP and lease)
+void handleWifiControl(AsyncWebServerRequest *request) {
+  if (request->hasArg("action") && request->arg("action") != "forget") {
+    request->send(400, "text/plain", "action must be forget");
+    return;
+  }
+  if (request->hasArg("reuseLease")) wifiReuseLeaseRequest = request->arg("reuseLease") == "1" ? 1 : 0;
+  if (request->hasArg("action")) wifiForgetRequest = true;
+  request->send(200, "text/plain", "OK");
+}
+
+// ========== OTA SETUP ==========
+void setupOTA() {
+  ArduinoOTA.setHostname("groutpump");
+  ArduinoOTA.setPassword("groutpump123");  // Change this for security
+  
+  ArduinoOTA.onStart([]() {
+    const char* type;
+    if (ArduinoOTA.getCommand() == U_FLASH) {
+      type = "sketch";
+      otaDiscard("superseded by ArduinoOTA");
+    } else {  // U_SPIFFS
+      type = "filesystem";
+    }
+    logLine("Start updating %s", type);
+    
+    // Stop all outputs during OTA update
+    writeOutput(GPO1_PIN, LOW);
+    writeOutput(GPO2_PIN, LOW);
+  });
+  
+  ArduinoOTA.onEnd([]() {
+    Serial.println("\nOTA Update complete!");
+    if (ArduinoOTA.getCommand() == U_SPIFFS) flashAccountFs(FLASH_FS_IMAGE, Update.size());
+    flashFlushPending();  // ArduinoOTA restarts right after this
+  });
+  
+  ArduinoOTA.onProgress([](unsigned int progress, unsigned int total) {
+    Serial.printf("Progress: %u%%\r", (progress / (total / 100)));
+  });
+  
+  ArduinoOTA.onError([](ota_error_t error) {
+    Serial.printf("Error[%u]: ", error);
+    if (error == OTA_AUTH_ERROR) Serial.println("Auth Failed");
+    else if (error == OTA_BEGIN_ERROR) Serial.println("Begin Failed");
+    else if (error == OTA_CONNECT_ERROR) Serial.println("Connect Failed");
+    else if (error == OTA_RECEIVE_ERROR) Serial.println("Receive Failed");
+    else if (error == OTA_END_ERROR) Serial.println("End Failed");
+  });
+  
+  ArduinoOTA.begin();
+  Serial.println("OTA update service started");
+  Serial.println("OTA Password: groutpump123");
+}
+
+// ========== RESUMABLE OTA ==========
+// Chunked firmware upload that survives dropped connections and reboots.
+// The client announces the image (size and SHA-256), then POSTs it in
+// order as raw chunks, each with its offset and own SHA-256. A chunk's
+// sectors are erased one at a time as its body reaches them and written
+// straight into the inactive OTA partition, so no callback blocks the
+// AsyncTCP task for longer than one sector erase. Only once the chunk's hash
+// matches does the confirmed offset advance and get saved to NVS. A failed or
+// cut-off chunk is simply sent again (its sectors are erased again first).
+// After a reboot the session is reloaded, and /ota/begin with the same image
+// answers with the offset to resume from. /ota/finish answers 202 at once;
+// otaService() then hashes the partition range on the loop, a block per
+// pass, against the announced SHA-256 before esp_ota_set_boot_partition(),
+// which also checks the image itself. Clients poll GET /ota for the result.
+// Chunk bodies and the handlers run on the AsyncTCP task, verification on the
+// loop, and /update and ArduinoOTA, which write the same partition, discard
+// any session; otaLock serializes them all.
+const uint32_t OTA_CHUNK_DEFAULT = 32 * 1024;
+const uint32_t OTA_CHUNK_MAX = 64 * 1024;       // Chunks are whole sectors, up to this
+const unsigned long OTA_RESTART_DELAY_MS = 1000;  // Lets a status poll see the verified image
+const uint32_t OTA_VERIFY_BLOCK = 4096;          // Image bytes hashed per loop pass
+
+enum OtaChunkResult {
+  OTA_CHUNK_RECEIVING,
+  OTA_CHUNK_OK,
+  OTA_CHUNK_NO_SESSION,
+  OTA_CHUNK_BAD_REQUEST,
+  OTA_CHUNK_OFFSET,         // Not the confirmed offset: the reply tells the client where to resume
+  OTA_CHUNK_HASH,
+  OTA_CHUNK_FLASH
+};
+const char* const OTA_CHUNK_RESULT_NAMES[] = {"incomplete", "ok", "noSession", "badRequest", "offset", "hash", "flash"};
+const int OTA_CHUNK_RESULT_STATUS[] = {400, 200, 404, 400, 409, 422, 500};
+
+struct OtaSession {
+  bool active;
+  bool resumed;                 // Reloaded from NVS at boot
+  const esp_partition_t* partition;
+  uint32_t size;                // Image bytes
+  uint32_t chunkBytes;          // Largest chunk accepted
+  uint32_t offset;              // Bytes written and verified
+  char sha256[65];              // Whole image, lower-case hex
+  uint32_t chunks;              // Accepted this boot
+  uint32_t retries;             // Chunks rejected this boot (hash, offset, flash)
+  // Chunk in flight
+  uint32_t chunkLen;
+  uint32_t erasedTo;            // Sectors erased up to here
+  char chunkSha256[65];
+  int chunkResult;
+  mbedtls_sha256_context chunkHash;
+  // Whole-image check, after /ota/finish
+  bool verifying;
+  uint32_t verified;            // Bytes hashed
+  mbedtls_sha256_context verifyHash;
+};
+
+OtaSession ota;
+AsyncWebServerRequest* otaChunkOwner = NULL;  // Only compared, never dereferenced
+unsigned long otaRestartAtMs = 0;             // Set once the image is verified, applied in otaService()
+char otaLastError[48] = "";
+SemaphoreHandle_t otaLock = NULL;             // Guards all of the above; created in otaInit()
+
+void otaHex(const uint8_t* digest, char* out) {
+  for (int i = 0; i < 32; i++) snprintf(out + i * 2, 3, "%02x", digest[i]);
+}
+
+// Lower-cased copy of a 64-digit hex hash; false if malformed
+bool otaParseSha256(const String& in, char* out) {
+  if (in.length() != 64) return false;
+  const char* p = in.c_str();
+  for (int i = 0; i < 64; i++) {
+    char c = tolower(p[i]);
+    if (!isxdigit(c)) return false;
+    out[i] = c;
+  }
+  out[64] = '\0';
+  return true;
+}
+
+// Caller holds otaLock
+void otaSaveProgress() {
+  xSemaphoreTake(flashLock, portMAX_DELAY);
+  preferences.begin("ota", false);
+  nvsPutULong(FLASH_OTA_PROGRESS, "part", ota.active ? ota.partition->address : 0);
+  nvsPutULong(FLASH_OTA_PROGRESS, "size", ota.size);
+  nvsPutULong(FLASH_OTA_PROGRESS, "chunk", ota.chunkBytes);
+  nvsPutULong(FLASH_OTA_PROGRESS, "offset", ota.offset);
+  nvsPutString(FLASH_OTA_PROGRESS, "sha", ota.active ? ota.sha256 : "");
+  preferences.end();
+  xSemaphoreGive(flashLock);
+}
+
+// Caller holds otaLock
+void otaDiscardLocked(const char* why) {
+  if (!ota.active) return;
+  logLine("OTA: upload at %lu of %lu bytes discarded (%s)", (unsigned long)ota.offset,
+          (unsigned long)ota.size, why);
+  strlcpy(otaLastError, why, sizeof(otaLastError));
+  if (ota.verifying) mbedtls_sha256_free(&ota.verifyHash);
+  ota.verifying = false;
+  ota.active = false;
+  otaChunkOwner = NULL;
+  otaSaveProgress();
+}
+
+void otaDiscard(const char* why) {
+  xSemaphoreTake(otaLock, portMAX_DELAY);
+  otaDiscardLocked(why);
+  xSemaphoreGive(otaLock);
+}
+
+// Boot: reload an interrupted upload if it still targets the inactive partition
+void otaInit() {
+  otaLock = xSemaphoreCreateMutex();
+  mbedtls_sha256_init(&ota.chunkHash);
+  preferences.begin("ota", true);
+  uint32_t part = preferences.getULong("part", 0);
+  ota.size = preferences.getULong("size", 0);
+  ota.chunkBytes = preferences.getULong("chunk", OTA_CHUNK_DEFAULT);
+  ota.offset = preferences.getULong("offset", 0);
+  preferences.getString("sha", ota.sha256, sizeof(ota.sha256));
+  preferences.end();
+  if (part == 0) return;
+
+  ota.partition = esp_ota_get_next_update_partition(NULL);
+  ota.active = true;
+  if (!ota.partition || ota.partition->address != part) {
+    otaDiscardLocked("booted into the target partition");
+  } else if (ota.size == 0 || ota.size > ota.partition->size || ota.offset > ota.size ||
+             (ota.offset % FLASH_SECTOR_BYTES != 0 && ota.offset != ota.size) || strlen(ota.sha256) != 64) {
+    otaDiscardLocked("saved progress invalid");
+  } else {
+    ota.resumed = true;
+    logLine("OTA: resumable upload at %lu of %lu bytes in %s", (unsigned long)ota.offset,
+            (unsigned long)ota.size, ota.partition->label);
+  }
+}
+
+// Caller holds otaLock
+size_t getOtaJson(char* out, size_t cap) {
+  StaticJsonDocument<640> doc;
+  const esp_partition_t* running = esp_ota_get_running_partition();
+  doc["running"] = running ? running->label : "";
+  doc["active"] = ota.active;
+  if (ota.active) {
+    doc["partition"] = ota.partition->label;
+    doc["size"] = ota.size;
+    doc["sha256"] = ota.sha256;
+    doc["offset"] = ota.offset;
+    doc["chunkBytes"] = ota.chunkBytes;
+    doc["pct"] = ota.size ? 100.0 * ota.offset / ota.size : 0;
+    doc["resumed"] = ota.resumed;
+    doc["verifying"] = ota.verifying;
+    if (ota.verifying) doc["verified"] = ota.verified;
+  }
+  doc["chunks"] = ota.chunks;
+  doc["retries"] = ota.retries;
+  doc["restarting"] = otaRestartAtMs != 0;
+  if (otaLastError[0]) doc["lastError"] = otaLastError;
+  return serializeJson(doc, out, cap);
+}
+
+void sendOtaJson(AsyncWebServerRequest *request, int code) {
+  char json[640];
+  getOtaJson(json, sizeof(json));
+  request->send(code, "application/json", json);
+}
+
+// GET /ota
+void handleOtaStatus(AsyncWebServerRequest *request) {
+  xSemaphoreTake(otaLock, portMAX_DELAY);
+  sendOtaJson(request, 200);
+  xSemaphoreGive(otaLock);
+}
+
+// POST /ota/begin?size=N&sha256=<hex>[&chunk=32768] (under otaLock)
+void otaBegin(AsyncWebServerRequest *request) {
+  char sha[65];
+  long size = request->arg("size").toInt();
+  long chunk = request->hasArg("chunk") ? request->arg("chunk").toInt() : (long)OTA_CHUNK_DEFAULT;
+  if (size <= 0 || !otaParseSha256(request->arg("sha256"), sha)) {
+    request->send(400, "text/plain", "size and sha256 (64 hex digits) required");
+    return;
+  }
+  if (chunk < (long)FLASH_SECTOR_BYTES || chunk > (long)OTA_CHUNK_MAX || chunk % FLASH_SECTOR_BYTES != 0) {
+    request->send(400, "text/plain", "chunk must be a multiple of 4096, up to 65536");
+    return;
+  }
+  if (ota.active && ota.size == (uint32_t)size && strcmp(ota.sha256, sha) == 0) {
+    // Same image: carry on from the confirmed offset (a sector boundary)
+    ota.chunkBytes = chunk;
+    logLine("OTA: resuming at %lu of %lu bytes", (unsigned long)ota.offset, (unsigned long)ota.size);
+    sendOtaJson(request, 200);
+    return;
+  }
+  const esp_partition_t* part = esp_ota_get_next_update_partition(NULL);
+  if (!part) {
+    request->send(500, "text/plain", "No OTA partition");
+    return;
+  }
+  if ((uint32_t)size > part->size) {
+    request->send(413, "text/plain", "Image larger than the OTA partition");
+    return;
+  }
+  if (ota.active) otaDiscardLocked("new image");
+  ota.active = true;
+  ota.resumed = false;
+  ota.partition = part;
+  ota.size = size;
+  ota.chunkBytes = chunk;
+  ota.offset = 0;
+  strlcpy(ota.sha256, sha, sizeof(ota.sha256));
+  otaLastError[0] = '\0';
+  otaSaveProgress();
+  logLine("OTA: new upload, %lu bytes into %s", (unsigned long)ota.size, part->label);
+  sendOtaJson(request, 200);
+}
+
+void handleOtaBegin(AsyncWebServerRequest *request) {
+  xSemaphoreTake(otaLock, portMAX_DELAY);
+  otaBegin(request);
+  xSemaphoreGive(otaLock);
+}
+
+int otaChunkStart(AsyncWebServerRequest *request, size_t total) {
+  if (!ota.active) return OTA_CHUNK_NO_SESSION;
+  if (!request->hasArg("offset") || !otaParseSha256(request->arg("sha256"), ota.chunkSha256)) {
+    return OTA_CHUNK_BAD_REQUEST;
+  }
+  if ((uint32_t)request->arg("offset").toInt() != ota.offset) return OTA_CHUNK_OFFSET;
+  // Full chunks only, except the last; anything else could leave the offset off a sector boundary
+  if (total > ota.chunkBytes || ota.offset + total > ota.size ||
+      (total % FLASH_SECTOR_BYTES != 0 && ota.offset + total != ota.size)) {
+    return OTA_CHUNK_BAD_REQUEST;
+  }
+  ota.chunkLen = total;
+  ota.erasedTo = ota.offset;
+  mbedtls_sha256_starts_ret(&ota.chunkHash, 0);
+  return OTA_CHUNK_RECEIVING;
+}
+
+int otaChunkFinish() {
+  uint8_t digest[32];
+  char hex[65];
+  mbedtls_sha256_finish_ret(&ota.chunkHash, digest);
+  otaHex(digest, hex);
+  if (strcmp(hex, ota.chunkSha256) != 0) return OTA_CHUNK_HASH;
+  ota.offset += ota.chunkLen;
+  ota.chunks++;
+  otaSaveProgress();
+  return OTA_CHUNK_OK;
+}
+
+// Erase the sectors this piece reaches, then write it (under otaLock)
+int otaChunkWrite(uint32_t at, uint8_t *data, size_t len) {
+  while (ota.erasedTo < at + len) {
+    if (esp_partition_erase_range(ota.partition, ota.erasedTo, FLASH_SECTOR_BYTES) != ESP_OK) return OTA_CHUNK_FLASH;
+    ota.erasedTo += FLASH_SECTOR_BYTES;
+  }
+  if (esp_partition_write(ota.partition, at, data, len) != ESP_OK) return OTA_CHUNK_FLASH;
+  mbedtls_sha256_update_ret(&ota.chunkHash, data, len);
+  return OTA_CHUNK_RECEIVING;
+}
+
+// POST /ota/chunk?offset=N&sha256=<hex>, raw body (AsyncTCP task)
+void otaChunkBody(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+  TRACE_SCOPE("ota.chunk");
+  xSemaphoreTake(otaLock, portMAX_DELAY);
+  if (index == 0) {
+    otaChunkOwner = request;      // A new chunk supersedes one whose client went away
+    ota.chunkResult = otaChunkStart(request, total);
+  }
+  if (request == otaChunkOwner && ota.chunkResult == OTA_CHUNK_RECEIVING) {
+    ota.chunkResult = otaChunkWrite(ota.offset + index, data, len);
+    if (ota.chunkResult == OTA_CHUNK_RECEIVING && index + len == total) ota.chunkResult = otaChunkFinish();
+  }
+  xSemaphoreGive(otaLock);
+}
+
+// Under otaLock
+void otaChunkReply(AsyncWebServerRequest *request) {
+  if (request != otaChunkOwner) {
+    request->send(request->contentLength() ? 409 : 400, "text/plain",
+                  request->contentLength() ? "Superseded by another chunk" : "Chunk body required");
+    return;
+  }
+  otaChunkOwner = NULL;
+  int result = ota.chunkResult;
+  if (result != OTA_CHUNK_OK) {
+    ota.retries++;
+    snprintf(otaLastError, sizeof(otaLastError), "chunk at %lu: %s", (unsigned long)ota.offset,
+             OTA_CHUNK_RESULT_NAMES[result]);
+  }
+  char json[160];
+  snprintf(json, sizeof(json), "{\"result\":\"%s\",\"offset\":%lu,\"size\":%lu}", OTA_CHUNK_RESULT_NAMES[result],
+           (unsigned long)ota.offset, (unsigned long)ota.size);
+  request->send(OTA_CHUNK_RESULT_STATUS[result], "application/json", json);
+}
+
+void handleOtaChunk(AsyncWebServerRequest *request) {
+  xSemaphoreTake(otaLock, portMAX_DELAY);
+  otaChunkReply(request);
+  xSemaphoreGive(otaLock);
+}
+
+// POST /ota/finish: start checking the whole image; poll GET /ota for the result
+void handleOtaFinish(AsyncWebServerRequest *request) {
+  xSemaphoreTake(otaLock, portMAX_DELAY);
+  if (!ota.active) {
+    request->send(404, "text/plain", "No upload in progress");
+  } else if (ota.offset != ota.size) {
+    sendOtaJson(request, 409);
+  } else {
+    if (!ota.verifying) {
+      mbedtls_sha256_init(&ota.verifyHash);
+      mbedtls_sha256_starts_ret(&ota.verifyHash, 0);
+      ota.verified = 0;
+      ota.verifying = true;
+      logLine("OTA: verifying %lu byte image", (unsigned long)ota.size);
+    }
+    sendOtaJson(request, 202);
+  }
+  xSemaphoreGive(otaLock);
+}
+
+// Hash the next block of the image; once all of it is in, boot it or discard
+// it (loop task, under otaLock)
+void otaVerifyStep() {
+  TRACE_SCOPE("ota.verify");
+  uint8_t buf[512];
+  uint32_t end = min(ota.verified + OTA_VERIFY_BLOCK, ota.size);
+  bool readOk = true;
+  while (ota.verified < end && readOk) {
+    size_t n = min((uint32_t)sizeof(buf), end - ota.verified);
+    readOk = esp_partition_read(ota.partition, ota.verified, buf, n) == ESP_OK;
+    mbedtls_sha256_update_ret(&ota.verifyHash, buf, n);
+    ota.verified += n;
+  }
+  if (readOk && ota.verified < ota.size) return;
+
+  uint8_t digest[32];
+  char hex[65];
+  mbedtls_sha256_finish_ret(&ota.verifyHash, digest);
+  otaHex(digest, hex);
+  if (!readOk || strcmp(hex, ota.sha256) != 0) {
+    otaDiscardLocked(readOk ? "image hash mismatch" : "partition read failed");
+    return;
+  }
+  mbedtls_sha256_free(&ota.verifyHash);
+  ota.verifying = false;
+  esp_err_t err = esp_ota_set_boot_partition(ota.partition);
+  if (err != ESP_OK) {
+    char why[40];
+    snprintf(why, sizeof(why), "image rejected (error 0x%x)", err);
+    otaDiscardLocked(why);
+    return;
+  }
+  logLine("OTA: %lu byte image verified, booting %s", (unsigned long)ota.size, ota.partition->label);
+  ota.active = false;
+  otaSaveProgress();
+  otaRestartAtMs = millis() + OTA_RESTART_DELAY_MS;
+  if (otaRestartAtMs == 0) otaRestartAtMs = 1;
+}
+
+// Loop task: check a finished upload, then restart into it once the status
+// has had time to go out. Skips the pass rather than wait while a chunk holds
+// the lock.
+void otaService() {
+  if (xSemaphoreTake(otaLock, 0) != pdTRUE) return;
+  if (ota.verifying) otaVerifyStep();
+  bool restart = otaRestartAtMs != 0 && (long)(millis() - otaRestartAtMs) >= 0;
+  xSemaphoreGive(otaLock);
+  if (!restart) return;
+  writeOutput(GPO1_PIN, LOW);
+  writeOutput(GPO2_PIN, LOW);
+  flashFlushPending();
+  ESP.restart();
+}
+
+// ========== DEVICE SNAPSHOT ==========
+// One text file with everything needed to clone or diagnose a unit. It holds
+// each NVS namespace (settings and calibration, output wear, flash wear) as
+// typed key/value lines, then every fault capture as hex. Sections are
+// framed by "@section" / "@end" lines. The end line carries the line count
+// and CRC-32 (zlib) of the section body, and a versioned header comes first:
+//
+//   GROUTPUMP-SNAPSHOT 1
+//   # built Oct 18 2026 09:12:44, uptime 5402 s, running app0
+//   @section config nvs groutpump
+//   u32 cycleTimeout 30000
+//   str ssid Site%20WiFi
+//   sec password redacted
+//   @end config lines=41 crc32=5a1c03e2
+//   @section capture-7 file /captures/7.bin
+//   4652454301000000...
+//   @end capture-7 lines=134 crc32=0b9d44f1
+//   @snapshot end sections=5
+//
+// GET /snapshot streams it one line at a time. POST /snapshot streams an
+// archive into /snapshot.tmp and checks each section as it arrives. Only the
+// lines of the sections being restored are kept. Nothing is applied unless
+// the whole archive checks out. Then the file becomes /snapshot.pending, and
+// the loop clears and rewrites each namespace from it and restarts. If power
+// is cut part-way, the file stays in place and is applied again once the
+// filesystem mounts on the next boot. Flash wear belongs to the chip and is
+// never restored.
+//
+// GET /snapshot needs no login, so secrets (the WiFi password) go out as a
+// "sec" line without their value unless ?secrets=1 asks for them. Restoring
+// a "sec" line keeps the key's current value on the unit.
+const int SNAPSHOT_VERSION = 1;
+const char* const SNAPSHOT_MAGIC = "GROUTPUMP-SNAPSHOT";
+const char* const SNAPSHOT_STAGING_PATH = "/snapshot.tmp";
+const char* const SNAPSHOT_PENDING_PATH = "/snapshot.pending";
+const size_t SNAPSHOT_STR_MAX = 100;            // Longest NVS string exported (the webhook URL is 96)
+const size_t SNAPSHOT_LINE_MAX = 352;           // Namespace, type, key and a fully escaped string
+const size_t SNAPSHOT_HEX_BYTES = 64;           // Capture bytes per line
+const unsigned long SNAPSHOT_RESTART_DELAY_MS = 1000;  // Lets the POST reply go out first
+
+struct SnapshotNvsSection {
+  const char* name;
+  const char* ns;
+  bool restorable;
+};
+
+const SnapshotNvsSection SNAPSHOT_NVS_SECTIONS[] = {
+  {"config",     "groutpump",  true},   // WiFi, timing, simulation, pressure calibration, alarms, debounce
+  {"outputwear", "outputwear", true},   // SSR/valve totals, ratings and valve baselines
+  {"flashwear",  "flashwear",  false},  // This chip's flash endurance
+};
+const int SNAPSHOT_NVS_SECTION_COUNT = sizeof(SNAPSHOT_NVS_SECTIONS) / sizeof(SNAPSHOT_NVS_SECTIONS[0]);
+
+// String keys exported only with ?secrets=1
+const char* const SNAPSHOT_SECRET_KEYS[] = {"password"};
+
+bool snapshotSecret(const char* key) {
+  for (const char* k : SNAPSHOT_SECRET_KEYS) {
+    if (strcmp(k, key) == 0) return true;
+  }
+  return false;
+}
+
+// zlib-compatible CRC-32, bitwise: snapshots are small and this needs no table
+uint32_t snapshotCrc(uint32_t crc, const char* data, size_t len) {
+  crc = ~crc;
+  while (len--) {
+    crc ^= (uint8_t)*data++;
+    for (int k = 0; k < 8; k++) crc = (crc >> 1) ^ (0xEDB88320UL & (0 - (crc & 1)));
+  }
+  return ~crc;
+}
+
+// Spaces, control bytes, non-ASCII and '%' become %XX
+size_t snapshotEscape(const char* in, char* out, size_t cap) {
+  size_t len = 0;
+  for (; *in && len + 4 < cap; in++) {
+    uint8_t c = *in;
+    if (c <= ' ' || c >= 0x7f || c == '%') len += snprintf(out + len, cap - len, "%%%02X", c);
+    else out[len++] = c;
+  }
+  out[len] = '\0';
+  return len;
+}
+
+bool snapshotUnescape(const char* in, char* out, size_t cap) {
+  size_t len = 0;
+  while (*in) {
+    if (len + 1 >= cap) return false;
+    if (*in == '%') {
+      if (!isxdigit(in[1]) || !isxdigit(in[2])) return false;
+      char hex[3] = {in[1], in[2], '\0'};
+      out[len++] = (char)strtoul(hex, NULL, 16);
+      in += 3;
+    } else {
+      out[len++] = *in++;
+    }
+  }
+  out[len] = '\0';
+  return true;
+}
+
+// ---- Export ----
+enum SnapshotExportStage {
+  SNAP_HEADER,
+  SNAP_NVS_BEGIN,
+  SNAP_NVS_BODY,
+  SNAP_CAPTURES_BEGIN,
+  SNAP_CAPTURE_NEXT,
+  SNAP_CAPTURE_BODY,
+  SNAP_SECTION_END,
+  SNAP_FOOTER,
+  SNAP_DONE
+};
+
+struct SnapshotExport {
+  bool active;
+  bool captures;
+  bool secrets;
+  int stage;
+  int afterSection;             // Stage to continue with once the section is closed
+  int section;                  // Index into SNAPSHOT_NVS_SECTIONS
+  uint16_t sections;            // Sections written
+  uint32_t lines;               // Current section
+  uint32_t crc;
+  char name[24];
+  nvs_handle_t nvs;
+  bool nvsOpen;
+  nvs_iterator_t it;
+  File dir;
+  File file;
+  char line[SNAPSHOT_LINE_MAX];
+  size_t lineLen;
+  size_t lineOff;
+  ChunkedExport stream;
+};
+
+SnapshotExport snapshotExport;
+
+void snapshotExportClose() {
+  SnapshotExport& x = snapshotExport;
+  if (x.it) nvs_release_iterator(x.it);
+  x.it = NULL;
+  if (x.nvsOpen) nvs_close(x.nvs);
+  x.nvsOpen = false;
+  if (x.file) x.file.close();
+  if (x.dir) x.dir.close();
+  x.active = false;
+}
+
+// A section body line: counted and added to the section CRC
+void snapshotExportBody(SnapshotExport& x) {
+  x.lines++;
+  x.crc = snapshotCrc(x.crc, x.line, x.lineLen);
+}
+
+// Format the next NVS entry of the open section; false when there are no more
+bool snapshotExportNvsLine(SnapshotExport& x) {
+  while (x.it) {
+    nvs_entry_info_t info;
+    nvs_entry_info(x.it, &info);
+    x.it = nvs_entry_next(x.it);
+    size_t cap = sizeof(x.line);
+    if (info.type == NVS_TYPE_U8) {
+      uint8_t v;
+      if (nvs_get_u8(x.nvs, info.key, &v) != ESP_OK) continue;
+      x.lineLen = snprintf(x.line, cap, "u8 %s %u\n", info.key, (unsigned)v);
+    } else if (info.type == NVS_TYPE_I32) {
+      int32_t v;
+      if (nvs_get_i32(x.nvs, info.key, &v) != ESP_OK) continue;
+      x.lineLen = snprintf(x.line, cap, "i32 %s %ld\n", info.key, (long)v);
+    } else if (info.type == NVS_TYPE_U32) {
+      uint32_t v;
+      if (nvs_get_u32(x.nvs, info.key, &v) != ESP_OK) continue;
+      x.lineLen = snprintf(x.line, cap, "u32 %s %lu\n", info.key, (unsigned long)v);
+    } else if (info.type == NVS_TYPE_STR) {
+      char v[SNAPSHOT_STR_MAX + 1];
+      size_t n = sizeof(v);
+      if (nvs_get_str(x.nvs, info.key, v, &n) != ESP_OK) continue;
+      if (!x.secrets && snapshotSecret(info.key)) {
+        x.lineLen = snprintf(x.line, cap, "sec %s redacted\n", info.key);
+        snapshotExportBody(x);
+        return true;
+      }
+      x.lineLen = snprintf(x.line, cap, "str %s ", info.key);
+      x.lineLen += snapshotEscape(v, x.line + x.lineLen, cap - x.lineLen - 1);
+      x.line[x.lineLen++] = '\n';
+    } else {
+      continue;  // This firmware writes no other types
+    }
+    snapshotExportBody(x);
+    return true;
+  }
+  return false;
+}
+
+// Produce the next whole line into x.line. Returns false at the end.
+bool snapshotExportLine(SnapshotExport& x) {
+  size_t cap = sizeof(x.line);
+  x.lineOff = 0;
+  x.lineLen = 0;
+  while (x.lineLen == 0) {
+    switch (x.stage) {
+      case SNAP_HEADER: {
+        const esp_partition_t* running = esp_ota_get_running_partition();
+        x.lineLen = snprintf(x.line, cap, "%s %d\n# built %s %s, uptime %lu s, running %s%s%s\n",
+                             SNAPSHOT_MAGIC, SNAPSHOT_VERSION, __DATE__, __TIME__, millis() / 1000,
+                             running ? running->label : "?", x.captures ? "" : ", captures omitted",
+                             x.secrets ? ", secrets included" : "");
+        x.stage = SNAP_NVS_BEGIN;
+        x.section = 0;
+        break;
+      }
+      case SNAP_NVS_BEGIN: {
+        if (x.section == SNAPSHOT_NVS_SECTION_COUNT) {
+          x.stage = SNAP_CAPTURES_BEGIN;
+          break;
+        }
+        const SnapshotNvsSection& s = SNAPSHOT_NVS_SECTIONS[x.section];
+        // A namespace never written yet still gets an (empty) section
+        x.nvsOpen = nvs_open(s.ns, NVS_READONLY, &x.nvs) == ESP_OK;
+        x.it = x.nvsOpen ? nvs_entry_find("nvs", s.ns, NVS_TYPE_ANY) : NULL;
+        strlcpy(x.name, s.name, sizeof(x.name));
+        x.lines = 0;
+        x.crc = 0;
+        x.lineLen = snprintf(x.line, cap, "@section %s nvs %s\n", s.name, s.ns);
+        x.stage = SNAP_NVS_BODY;
+        break;
+      }
+      case SNAP_NVS_BODY:
+        if (snapshotExportNvsLine(x)) break;
+        if (x.nvsOpen) nvs_close(x.nvs);
+        x.nvsOpen = false;
+        x.section++;
+        x.stage = SNAP_SECTION_END;
+        x.afterSection = SNAP_NVS_BEGIN;
+        break;
+      case SNAP_CAPTURES_BEGIN:
+        x.stage = SNAP_FOOTER;
+        if (x.captures && fsReady()) {
+          x.dir = LittleFS.open(RECORDER_DIR);
+          if (x.dir && x.dir.isDirectory()) x.stage = SNAP_CAPTURE_NEXT;
+        }
+        break;
+      case SNAP_CAPTURE_NEXT:
+        x.file = x.dir.openNextFile();
+        if (!x.file) {
+          x.dir.close();
+          x.stage = SNAP_FOOTER;
+          break;
+        }
+        snprintf(x.name, sizeof(x.name), "capture-%lu", strtoul(x.file.name(), NULL, 10));
+        x.lines = 0;
+        x.crc = 0;
+        x.lineLen = snprintf(x.line, cap, "@section %s file %s/%s\n", x.name, RECORDER_DIR, x.file.name());
+        x.stage = SNAP_CAPTURE_BODY;
+        break;
+      case SNAP_CAPTURE_BODY: {
+        uint8_t buf[SNAPSHOT_HEX_BYTES];
+        size_t n = x.file.read(buf, sizeof(buf));
+        if (n == 0) {
+          x.file.close();
+          x.stage = SNAP_SECTION_END;
+          x.afterSection = SNAP_CAPTURE_NEXT;
+          break;
+        }
+        for (size_t i = 0; i < n; i++) snprintf(x.line + i * 2, 3, "%02x", buf[i]);
+        x.lineLen = n * 2;
+        x.line[x.lineLen++] = '\n';
+        snapshotExportBody(x);
+        break;
+      }
+      case SNAP_SECTION_END:
+        x.lineLen = snprintf(x.line, cap, "@end %s lines=%lu crc32=%08lx\n", x.name,
+                             (unsigned long)x.lines, (unsigned long)x.crc);
+        x.sections++;
+        x.stage = x.afterSection;
+        break;
+      case SNAP_FOOTER:
+        x.lineLen = snprintf(x.line, cap, "@snapshot end sections=%u\n", x.sections);
+        x.stage = SNAP_DONE;
+        break;
+      default:
+        return false;
+    }
+  }
+  return true;
+}
+
+// Next piece of the current line, refilling it when used up
+size_t snapshotExportNext(char* out, size_t cap) {
+  SnapshotExport& x = snapshotExport;
+  if (x.lineOff == x.lineLen && !snapshotExportLine(x)) return 0;
+  size_t n = min(cap - 1, x.lineLen - x.lineOff);
+  memcpy(out, x.line + x.lineOff, n);
+  x.lineOff += n;
+  return n;
+}
+
+size_t snapshotExportFill(uint8_t* buffer, size_t maxLen, size_t index) {
+  size_t written = chunkedExportFill(snapshotExport.stream, buffer, maxLen);
+  if (written == 0) snapshotExportClose();
+  return written;
+}
+
+// GET /snapshot[?captures=0][&secrets=1]
+void handleSnapshotDownload(AsyncWebServerRequest *request) {
+  SnapshotExport& x = snapshotExport;
+  if (x.active) {
+    request->send(409, "text/plain", "Snapshot export already in progress");
+    return;
+  }
+  x.active = true;
+  x.captures = request->arg("captures") != "0";
+  x.secrets = request->arg("secrets") == "1";
+  if (x.secrets) logLine("SNAPSHOT: export includes secrets");
+  x.stage = SNAP_HEADER;
+  x.sections = 0;
+  x.lineLen = x.lineOff = 0;
+  chunkedExportBegin(x.stream, snapshotExportNext);
+
+  AsyncWebServerResponse *response = request->beginChunkedResponse("text/plain", snapshotExportFill);
+  response->addHeader("Content-Disposition", "attachment; filename=\"groutpump-snapshot.txt\"");
+  request->onDisconnect([]() { if (snapshotExport.active) snapshotExportClose(); });
+  request->send(response);
+}
+
+// ---- Restore ----
+enum SnapshotRestoreState {
+  SNAPR_HEADER,
+  SNAPR_BETWEEN,                // Between sections
+  SNAPR_SECTION,
+  SNAPR_DONE,                   // Footer seen
+  SNAPR_ERROR
+};
+
+struct SnapshotRestore {
+  int state;
+  uint8_t select;               // Bit per SNAPSHOT_NVS_SECTIONS entry to restore
+  bool keepWifi;
+  int section;                  // NVS section being restored, -1 = checked only
+  char name[24];
+  uint32_t lines;
+  uint32_t crc;
+  uint16_t sections;
+  uint16_t restored;
+  uint32_t keys;
+  uint16_t kept;                // Redacted keys that kept this unit's value
+  File staging;
+  char line[SNAPSHOT_LINE_MAX];
+  size_t lineLen;
+  char error[64];
+};
+
+SnapshotRestore snapshotRestore;
+AsyncWebServerRequest* snapshotRestoreOwner = NULL;  // Only compared, never dereferenced
+unsigned long snapshotApplyAtMs = 0;                 // Set by a good restore, applied in snapshotService()
+bool snapshotBootCheck = true;                       // Look for a restore cut short by a power loss
+
+void snapshotRestoreFail(SnapshotRestore& r, const char* why) {
+  if (r.state == SNAPR_ERROR) return;
+  snprintf(r.error, sizeof(r.error), "line %lu of %s: %s", (unsigned long)r.lines,
+           r.state == SNAPR_SECTION ? r.name : "archive", why);
+  r.state = SNAPR_ERROR;
+}
+
+void snapshotStage(SnapshotRestore& r, const char* ns, const char* type, const char* key, const char* value) {
+  char line[SNAPSHOT_LINE_MAX];
+  size_t len = snprintf(line, sizeof(line), "%s %s %s %s\n", ns, type, key, value);
+  if (len >= sizeof(line) || r.staging.write((const uint8_t*)line, len) != len) {
+    snapshotRestoreFail(r, "staging write failed");
+    return;
+  }
+  r.keys++;
+}
+
+// A key/value line of a section being restored
+void snapshotRestoreKey(SnapshotRestore& r, const char* text) {
+  const SnapshotNvsSection& s = SNAPSHOT_NVS_SECTIONS[r.section];
+  char type[4], key[16];
+  int off = 0;
+  if (sscanf(text, "%3s %15s %n", type, key, &off) < 2 || off == 0) {
+    snapshotRestoreFail(r, "expected: type key value");
+    return;
+  }
+  const char* value = text + off;
+  char* end;
+  if (strcmp(type, "str") == 0) {
+    char raw[SNAPSHOT_STR_MAX + 1];
+    if (!snapshotUnescape(value, raw, sizeof(raw))) {
+      snapshotRestoreFail(r, "bad string");
+      return;
+    }
+    // Keeping this unit's WiFi: its own credentials were staged with the section
+    if (r.keepWifi && r.section == 0 && (strcmp(key, "ssid") == 0 || strcmp(key, "password") == 0)) return;
+  } else if (strcmp(type, "sec") == 0) {
+    // Redacted on export: keep whatever this unit has now
+    if (r.keepWifi && r.section == 0 && strcmp(key, "password") == 0) return;
+    char raw[SNAPSHOT_STR_MAX + 1];
+    char esc[SNAPSHOT_STR_MAX * 3 + 1];
+    nvs_handle_t h;
+    if (nvs_open(s.ns, NVS_READONLY, &h) != ESP_OK) return;
+    size_t n = sizeof(raw);
+    esp_err_t err = nvs_get_str(h, key, raw, &n);
+    nvs_close(h);
+    if (err != ESP_OK) return;   // Not set here either
+    snapshotEscape(raw, esc, sizeof(esc));
+    snapshotStage(r, s.ns, "str", key, esc);
+    r.kept++;
+    return;
+  } else if (strcmp(type, "u8") == 0 || strcmp(type, "u32") == 0 || strcmp(type, "i32") == 0) {
+    strtol(value, &end, 10);
+    if (end == value || *end != '\0') {
+      snapshotRestoreFail(r, "bad number");
+      return;
+    }
+  } else {
+    snapshotRestoreFail(r, "unknown type");
+    return;
+  }
+  snapshotStage(r, s.ns, type, key, value);
+}
+
+void snapshotRestoreLine(SnapshotRestore& r) {
+  const char* text = r.line;
+  if (r.state == SNAPR_HEADER) {
+    size_t magic = strlen(SNAPSHOT_MAGIC);
+    if (strncmp(text, SNAPSHOT_MAGIC, magic) != 0 || text[magic] != ' ') {
+      snapshotRestoreFail(r, "not a snapshot");
+      return;
+    }
+    if (atoi(text + magic + 1) > SNAPSHOT_VERSION) {
+      snapshotRestoreFail(r, "snapshot version is newer than this firmware");
+      return;
+    }
+    r.state = SNAPR_BETWEEN;
+    return;
+  }
+
+  if (r.state == SNAPR_SECTION) {
+    if (strncmp(text, "@end ", 5) != 0) {
+      r.lines++;
+      r.crc = snapshotCrc(r.crc, text, strlen(text));
+      r.crc = snapshotCrc(r.crc, "\n", 1);
+      if (r.section >= 0) snapshotRestoreKey(r, text);
+      return;
+    }
+    char name[24];
+    unsigned long lines, crc;
+    if (sscanf(text, "@end %23s lines=%lu crc32=%lx", name, &lines, &crc) != 3 || strcmp(name, r.name) != 0) {
+      snapshotRestoreFail(r, "bad section end");
+    } else if (lines != r.lines) {
+      snapshotRestoreFail(r, "line count mismatch");
+    } else if (crc != r.crc) {
+      snapshotRestoreFail(r, "checksum mismatch");
+    } else {
+      r.sections++;
+      if (r.section >= 0) r.restored |= 1 << r.section;
+      r.state = SNAPR_BETWEEN;
+    }
+    return;
+  }
+
+  if (r.state == SNAPR_DONE) {
+    if (text[0]) snapshotRestoreFail(r, "data after the end marker");
+    return;
+  }
+
+  // Between sections
+  if (text[0] == '\0' || text[0] == '#') return;
+  unsigned sections;
+  if (sscanf(text, "@snapshot end sections=%u", &sections) == 1) {
+    if (sections != r.sections) snapshotRestoreFail(r, "section count mismatch");
+    else r.state = SNAPR_DONE;
+    return;
+  }
+  char kind[8], arg[40];
+  if (sscanf(text, "@section %23s %7s %39s", r.name, kind, arg) != 3) {
+    snapshotRestoreFail(r, "expected a section");
+    return;
+  }
+  r.state = SNAPR_SECTION;
+  r.lines = 0;
+  r.crc = 0;
+  r.section = -1;
+  if (strcmp(kind, "nvs") != 0) return;
+  for (int i = 0; i < SNAPSHOT_NVS_SECTION_COUNT; i++) {
+    const SnapshotNvsSection& s = SNAPSHOT_NVS_SECTIONS[i];
+    if (strcmp(r.name, s.name) != 0 || strcmp(arg, s.ns) != 0 || !(r.select & (1 << i))) continue;
+    r.section = i;
+    if (i == 0 && r.keepWifi) {
+      char esc[SNAPSHOT_STR_MAX * 3 + 1];
+      snapshotEscape(wifiSSID.c_str(), esc, sizeof(esc));
+      snapshotStage(r, s.ns, "str", "ssid", esc);
+      snapshotEscape(wifiPassword.c_str(), esc, sizeof(esc));
+      snapshotStage(r, s.ns, "str", "password", esc);
+    }
+  }
+}
+
+// First body piece: parse the options and open the staging file
+void snapshotRestoreBegin(AsyncWebServerRequest *request) {
+  SnapshotRestore& r = snapshotRestore;
+  if (r.staging) r.staging.close();   // From a client that went away
+  memset(r.error, 0, sizeof(r.error));
+  r.state = SNAPR_HEADER;
+  r.lineLen = 0;
+  r.lines = 0;
+  r.sections = r.restored = 0;
+  r.keys = 0;
+  r.kept = 0;
+  r.keepWifi = request->arg("keepWifi") == "1";
+  r.select = 0;
+  String list = request->hasArg("sections") ? request->arg("sections") : String("config");
+  for (int i = 0; i < SNAPSHOT_NVS_SECTION_COUNT; i++) {
+    const SnapshotNvsSection& s = SNAPSHOT_NVS_SECTIONS[i];
+    if (s.restorable && (String(",") + list + ",").indexOf(String(",") + s.name + ",") >= 0) r.select |= 1 << i;
+  }
+  if (r.select == 0) {
+    snapshotRestoreFail(r, "sections must list config and/or outputwear");
+  } else if (!fsReady()) {
+    snapshotRestoreFail(r, "filesystem not ready");
+  } else if (snapshotApplyAtMs) {
+    snapshotRestoreFail(r, "a restore is already being applied");
+  } else {
+    r.staging = LittleFS.open(SNAPSHOT_STAGING_PATH, "w");
+    if (!r.staging) snapshotRestoreFail(r, "can't create the staging file");
+  }
+}
+
+void snapshotRestoreEnd() {
+  SnapshotRestore& r = snapshotRestore;
+  if (r.lineLen > 0 && r.state != SNAPR_ERROR) {    // Last line without a newline
+    r.line[r.lineLen] = '\0';
+    snapshotRestoreLine(r);
+  }
+  if (r.state != SNAPR_DONE) snapshotRestoreFail(r, "archive incomplete");
+  if (!r.staging) return;
+  size_t bytes = r.staging.size();
+  r.staging.close();
+  if (r.state == SNAPR_DONE) {
+    LittleFS.remove(SNAPSHOT_PENDING_PATH);
+    if (LittleFS.rename(SNAPSHOT_STAGING_PATH, SNAPSHOT_PENDING_PATH)) {
+      flashAccountFs(FLASH_SNAPSHOT, bytes);
+      snapshotApplyAtMs = millis() + SNAPSHOT_RESTART_DELAY_MS;
+      if (snapshotApplyAtMs == 0) snapshotApplyAtMs = 1;
+      return;
+    }
+    snapshotRestoreFail(r, "can't commit the staging file");
+  }
+  LittleFS.remove(SNAPSHOT_STAGING_PATH);
+}
+
+// POST /snapshot[?sections=config,outputwear][&keepWifi=1], raw body (AsyncTCP task)
+void snapshotRestoreBody(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+  SnapshotRestore& r = snapshotRestore;
+  if (index == 0) {
+    snapshotRestoreOwner = request;   // A new upload supersedes one whose client went away
+    snapshotRestoreBegin(request);
+  }
+  if (request != snapshotRestoreOwner) return;
+  for (size_t i = 0; i < len && r.state != SNAPR_ERROR; i++) {
+    char c = data[i];
+    if (c == '\n') {
+      r.line[r.lineLen] = '\0';
+      r.lineLen = 0;
+      snapshotRestoreLine(r);
+    } else if (c == '\r') {
+      continue;
+    } else if (r.lineLen < sizeof(r.line) - 1) {
+      r.line[r.lineLen++] = c;
+    } else {
+      snapshotRestoreFail(r, "line too long");
+    }
+  }
+  if (index + len == total) snapshotRestoreEnd();
+}
+
+void handleSnapshotRestore(AsyncWebServerRequest *request) {
+  SnapshotRestore& r = snapshotRestore;
+  if (request != snapshotRestoreOwner) {
+    request->send(request->contentLength() ? 409 : 400, "text/plain",
+                  request->contentLength() ? "Superseded by another restore" : "Snapshot body required");
+    return;
+  }
+  snapshotRestoreOwner = NULL;
+  if (r.state != SNAPR_DONE) {
+    if (r.staging) {
+      r.staging.close();
+      LittleFS.remove(SNAPSHOT_STAGING_PATH);
+    }
+    logLine("SNAPSHOT: restore rejected, %s", r.error);
+    request->send(r.state == SNAPR_ERROR && !fsReady() ? 503 : 400, "text/plain", r.error);
+    return;
+  }
+  StaticJsonDocument<256> doc;
+  doc["sections"] = r.sections;
+  JsonArray arr = doc.createNestedArray("restored");
+  for (int i = 0; i < SNAPSHOT_NVS_SECTION_COUNT; i++) {
+    if (r.restored & (1 << i)) arr.add(SNAPSHOT_NVS_SECTIONS[i].name);
+  }
+  doc["keys"] = r.keys;
+  doc["keepWifi"] = r.keepWifi;
+  doc["keptRedacted"] = r.kept;
+  doc["restarting"] = true;
+  char json[256];
+  serializeJson(doc, json, sizeof(json));
+  logLine("SNAPSHOT: %lu keys staged from %u sections, applying", (unsigned long)r.keys, r.sections);
+  request->send(200, "application/json", json);
+}
+
+// Rewrite each namespace named in the pending file, then restart (loop task)
+void snapshotApply() {
+  File f = LittleFS.open(SNAPSHOT_PENDING_PATH, "r");
+  if (!f) return;
+  flashFlushPending();  // Save RAM state first, so the restore overwrites it and not the reverse
+  xSemaphoreTake(flashLock, portMAX_DELAY);
+  char line[SNAPSHOT_LINE_MAX];
+  char ns[16] = "";
+  uint32_t keys = 0;
+  size_t n;
+  while ((n = f.readBytesUntil('\n', line, sizeof(line) - 1)) > 0) {
+    line[n] = '\0';
+    char lineNs[16], type[4], key[16];
+    int off = 0;
+    if (sscanf(line, "%15s %3s %15s %n", lineNs, type, key, &off) < 3 || off == 0) continue;
+    if (strcmp(lineNs, ns) != 0) {
+      if (ns[0]) preferences.end();
+      strlcpy(ns, lineNs, sizeof(ns));
+      preferences.begin(ns, false);
+      preferences.clear();
+    }
+    FlashSubsystem s = strcmp(ns, "outputwear") == 0 ? FLASH_OUTPUT_WEAR : FLASH_SETTINGS;
+    const char* value = line + off;
+    if (strcmp(type, "u32") == 0) {
+      nvsPutULong(s, key, strtoul(value, NULL, 10));
+    } else if (strcmp(type, "i32") == 0) {
+      nvsPutInt(s, key, strtol(value, NULL, 10));
+    } else if (strcmp(type, "u8") == 0) {
+      nvsPutBool(s, key, strtoul(value, NULL, 10) != 0);
+    } else {
+      char raw[SNAPSHOT_STR_MAX + 1];
+      if (!snapshotUnescape(value, raw, sizeof(raw))) continue;
+      nvsPutString(s, key, raw);
+    }
+    keys++;
+  }
+  if (ns[0]) preferences.end();
+  xSemaphoreGive(flashLock);
+  f.close();
+  LittleFS.remove(SNAPSHOT_PENDING_PATH);
+  logLine("SNAPSHOT: restored %lu keys, restarting", (unsigned long)keys);
+  ESP.restart();
+}
+
+// Loop task: apply a staged restore once its reply has gone out, or one left
+// over from a power loss once the filesystem is up
+void snapshotService() {
+  if (snapshotBootCheck && fsState != FS_MOUNTING && fsState != FS_FORMATTING) {
+    snapshotBootCheck = false;
+    if (fsReady() && LittleFS.exists(SNAPSHOT_PENDING_PATH)) {
+      logLine("SNAPSHOT: finishing an interrupted restore");
+      snapshotApply();
+    }
+  }
+  if (snapshotApplyAtMs == 0 || (long)(millis() - snapshotApplyAtMs) < 0) return;
+  snapshotApply();
+  snapshotApplyAtMs = 0;   // Only reached if the pending file vanished
+}
+
+// ========== LATENCY PROBE ==========
+// How stale the dashboard is, end to end. The loop stamps the edge that made
+// it publish (end stop, button, E-stop, trip) and that status frame carries
+// it as "edge"/"edgeTs". Browsers sync to the device clock with ping/pong,
+// time edge -> received -> rendered and send back percentiles every few
+// seconds (protocol in status_publisher.h). GET /diag/latency combines them
+// with the device's own edge -> publish time.
+uint64_t statusEdgeUs = 0;           // Oldest edge not yet published (loop task only)
+const char* statusEdgeSource = NULL;
+
+// Latest report per connected client; all latency state is under statusLock
+struct LatencyClient {
+  uint32_t id;                       // 0 = free slot
+  unsigned long atMs;
+  uint32_t reports;
+  LatencyReport last;
+};
+
+struct LatencyTotals {
+  uint32_t reports;
+  uint32_t samples;
+  uint32_t worstRenderP99Us;
+  uint32_t maxUs;
+  uint32_t publishedFrames;          // Device side: edge -> frame queued
+  uint32_t publishMaxUs;
+  uint64_t publishSumUs;
+};
+
+LatencyClient latencyClients[DEFAULT_MAX_WS_CLIENTS];
+LatencyTotals latencyTotals;
+
+// Loop task. Keeps the first edge when several land before one publish.
+void markStatusEdge(const char* source, uint64_t us) {
+  if (statusEdgeUs) return;
+  statusEdgeUs = us ? us : esp_timer_get_time();
+  statusEdgeSource = source;
+}
+
+void latencyPublished(int64_t us) {
+  if (us < 0) return;
+  latencyTotals.publishedFrames++;
+  latencyTotals.publishSumUs += us;
+  if ((uint64_t)us > latencyTotals.publishMaxUs) latencyTotals.publishMaxUs = (uint32_t)us;
+}
+
+void latencyRecord(uint32_t clientId, const LatencyReport& r) {
+  LatencyClient* slot = NULL;
+  for (int i = 0; i < DEFAULT_MAX_WS_CLIENTS && !slot; i++) {
+    if (latencyClients[i].id == clientId) slot = &latencyClients[i];
+  }
+  for (int i = 0; i < DEFAULT_MAX_WS_CLIENTS && !slot; i++) {
+    if (latencyClients[i].id == 0) slot = &latencyClients[i];
+  }
+  if (!slot) return;
+  if (slot->id != clientId) memset(slot, 0, sizeof(*slot));
+  slot->id = clientId;
+  slot->atMs = millis();
+  slot->reports++;
+  slot->last = r;
+
+  latencyTotals.reports++;
+  latencyTotals.samples += r.samples;
+  if (r.renderUs[2] > latencyTotals.worstRenderP99Us) latencyTotals.worstRenderP99Us = r.renderUs[2];
+  if (r.maxUs > latencyTotals.maxUs) latencyTotals.maxUs = r.maxUs;
+}
+
+void latencyForget(uint32_t clientId) {
+  for (int i = 0; i < DEFAULT_MAX_WS_CLIENTS; i++) {
+    if (latencyClients[i].id == clientId) latencyClients[i].id = 0;
+  }
+}
+
+void latencyReset() {
+  xSemaphoreTake(statusLock, portMAX_DELAY);
+  memset(&latencyTotals, 0, sizeof(latencyTotals));
+  xSemaphoreGive(statusLock);
+}
+
+void addPercentiles(JsonObject o, const char* key, const uint32_t* us) {
+  JsonObject p = o.createNestedObject(key);
+  p["p50"] = us[0] / 1000.0;
+  p["p95"] = us[1] / 1000.0;
+  p["p99"] = us[2] / 1000.0;
+}
+
+// GET /diag/latency (milliseconds). "clients" combines the connected
+// browsers' latest reports: p50 weighted by samples, p95/p99 the worst.
+size_t getLatencyJson(char* out, size_t cap) {
+  xSemaphoreTake(statusLock, portMAX_DELAY);
+  LatencyClient clients[DEFAULT_MAX_WS_CLIENTS];
+  memcpy(clients, latencyClients, sizeof(clients));
+  LatencyTotals totals = latencyTotals;
+  xSemaphoreGive(statusLock);
+
+  StaticJsonDocument<1536> doc;
+  JsonObject dev = doc.createNestedObject("device");
+  dev["frames"] = totals.publishedFrames;
+  dev["edgeToPublishAvg"] = totals.publishedFrames ? totals.publishSumUs / totals.publishedFrames / 1000.0 : 0;
+  dev["edgeToPublishMax"] = totals.publishMaxUs / 1000.0;
+
+  LatencyReport combined;
+  memset(&combined, 0, sizeof(combined));
+  uint64_t weighted[2] = {0, 0};
+  JsonArray list = doc.createNestedArray("reports");
+  for (int i = 0; i < DEFAULT_MAX_WS_CLIENTS; i++) {
+    const LatencyClient& c = clients[i];
+    if (!c.id) continue;
+    const LatencyReport& r = c.last;
+    JsonObject o = list.createNestedObject();
+    o["client"] = c.id;
+    o["ageS"] = (millis() - c.atMs) / 1000;
+    o["samples"] = r.samples;
+    addPercentiles(o, "received", r.receiveUs);
+    addPercentiles(o, "rendered", r.renderUs);
+    o["max"] = r.maxUs / 1000.0;
+    o["rtt"] = r.rttUs / 1000.0;
+
+    combined.samples += r.samples;
+    weighted[0] += (uint64_t)r.receiveUs[0] * r.samples;
+    weighted[1] += (uint64_t)r.renderUs[0] * r.samples;
+    for (int k = 1; k < 3; k++) {
+      combined.receiveUs[k] = max(combined.receiveUs[k], r.receiveUs[k]);
+      combined.renderUs[k] = max(combined.renderUs[k], r.renderUs[k]);
+    }
+    combined.maxUs = max(combined.maxUs, r.maxUs);
+  }
+  if (combined.samples) {
+    combined.receiveUs[0] = weighted[0] / combined.samples;
+    combined.renderUs[0] = weighted[1] / combined.samples;
+  }
+  JsonObject all = doc.createNestedObject("clients");
+  all["samples"] = combined.samples;
+  addPercentiles(all, "received", combined.receiveUs);
+  addPercentiles(all, "rendered", combined.renderUs);
+  all["max"] = combined.maxUs / 1000.0;
+
+  JsonObject life = doc.createNestedObject("sinceReset");
+  life["reports"] = totals.reports;
+  life["samples"] = totals.samples;
+  life["worstRenderedP99"] = totals.worstRenderP99Us / 1000.0;
+  life["max"] = totals.maxUs / 1000.0;
+  return serializeJson(doc, out, cap);
+}
+
+// ========== STATUS PUBLISHING ==========
+// AsyncWebSocket backend for the platform-independent StatusPublisher
+// (status_publisher.h). Tracks per-client topic subscriptions and queues one
+// shared frame buffer to every subscriber.
+//
+// Each frame pool block is backed by an AsyncWebSocketMessageBuffer created
+// once at boot and never registered with the socket, so the library
+// reference-counts it per queued message but never frees it. poll() hands a
+// block back to the pool once the library's count drops to zero.
+//
+// The library's buffer message always sends the buffer's full length, and
+// that length is fixed at the block size. So each client gets a
+// PooledFrameMessage instead. It sends only frame.len bytes of the block and
+// holds the same reference the library's message would.
+const int FRAME_POOL_BLOCKS = 6;
+
+// Frame writers from AsyncWebSocket.cpp (external linkage, not in its header)
+size_t webSocketSendFrameWindow(AsyncClient *client);
+size_t webSocketSendFrame(AsyncClient *client, bool final, uint8_t opcode, bool mask, uint8_t *data, size_t len);
+
+// AsyncWebSocketMultiMessage's send/ack logic, with the length taken from the
+// frame. The client deletes it once sent, or straight away if its queue is full.
+class PooledFrameMessage : public AsyncWebSocketMessage {
+ public:
+  PooledFrameMessage(AsyncWebSocketMessageBuffer* buffer, size_t len)
+      : buffer_(buffer), len_(len), sent_(0), ack_(0), acked_(0) {
+    _opcode = WS_TEXT;
+    _mask = false;
+    _status = WS_MSG_SENDING;
+    (*buffer_)++;
+  }
+
+  ~PooledFrameMessage() override { (*buffer_)--; }
+
+  void ack(size_t len, uint32_t time) override {
+    acked_ += len;
+    if (sent_ >= len_ && acked_ >= ack_) _status = WS_MSG_SENT;
+  }
+
+  size_t send(AsyncClient *client) override {
+    if (_status != WS_MSG_SENDING || acked_ < ack_) return 0;
+    if (sent_ == len_) {
+      _status = WS_MSG_SENT;
+      return 0;
+    }
+    size_t toSend = min(len_ - sent_, webSocketSendFrameWindow(client));
+    uint8_t opcode = sent_ == 0 ? _opcode : (uint8_t)WS_CONTINUATION;
+    uint8_t* data = buffer_->get() + sent_;
+    sent_ += toSend;
+    ack_ += toSend + (toSend < 126 ? 2 : 4);
+    size_t sent = webSocketSendFrame(client, sent_ == len_, opcode, false, data, toSend);
+    if (toSend && sent != toSend) {  // Partly refused: retry the rest later
+      sent_ -= toSend - sent;
+      ack_ -= toSend - sent;
+    }
+    return sent;
+  }
+
+ private:
+  AsyncWebSocketMessageBuffer* buffer_;
+  size_t len_;
+  size_t sent_;
+  size_t ack_;
+  size_t acked_;
+};
+
+class AsyncWsTransport : public StatusTransport {
+ public:
+  AsyncWsTransport(AsyncWebSocket& socket, FramePool& pool) : skippedSends(0), socket_(socket), pool_(pool) {
+    for (int i = 0; i < FRAME_POOL_BLOCKS; i++) {
+      buffers_[i] = NULL;
+      held_[i] = false;
+    }
+  }
+
+  void begin() {
+    for (int i = 0; i < FRAME_POOL_BLOCKS; i++) {
+      buffers_[i] = new AsyncWebSocketMessageBuffer(STATUS_FRAME_CAPACITY);
+      if (!buffers_[i] || !buffers_[i]->get()) break;
+      pool_.addBlock((char*)buffers_[i]->get(), STATUS_FRAME_CAPACITY);
+    }
+  }
+
+  void broadcast(uint32_t topic, Frame& frame) override {
+    TRACE_SCOPE("ws.broadcast");
+    ALLOC_SECTION(ALLOC_STATUS_SEND);
+    for (int i = 0; i < subscriptions.capacity(); i++) {
+      uint32_t id = subscriptions.idAt(i);
+      if (id && subscriptions.wants(id, topic)) queue(id, frame);
+    }
+  }
+
+  void send(uint32_t clientId, Frame& frame) override {
+    TRACE_SCOPE("ws.send");
+    ALLOC_SECTION(ALLOC_STATUS_SEND);
+    queue(clientId, frame);
+  }
+
+  size_t clientCount() override { return socket_.count(); }
+
+  void poll() override {
+    for (int i = 0; i < FRAME_POOL_BLOCKS; i++) {
+      if (held_[i] && buffers_[i]->count() == 0) {
+        held_[i] = false;
+        pool_.release(pool_.frame(i));
+      }
+    }
+  }
+
+  TopicSubscriptions<DEFAULT_MAX_WS_CLIENTS> subscriptions;
+  uint32_t skippedSends;   // Client's message queue was full
+
+ private:
+  void queue(uint32_t clientId, Frame& frame) {
+    AsyncWebSocketClient* client = socket_.client(clientId);
+    if (!client) return;
+    if (client->queueIsFull()) {
+      skippedSends++;
+      return;
+    }
+    int i = pool_.indexOf(&frame);
+    if (!held_[i]) {
+      // First send of this frame: hold one reference for the library until
+      // all of its queued messages are done
+      pool_.retain(&frame);
+      held_[i] = true;
+    }
+    client->message(new PooledFrameMessage(buffers_[i], frame.len));
+  }
+
+  AsyncWebSocket& socket_;
+  FramePool& pool_;
+  AsyncWebSocketMessageBuffer* buffers_[FRAME_POOL_BLOCKS];
+  bool held_[FRAME_POOL_BLOCKS];
+};
+
+Frame frameSlots[FRAME_POOL_BLOCKS];
+FramePool framePool(frameSlots, FRAME_POOL_BLOCKS);
+AsyncWsTransport wsTransport(ws, framePool);
+StatusPublisher statusPublisher(wsTransport, framePool);
+StatusSnapshot statusSnapshot;  // Reused for every publish
+
+void captureStatus(StatusSnapshot& s) {
+  TRACE_SCOPE("status.capture");
+  s.timestampUs = esp_timer_get_time();
+  s.edgeUs = 0;  // Set by notifyClients() for frames an edge caused
+  s.edge = NULL;
+  s.simulation = simEnabled;
+  s.estopActive = isEstopActive;
+  s.mode = (currentMode == MODE_MANUAL ? "MANUAL" : "AUTO");
+
+  if (cycleDirection == CYCLE_IN) s.cycleDirection = "IN";
+  else if (cycleDirection == CYCLE_OUT) s.cycleDirection = "OUT";
+  else s.cycleDirection = "STOPPED";
+
+  s.gpo1 = readOutput(GPO1_PIN);
+  s.gpo2 = readOutput(GPO2_PIN);
+
+  unsigned long now = millis();
+  // Lower the threshold because we update much faster now
+  s.inputA = (now - inputA.lastPressTime < 1000) || (readInput(INPUT_A_PIN) == LOW);
+  s.inputB = (now - inputB.lastPressTime < 1000) || (readInput(INPUT_B_PIN) == LOW);
+  s.inputC = (now - inputC.lastPressTime < 1000) || (readInput(INPUT_C_PIN) == LOW);
+  s.inputD = (now - inputD.lastPressTime < 1000) || (readInput(INPUT_D_PIN) == LOW);
+
+  s.endStopIn = (readInput(ENDSTOP_IN_PIN) == HIGH);
+  s.endStopOut = (readInput(ENDSTOP_OUT_PIN) == HIGH);
+
+  // Cycle Statistics
+  s.lastDuration = lastDuration;
+  s.avgDuration = avgDuration;
+
+  // Output history ordered (Oldest -> Newest) is ideal for graphing
+  uint32_t n = strokeHistory.count();
+  uint32_t window = min(n, (uint32_t)STATUS_HISTORY_LEN);
+  StrokeHistory::Reader reader(strokeHistory, n - window);
+  s.historyCount = 0;
+  uint32_t v;
+  while (reader.next(&v)) s.history[s.historyCount++] = v;
+
+  s.valveSlow = false;
+  for (int d = 0; d < 2; d++) {
+    s.valveResponseUs[d] = lroundf(valveStats[d][VALVE_RESPONSE].ewmaUs);
+    s.valveTravelUs[d] = lroundf(valveStats[d][VALVE_TRAVEL].ewmaUs);
+    if (valveSlow(valveStats[d][VALVE_RESPONSE])) s.valveSlow = true;
+  }
+
+  s.cycleTimeout = cycleTimeout;
+  s.timeoutEnabled = timeoutEnabled;
+  s.wifiConnected = (WiFi.status() == WL_CONNECTED);
+  strlcpy(s.wifiSSID, s.wifiConnected ? wifiSSID.c_str() : "AP Mode", sizeof(s.wifiSSID));
+  strlcpy(s.ipAddress, formatIp(s.wifiConnected ? WiFi.localIP() : WiFi.softAPIP()).c_str(), sizeof(s.ipAddress));
+}
+
+void notifyClients() {
+  if (wsTransport.clientCount() == 0) {
+    statusEdgeUs = 0;
+    return;
+  }
+  TRACE_SCOPE("status.publish");
+  ALLOC_SECTION(ALLOC_STATUS_RENDER);
+  xSemaphoreTake(statusLock, portMAX_DELAY);
+  captureStatus(statusSnapshot);
+  statusSnapshot.edgeUs = statusEdgeUs;
+  statusSnapshot.edge = statusEdgeSource;
+  statusPublisher.publish(statusSnapshot);
+  if (statusEdgeUs) latencyPublished(esp_timer_get_time() - statusEdgeUs);
+  xSemaphoreGive(statusLock);
+  statusEdgeUs = 0;
+}
+
+// Scope topic ("sub:scope"): filtered pressure samples since the last frame,
+// batched every PRESSURE_SCOPE_INTERVAL and rendered only while someone is
+// subscribed. "seq" is the index of the first sample, so gaps are visible.
+unsigned long lastScopePublish = 0;
+uint32_t scopeSent = 0;  // Next pressureScope sample to send
+
+size_t renderScopeFrame(char* out, size_t cap) {
+  uint32_t head = pressureScopeHead;
+  if (head - scopeSent > PRESSURE_SCOPE_LEN) scopeSent = head - PRESSURE_SCOPE_LEN;
+  if (head == scopeSent) return 0;
+  size_t len = snprintf(out, cap, "{\"topic\":\"scope\",\"signal\":\"pressure\",\"unit\":\"bar\",\"hz\":%lu,\"seq\":%lu,\"samples\":[",
+                        (unsigned long)PRESSURE_OUTPUT_HZ, (unsigned long)scopeSent);
+  for (uint32_t i = scopeSent; i != head && len + 16 < cap; i++) {
+    len += snprintf(out + len, cap - len, "%s%.1f", i == scopeSent ? "" : ",", pressureScope[i % PRESSURE_SCOPE_LEN] / 10.0);
+    scopeSent = i + 1;
+  }
+  len += snprintf(out + len, cap - len, "]}");
+  return len;
+}
+
+void publishScope() {
+  if (millis() - lastScopePublish < PRESSURE_SCOPE_INTERVAL) return;
+  lastScopePublish = millis();
+  if (wsTransport.clientCount() == 0) return;
+  TRACE_SCOPE("scope.publish");
+  ALLOC_SECTION(ALLOC_STATUS_RENDER);
+  xSemaphoreTake(statusLock, portMAX_DELAY);
+  if (wsTransport.subscriptions.subscriberCount(TOPIC_SCOPE) > 0) {
+    statusPublisher.publishRaw(TOPIC_SCOPE, renderScopeFrame);
+  } else {
+    scopeSent = pressureScopeHead;
+  }
+  xSemaphoreGive(statusLock);
+}
+
+// Diagnostics topic ("sub:diag", diagnostics.html): loop period histogram,
+// CPU share per task, heap, WebSocket queues and flash write totals, one
+// frame every DIAG_INTERVAL. The loop timing and the tick hook that samples
+// the running task only exist while someone is subscribed, so an unwatched
+// unit pays one subscriber count per interval.
+const unsigned long DIAG_INTERVAL = 1000;
+const int DIAG_LOOP_BUCKETS = 12;          // Log2 from < 32 us to >= 32 ms
+const uint32_t DIAG_LOOP_MIN_US = 32;
+const int DIAG_TASK_SLOTS = 16;
+
+struct DiagTaskSlot {
+  void* task;           // TCB; NULL = free
+  uint32_t ticks[2];    // Ticks it was running on each core this interval
+};
+
+bool diagActive = false;
+unsigned long lastDiagPublish = 0;
+int64_t diagLastLoopUs = 0;
+uint32_t diagLoopBuckets[DIAG_LOOP_BUCKETS];
+uint32_t diagLoopMaxUs = 0;
+DiagTaskSlot diagTasks[DIAG_TASK_SLOTS];   // Written by the tick hook on both cores
+uint32_t diagTaskOverflow = 0;             // Ticks not attributed: table full
+portMUX_TYPE diagMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Loop task, once per iteration
+void diagLoopTick() {
+  if (!diagActive) return;
+  int64_t now = esp_timer_get_time();
+  if (diagLastLoopUs) {
+    uint32_t us = (uint32_t)(now - diagLastLoopUs);
+    int b = 0;
+    while (b < DIAG_LOOP_BUCKETS - 1 && us >= (DIAG_LOOP_MIN_US << b)) b++;
+    diagLoopBuckets[b]++;
+    if (us > diagLoopMaxUs) diagLoopMaxUs = us;
+  }
+  diagLastLoopUs = now;
+}
+
+// FreeRTOS tick hook (1 kHz per core): charge the tick to the running task
+void IRAM_ATTR diagTickHook() {
+  uint32_t core = xPortGetCoreID();
+  void* task = pxCurrentTCB[core];
+  portENTER_CRITICAL_ISR(&diagMux);
+  DiagTaskSlot* free = NULL;
+  for (int i = 0; i < DIAG_TASK_SLOTS; i++) {
+    if (diagTasks[i].task == task) {
+      diagTasks[i].ticks[core]++;
+      portEXIT_CRITICAL_ISR(&diagMux);
+      return;
+    }
+    if (!free && !diagTasks[i].task) free = &diagTasks[i];
+  }
+  if (free) {
+    free->task = task;
+    free->ticks[core] = 1;
+  } else {
+    diagTaskOverflow++;
+  }
+  portEXIT_CRITICAL_ISR(&diagMux);
+}
+
+void diagSetActive(bool on) {
+  if (on == diagActive) return;
+  if (on) {
+    memset(diagLoopBuckets, 0, sizeof(diagLoopBuckets));
+    diagLoopMaxUs = 0;
+    diagLastLoopUs = 0;
+    portENTER_CRITICAL(&diagMux);
+    memset(diagTasks, 0, sizeof(diagTasks));
+    diagTaskOverflow = 0;
+    portEXIT_CRITICAL(&diagMux);
+    for (UBaseType_t core = 0; core < 2; core++) esp_register_freertos_tick_hook_for_cpu(diagTickHook, core);
+  } else {
+    for (UBaseType_t core = 0; core < 2; core++) esp_deregister_freertos_tick_hook_for_cpu(diagTickHook, core);
+  }
+  diagActive = on;
+  logLine("Diagnostics topic %s", on ? "active" : "idle");
+}
+
+// Loop task, under statusLock. Each frame covers the interval since the
+// previous one; counters are cleared once rendered.
+size_t renderDiagFrame(char* out, size_t cap) {
+  DiagTaskSlot tasks[DIAG_TASK_SLOTS];
+  portENTER_CRITICAL(&diagMux);
+  memcpy(tasks, diagTasks, sizeof(tasks));
+  for (int i = 0; i < DIAG_TASK_SLOTS; i++) {
+    // A task that didn't run all interval gives its slot back, so deleted
+    // tasks don't pin stale TCBs
+    if (!diagTasks[i].ticks[0] && !diagTasks[i].ticks[1]) diagTasks[i].task = NULL;
+    diagTasks[i].ticks[0] = diagTasks[i].ticks[1] = 0;
+  }
+  uint32_t overflow = diagTaskOverflow;
+  diagTaskOverflow = 0;
+  portEXIT_CRITICAL(&diagMux);
+
+  JsonWriter w(out, cap);
+  w.beginObject();
+  w.field("topic", "diag");
+  w.field("uptime", (unsigned long)(millis() / 1000));
+
+  w.beginObject("loop");
+  w.field("minUs", (unsigned long)DIAG_LOOP_MIN_US);
+  w.beginArray("counts");
+  for (int b = 0; b < DIAG_LOOP_BUCKETS; b++) w.value((unsigned long)diagLoopBuckets[b]);
+  w.endArray();
+  w.field("maxUs", (unsigned long)diagLoopMaxUs);
+  w.endObject();
+  memset(diagLoopBuckets, 0, sizeof(diagLoopBuckets));
+  diagLoopMaxUs = 0;
+
+  // Task name -> [core 0 ticks, core 1 ticks]; the page divides by each
+  // core's total
+  char name[16];
+  w.beginObject("cpu");
+  for (int i = 0; i < DIAG_TASK_SLOTS; i++) {
+    if (!tasks[i].task || (!tasks[i].ticks[0] && !tasks[i].ticks[1])) continue;
+    profileTaskName(tasks[i].task, name, sizeof(name));
+    w.beginArray(name);
+    w.value((unsigned long)tasks[i].ticks[0]);
+    w.value((unsigned long)tasks[i].ticks[1]);
+    w.endArray();
+  }
+  w.endObject();
+  w.field("cpuUnattributed", (unsigned long)overflow);
+
+  w.beginObject("heap");
+  w.field("free", (unsigned long)ESP.getFreeHeap());
+  w.field("minFree", (unsigned long)ESP.getMinFreeHeap());
+  w.field("largest", (unsigned long)ESP.getMaxAllocHeap());
+  w.endObject();
+
+  // Messages waiting in each client's AsyncWebSocket queue
+  w.beginObject("ws");
+  w.beginArray("queues");
+  for (int i = 0; i < wsTransport.subscriptions.capacity(); i++) {
+    uint32_t id = wsTransport.subscriptions.idAt(i);
+    AsyncWebSocketClient* client = id ? ws.client(id) : NULL;
+    if (client) w.value((unsigned long)client->queueLen());
+  }
+  w.endArray();
+  w.field("poolInUse", (unsigned long)framePool.stats().inUse);
+  w.field("poolExhausted", (unsigned long)framePool.stats().exhausted);
+  w.field("skipped", (unsigned long)wsTransport.skippedSends);
+  w.endObject();
+
+  // Bytes written per subsystem since boot; the page turns them into rates.
+  // Plain 32-bit reads, so no flashLock (a long write must not stall the loop)
+  w.beginObject("flash");
+  for (int i = 0; i < FLASH_SUBSYSTEM_COUNT; i++) {
+    w.field(flashSubsystems[i].name, (unsigned long)flashSubsystems[i].bytes);
+  }
+  w.endObject();
+  w.endObject();
+  return w.overflowed() ? 0 : w.length();
+}
+
+void publishDiagnostics() {
+  if (millis() - lastDiagPublish < DIAG_INTERVAL) return;
+  lastDiagPublish = millis();
+  if (wsTransport.clientCount() == 0) {
+    diagSetActive(false);
+    return;
+  }
+  xSemaphoreTake(statusLock, portMAX_DELAY);
+  bool wanted = wsTransport.subscriptions.subscriberCount(TOPIC_DIAG) > 0;
+  // The first interval after activation has nothing measured yet
+  if (wanted && diagActive) {
+    TRACE_SCOPE("diag.publish");
+    ALLOC_SECTION(ALLOC_STATUS_RENDER);
+    statusPublisher.publishRaw(TOPIC_DIAG, renderDiagFrame);
+  }
+  xSemaphoreGive(statusLock);
+  diagSetActive(wanted);
+}
+
+void onWsEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len) {
+  if (type == WS_EVT_CONNECT) {
+    xSemaphoreTake(statusLock, portMAX_DELAY);
+    wsTransport.subscriptions.add(client->id());
+    captureStatus(statusSnapshot);
+    statusPublisher.sendTo(client->id(), statusSnapshot);
+    xSemaphoreGive(statusLock);
+  } else if (type == WS_EVT_DISCONNECT) {
+    xSemaphoreTake(statusLock, portMAX_DELAY);
+    wsTransport.subscriptions.remove(client->id());
+    latencyForget(client->id());
+    xSemaphoreGive(statusLock);
+  } else if (type == WS_EVT_DATA) {
+    AwsFrameInfo* info = (AwsFrameInfo*)arg;
+    if (info->final && info->index == 0 && info->len == len && info->opcode == WS_TEXT) {
+      // Answer clock pings first and outside the lock, so the pong is prompt
+      char pong[80];
+      size_t pongLen = writePongJson((const char*)data, len, esp_timer_get_time(), pong, sizeof(pong));
+      if (pongLen) {
+        client->text(pong, pongLen);
+        return;
+      }
+      LatencyReport report;
+      xSemaphoreTake(statusLock, portMAX_DELAY);
+      if (parseLatencyReport((const char*)data, len, &report)) {
+        latencyRecord(client->id(), report);
+      } else {
+        uint32_t* mask = wsTransport.subscriptions.mask(client->id());
+        if (mask) applyTopicCommand((const char*)data, len, mask);
+      }
+      xSemaphoreGive(statusLock);
+    }
+  }
+}
+
+// Frame pool occupancy and publisher counters for GET /diag/ws.
+size_t getWsStatsJson(char* out, size_t cap) {
+  xSemaphoreTake(statusLock, portMAX_DELAY);
+  wsTransport.poll();
+  FramePoolStats pool = framePool.stats();
+  PublisherStats pub = statusPublisher.stats();
+  uint32_t skipped = wsTransport.skippedSends;
+  xSemaphoreGive(statusLock);
+
+  StaticJsonDocument<384> doc;
+  doc["clients"] = ws.count();
+  JsonObject p = doc.createNestedObject("framePool");
+  p["blocks"] = pool.blocks;
+  p["blockSize"] = STATUS_FRAME_CAPACITY;
+  p["inUse"] = pool.inUse;
+  p["highWater"] = pool.highWater;
+  p["acquired"] = pool.acquired;
+  p["exhausted"] = pool.exhausted;
+  doc["framesPublished"] = pub.framesPublished;
+  doc["directSends"] = pub.directSends;
+  doc["serializeFailures"] = pub.serializeFailures;
+  doc["skippedSends"] = skipped;
+  return serializeJson(doc, out, cap);
+}
+
+// ========== STATIC ASSET CACHE ==========
+// Small, frequently requested web files are kept in RAM so page loads don't
+// hit flash. Entries are validated against the file's size and mtime (at most
+// once per ASSET_CACHE_REVALIDATE_MS) and reloaded if the file changed.
+// Each body is a reference-counted AssetBuffer: the cache holds one reference
+// and every response streaming it holds another, so a reload or eviction
+// never frees a body a slow client is still being sent. Bytes count against
+// assetCacheBudget until the last reference goes. The fsMount task warms the
+// cache before fsState turns FS_READY; from then on all cache access happens
+// on the AsyncTCP task (a format is only allowed while the cache is empty).
+struct AssetBuffer {
+  uint16_t refs;
+  size_t size;
+  uint8_t* data;        // Follows the header in the same allocation
+};
+
+struct CachedAsset {
+  const char* path;
+  const char* contentType;
+  AssetBuffer* buffer;  // NULL when not cached
+  time_t mtime;
+  unsigned long lastValidated;
+};
+
+CachedAsset hotAssets[] = {
+  {"/index.html",    "text/html",              NULL, 0, 0},
+  {"/script.js",     "application/javascript", NULL, 0, 0},
+  {"/style.css",     "text/css",               NULL, 0, 0},
+  {"/settings.html", "text/html",              NULL, 0, 0},
+};
+const int HOT_ASSET_COUNT = sizeof(hotAssets) / sizeof(hotAssets[0]);
+
+size_t assetCacheBytes = 0;
+unsigned long assetCacheHits = 0;
+unsigned long assetCacheMisses = 0;
+unsigned long assetCacheReloads = 0;
+unsigned long assetCacheRejects = 0;  // Not cached because of budget/heap limits
 
-    cycleDirection = CYCLE_OUT;
-    lastCycleTime = millis();
-    cycleStartTime = millis();  // Reset timeout timer for new cycle
-  } else if (cycleDirection == CYCLE_OUT && endStopOut) {
-    Serial.println("End stop OUT reached - switching to IN cycle");
+CachedAsset* findHotAsset(const String& url) {
+  const char* path = (url == "/") ? "/index.html" : url.c_str();
+  for (int i = 0; i < HOT_ASSET_COUNT; i++) {
+    if (strcmp(hotAssets[i].path, path) == 0) return &hotAssets[i];
+  }
+  return NULL;
+}
 
-    unsigned long rawDuration = millis() - cycleStartTime;
-    if (rawDuration > CYCLE_DELAY) {
-        updateStats(rawDuration - CYCLE_DELAY);
-    }
+void assetBufferRelease(AssetBuffer* b) {
+  if (--b->refs > 0) return;
+  assetCacheBytes -= b->size;
+  free(b);
+}
 
-    cycleDirection = CYCLE_IN;
-    lastCycleTime = millis();
-    cycleStartTime = millis();  // Reset timeout timer for new cycle
+// Stop serving the cached copy; responses still sending it keep theirs
+void assetCacheDrop(CachedAsset* asset) {
+  if (!asset->buffer) return;
+  assetBufferRelease(asset->buffer);
+  asset->buffer = NULL;
+}
+
+// Read the file into a fresh buffer that replaces the current one
+bool assetCacheLoad(CachedAsset* asset, File& file) {
+  TRACE_SCOPE("flash.assetRead");
+  size_t size = file.size();
+  // A buffer only the cache holds is freed by the swap, so it doesn't count
+  size_t replaced = (asset->buffer && asset->buffer->refs == 1) ? asset->buffer->size : 0;
+  if (size == 0 || size > ASSET_CACHE_MAX_FILE ||
+      assetCacheBytes - replaced + size > assetCacheBudget ||
+      ESP.getFreeHeap() < size + ASSET_CACHE_HEAP_RESERVE) {
+    assetCacheRejects++;
+    return false;
   }
-  
-  // Apply cycle delay after direction change to prevent immediate reversal
-  // This also ensures both outputs are never active simultaneously
-  if (millis() - lastCycleTime < CYCLE_DELAY) {
-    digitalWrite(GPO1_PIN, LOW);
-    digitalWrite(GPO2_PIN, LOW);
-    return;
+
+  AssetBuffer* b = (AssetBuffer*)malloc(sizeof(AssetBuffer) + size);
+  if (!b) {
+    assetCacheRejects++;
+    return false;
   }
-  
-  // Control outputs based on cycle direction
-  // Safety: Explicitly ensure only one output is active at a time
-  if (cycleDirection == CYCLE_IN) {
-    digitalWrite(GPO2_PIN, LOW);  // Turn off GPO2 first
-    digitalWrite(GPO1_PIN, HIGH);  // Then turn on GPO1
-  } else if (cycleDirection == CYCLE_OUT) {
-    digitalWrite(GPO1_PIN, LOW);  // Turn off GPO1 first
-    digitalWrite(GPO2_PIN, HIGH);  // Then turn on GPO2
-  } else {
-    digitalWrite(GPO1_PIN, LOW);
-    digitalWrite(GPO2_PIN, LOW);
+  b->data = (uint8_t*)(b + 1);
+  if (file.read(b->data, size) != size) {
+    free(b);
+    return false;
   }
+  b->refs = 1;
+  b->size = size;
+  assetCacheBytes += size;
+
+  assetCacheDrop(asset);
+  asset->buffer = b;
+  asset->mtime = file.getLastWrite();
+  asset->lastValidated = millis();
+  return true;
 }
 
-// ========== SETTINGS MANAGEMENT ==========
-void loadSettings() {
-  preferences.begin("groutpump", false);
-  
-  // Load WiFi credentials
-  wifiSSID = preferences.getString("ssid", "");
-  wifiPassword = preferences.getString("password", "");
-  
-  // Load timing settings
-  cycleTimeout = preferences.getULong("cycleTimeout", DEFAULT_CYCLE_TIMEOUT);
-  timeoutEnabled = preferences.getBool("timeoutEnabled", true);
-  
-  preferences.end();
-  
-  Serial.println("Settings loaded from flash");
-  Serial.println("  SSID: " + (wifiSSID.length() > 0 ? wifiSSID : "Not configured"));
-  Serial.println("  Cycle Timeout: " + String(cycleTimeout) + " ms");
-  Serial.println("  Timeout Enabled: " + String(timeoutEnabled ? "Yes" : "No"));
+// Returns true if the asset is cached and matches the file on flash.
+bool assetCacheEnsure(CachedAsset* asset) {
+  if (asset->buffer && (millis() - asset->lastValidated < ASSET_CACHE_REVALIDATE_MS)) {
+    return true;
+  }
+
+  File file = LittleFS.open(asset->path, "r");
+  if (!file) return false;
+
+  if (asset->buffer && file.size() == asset->buffer->size && file.getLastWrite() == asset->mtime) {
+    asset->lastValidated = millis();
+    file.close();
+    return true;
+  }
+
+  bool wasCached = (asset->buffer != NULL);
+  bool loaded = assetCacheLoad(asset, file);
+  file.close();
+  if (loaded && wasCached) assetCacheReloads++;
+  // File changed but can't be re-cached: stop serving the stale copy.
+  if (!loaded) assetCacheDrop(asset);
+  return loaded;
 }
 
-void saveSettings() {
-  preferences.begin("groutpump", false);
-  
-  preferences.putString("ssid", wifiSSID);
-  preferences.putString("password", wifiPassword);
-  preferences.putULong("cycleTimeout", cycleTimeout);
-  preferences.putBool("timeoutEnabled", timeoutEnabled);
-  
-  preferences.end();
-  
-  Serial.println("Settings saved to flash");
+// Drop cached files, last first, until the cache fits its budget again
+void assetCacheTrim() {
+  for (int i = HOT_ASSET_COUNT - 1; i >= 0 && assetCacheBytes > assetCacheBudget; i--) {
+    assetCacheDrop(&hotAssets[i]);
+  }
 }
 
-// ========== WIFI SETUP ==========
-void setupWiFi() {
-  if (wifiSSID.length() == 0) {
-    Serial.println("WiFi not configured. Starting in AP mode...");
-    WiFi.mode(WIFI_AP);
-    WiFi.softAP("GroutPump-Setup", "12345678");
-    Serial.println("AP Mode started");
-    Serial.print("AP IP address: ");
-    Serial.println(WiFi.softAPIP());
-    Serial.println("Connect to 'GroutPump-Setup' (password: 12345678)");
-    Serial.println("Then navigate to http://192.168.4.1 to configure WiFi");
-    return;
+void assetCacheWarm() {
+  for (int i = 0; i < HOT_ASSET_COUNT; i++) {
+    assetCacheEnsure(&hotAssets[i]);
   }
-  
-  Serial.println("Connecting to WiFi: " + wifiSSID);
-  WiFi.mode(WIFI_STA);
-  WiFi.begin(wifiSSID.c_str(), wifiPassword.c_str());
-  
-  int attempts = 0;
-  while (WiFi.status() != WL_CONNECTED && attempts < 20) {
-    delay(500);
-    Serial.print(".");
-    attempts++;
+  Serial.printf("Asset cache: %lu bytes in RAM (budget %lu)\n",
+                (unsigned long)assetCacheBytes, (unsigned long)assetCacheBudget);
+}
+
+// Streams a cached body and holds a reference to it until the request is gone
+class CachedAssetResponse : public AsyncAbstractResponse {
+ public:
+  explicit CachedAssetResponse(const CachedAsset* asset) : buffer_(asset->buffer), sent_(0) {
+    buffer_->refs++;
+    _code = 200;
+    _contentType = asset->contentType;
+    _contentLength = buffer_->size;
   }
-  
-  if (WiFi.status() == WL_CONNECTED) {
-    Serial.println("\nWiFi connected!");
-    Serial.print("IP address: ");
-    Serial.println(WiFi.localIP());
-    
-    // Setup mDNS
-    if (MDNS.begin("groutpump")) {
-      Serial.println("mDNS responder started: http://groutpump.local");
+
+  ~CachedAssetResponse() override { assetBufferRelease(buffer_); }
+
+  bool _sourceValid() const override { return true; }
+
+  size_t _fillBuffer(uint8_t* buf, size_t maxLen) override {
+    size_t n = buffer_->size - sent_;
+    if (n > maxLen) n = maxLen;
+    memcpy(buf, buffer_->data + sent_, n);
+    sent_ += n;
+    return n;
+  }
+
+ private:
+  AssetBuffer* buffer_;
+  size_t sent_;
+};
+
+class AssetCacheHandler : public AsyncWebHandler {
+ public:
+  bool canHandle(AsyncWebServerRequest *request) override {
+    return request->method() == HTTP_GET && findHotAsset(request->url()) != NULL;
+  }
+
+  void handleRequest(AsyncWebServerRequest *request) override {
+    if (!fsReady()) {
+      sendFsUnavailable(request);
+      return;
     }
-  } else {
-    Serial.println("\nWiFi connection failed. Starting in AP mode...");
-    WiFi.mode(WIFI_AP);
-    WiFi.softAP("GroutPump-Setup", "12345678");
-    Serial.println("AP Mode started");
-    Serial.print("AP IP address: ");
-    Serial.println(WiFi.softAPIP());
+    CachedAsset* asset = findHotAsset(request->url());
+    if (assetCacheEnsure(asset)) {
+      assetCacheHits++;
+      request->send(new CachedAssetResponse(asset));
+    } else {
+      assetCacheMisses++;
+      request->send(LittleFS, asset->path, asset->contentType);
+    }
+  }
+};
+
+AssetCacheHandler assetCacheHandler;
+
+// POST /diag/cache?budget=<bytes> (0 turns the cache off)
+void handleAssetCacheControl(AsyncWebServerRequest *request) {
+  long budget = request->hasArg("budget") ? request->arg("budget").toInt() : -1;
+  if (budget < 0 || budget > (long)ASSET_CACHE_BUDGET) {
+    request->send(400, "text/plain", "budget must be between 0 and " + String((unsigned long)ASSET_CACHE_BUDGET));
+    return;
   }
+  assetCacheBudget = budget;
+  assetCacheTrim();
+  saveSettings();
+  logLine("Asset cache budget %lu bytes (%lu held)", (unsigned long)assetCacheBudget, (unsigned long)assetCacheBytes);
+  request->send(200, "text/plain", "OK");
 }
 
-// ========== OTA SETUP ==========
-void setupOTA() {
-  ArduinoOTA.setHostname("groutpump");
-  ArduinoOTA.setPassword("groutpump123");  // Change this for security
-  
-  ArduinoOTA.onStart([]() {
-    String type;
-    if (ArduinoOTA.getCommand() == U_FLASH) {
-      type = "sketch";
-    } else {  // U_SPIFFS
-      type = "filesystem";
-    }
-    Serial.println("Start updating " + type);
-    
-    // Stop all outputs during OTA update
-    digitalWrite(GPO1_PIN, LOW);
-    digitalWrite(GPO2_PIN, LOW);
-  });
-  
-  ArduinoOTA.onEnd([]() {
-    Serial.println("\nOTA Update complete!");
-  });
-  
-  ArduinoOTA.onProgress([](unsigned int progress, unsigned int total) {
-    Serial.printf("Progress: %u%%\r", (progress / (total / 100)));
-  });
-  
-  ArduinoOTA.onError([](ota_error_t error) {
-    Serial.printf("Error[%u]: ", error);
-    if (error == OTA_AUTH_ERROR) Serial.println("Auth Failed");
-    else if (error == OTA_BEGIN_ERROR) Serial.println("Begin Failed");
-    else if (error == OTA_CONNECT_ERROR) Serial.println("Connect Failed");
-    else if (error == OTA_RECEIVE_ERROR) Serial.println("Receive Failed");
-    else if (error == OTA_END_ERROR) Serial.println("End Failed");
-  });
-  
-  ArduinoOTA.begin();
-  Serial.println("OTA update service started");
-  Serial.println("OTA Password: groutpump123");
+size_t getAssetCacheJson(char* out, size_t cap) {
+  StaticJsonDocument<768> doc;
+  doc["bytes"] = assetCacheBytes;
+  doc["budget"] = assetCacheBudget;
+  doc["maxBudget"] = ASSET_CACHE_BUDGET;
+  doc["heapReserve"] = ASSET_CACHE_HEAP_RESERVE;
+  doc["freeHeap"] = ESP.getFreeHeap();
+  doc["hits"] = assetCacheHits;
+  doc["misses"] = assetCacheMisses;
+  doc["reloads"] = assetCacheReloads;
+  doc["rejects"] = assetCacheRejects;
+  JsonArray files = doc.createNestedArray("files");
+  for (int i = 0; i < HOT_ASSET_COUNT; i++) {
+    JsonObject f = files.createNestedObject();
+    f["path"] = hotAssets[i].path;
+    f["cached"] = (hotAssets[i].buffer != NULL);
+    f["size"] = hotAssets[i].buffer ? hotAssets[i].buffer->size : 0;
+  }
+  return serializeJson(doc, out, cap);
+}
+
+// ========== MEMORY MAP ==========
+// Where the firmware's own RAM goes, printed at boot and served from
+// GET /diag/memory. "static" buffers live in .bss, "arena" slices come from
+// the boot arena, "heap" entries are capped at their budget at runtime.
+struct MemoryMapEntry {
+  const char* name;
+  const char* placement;
+  size_t bytes;         // Reserved (static/arena) or budget (heap)
+  size_t inUse;
+};
+
+const size_t TRACE_RING_BYTES = TRACE_RING_EVENTS * sizeof(TraceEvent);
+const size_t PROFILE_TABLE_BYTES = PROFILE_TABLE_SLOTS * sizeof(ProfileSlot);
+const size_t FRAME_POOL_BYTES = FRAME_POOL_BLOCKS * (STATUS_FRAME_CAPACITY + 1);
+const size_t ALARM_STATIC_BYTES = sizeof(alarmRules) + sizeof(alarmStates) + sizeof(alarmRate) +
+    sizeof(webhookUrl) + sizeof(webhookHost) + sizeof(webhookPath) + sizeof(webhookClient);
+const size_t PRESSURE_STATIC_BYTES = sizeof(pressure) + sizeof(pressureDmaBuf) + sizeof(pressureSamples) + sizeof(pressureScope);
+const size_t LATENCY_STATIC_BYTES = sizeof(latencyClients) + sizeof(latencyTotals);
+const size_t DIAG_STATIC_BYTES = sizeof(diagLoopBuckets) + sizeof(diagTasks);
+const size_t UTIL_STATIC_BYTES = sizeof(utilBoot) + sizeof(utilBuckets) + sizeof(utilJob) + sizeof(utilLastJob);
+const size_t MOTION_STATIC_BYTES = sizeof(motionCounters) + sizeof(motionLog);
+const size_t VALVE_STATIC_BYTES = sizeof(valveStats) + sizeof(valveSavedBaseline);
+const size_t RECORDER_STATIC_BYTES = sizeof(recorderPending) + sizeof(recorderStats) + sizeof(captureExport);
+const size_t OTA_STATIC_BYTES = sizeof(ota) + sizeof(otaLastError);
+const size_t SNAPSHOT_STATIC_BYTES = sizeof(snapshotExport) + sizeof(snapshotRestore);
+const size_t STATIC_SUBSYSTEM_BYTES =
+    sizeof(statusPublisher) + sizeof(statusSnapshot) + sizeof(wsTransport) +
+    sizeof(strokeHistory) + sizeof(historyExport) + sizeof(traceCalib) + sizeof(traceTasks) +
+    sizeof(hotAssets) + sizeof(allocLoopCounters) + sizeof(frameSlots) +
+    sizeof(flashSubsystems) + sizeof(sensorHealth) + sizeof(debounce) + sizeof(outputCounters) +
+    sizeof(outputWear) + PRESSURE_STATIC_BYTES + ALARM_STATIC_BYTES + LATENCY_STATIC_BYTES +
+    DIAG_STATIC_BYTES + UTIL_STATIC_BYTES + MOTION_STATIC_BYTES + VALVE_STATIC_BYTES +
+    RECORDER_STATIC_BYTES + OTA_STATIC_BYTES + SNAPSHOT_STATIC_BYTES;
+
+static_assert(TRACE_RING_BYTES + PROFILE_TABLE_BYTES + PRESSURE_HISTORY_ARENA_BYTES + WEBHOOK_QUEUE_BYTES +
+              VALVE_HISTORY_ARENA_BYTES + RECORDER_RING_BYTES <= MEMORY_ARENA_BUDGET,
+              "Arena slices exceed MEMORY_ARENA_BUDGET");
+static_assert(STATIC_SUBSYSTEM_BYTES <= MEMORY_STATIC_BUDGET,
+              "Static subsystem buffers exceed MEMORY_STATIC_BUDGET");
+static_assert(MEMORY_ARENA_BUDGET + MEMORY_STATIC_BUDGET + ASSET_CACHE_BUDGET + FRAME_POOL_BYTES + MEMORY_NETWORK_RESERVE <= MEMORY_APP_BUDGET,
+              "Memory budgets exceed MEMORY_APP_BUDGET");
+
+// Linker-script symbols bounding initialized and zeroed DRAM data
+extern "C" uint8_t _data_start, _data_end, _bss_start, _bss_end;
+
+int collectMemoryMap(MemoryMapEntry* rows, int max) {
+  const MemoryMapEntry all[] = {
+    {"status",          "static", sizeof(statusPublisher) + sizeof(statusSnapshot), sizeof(statusPublisher) + sizeof(statusSnapshot)},
+    {"wsTransport",     "static", sizeof(wsTransport) + sizeof(frameSlots), sizeof(wsTransport) + sizeof(frameSlots)},
+    {"strokeHistory",   "static", sizeof(strokeHistory) + sizeof(historyExport), strokeHistory.bytesUsed()},
+    {"traceIndex",      "static", sizeof(traceCalib) + sizeof(traceTasks), sizeof(traceCalib) + sizeof(traceTasks)},
+    {"assetTable",      "static", sizeof(hotAssets), sizeof(hotAssets)},
+    {"allocCounters",   "static", sizeof(allocLoopCounters), sizeof(allocLoopCounters)},
+    {"flashWear",       "static", sizeof(flashSubsystems), sizeof(flashSubsystems)},
+    {"sensorHealth",    "static", sizeof(sensorHealth), sizeof(sensorHealth)},
+    {"debounce",        "static", sizeof(debounce), sizeof(debounce)},
+    {"outputWear",      "static", sizeof(outputCounters) + sizeof(outputWear), sizeof(outputCounters) + sizeof(outputWear)},
+    {"pressure",        "static", PRESSURE_STATIC_BYTES, PRESSURE_STATIC_BYTES},
+    {"alarms",          "static", ALARM_STATIC_BYTES, ALARM_STATIC_BYTES},
+    {"latency",         "static", LATENCY_STATIC_BYTES, LATENCY_STATIC_BYTES},
+    {"diagnostics",     "static", DIAG_STATIC_BYTES, DIAG_STATIC_BYTES},
+    {"utilization",     "static", UTIL_STATIC_BYTES, UTIL_STATIC_BYTES},
+    {"motion",          "static", MOTION_STATIC_BYTES, MOTION_STATIC_BYTES},
+    {"valves",          "static", VALVE_STATIC_BYTES, VALVE_STATIC_BYTES},
+    {"flightRecorder",  "static", RECORDER_STATIC_BYTES, RECORDER_STATIC_BYTES},
+    {"otaSession",      "static", OTA_STATIC_BYTES, OTA_STATIC_BYTES},
+    {"snapshot",        "static", SNAPSHOT_STATIC_BYTES, SNAPSHOT_STATIC_BYTES},
+    {"traceRing",       "arena",  TRACE_RING_BYTES, traceRing ? TRACE_RING_BYTES : 0},
+    {"profileTable",    "arena",  PROFILE_TABLE_BYTES, profileTable ? PROFILE_TABLE_BYTES : 0},
+    {"pressureHistory", "arena",  PRESSURE_HISTORY_ARENA_BYTES,
+                                  pressurePeakHistory ? pressurePeakHistory->bytesUsed() + pressureMeanHistory->bytesUsed() : 0},
+    {"webhookQueue",    "arena",  WEBHOOK_QUEUE_BYTES, webhookQueue ? webhookCount * sizeof(WebhookMessage) : 0},
+    {"valveHistory",    "arena",  VALVE_HISTORY_ARENA_BYTES, valveHistoryBytesUsed()},
+    {"recorderRing",    "arena",  RECORDER_RING_BYTES,
+                                  recorderRing ? min(recorderTotal, (uint32_t)RECORDER_RING_SAMPLES) * sizeof(RecorderSample) : 0},
+    {"assetCache",      "heap",   ASSET_CACHE_BUDGET, assetCacheBytes},
+    {"framePool",       "heap",   FRAME_POOL_BYTES, framePool.stats().blocks * (STATUS_FRAME_CAPACITY + 1)},
+  };
+  int n = 0;
+  for (size_t i = 0; i < sizeof(all) / sizeof(all[0]) && n < max; i++) rows[n++] = all[i];
+  return n;
+}
+
+const int MEMORY_MAP_MAX_ROWS = 28;
+
+void printMemoryMap() {
+  MemoryMapEntry rows[MEMORY_MAP_MAX_ROWS];
+  int n = collectMemoryMap(rows, MEMORY_MAP_MAX_ROWS);
+  Serial.println("Memory map:");
+  for (int i = 0; i < n; i++) {
+    logLine("  %-16s %-6s %6lu / %6lu bytes", rows[i].name, rows[i].placement,
+            (unsigned long)rows[i].inUse, (unsigned long)rows[i].bytes);
+  }
+  logLine("  arena %lu / %lu bytes, static data %lu bytes",
+          (unsigned long)memArena.used, (unsigned long)memArena.size,
+          (unsigned long)((&_data_end - &_data_start) + (&_bss_end - &_bss_start)));
+  size_t freeHeap = ESP.getFreeHeap();
+  logLine("  heap free %lu, largest block %lu, min ever %lu",
+          (unsigned long)freeHeap, (unsigned long)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT),
+          (unsigned long)ESP.getMinFreeHeap());
+  if (freeHeap < MEMORY_NETWORK_RESERVE) {
+    logLine("WARNING: free heap below the %lu byte network reserve", (unsigned long)MEMORY_NETWORK_RESERVE);
+  }
+}
+
+size_t getMemoryMapJson(char* out, size_t cap) {
+  MemoryMapEntry rows[MEMORY_MAP_MAX_ROWS];
+  int n = collectMemoryMap(rows, MEMORY_MAP_MAX_ROWS);
+  StaticJsonDocument<3072> doc;
+  JsonArray subsystems = doc.createNestedArray("subsystems");
+  for (int i = 0; i < n; i++) {
+    JsonObject r = subsystems.createNestedObject();
+    r["name"] = rows[i].name;
+    r["placement"] = rows[i].placement;
+    r["bytes"] = rows[i].bytes;
+    r["inUse"] = rows[i].inUse;
+  }
+  JsonObject arena = doc.createNestedObject("arena");
+  arena["size"] = memArena.size;
+  arena["used"] = memArena.used;
+  arena["budget"] = MEMORY_ARENA_BUDGET;
+  doc["staticData"] = (unsigned long)((&_data_end - &_data_start) + (&_bss_end - &_bss_start));
+  doc["freeHeap"] = ESP.getFreeHeap();
+  doc["largestBlock"] = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+  doc["minFreeHeap"] = ESP.getMinFreeHeap();
+  doc["networkReserve"] = MEMORY_NETWORK_RESERVE;
+  return serializeJson(doc, out, cap);
 }
 
 // ========== WEB SERVER SETUP ==========
 void setupWebServer() {
   // WebSocket
+  wsTransport.begin();
   ws.onEvent(onWsEvent);
   server.addHandler(&ws);
 
-  // Static files
-  server.serveStatic("/", LittleFS, "/").setDefaultFile("index.html");
+  // Static files (hot assets from the RAM cache, everything else from flash)
+  server.addHandler(&assetCacheHandler);
+  server.serveStatic("/", LittleFS, "/").setDefaultFile("index.html")
+      .setFilter([](AsyncWebServerRequest *request) { return fsReady(); });
   
   // API endpoints
   server.on("/save", HTTP_POST, handleSaveSettings);
   server.on("/status", HTTP_GET, [](AsyncWebServerRequest *request){
-    request->send(200, "application/json", getStatusJson());
+    TRACE_SCOPE("http.status");
+    StatusSnapshot snapshot;
+    char json[STATUS_FRAME_CAPACITY];
+    xSemaphoreTake(statusLock, portMAX_DELAY);
+    captureStatus(snapshot);
+    size_t len = statusPublisher.render(snapshot, json, sizeof(json));
+    xSemaphoreGive(statusLock);
+    if (len == 0) {
+      request->send(500, "text/plain", "Status too large");
+      return;
+    }
+    request->send(200, "application/json", json);
   });
   server.on("/setwifi", HTTP_POST, handleSetWiFi);
+  server.on("/sim", HTTP_POST, handleSimSettings);
+  server.on("/sim/press", HTTP_POST, handleSimPress);
+  server.on("/sim", HTTP_GET, [](AsyncWebServerRequest *request){
+    char json[384];
+    getSimJson(json, sizeof(json));
+    request->send(200, "application/json", json);
+  });
+  server.on("/pressure", HTTP_POST, handlePressureSettings);
+  server.on("/pressure", HTTP_GET, [](AsyncWebServerRequest *request){
+    char json[768];
+    getPressureJson(json, sizeof(json));
+    request->send(200, "application/json", json);
+  });
+  server.on("/history", HTTP_GET, handleHistoryDownload);
+  server.on("/alarms", HTTP_GET, [](AsyncWebServerRequest *request){
+    char json[2560];
+    getAlarmsJson(json, sizeof(json));
+    request->send(200, "application/json", json);
+  });
+  server.on("/alarms", HTTP_POST, handleAlarmControl);
+  server.on("/alarms/rule", HTTP_POST, handleAlarmRule);
+  server.on("/alarms/webhook", HTTP_POST, handleWebhookSettings);
+  server.on("/diag/trace", HTTP_GET, handleTraceDownload);
+  server.on("/diag/trace", HTTP_POST, handleTraceControl);
+  server.on("/diag/profile", HTTP_GET, handleProfileDownload);
+  server.on("/diag/profile", HTTP_POST, handleProfileControl);
+  server.on("/diag/cache", HTTP_GET, [](AsyncWebServerRequest *request){
+    char json[512];
+    getAssetCacheJson(json, sizeof(json));
+    request->send(200, "application/json", json);
+  });
+  server.on("/diag/cache", HTTP_POST, handleAssetCacheControl);
+  server.on("/diag/ws", HTTP_GET, [](AsyncWebServerRequest *request){
+    char json[384];
+    getWsStatsJson(json, sizeof(json));
+    request->send(200, "application/json", json);
+  });
+  server.on("/diag/latency", HTTP_GET, [](AsyncWebServerRequest *request){
+    char json[1536];
+    getLatencyJson(json, sizeof(json));
+    request->send(200, "application/json", json);
+  });
+  server.on("/diag/latency", HTTP_POST, [](AsyncWebServerRequest *request){
+    // Before comparing a firmware change: start the totals from scratch
+    latencyReset();
+    request->send(200, "text/plain", "OK");
+  });
+  server.on("/diag/memory", HTTP_GET, [](AsyncWebServerRequest *request){
+    char json[2560];
+    getMemoryMapJson(json, sizeof(json));
+    request->send(200, "application/json", json);
+  });
+  server.on("/diag/sensors", HTTP_GET, [](AsyncWebServerRequest *request){
+    char json[1024];
+    getSensorHealthJson(json, sizeof(json));
+    request->send(200, "application/json", json);
+  });
+  server.on("/diag/sensors", HTTP_POST, [](AsyncWebServerRequest *request){
+    // After replacing a sensor: start its score from scratch
+    sensorResetRequest = true;
+    request->send(200, "text/plain", "OK");
+  });
+  server.on("/diag/debounce", HTTP_GET, [](AsyncWebServerRequest *request){
+    char json[1280];
+    getDebounceJson(json, sizeof(json));
+    request->send(200, "application/json", json);
+  });
+  server.on("/diag/debounce", HTTP_POST, handleDebounceControl);
+  server.on("/diag/wear", HTTP_GET, [](AsyncWebServerRequest *request){
+    char json[1024];
+    getOutputWearJson(json, sizeof(json));
+    request->send(200, "application/json", json);
+  });
+  server.on("/diag/wear", HTTP_POST, handleOutputWear);
+  server.on("/diag/captures", HTTP_GET, handleCaptureDownload);
+  server.on("/diag/captures", HTTP_POST, handleCaptureControl);
+  server.on("/diag/valves", HTTP_GET, [](AsyncWebServerRequest *request){
+    char json[1024];
+    getValvesJson(json, sizeof(json));
+    request->send(200, "application/json", json);
+  });
+  server.on("/diag/valves", HTTP_POST, [](AsyncWebServerRequest *request){
+    // After servicing the valves: learn new baselines from the next travels
+    valveRelearnRequest = true;
+    request->send(200, "text/plain", "OK");
+  });
+  server.on("/motion", HTTP_GET, [](AsyncWebServerRequest *request){
+    char json[1536];
+    getMotionJson(json, sizeof(json));
+    request->send(200, "application/json", json);
+  });
+  server.on("/utilization", HTTP_GET, [](AsyncWebServerRequest *request){
+    char json[1536];
+    getUtilizationJson(json, sizeof(json));
+    request->send(200, "application/json", json);
+  });
+  server.on("/utilization", HTTP_POST, handleUtilization);
+  server.on("/diag/wifi", HTTP_GET, [](AsyncWebServerRequest *request){
+    char json[1024];
+    getWifiJson(json, sizeof(json));
+    request->send(200, "application/json", json);
+  });
+  server.on("/diag/wifi", HTTP_POST, handleWifiControl);
+  server.on("/diag/boot", HTTP_GET, [](AsyncWebServerRequest *request){
+    char json[512];
+    getBootJson(json, sizeof(json));
+    request->send(200, "application/json", json);
+  });
+  server.on("/diag/fs", HTTP_POST, handleFsControl);
+  server.on("/diag/flash", HTTP_GET, [](AsyncWebServerRequest *request){
+    char json[1280];
+    getFlashWearJson(json, sizeof(json));
+    request->send(200, "application/json", json);
+  });
+  server.on("/diag/flash", HTTP_POST, handleFlashBudget);
+  server.on("/diag/alloc", HTTP_GET, [](AsyncWebServerRequest *request){
+    char json[384];
+    getAllocJson(json, sizeof(json));
+    request->send(200, "application/json", json);
+  });
+  server.on("/diag/alloc", HTTP_POST, [](AsyncWebServerRequest *request){
+    // Zero the counters to measure a window: POST, wait, then GET
+    allocTotalCalls = 0;
+    memset(allocLoopCounters, 0, sizeof(allocLoopCounters));
+    request->send(200, "text/plain", "OK");
+  });
   
+  // Resumable chunked firmware upload (see RESUMABLE OTA)
+  server.on("/ota", HTTP_GET, handleOtaStatus);
+  server.on("/ota/begin", HTTP_POST, handleOtaBegin);
+  server.on("/ota/chunk", HTTP_POST, handleOtaChunk, NULL, otaChunkBody);
+  server.on("/ota/finish", HTTP_POST, handleOtaFinish);
+  server.on("/ota/abort", HTTP_POST, [](AsyncWebServerRequest *request){
+    otaDiscard("aborted");
+    request->send(200, "text/plain", "OK");
+  });
+
+  // Single-file backup and restore (see DEVICE SNAPSHOT)
+  server.on("/snapshot", HTTP_GET, handleSnapshotDownload);
+  server.on("/snapshot", HTTP_POST, handleSnapshotRestore, NULL, snapshotRestoreBody);
+
   // Web OTA Update
   server.on("/update", HTTP_POST, [](AsyncWebServerRequest *request){
     bool shouldReboot = !Update.hasError();
     AsyncWebServerResponse *response = request->beginResponse(200, "text/plain", shouldReboot?"OK":"FAIL");
     response->addHeader("Connection", "close");
     request->send(response);
-    if(shouldReboot) ESP.restart();
+    if(shouldReboot) {
+      flashFlushPending();
+      ESP.restart();
+    }
   }, [](AsyncWebServerRequest *request, String filename, size_t index, uint8_t *data, size_t len, bool final){
+    TRACE_SCOPE("ota.write");
     if(!index){
       Serial.printf("Update Start: %s\n", filename.c_str());
       int cmd = (filename == "filesystem") ? U_SPIFFS : U_FLASH;
+      if (cmd == U_FLASH) otaDiscard("superseded by /update");
       if(!Update.begin(UPDATE_SIZE_UNKNOWN, cmd)) Update.printError(Serial);
     }
     if(Update.write(data, len) != len) Update.printError(Serial);
     if(final){
-      if(Update.end(true)) Serial.printf("Update Success: %uB\n", index+len);
-      else Update.printError(Serial);
+      if(Update.end(true)) {
+        Serial.printf("Update Success: %uB\n", index+len);
+        if (filename == "filesystem") flashAccountFs(FLASH_FS_IMAGE, index + len);
+      } else {
+        Update.printError(Serial);
+      }
     }
   });
   
   // 404
   server.onNotFound([](AsyncWebServerRequest *request){
+    // Static files are skipped until LittleFS is mounted and land here
+    if (!fsReady() && request->method() == HTTP_GET) {
+      sendFsUnavailable(request);
+      return;
+    }
     request->send(404, "text/plain", "Not Found");
   });
 
@@ -637,63 +7634,6 @@ void setupWebServer() {
   Serial.println("Async Web server started");
 }
 
-void notifyClients() {
-  ws.textAll(getStatusJson());
-}
-
-String getStatusJson() {
-  DynamicJsonDocument doc(1024);
-  
-  doc["estopActive"] = isEstopActive;
-  doc["mode"] = (currentMode == MODE_MANUAL ? "MANUAL" : "AUTO");
-  
-  if (cycleDirection == CYCLE_IN) doc["cycleDirection"] = "IN";
-  else if (cycleDirection == CYCLE_OUT) doc["cycleDirection"] = "OUT";
-  else doc["cycleDirection"] = "STOPPED";
-  
-  doc["gpo1"] = digitalRead(GPO1_PIN);
-  doc["gpo2"] = digitalRead(GPO2_PIN);
-  
-  unsigned long now = millis();
-  // Lower the threshold because we update much faster now
-  doc["inputA"] = (now - inputA.lastPressTime < 1000) || (digitalRead(INPUT_A_PIN) == LOW);
-  doc["inputB"] = (now - inputB.lastPressTime < 1000) || (digitalRead(INPUT_B_PIN) == LOW);
-  doc["inputC"] = (now - inputC.lastPressTime < 1000) || (digitalRead(INPUT_C_PIN) == LOW);
-  doc["inputD"] = (now - inputD.lastPressTime < 1000) || (digitalRead(INPUT_D_PIN) == LOW);
-  
-  doc["endStopIn"] = (digitalRead(ENDSTOP_IN_PIN) == HIGH);
-  doc["endStopOut"] = (digitalRead(ENDSTOP_OUT_PIN) == HIGH);
-
-  // Cycle Statistics
-  doc["lastDuration"] = lastDuration;
-  doc["avgDuration"] = avgDuration;
-  
-  JsonArray history = doc.createNestedArray("history");
-  // Output history ordered (Oldest -> Newest) is ideal for graphing
-  if (cycleCount > 0) {
-      int idx = (cycleCount < 20) ? 0 : cycleIndex; // Start at oldest
-      for (int i = 0; i < cycleCount; i++) {
-         history.add(cycleDurations[(idx + i) % 20]);
-      }
-  }
-  
-  doc["cycleTimeout"] = cycleTimeout;
-  doc["timeoutEnabled"] = timeoutEnabled;
-  doc["wifiConnected"] = (WiFi.status() == WL_CONNECTED);
-  doc["wifiSSID"] = (WiFi.status() == WL_CONNECTED ? wifiSSID : "AP Mode");
-  doc["ipAddress"] = (WiFi.status() == WL_CONNECTED ? WiFi.localIP().toString() : WiFi.softAPIP().toString());
-  
-  String json;
-  serializeJson(doc, json);
-  return json;
-}
-
-void onWsEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len) {
-  if(type == WS_EVT_CONNECT){
-    client->text(getStatusJson());
-  }
-}
-
 // ========== ASYNC HANDLERS ==========
 void handleSaveSettings(AsyncWebServerRequest *request) {
   if (request->hasArg("timeout")) {
@@ -711,11 +7651,206 @@ void handleSaveSettings(AsyncWebServerRequest *request) {
   request->send(200, "text/html", "<h1>Settings Saved!</h1><meta http-equiv='refresh' content='2;url=/'>");
 }
 
+// Static IP fields are optional. A blank "ip" means DHCP, and omitting
+// "ip" altogether keeps the current IP setup.
 void handleSetWiFi(AsyncWebServerRequest *request) {
-  if (request->hasArg("ssid")) wifiSSID = request->arg("ssid");
-  if (request->hasArg("password")) wifiPassword = request->arg("password");
-  saveSettings();
+  if (request->hasArg("ip")) {
+    const char* names[] = {"ip", "gateway", "subnet", "dns"};
+    uint32_t values[4] = {0, 0, 0, 0};
+    bool useStatic = request->arg("ip").length() > 0;
+    for (int i = 0; useStatic && i < 4; i++) {
+      String v = request->arg(names[i]);
+      IPAddress addr;
+      if (v.length() == 0 && i == 3) continue;  // DNS defaults to the gateway
+      if (!addr.fromString(v.c_str()) || (uint32_t)addr == 0) {
+        request->send(400, "text/html", String("Invalid ") + names[i]);
+        return;
+      }
+      values[i] = addr;
+    }
+    memcpy(wifiStaticPending, values, sizeof(wifiStaticPending));
+    wifiStaticRequest = true;
+  }
+  if (request->hasArg("ssid") && strcmp(request->arg("ssid").c_str(), wifiSSID.c_str()) != 0) {
+    wifiForgetRequest = true;  // Another network: the cached AP and lease don't apply
+  }
+  if (request->hasArg("ssid")) wifiSSID = request->arg("ssid").c_str();
+  if (request->hasArg("password")) wifiPassword = request->arg("password").c_str();
+  saveSettings(true);  // Must land before the restart
   request->send(200, "text/html", "<h1>WiFi Saved! Device restarting...</h1>");
-  delay(1000);
-  ESP.restart();
+  // wifiService() saves the network cache, then restarts once the reply is out
+  unsigned long at = millis() + 1000;
+  wifiRestartAtMs = at ? at : 1;
+}
+
+// Simulation settings form / API. Omitting "enabled" turns simulation off,
+// like the timeoutEnabled checkbox on /save.
+void handleSimSettings(AsyncWebServerRequest *request) {
+  if (request->hasArg("strokeIn")) {
+    unsigned long v = request->arg("strokeIn").toInt();
+    if (v < 200 || v > 120000) {
+      request->send(400, "text/html", "Invalid Stroke IN Time");
+      return;
+    }
+    simStrokeInMs = v;
+  }
+  if (request->hasArg("strokeOut")) {
+    unsigned long v = request->arg("strokeOut").toInt();
+    if (v < 200 || v > 120000) {
+      request->send(400, "text/html", "Invalid Stroke OUT Time");
+      return;
+    }
+    simStrokeOutMs = v;
+  }
+  if (request->hasArg("jitter")) simJitterPct = constrain(request->arg("jitter").toInt(), 0, 50);
+  if (request->hasArg("bounce")) simBounceMs = constrain(request->arg("bounce").toInt(), 0, 200);
+  if (request->hasArg("valve")) simValveMs = constrain(request->arg("valve").toInt(), 0, 1000);
+  if (request->hasArg("fault")) {
+    SimFault fault = SIM_FAULT_NONE;
+    for (int i = 0; i < SIM_FAULT_COUNT; i++) {
+      if (request->arg("fault") == SIM_FAULT_NAMES[i]) fault = (SimFault)i;
+    }
+    simFault = fault;
+  }
+
+  bool enable = request->hasArg("enabled");
+  if (enable != simEnabled) simRequest = enable ? 1 : 0;
+  saveSettings();
+  request->send(200, "text/html", "<h1>Simulation Settings Saved!</h1><meta http-equiv='refresh' content='2;url=/'>");
+}
+
+// Pressure input form / API. Omitting "enabled" turns monitoring off, like
+// /sim. The pressure task applies pin changes on its next pass.
+void handlePressureSettings(AsyncWebServerRequest *request) {
+  int pin = request->hasArg("pin") ? request->arg("pin").toInt() : pressurePin;
+  int zero = request->hasArg("zero") ? request->arg("zero").toInt() : pressureZeroCounts;
+  int full = request->hasArg("full") ? request->arg("full").toInt() : pressureFullCounts;
+  long scale = request->hasArg("fullScale") ? request->arg("fullScale").toInt() : (long)pressureFullScaleBar;
+  long trip = request->hasArg("trip") ? request->arg("trip").toInt() : (long)pressureTripBar;
+
+  if (pin < 34 || pin > 39) {
+    request->send(400, "text/html", "Invalid Pressure Pin (ADC1 input GPIO 34-39)");
+    return;
+  }
+  if (zero < 0 || full > 4095 || full < zero + 100) {
+    request->send(400, "text/html", "Invalid Calibration (0 <= zero, zero + 100 <= full <= 4095)");
+    return;
+  }
+  if (scale < 1 || scale > 1000 || trip < 0 || trip > scale) {
+    request->send(400, "text/html", "Invalid Full Scale or Trip Pressure");
+    return;
+  }
+  pressurePin = pin;
+  pressureZeroCounts = zero;
+  pressureFullCounts = full;
+  pressureFullScaleBar = scale;
+  pressureTripBar = trip;
+  pressureEnabled = request->hasArg("enabled");
+  saveSettings();
+  request->send(200, "text/html", "<h1>Pressure Settings Saved!</h1><meta http-equiv='refresh' content='2;url=/'>");
+}
+
+// Acknowledge or shelve: POST /alarms?action=ack|shelve|unshelve&alarm=<name>|all[&minutes=N]
+void handleAlarmControl(AsyncWebServerRequest *request) {
+  int id = alarmFind(request->arg("alarm"));
+  if (id < 0) {
+    request->send(400, "text/plain", "Unknown alarm");
+    return;
+  }
+  const String& action = request->arg("action");
+  if (action == "ack") {
+    alarmAckRequest = id;
+  } else if (action == "shelve" || action == "unshelve") {
+    unsigned long minutes = 0;
+    if (action == "shelve") {
+      minutes = request->hasArg("minutes") ? request->arg("minutes").toInt() : 60;
+      if (minutes < 1 || minutes > ALARM_MAX_SHELVE_MINUTES) {
+        request->send(400, "text/plain", "minutes must be 1-480");
+        return;
+      }
+    }
+    alarmShelveMinutes = minutes;
+    alarmShelveRequest = id;
+  } else {
+    request->send(400, "text/plain", "action must be ack, shelve or unshelve");
+    return;
+  }
+  request->send(200, "text/plain", "OK");
+}
+
+// Change one rule: POST /alarms/rule?alarm=<name>[&enabled=0|1][&setpoint=][&hysteresis=][&delay=]
+void handleAlarmRule(AsyncWebServerRequest *request) {
+  int id = alarmFind(request->arg("alarm"));
+  if (id < 0 || id == ALARM_TARGET_ALL) {
+    request->send(400, "text/plain", "Unknown alarm");
+    return;
+  }
+  AlarmRule& r = alarmRules[id];
+  long hysteresis = request->hasArg("hysteresis") ? request->arg("hysteresis").toInt() : r.hysteresis;
+  long delayMs = request->hasArg("delay") ? request->arg("delay").toInt() : (long)r.delayMs;
+  if (hysteresis < 0 || delayMs < 0 || delayMs > 3600000L) {
+    request->send(400, "text/plain", "Invalid hysteresis or delay");
+    return;
+  }
+  if (request->hasArg("enabled")) r.enabled = request->arg("enabled") != "0";
+  if (request->hasArg("setpoint")) r.setpoint = request->arg("setpoint").toInt();
+  r.hysteresis = hysteresis;
+  r.delayMs = delayMs;
+  saveSettings();
+  request->send(200, "text/plain", "OK");
+}
+
+// Webhook URL form / API: POST /alarms/webhook?url=http://host[:port]/path
+// (empty = off), or action=test to queue a test message
+void handleWebhookSettings(AsyncWebServerRequest *request) {
+  if (request->arg("action") == "test") {
+    if (webhookUrl.empty()) {
+      request->send(409, "text/plain", "No webhook URL configured");
+      return;
+    }
+    webhookTestRequest = true;
+    request->send(200, "text/plain", "OK");
+    return;
+  }
+  const String& url = request->arg("url");
+  WebhookHostString host, path;
+  uint16_t port;
+  if (url.length() > WebhookUrlString::CAPACITY || !webhookParseUrl(url.c_str(), host, port, path)) {
+    request->send(400, "text/html", "Invalid Webhook URL (http://host[:port]/path)");
+    return;
+  }
+  webhookUrl = url.c_str();
+  webhookUrlChanged = true;
+  saveSettings();
+  request->send(200, "text/html", "<h1>Alarm Settings Saved!</h1><meta http-equiv='refresh' content='2;url=/'>");
+}
+
+// Simulated remote button press: POST /sim/press?input=C[&ms=200]
+void handleSimPress(AsyncWebServerRequest *request) {
+  if (!simEnabled) {
+    request->send(409, "text/plain", "Simulation mode is off");
+    return;
+  }
+  const String& input = request->arg("input");
+  int idx = (input.length() == 1) ? input.c_str()[0] - 'A' : -1;
+  if (idx < 0 || idx > 3) {
+    request->send(400, "text/plain", "input must be A, B, C or D");
+    return;
+  }
+  unsigned long ms = request->hasArg("ms") ? constrain(request->arg("ms").toInt(), 1, 60000) : 200;
+  simPressUntil[idx] = millis() + ms;
+  request->send(200, "text/plain", "OK");
+}
+
+size_t getSimJson(char* out, size_t cap) {
+  StaticJsonDocument<384> doc;
+  doc["enabled"] = simEnabled;
+  doc["strokeIn"] = simStrokeInMs;
+  doc["strokeOut"] = simStrokeOutMs;
+  doc["jitter"] = simJitterPct;
+  doc["bounce"] = simBounceMs;
+  doc["valve"] = simValveMs;
+  doc["fault"] = SIM_FAULT_NAMES[simFault];
+  doc["position"] = simCylinder.position;
+  return serializeJson(doc, out, cap);
 }
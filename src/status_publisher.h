@@ -0,0 +1,499 @@
+/*
+ * Status publishing layer
+ *
+ * Platform-independent part of the status path: the state snapshot, its JSON
+ * serialization, topic subscriptions, the pool of shared frame buffers and
+ * the fan-out to connected clients.
+ * Nothing in here depends on Arduino or ESPAsyncWebServer, so the same code
+ * runs in the firmware (AsyncWebSocket transport in main.cpp) and on a
+ * workstation (POSIX socket transport in tools/loadtest/host_server.cpp).
+ */
+
+#ifndef STATUS_PUBLISHER_H
+#define STATUS_PUBLISHER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+
+// ========== STATUS SNAPSHOT ==========
+const int STATUS_HISTORY_LEN = 20;
+const size_t STATUS_FRAME_CAPACITY = 1024;  // Max serialized status size
+
+// Plain copy of everything the status page shows. Captured once per publish
+// so serialization never touches hardware or shared state.
+struct StatusSnapshot {
+  uint32_t seq;             // Broadcast sequence number (set by the publisher)
+  uint64_t timestampUs;     // Device clock when the snapshot was captured
+  uint64_t edgeUs;          // Device clock of the edge that caused this frame (0 = periodic)
+  const char* edge;         // Source of that edge, e.g. "endStopIn"
+  bool simulation;          // Dry-run mode: outputs masked, inputs modelled
+  bool estopActive;
+  const char* mode;         // "MANUAL" / "AUTO"
+  const char* cycleDirection;  // "IN" / "OUT" / "STOPPED"
+  int gpo1;
+  int gpo2;
+  bool inputA;
+  bool inputB;
+  bool inputC;
+  bool inputD;
+  bool endStopIn;
+  bool endStopOut;
+  unsigned long lastDuration;
+  unsigned long avgDuration;
+  unsigned long history[STATUS_HISTORY_LEN];  // Oldest -> newest
+  int historyCount;
+  unsigned long valveResponseUs[2];  // IN, OUT moving averages (0 = not measured yet)
+  unsigned long valveTravelUs[2];
+  bool valveSlow;           // A valve's response is past its alarm setpoint vs baseline
+  unsigned long cycleTimeout;
+  bool timeoutEnabled;
+  bool wifiConnected;
+  char wifiSSID[33];
+  char ipAddress[16];
+};
+
+// ========== JSON WRITER ==========
+// Minimal streaming JSON writer into a caller-provided buffer. Never allocates;
+// output is truncated (and overflowed() set) if the buffer is too small.
+class JsonWriter {
+ public:
+  JsonWriter(char* buf, size_t cap) : buf_(buf), cap_(cap), len_(0), overflow_(false), needComma_(false) {
+    if (cap_ > 0) buf_[0] = '\0';
+  }
+
+  void beginObject() { separator(); raw("{"); needComma_ = false; }
+  void endObject() { raw("}"); needComma_ = true; }
+  void beginObject(const char* k) { key(k); raw("{"); needComma_ = false; }
+  void beginArray(const char* k) { key(k); raw("["); needComma_ = false; }
+  void endArray() { raw("]"); needComma_ = true; }
+
+  void field(const char* k, bool v) { key(k); raw(v ? "true" : "false"); needComma_ = true; }
+  void field(const char* k, int v) { key(k); number("%ld", (long)v); }
+  void field(const char* k, long v) { key(k); number("%ld", v); }
+  void field(const char* k, unsigned int v) { key(k); number("%lu", (unsigned long)v); }
+  void field(const char* k, unsigned long v) { key(k); number("%lu", v); }
+  void field(const char* k, unsigned long long v) { key(k); number("%llu", v); }
+  void field(const char* k, const char* v) { key(k); string(v); needComma_ = true; }
+
+  void value(unsigned long v) { separator(); number("%lu", v); }
+  void value(const char* v) { separator(); string(v); needComma_ = true; }
+
+  size_t length() const { return len_; }
+  bool overflowed() const { return overflow_; }
+
+ private:
+  void separator() { if (needComma_) raw(","); }
+
+  void key(const char* k) {
+    separator();
+    string(k);
+    raw(":");
+    needComma_ = false;
+  }
+
+  template <typename T>
+  void number(const char* fmt, T v) {
+    char tmp[24];
+    snprintf(tmp, sizeof(tmp), fmt, v);
+    raw(tmp);
+    needComma_ = true;
+  }
+
+  void string(const char* s) {
+    put('"');
+    for (; s && *s; s++) {
+      char c = *s;
+      if (c == '"' || c == '\\') { put('\\'); put(c); }
+      else if ((unsigned char)c < 0x20) {
+        char tmp[8];
+        snprintf(tmp, sizeof(tmp), "\\u%04x", (unsigned)c);
+        raw(tmp);
+      } else put(c);
+    }
+    put('"');
+  }
+
+  void raw(const char* s) { while (*s) put(*s++); }
+
+  void put(char c) {
+    if (len_ + 1 < cap_) {
+      buf_[len_++] = c;
+      buf_[len_] = '\0';
+    } else {
+      overflow_ = true;
+    }
+  }
+
+  char* buf_;
+  size_t cap_;
+  size_t len_;
+  bool overflow_;
+  bool needComma_;
+};
+
+// Serialize a snapshot using the field names the web UI expects.
+inline size_t writeStatusJson(const StatusSnapshot& s, char* out, size_t cap) {
+  JsonWriter w(out, cap);
+  w.beginObject();
+  w.field("seq", (unsigned long)s.seq);
+  w.field("ts", (unsigned long long)s.timestampUs);
+  if (s.edgeUs) {
+    w.field("edge", s.edge);
+    w.field("edgeTs", (unsigned long long)s.edgeUs);
+  }
+  w.field("simulation", s.simulation);
+  w.field("estopActive", s.estopActive);
+  w.field("mode", s.mode);
+  w.field("cycleDirection", s.cycleDirection);
+  w.field("gpo1", s.gpo1);
+  w.field("gpo2", s.gpo2);
+  w.field("inputA", s.inputA);
+  w.field("inputB", s.inputB);
+  w.field("inputC", s.inputC);
+  w.field("inputD", s.inputD);
+  w.field("endStopIn", s.endStopIn);
+  w.field("endStopOut", s.endStopOut);
+  w.field("lastDuration", s.lastDuration);
+  w.field("avgDuration", s.avgDuration);
+  w.beginArray("history");
+  for (int i = 0; i < s.historyCount; i++) w.value(s.history[i]);
+  w.endArray();
+  w.beginObject("valve");
+  w.beginArray("responseUs");
+  w.value(s.valveResponseUs[0]);
+  w.value(s.valveResponseUs[1]);
+  w.endArray();
+  w.beginArray("travelUs");
+  w.value(s.valveTravelUs[0]);
+  w.value(s.valveTravelUs[1]);
+  w.endArray();
+  w.field("slow", s.valveSlow);
+  w.endObject();
+  w.field("cycleTimeout", s.cycleTimeout);
+  w.field("timeoutEnabled", s.timeoutEnabled);
+  w.field("wifiConnected", s.wifiConnected);
+  w.field("wifiSSID", s.wifiSSID);
+  w.field("ipAddress", s.ipAddress);
+  w.endObject();
+  return w.overflowed() ? 0 : w.length();
+}
+
+// ========== TOPICS ==========
+// Clients subscribe to topics with text commands "sub:<topic>" and
+// "unsub:<topic>". New clients start subscribed to TOPIC_STATUS only.
+enum StatusTopic {
+  TOPIC_STATUS = 1 << 0,
+  TOPIC_SCOPE = 1 << 1,    // High-rate sensor traces (line pressure)
+  TOPIC_DIAG = 1 << 2      // Once-a-second performance internals
+};
+
+const uint32_t DEFAULT_TOPIC_MASK = TOPIC_STATUS;
+
+struct TopicName {
+  const char* name;
+  uint32_t bit;
+};
+
+const TopicName TOPIC_NAMES[] = {
+  {"status", TOPIC_STATUS},
+  {"scope", TOPIC_SCOPE},
+  {"diag", TOPIC_DIAG},
+};
+
+// Apply a subscription command to a client's topic mask.
+// Returns false if the message isn't a recognised command.
+inline bool applyTopicCommand(const char* msg, size_t len, uint32_t* mask) {
+  bool subscribe;
+  size_t prefix;
+  if (len > 4 && strncmp(msg, "sub:", 4) == 0) { subscribe = true; prefix = 4; }
+  else if (len > 6 && strncmp(msg, "unsub:", 6) == 0) { subscribe = false; prefix = 6; }
+  else return false;
+
+  const char* name = msg + prefix;
+  size_t nameLen = len - prefix;
+  for (size_t i = 0; i < sizeof(TOPIC_NAMES) / sizeof(TOPIC_NAMES[0]); i++) {
+    if (strlen(TOPIC_NAMES[i].name) == nameLen && strncmp(TOPIC_NAMES[i].name, name, nameLen) == 0) {
+      if (subscribe) *mask |= TOPIC_NAMES[i].bit;
+      else *mask &= ~TOPIC_NAMES[i].bit;
+      return true;
+    }
+  }
+  return false;
+}
+
+// ========== LATENCY PROBE ==========
+// Clients measure how stale the page is: edge -> frame received -> frame
+// rendered. They learn their offset from the device clock with
+// "ping:<clientTime>", answered directly to that client (not through the
+// pool) with {"topic":"pong","c":<clientTime>,"d":<deviceUs>}, and report
+// what they measured with
+// "lat:<samples>,<rx50>,<rx95>,<rx99>,<render50>,<render95>,<render99>,<max>,<rtt>"
+// (all microseconds; rx = edge -> received, render = edge -> rendered).
+struct LatencyReport {
+  uint32_t samples;       // Frames measured since the client's previous report
+  uint32_t receiveUs[3];  // p50, p95, p99
+  uint32_t renderUs[3];   // p50, p95, p99
+  uint32_t maxUs;         // Worst edge -> rendered
+  uint32_t rttUs;         // Round trip of the ping the clock offset came from
+};
+
+// Writes the pong for a ping command. Returns its length, or 0 if `msg` is
+// not a ping (the client time must be a plain decimal number).
+inline size_t writePongJson(const char* msg, size_t len, uint64_t deviceUs, char* out, size_t cap) {
+  if (len <= 5 || len > 5 + 20 || strncmp(msg, "ping:", 5) != 0) return 0;
+  for (size_t i = 5; i < len; i++) {
+    if ((msg[i] < '0' || msg[i] > '9') && msg[i] != '.') return 0;
+  }
+  int n = snprintf(out, cap, "{\"topic\":\"pong\",\"c\":%.*s,\"d\":%llu}",
+                   (int)(len - 5), msg + 5, (unsigned long long)deviceUs);
+  return (n > 0 && (size_t)n < cap) ? (size_t)n : 0;
+}
+
+// Parses a "lat:" report. Returns false if the message isn't one.
+inline bool parseLatencyReport(const char* msg, size_t len, LatencyReport* r) {
+  char buf[128];
+  if (len <= 4 || len >= sizeof(buf) || strncmp(msg, "lat:", 4) != 0) return false;
+  memcpy(buf, msg + 4, len - 4);
+  buf[len - 4] = '\0';
+
+  uint32_t* fields[] = {&r->samples, &r->receiveUs[0], &r->receiveUs[1], &r->receiveUs[2],
+                        &r->renderUs[0], &r->renderUs[1], &r->renderUs[2], &r->maxUs, &r->rttUs};
+  const size_t count = sizeof(fields) / sizeof(fields[0]);
+  const char* p = buf;
+  for (size_t i = 0; i < count; i++) {
+    if (i > 0 && *p++ != ',') return false;
+    if (*p < '0' || *p > '9') return false;
+    unsigned long v = 0;
+    for (; *p >= '0' && *p <= '9'; p++) v = v * 10 + (unsigned long)(*p - '0');
+    *fields[i] = (uint32_t)v;
+  }
+  return *p == '\0';
+}
+
+// Fixed-size client id -> topic mask table for transports with a bounded
+// number of clients.
+template <int N>
+class TopicSubscriptions {
+ public:
+  TopicSubscriptions() { for (int i = 0; i < N; i++) ids_[i] = 0; }
+
+  void add(uint32_t id) {
+    int slot = find(id);
+    if (slot < 0) slot = find(0);
+    if (slot < 0) return;
+    ids_[slot] = id;
+    masks_[slot] = DEFAULT_TOPIC_MASK;
+  }
+
+  void remove(uint32_t id) {
+    int slot = find(id);
+    if (slot >= 0) ids_[slot] = 0;
+  }
+
+  uint32_t* mask(uint32_t id) {
+    int slot = find(id);
+    return slot >= 0 ? &masks_[slot] : NULL;
+  }
+
+  bool wants(uint32_t id, uint32_t topic) {
+    int slot = find(id);
+    return slot >= 0 && (masks_[slot] & topic);
+  }
+
+  int subscriberCount(uint32_t topic) const {
+    int n = 0;
+    for (int i = 0; i < N; i++) if (ids_[i] && (masks_[i] & topic)) n++;
+    return n;
+  }
+
+  uint32_t idAt(int slot) const { return ids_[slot]; }
+  int capacity() const { return N; }
+
+ private:
+  int find(uint32_t id) const {
+    for (int i = 0; i < N; i++) if (ids_[i] == id) return i;
+    return -1;
+  }
+
+  uint32_t ids_[N];
+  uint32_t masks_[N];
+};
+
+// ========== FRAME POOL ==========
+// Fixed set of reference-counted frame buffers. A frame is encoded once and
+// the same buffer is queued to every client; each pending send holds a
+// reference and the block returns to the pool when the last one completes.
+// When every block is still in flight a new frame is dropped (and counted)
+// rather than allocated, so memory stays flat under any client load.
+// Status frames are full snapshots, so a dropped one is superseded by the next.
+// Not locked internally: callers serialize access like the publisher's.
+struct Frame {
+  char* data;
+  size_t capacity;      // Including room for the terminating NUL
+  size_t len;
+  uint16_t refs;        // 0 = free
+};
+
+struct FramePoolStats {
+  uint32_t blocks;
+  uint32_t inUse;
+  uint32_t highWater;
+  uint32_t acquired;
+  uint32_t exhausted;   // acquire() found every block in flight
+};
+
+class FramePool {
+ public:
+  // `slots` is caller-owned; blocks are added with addBlock() at init.
+  FramePool(Frame* slots, int maxBlocks) : slots_(slots), max_(maxBlocks) {
+    memset(&stats_, 0, sizeof(stats_));
+  }
+
+  bool addBlock(char* storage, size_t capacity) {
+    if ((int)stats_.blocks >= max_) return false;
+    Frame& f = slots_[stats_.blocks++];
+    f.data = storage;
+    f.capacity = capacity;
+    f.len = 0;
+    f.refs = 0;
+    return true;
+  }
+
+  // Returns a free block holding one reference, or NULL if all are in use.
+  Frame* acquire() {
+    for (uint32_t i = 0; i < stats_.blocks; i++) {
+      if (slots_[i].refs == 0) {
+        slots_[i].refs = 1;
+        slots_[i].len = 0;
+        stats_.acquired++;
+        if (++stats_.inUse > stats_.highWater) stats_.highWater = stats_.inUse;
+        return &slots_[i];
+      }
+    }
+    stats_.exhausted++;
+    return NULL;
+  }
+
+  void retain(Frame* f) { f->refs++; }
+
+  void release(Frame* f) {
+    if (f->refs > 0 && --f->refs == 0) stats_.inUse--;
+  }
+
+  int indexOf(const Frame* f) const { return (int)(f - slots_); }
+  Frame* frame(int index) { return &slots_[index]; }
+  const FramePoolStats& stats() const { return stats_; }
+
+ private:
+  Frame* slots_;
+  int max_;
+  FramePoolStats stats_;
+};
+
+// ========== TRANSPORT INTERFACE ==========
+// Implemented by each backend (AsyncWebSocket on the ESP32, POSIX sockets on
+// the host). A transport that queues a frame instead of sending it inside the
+// call must FramePool::retain() it and release it once the send completes.
+class StatusTransport {
+ public:
+  virtual ~StatusTransport() {}
+  // Send a frame to every client subscribed to `topic`.
+  virtual void broadcast(uint32_t topic, Frame& frame) = 0;
+  // Send a frame to a single client.
+  virtual void send(uint32_t clientId, Frame& frame) = 0;
+  virtual size_t clientCount() = 0;
+  // Release references for sends that have completed. Called by the
+  // publisher before it takes a new frame from the pool.
+  virtual void poll() {}
+};
+
+// ========== PUBLISHER ==========
+struct PublisherStats {
+  uint32_t framesPublished;
+  uint64_t bytesPublished;
+  uint32_t directSends;
+  uint32_t serializeFailures;
+};
+
+class StatusPublisher {
+ public:
+  StatusPublisher(StatusTransport& transport, FramePool& pool) : transport_(transport), pool_(pool), seq_(0) {
+    memset(&stats_, 0, sizeof(stats_));
+  }
+
+  // Serialize once into a pooled frame and fan out to all status subscribers.
+  // Only broadcasts advance the sequence number, so a subscriber that sees a
+  // gap in it really missed a frame.
+  void publish(StatusSnapshot& s) {
+    Frame* f = encode(s, seq_.fetch_add(1) + 1);
+    if (!f) return;
+    transport_.broadcast(TOPIC_STATUS, *f);
+    stats_.framesPublished++;
+    stats_.bytesPublished += f->len;
+    pool_.release(f);
+  }
+
+  // Send the current state to one client (e.g. right after it connects).
+  void sendTo(uint32_t clientId, StatusSnapshot& s) {
+    Frame* f = encode(s, seq_.load());
+    if (!f) return;
+    transport_.send(clientId, *f);
+    stats_.directSends++;
+    pool_.release(f);
+  }
+
+  // Fan out a message rendered by `render` (returns its length, 0 = nothing
+  // to send) on a topic other than status. Returns false if no frame was free.
+  bool publishRaw(uint32_t topic, size_t (*render)(char* out, size_t cap)) {
+    transport_.poll();
+    Frame* f = pool_.acquire();
+    if (!f) return false;
+    f->len = render(f->data, f->capacity);
+    if (f->len > 0 && f->len < f->capacity) {
+      transport_.broadcast(topic, *f);
+      stats_.framesPublished++;
+      stats_.bytesPublished += f->len;
+    }
+    pool_.release(f);
+    return true;
+  }
+
+  // Render for HTTP GET /status, stamped with the last broadcast's sequence
+  // number. May run on another task than publish(). Returns 0 if the buffer
+  // is too small.
+  size_t render(StatusSnapshot& s, char* out, size_t cap) {
+    return serialize(s, seq_.load(), out, cap);
+  }
+
+  const PublisherStats& stats() const { return stats_; }
+
+ private:
+  size_t serialize(StatusSnapshot& s, uint32_t seq, char* out, size_t cap) {
+    s.seq = seq;
+    size_t len = writeStatusJson(s, out, cap);
+    if (len == 0) stats_.serializeFailures++;
+    return len;
+  }
+
+  Frame* encode(StatusSnapshot& s, uint32_t seq) {
+    transport_.poll();
+    Frame* f = pool_.acquire();
+    if (!f) return NULL;
+    f->len = serialize(s, seq, f->data, f->capacity);
+    if (f->len == 0) {
+      pool_.release(f);
+      return NULL;
+    }
+    return f;
+  }
+
+  StatusTransport& transport_;
+  FramePool& pool_;
+  std::atomic<uint32_t> seq_;
+  PublisherStats stats_;
+};
+
+#endif  // STATUS_PUBLISHER_H
@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+"""
+Fetch and inspect the pump's fault captures (flight recorder).
+
+Each capture holds the I/O, line pressure and loop timing from a few
+seconds before to a few seconds after a fault. This lists them, saves one
+as JSON or CSV for a spreadsheet, or prints every I/O edge as a timeline.
+
+  # List the captures on the device
+  tools/flightrec/capture.py --host groutpump.local list
+
+  # Save capture 7 as JSON, or as CSV with one column per channel
+  tools/flightrec/capture.py fetch 7 -o capture-7.json
+  tools/flightrec/capture.py fetch 7 --csv -o capture-7.csv
+
+  # Print the I/O edges around the trigger, from the device or a saved file
+  tools/flightrec/capture.py timeline 7
+  tools/flightrec/capture.py timeline capture-7.json
+
+  # Save a capture now, without a fault
+  curl -X POST "http://groutpump.local/diag/captures?action=trigger"
+"""
+
+import argparse
+import csv
+import json
+import os
+import sys
+import urllib.request
+
+
+def get_json(host, path):
+    with urllib.request.urlopen(f"http://{host}{path}", timeout=30) as r:
+        return json.load(r)
+
+
+def load_capture(args, ref):
+    if os.path.exists(ref):
+        with open(ref) as f:
+            return json.load(f)
+    return get_json(args.host, f"/diag/captures?id={int(ref)}")
+
+
+def channel_bits(cap, sample):
+    io = sample[cap["fields"].index("io")]
+    return {name: (io >> bit) & 1 for bit, name in enumerate(cap["channels"])}
+
+
+def cmd_list(args):
+    info = get_json(args.host, "/diag/captures")
+    print(f"window {info['preMs']} ms before / {info['postMs']} ms after, "
+          f"sampled every {info['periodMs']} ms and on every I/O change")
+    for c in sorted(info["captures"], key=lambda c: c["id"]):
+        print(f"#{c['id']:<4} {c['reason']:<14} uptime {c['uptimeMs'] / 1000:9.1f} s  "
+              f"{c['samples']:5} samples  {c['bytes']} bytes")
+    if not info["captures"]:
+        print("no captures")
+
+
+def cmd_fetch(args):
+    cap = load_capture(args, args.capture)
+    out = open(args.output, "w", newline="") if args.output else sys.stdout
+    if args.csv:
+        fields = cap["fields"]
+        w = csv.writer(out)
+        w.writerow(["tMs"] + cap["channels"] + [f for f in fields if f not in ("tUs", "io")])
+        for s in cap["samples"]:
+            bits = channel_bits(cap, s)
+            w.writerow([f"{s[0] / 1000:.3f}"] + [bits[n] for n in cap["channels"]] +
+                       [v for f, v in zip(fields, s) if f not in ("tUs", "io")])
+    else:
+        json.dump(cap, out, indent=1)
+        out.write("\n")
+    if args.output:
+        out.close()
+        print(f"capture {cap['id']} ({cap['reason']}, {len(cap['samples'])} samples) -> {args.output}",
+              file=sys.stderr)
+
+
+def cmd_timeline(args):
+    cap = load_capture(args, args.capture)
+    print(f"capture {cap['id']}: {cap['reason']} in {cap['mode']} ({cap['cycleDirection']}), "
+          f"{cap['strokes']} strokes, last {cap['lastDuration']} ms, avg {cap['avgDuration']} ms"
+          f"{', simulated' if cap['simulation'] else ''}")
+    pressure = cap["fields"].index("pressure")
+    prev = None
+    marked = False
+    for s in cap["samples"]:
+        if not marked and s[0] >= 0:
+            print(f"{0:+10.1f} ms  ---- trigger: {cap['reason']} ----")
+            marked = True
+        bits = channel_bits(cap, s)
+        if prev is None:
+            on = [n for n, v in bits.items() if v]
+            print(f"{s[0] / 1000:+10.1f} ms  start: {' '.join(on) or '(all low)'}")
+        else:
+            edges = [f"{n}{'↑' if v else '↓'}" for n, v in bits.items() if v != prev[n]]
+            if edges:
+                print(f"{s[0] / 1000:+10.1f} ms  {' '.join(edges)}  ({s[pressure] / 10:.1f} bar)")
+        prev = bits
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("--host", default="groutpump.local")
+    sub = ap.add_subparsers(dest="command", required=True)
+    sub.add_parser("list", help="list the captures on the device").set_defaults(func=cmd_list)
+    p = sub.add_parser("fetch", help="download one capture")
+    p.add_argument("capture", help="capture id on the device, or a saved JSON file")
+    p.add_argument("--csv", action="store_true", help="write CSV with one column per channel")
+    p.add_argument("-o", "--output", help="file to write (default: stdout)")
+    p.set_defaults(func=cmd_fetch)
+    p = sub.add_parser("timeline", help="print every I/O edge around the trigger")
+    p.add_argument("capture", help="capture id on the device, or a saved JSON file")
+    p.set_defaults(func=cmd_timeline)
+    args = ap.parse_args()
+    args.func(args)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,436 @@
+/*
+ * Host-side status server
+ *
+ * Runs the firmware's StatusPublisher (src/status_publisher.h) on a Linux
+ * workstation behind a POSIX socket transport, so the web path can be load
+ * tested without an ESP32. A simulated pump cycles in AUTO mode and publishes
+ * status frames at a fixed rate.
+ *
+ * Endpoints:
+ *   GET /ws      WebSocket, same frames and topic commands as the firmware
+ *   GET /status  Status JSON
+ *   GET /stats   Server counters (clients, frames, RSS) used by loadgen
+ *
+ * Usage: host_server [--port 8080] [--rate 10] [--max-queue 65536]
+ */
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <deque>
+#include <vector>
+
+#include "status_publisher.h"
+#include "ws_common.h"
+
+// A pooled status frame waiting on one connection. Holds a pool reference
+// until its last byte is written.
+struct QueuedFrame {
+  Frame* frame;
+  char header[10];
+  size_t headerLen;
+  size_t off;               // Bytes of header + payload already sent
+};
+
+struct Conn {
+  int fd;
+  uint32_t id;
+  bool websocket;
+  bool closeAfterFlush;
+  uint32_t topics;
+  std::string in;
+  std::string out;          // HTTP responses and control frames
+  std::deque<QueuedFrame> frames;
+  size_t framesQueuedBytes;
+};
+
+struct ServerStats {
+  uint64_t droppedFrames;   // Frames skipped because a client's queue was full
+  uint64_t bytesQueued;
+  uint32_t connectsTotal;
+};
+
+static std::vector<Conn*> conns;
+static ServerStats serverStats;
+static size_t maxQueueBytes = 65536;
+// AsyncWebSocket's per-client queue limit (WS_MAX_QUEUED_MESSAGES), which is
+// what queueIsFull() checks on the device
+static const size_t MAX_QUEUED_FRAMES = 32;
+
+// Frames stay referenced while any slow client still has them queued, so
+// the host pool is sized for a few hundred clients lagging a few frames.
+static const int HOST_FRAME_BLOCKS = 64;
+static char frameStorage[HOST_FRAME_BLOCKS][STATUS_FRAME_CAPACITY];
+static Frame frameSlots[HOST_FRAME_BLOCKS];
+static FramePool framePool(frameSlots, HOST_FRAME_BLOCKS);
+
+// ========== POSIX TRANSPORT ==========
+// Mirrors the device transport: each client is sent frame.len bytes of the
+// shared block, and messages are dropped for a client whose send queue is
+// full (by message count, as on the device, or by bytes) instead of
+// blocking the publisher.
+class PosixWsTransport : public StatusTransport {
+ public:
+  void broadcast(uint32_t topic, Frame& frame) override {
+    std::string header = wsFrameHeader(WS_OP_TEXT, frame.len);
+    for (size_t i = 0; i < conns.size(); i++) {
+      Conn* c = conns[i];
+      if (c->websocket && (c->topics & topic)) enqueue(c, header, frame);
+    }
+  }
+
+  void send(uint32_t clientId, Frame& frame) override {
+    std::string header = wsFrameHeader(WS_OP_TEXT, frame.len);
+    for (size_t i = 0; i < conns.size(); i++) {
+      if (conns[i]->id == clientId) enqueue(conns[i], header, frame);
+    }
+  }
+
+  size_t clientCount() override {
+    size_t n = 0;
+    for (size_t i = 0; i < conns.size(); i++) if (conns[i]->websocket) n++;
+    return n;
+  }
+
+ private:
+  void enqueue(Conn* c, const std::string& header, Frame& frame) {
+    size_t bytes = header.size() + frame.len;
+    if (c->frames.size() >= MAX_QUEUED_FRAMES || c->out.size() + c->framesQueuedBytes + bytes > maxQueueBytes) {
+      serverStats.droppedFrames++;
+      return;
+    }
+    QueuedFrame q;
+    q.frame = &frame;
+    memcpy(q.header, header.data(), header.size());
+    q.headerLen = header.size();
+    q.off = 0;
+    framePool.retain(&frame);
+    c->frames.push_back(q);
+    c->framesQueuedBytes += bytes;
+    serverStats.bytesQueued += bytes;
+  }
+};
+
+static PosixWsTransport transport;
+static StatusPublisher publisher(transport, framePool);
+static StatusSnapshot snapshot;
+
+// ========== SIMULATED PUMP ==========
+struct SimPump {
+  bool out;
+  uint64_t strokeStartUs;
+  unsigned long strokeMs;
+  unsigned long history[STATUS_HISTORY_LEN];
+  int historyIndex;
+  int historyCount;
+  unsigned long lastDuration;
+  uint64_t edgeUs;          // Reversal not yet published, like an end-stop edge
+};
+
+static SimPump pump;
+
+static void simulate(uint64_t now) {
+  if (pump.strokeStartUs == 0) pump.strokeStartUs = now;
+  if (now - pump.strokeStartUs < (uint64_t)pump.strokeMs * 1000) return;
+
+  pump.lastDuration = pump.strokeMs;
+  pump.history[pump.historyIndex] = pump.strokeMs;
+  pump.historyIndex = (pump.historyIndex + 1) % STATUS_HISTORY_LEN;
+  if (pump.historyCount < STATUS_HISTORY_LEN) pump.historyCount++;
+  pump.out = !pump.out;
+  pump.strokeStartUs = now;
+  pump.edgeUs = now;
+  pump.strokeMs = 3800 + rand() % 400;
+}
+
+static void captureStatus(StatusSnapshot& s) {
+  s.timestampUs = nowUs();
+  s.edgeUs = 0;             // Set by the publish tick for frames an edge caused
+  s.edge = NULL;
+  s.simulation = true;
+  s.estopActive = false;
+  s.mode = "AUTO";
+  s.cycleDirection = pump.out ? "OUT" : "IN";
+  s.gpo1 = pump.out ? 0 : 1;
+  s.gpo2 = pump.out ? 1 : 0;
+  s.inputA = s.inputB = s.inputC = s.inputD = false;
+  s.endStopIn = s.endStopOut = false;
+  s.lastDuration = pump.lastDuration;
+
+  unsigned long sum = 0;
+  int start = (pump.historyCount < STATUS_HISTORY_LEN) ? 0 : pump.historyIndex;
+  for (int i = 0; i < pump.historyCount; i++) {
+    s.history[i] = pump.history[(start + i) % STATUS_HISTORY_LEN];
+    sum += s.history[i];
+  }
+  s.historyCount = pump.historyCount;
+  s.avgDuration = pump.historyCount ? sum / pump.historyCount : 0;
+  s.cycleTimeout = 30000;
+  s.timeoutEnabled = true;
+  s.wifiConnected = true;
+  strcpy(s.wifiSSID, "host");
+  strcpy(s.ipAddress, "127.0.0.1");
+}
+
+// ========== HTTP ==========
+static void httpRespond(Conn* c, int code, const char* type, const char* body, size_t len) {
+  char head[256];
+  snprintf(head, sizeof(head),
+           "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %lu\r\nConnection: close\r\n\r\n",
+           code, code == 200 ? "OK" : "Not Found", type, (unsigned long)len);
+  c->out.append(head);
+  c->out.append(body, len);
+  c->closeAfterFlush = true;
+}
+
+static size_t renderStats(char* out, size_t cap) {
+  const PublisherStats& ps = publisher.stats();
+  const FramePoolStats& pool = framePool.stats();
+  size_t queued = 0;
+  for (size_t i = 0; i < conns.size(); i++) queued += conns[i]->out.size() + conns[i]->framesQueuedBytes;
+
+  JsonWriter w(out, cap);
+  w.beginObject();
+  w.field("connections", (unsigned long)conns.size());
+  w.field("wsClients", (unsigned long)transport.clientCount());
+  w.field("connectsTotal", (unsigned long)serverStats.connectsTotal);
+  w.field("rssKb", readRssKb());
+  w.field("framesPublished", (unsigned long)ps.framesPublished);
+  w.field("bytesPublished", (unsigned long long)ps.bytesPublished);
+  w.field("directSends", (unsigned long)ps.directSends);
+  w.field("droppedFrames", (unsigned long long)serverStats.droppedFrames);
+  w.field("bytesQueued", (unsigned long long)serverStats.bytesQueued);
+  w.field("queuedNow", (unsigned long)queued);
+  w.beginObject("framePool");
+  w.field("blocks", (unsigned long)pool.blocks);
+  w.field("inUse", (unsigned long)pool.inUse);
+  w.field("highWater", (unsigned long)pool.highWater);
+  w.field("acquired", (unsigned long)pool.acquired);
+  w.field("exhausted", (unsigned long)pool.exhausted);
+  w.endObject();
+  w.endObject();
+  return w.length();
+}
+
+static void handleHttp(Conn* c) {
+  size_t end = c->in.find("\r\n\r\n");
+  if (end == std::string::npos) return;
+  std::string head = c->in.substr(0, end + 4);
+  c->in.erase(0, end + 4);
+
+  char method[8] = {0}, path[128] = {0};
+  sscanf(head.c_str(), "%7s %127s", method, path);
+
+  if (strcmp(path, "/ws") == 0 && !httpHeader(head, "Sec-WebSocket-Key").empty()) {
+    std::string accept = wsAcceptKey(httpHeader(head, "Sec-WebSocket-Key"));
+    c->out.append("HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\n"
+                  "Connection: Upgrade\r\nSec-WebSocket-Accept: " + accept + "\r\n\r\n");
+    c->websocket = true;
+    c->topics = DEFAULT_TOPIC_MASK;
+    captureStatus(snapshot);
+    publisher.sendTo(c->id, snapshot);
+  } else if (strcmp(path, "/status") == 0) {
+    char json[STATUS_FRAME_CAPACITY];
+    captureStatus(snapshot);
+    size_t len = publisher.render(snapshot, json, sizeof(json));
+    httpRespond(c, 200, "application/json", json, len);
+  } else if (strcmp(path, "/stats") == 0) {
+    char json[512];
+    size_t len = renderStats(json, sizeof(json));
+    httpRespond(c, 200, "application/json", json, len);
+  } else {
+    httpRespond(c, 404, "text/plain", "Not Found", 9);
+  }
+}
+
+static void handleWebSocket(Conn* c) {
+  uint8_t opcode;
+  std::string payload;
+  while (wsParseFrame(c->in, &opcode, &payload)) {
+    if (opcode == WS_OP_TEXT) {
+      char pong[80];
+      size_t pongLen = writePongJson(payload.data(), payload.size(), nowUs(), pong, sizeof(pong));
+      if (pongLen) {
+        c->out.append(wsFrameHeader(WS_OP_TEXT, pongLen));
+        c->out.append(pong, pongLen);
+      } else {
+        applyTopicCommand(payload.data(), payload.size(), &c->topics);
+      }
+    } else if (opcode == WS_OP_PING) {
+      c->out.append(wsFrameHeader(WS_OP_PONG, payload.size()));
+      c->out.append(payload);
+    } else if (opcode == WS_OP_CLOSE) {
+      c->out.append(wsFrameHeader(WS_OP_CLOSE, 0));
+      c->closeAfterFlush = true;
+    }
+  }
+}
+
+// ========== MAIN LOOP ==========
+// Writes the head of the frame queue (header then pooled payload). Returns
+// bytes written, 0 if the socket would block, -1 on error.
+static ssize_t sendQueuedFrame(Conn* c) {
+  QueuedFrame& q = c->frames.front();
+  struct iovec iov[2];
+  int n = 0;
+  if (q.off < q.headerLen) {
+    iov[n].iov_base = q.header + q.off;
+    iov[n++].iov_len = q.headerLen - q.off;
+    iov[n].iov_base = q.frame->data;
+    iov[n++].iov_len = q.frame->len;
+  } else {
+    iov[n].iov_base = q.frame->data + (q.off - q.headerLen);
+    iov[n++].iov_len = q.frame->len - (q.off - q.headerLen);
+  }
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = n;
+  ssize_t sent = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+  if (sent < 0) return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+  q.off += sent;
+  if (q.off == q.headerLen + q.frame->len) {
+    c->framesQueuedBytes -= q.off;
+    framePool.release(q.frame);
+    c->frames.pop_front();
+  }
+  return sent;
+}
+
+static bool flush(Conn* c) {
+  for (;;) {
+    // A partly written frame must finish before anything else goes out
+    bool frameInProgress = !c->frames.empty() && c->frames.front().off > 0;
+    if (!frameInProgress && !c->out.empty()) {
+      ssize_t n = send(c->fd, c->out.data(), c->out.size(), MSG_NOSIGNAL);
+      if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+      c->out.erase(0, n);
+    } else if (!c->frames.empty()) {
+      ssize_t n = sendQueuedFrame(c);
+      if (n < 0) return false;
+      if (n == 0) return true;
+    } else {
+      break;
+    }
+  }
+  return !c->closeAfterFlush;
+}
+
+static void closeConn(size_t i) {
+  Conn* c = conns[i];
+  for (size_t k = 0; k < c->frames.size(); k++) framePool.release(c->frames[k].frame);
+  close(c->fd);
+  delete c;
+  conns.erase(conns.begin() + i);
+}
+
+int main(int argc, char** argv) {
+  int port = 8080;
+  double rate = 10.0;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "--port") == 0) port = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "--rate") == 0) rate = atof(argv[i + 1]);
+    else if (strcmp(argv[i], "--max-queue") == 0) maxQueueBytes = strtoul(argv[i + 1], NULL, 10);
+    else {
+      fprintf(stderr, "usage: %s [--port N] [--rate HZ] [--max-queue BYTES]\n", argv[0]);
+      return 2;
+    }
+  }
+  signal(SIGPIPE, SIG_IGN);
+  pump.strokeMs = 4000;
+  for (int i = 0; i < HOST_FRAME_BLOCKS; i++) framePool.addBlock(frameStorage[i], STATUS_FRAME_CAPACITY);
+
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  int one = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listener, 1024) < 0) {
+    perror("bind/listen");
+    return 1;
+  }
+  setNonBlocking(listener);
+  printf("host_server listening on 127.0.0.1:%d, publishing at %.1f Hz\n", port, rate);
+  fflush(stdout);
+
+  uint64_t periodUs = (uint64_t)(1000000.0 / rate);
+  uint64_t nextPublish = nowUs() + periodUs;
+  uint32_t nextId = 1;
+  std::vector<struct pollfd> fds;
+
+  for (;;) {
+    fds.clear();
+    struct pollfd lp = {listener, POLLIN, 0};
+    fds.push_back(lp);
+    for (size_t i = 0; i < conns.size(); i++) {
+      bool pending = !conns[i]->out.empty() || !conns[i]->frames.empty();
+      struct pollfd p = {conns[i]->fd, (short)(POLLIN | (pending ? POLLOUT : 0)), 0};
+      fds.push_back(p);
+    }
+
+    uint64_t now = nowUs();
+    int timeoutMs = now >= nextPublish ? 0 : (int)((nextPublish - now) / 1000);
+    poll(fds.data(), fds.size(), timeoutMs);
+
+    if (fds[0].revents & POLLIN) {
+      int fd;
+      while ((fd = accept(listener, NULL, NULL)) >= 0) {
+        setNonBlocking(fd);
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        Conn* c = new Conn();
+        c->fd = fd;
+        c->id = nextId++;
+        c->websocket = false;
+        c->closeAfterFlush = false;
+        c->topics = 0;
+        c->framesQueuedBytes = 0;
+        conns.push_back(c);
+        serverStats.connectsTotal++;
+      }
+    }
+
+    // fds[1..] line up with conns as they were before accept() appended more.
+    for (size_t i = fds.size() - 1; i >= 1; i--) {
+      Conn* c = conns[i - 1];
+      bool keep = true;
+      if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+        char buf[4096];
+        ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+        if (n <= 0) {
+          keep = (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+        } else {
+          c->in.append(buf, n);
+          if (c->websocket) handleWebSocket(c);
+          else handleHttp(c);
+        }
+      }
+      if (keep) keep = flush(c);
+      if (!keep) closeConn(i - 1);
+    }
+
+    now = nowUs();
+    if (now >= nextPublish) {
+      simulate(now);
+      captureStatus(snapshot);
+      snapshot.edgeUs = pump.edgeUs;
+      snapshot.edge = pump.out ? "endStopIn" : "endStopOut";
+      pump.edgeUs = 0;
+      publisher.publish(snapshot);
+      for (size_t i = conns.size(); i-- > 0;) {
+        if (!flush(conns[i])) closeConn(i);
+      }
+      nextPublish += periodUs;
+      if (nextPublish < now) nextPublish = now + periodUs;  // Don't burst after a stall
+    }
+  }
+}
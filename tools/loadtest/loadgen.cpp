@@ -0,0 +1,277 @@
+/*
+ * WebSocket load generator
+ *
+ * Opens many WebSocket clients against host_server (or a real device) and
+ * measures connect time, broadcast latency, throughput, missed frames and
+ * server memory per client. Results are written as JSON so runs can be
+ * compared across changes.
+ *
+ * Broadcast latency uses the "ts" field of each status frame, which the host
+ * server fills from CLOCK_MONOTONIC; it is only meaningful when loadgen runs
+ * on the same machine as host_server.
+ *
+ * Usage: loadgen [--host 127.0.0.1] [--port 8080] [--clients 200]
+ *                [--duration 10] [--label NAME] [--report loadtest-report.json]
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "ws_common.h"
+
+struct Client {
+  int fd;
+  std::string in;
+  uint32_t lastSeq;
+  uint64_t frames;
+  uint64_t bytes;
+  uint64_t missed;
+};
+
+static const char* host = "127.0.0.1";
+static int port = 8080;
+
+static int connectTcp() {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  inet_pton(AF_INET, host, &addr.sin_addr);
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return fd;
+}
+
+// Read until the end of the HTTP header block; anything after it is returned
+// in `rest`.
+static bool readHead(int fd, std::string* head, std::string* rest) {
+  std::string buf;
+  char tmp[2048];
+  while (buf.find("\r\n\r\n") == std::string::npos) {
+    ssize_t n = recv(fd, tmp, sizeof(tmp), 0);
+    if (n <= 0) return false;
+    buf.append(tmp, n);
+  }
+  size_t end = buf.find("\r\n\r\n") + 4;
+  *head = buf.substr(0, end);
+  *rest = buf.substr(end);
+  return true;
+}
+
+static std::string httpGet(const char* path) {
+  int fd = connectTcp();
+  if (fd < 0) return std::string();
+  char req[256];
+  snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n", path, host);
+  send(fd, req, strlen(req), MSG_NOSIGNAL);
+  std::string head, body;
+  if (readHead(fd, &head, &body)) {
+    char tmp[2048];
+    ssize_t n;
+    while ((n = recv(fd, tmp, sizeof(tmp), 0)) > 0) body.append(tmp, n);
+  }
+  close(fd);
+  return body;
+}
+
+// Pull an unsigned number out of a flat JSON object ("key":123).
+static uint64_t jsonNumber(const std::string& json, const char* key) {
+  std::string needle = std::string("\"") + key + "\":";
+  size_t pos = json.find(needle);
+  if (pos == std::string::npos) return 0;
+  return strtoull(json.c_str() + pos + needle.size(), NULL, 10);
+}
+
+static bool openClient(Client* c) {
+  c->fd = connectTcp();
+  if (c->fd < 0) return false;
+  char req[512];
+  snprintf(req, sizeof(req),
+           "GET /ws HTTP/1.1\r\nHost: %s\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+           "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n", host);
+  send(c->fd, req, strlen(req), MSG_NOSIGNAL);
+  std::string head;
+  if (!readHead(c->fd, &head, &c->in) || head.find(" 101 ") == std::string::npos) {
+    close(c->fd);
+    c->fd = -1;
+    return false;
+  }
+  setNonBlocking(c->fd);
+  c->lastSeq = 0;
+  c->frames = c->bytes = c->missed = 0;
+  return true;
+}
+
+static uint64_t percentile(const std::vector<uint64_t>& sorted, double p) {
+  if (sorted.empty()) return 0;
+  size_t idx = (size_t)(p * (sorted.size() - 1) + 0.5);
+  return sorted[idx];
+}
+
+int main(int argc, char** argv) {
+  int clientCount = 200;
+  double duration = 10.0;
+  const char* label = "";
+  const char* reportPath = "loadtest-report.json";
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "--host") == 0) host = argv[i + 1];
+    else if (strcmp(argv[i], "--port") == 0) port = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "--clients") == 0) clientCount = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "--duration") == 0) duration = atof(argv[i + 1]);
+    else if (strcmp(argv[i], "--label") == 0) label = argv[i + 1];
+    else if (strcmp(argv[i], "--report") == 0) reportPath = argv[i + 1];
+    else {
+      fprintf(stderr, "usage: %s [--host H] [--port N] [--clients N] [--duration S] [--label NAME] [--report FILE]\n", argv[0]);
+      return 2;
+    }
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  std::string baseline = httpGet("/stats");
+  if (baseline.empty()) {
+    fprintf(stderr, "Cannot reach %s:%d/stats - is host_server running?\n", host, port);
+    return 1;
+  }
+  uint64_t rssBaseline = jsonNumber(baseline, "rssKb");
+
+  // Connect phase
+  std::vector<Client> clients(clientCount);
+  std::vector<uint64_t> connectUs;
+  int failed = 0;
+  for (int i = 0; i < clientCount; i++) {
+    uint64_t t0 = nowUs();
+    if (openClient(&clients[i])) connectUs.push_back(nowUs() - t0);
+    else failed++;
+  }
+  std::sort(connectUs.begin(), connectUs.end());
+
+  // Let the server settle, then sample its memory with all clients attached.
+  usleep(200000);
+  std::string loaded = httpGet("/stats");
+  uint64_t rssLoaded = jsonNumber(loaded, "rssKb");
+  uint64_t framesBefore = jsonNumber(loaded, "framesPublished");
+  uint64_t droppedBefore = jsonNumber(loaded, "droppedFrames");
+
+  // Measurement phase
+  std::vector<uint64_t> latencies;
+  std::vector<struct pollfd> fds;
+  for (size_t i = 0; i < clients.size(); i++) {
+    if (clients[i].fd < 0) continue;
+    // Discard the on-connect snapshot and anything queued while settling
+    char buf[8192];
+    ssize_t n;
+    while ((n = recv(clients[i].fd, buf, sizeof(buf), 0)) > 0) clients[i].in.append(buf, n);
+    uint8_t opcode;
+    std::string payload;
+    while (wsParseFrame(clients[i].in, &opcode, &payload)) {}
+    struct pollfd p = {clients[i].fd, POLLIN, 0};
+    fds.push_back(p);
+  }
+  std::vector<Client*> byFd;
+  for (size_t i = 0; i < clients.size(); i++) if (clients[i].fd >= 0) byFd.push_back(&clients[i]);
+
+  uint64_t start = nowUs();
+  uint64_t end = start + (uint64_t)(duration * 1e6);
+  uint64_t totalFrames = 0, totalBytes = 0, totalMissed = 0;
+  while (nowUs() < end) {
+    int remainingMs = (int)((end - nowUs()) / 1000);
+    if (poll(fds.data(), fds.size(), remainingMs > 100 ? 100 : remainingMs) <= 0) continue;
+    for (size_t i = 0; i < fds.size(); i++) {
+      if (!(fds[i].revents & POLLIN)) continue;
+      Client* c = byFd[i];
+      char buf[8192];
+      ssize_t n;
+      while ((n = recv(c->fd, buf, sizeof(buf), 0)) > 0) c->in.append(buf, n);
+
+      uint8_t opcode;
+      std::string payload;
+      uint64_t received = nowUs();
+      while (wsParseFrame(c->in, &opcode, &payload)) {
+        if (opcode != WS_OP_TEXT) continue;
+        uint32_t seq = (uint32_t)jsonNumber(payload, "seq");
+        uint64_t ts = jsonNumber(payload, "ts");
+        if (ts && received >= ts) latencies.push_back(received - ts);
+        if (c->lastSeq && seq > c->lastSeq + 1) c->missed += seq - c->lastSeq - 1;
+        c->lastSeq = seq;
+        c->frames++;
+        c->bytes += payload.size();
+      }
+    }
+  }
+  double elapsed = (nowUs() - start) / 1e6;
+  for (size_t i = 0; i < byFd.size(); i++) {
+    totalFrames += byFd[i]->frames;
+    totalBytes += byFd[i]->bytes;
+    totalMissed += byFd[i]->missed;
+  }
+
+  std::string after = httpGet("/stats");
+  uint64_t framesPublished = jsonNumber(after, "framesPublished") - framesBefore;
+  uint64_t dropped = jsonNumber(after, "droppedFrames") - droppedBefore;
+
+  for (size_t i = 0; i < byFd.size(); i++) close(byFd[i]->fd);
+
+  std::sort(latencies.begin(), latencies.end());
+  uint64_t latencySum = 0;
+  for (size_t i = 0; i < latencies.size(); i++) latencySum += latencies[i];
+  int connected = (int)byFd.size();
+  long bytesPerClient = connected ? (long)((rssLoaded - rssBaseline) * 1024 / connected) : 0;
+
+  FILE* f = fopen(reportPath, "w");
+  if (!f) {
+    perror(reportPath);
+    return 1;
+  }
+  fprintf(f, "{\n");
+  fprintf(f, "  \"label\": \"%s\",\n", label);
+  fprintf(f, "  \"timestamp\": %ld,\n", (long)time(NULL));
+  fprintf(f, "  \"config\": {\"host\": \"%s\", \"port\": %d, \"clients\": %d, \"durationSec\": %.1f},\n",
+          host, port, clientCount, duration);
+  fprintf(f, "  \"connect\": {\"ok\": %d, \"failed\": %d, \"p50Us\": %llu, \"p99Us\": %llu, \"maxUs\": %llu},\n",
+          connected, failed,
+          (unsigned long long)percentile(connectUs, 0.50), (unsigned long long)percentile(connectUs, 0.99),
+          (unsigned long long)(connectUs.empty() ? 0 : connectUs.back()));
+  fprintf(f, "  \"latencyUs\": {\"samples\": %lu, \"min\": %llu, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"max\": %llu, \"mean\": %llu},\n",
+          (unsigned long)latencies.size(),
+          (unsigned long long)(latencies.empty() ? 0 : latencies.front()),
+          (unsigned long long)percentile(latencies, 0.50), (unsigned long long)percentile(latencies, 0.90),
+          (unsigned long long)percentile(latencies, 0.99),
+          (unsigned long long)(latencies.empty() ? 0 : latencies.back()),
+          (unsigned long long)(latencies.empty() ? 0 : latencySum / latencies.size()));
+  fprintf(f, "  \"throughput\": {\"framesPerSec\": %.1f, \"bytesPerSec\": %.1f, \"framesPerClientPerSec\": %.2f},\n",
+          totalFrames / elapsed, totalBytes / elapsed, connected ? totalFrames / elapsed / connected : 0.0);
+  fprintf(f, "  \"frames\": {\"published\": %llu, \"received\": %llu, \"missed\": %llu, \"droppedByServer\": %llu},\n",
+          (unsigned long long)framesPublished, (unsigned long long)totalFrames,
+          (unsigned long long)totalMissed, (unsigned long long)dropped);
+  fprintf(f, "  \"memory\": {\"rssBaselineKb\": %llu, \"rssLoadedKb\": %llu, \"bytesPerClient\": %ld}\n",
+          (unsigned long long)rssBaseline, (unsigned long long)rssLoaded, bytesPerClient);
+  fprintf(f, "}\n");
+  fclose(f);
+
+  printf("clients: %d connected, %d failed\n", connected, failed);
+  printf("latency: p50 %llu us, p99 %llu us, max %llu us (%lu samples)\n",
+         (unsigned long long)percentile(latencies, 0.50), (unsigned long long)percentile(latencies, 0.99),
+         (unsigned long long)(latencies.empty() ? 0 : latencies.back()), (unsigned long)latencies.size());
+  printf("throughput: %.1f frames/s, %.1f KB/s; missed %llu, dropped by server %llu\n",
+         totalFrames / elapsed, totalBytes / elapsed / 1024, (unsigned long long)totalMissed,
+         (unsigned long long)dropped);
+  printf("memory: %ld bytes/client (RSS %llu -> %llu kB)\n", bytesPerClient,
+         (unsigned long long)rssBaseline, (unsigned long long)rssLoaded);
+  printf("report written to %s\n", reportPath);
+  return 0;
+}
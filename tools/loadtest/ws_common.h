@@ -0,0 +1,187 @@
+/*
+ * Shared helpers for the host-side load test tools: monotonic clock,
+ * WebSocket handshake (SHA-1 + base64) and RFC 6455 frame encode/decode.
+ */
+
+#ifndef WS_COMMON_H
+#define WS_COMMON_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <string>
+
+inline uint64_t nowUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+inline void setNonBlocking(int fd) {
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+// Resident set size of this process in kB (Linux only, 0 if unavailable).
+inline long readRssKb() {
+  FILE* f = fopen("/proc/self/status", "r");
+  if (!f) return 0;
+  char line[128];
+  long kb = 0;
+  while (fgets(line, sizeof(line), f)) {
+    if (strncmp(line, "VmRSS:", 6) == 0) {
+      kb = strtol(line + 6, NULL, 10);
+      break;
+    }
+  }
+  fclose(f);
+  return kb;
+}
+
+// ========== SHA-1 / BASE64 ==========
+inline void sha1(const uint8_t* data, size_t len, uint8_t out[20]) {
+  uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+  uint64_t bitLen = (uint64_t)len * 8;
+  size_t total = ((len + 8) / 64 + 1) * 64;
+  std::string msg((const char*)data, len);
+  msg.push_back((char)0x80);
+  msg.resize(total - 8, '\0');
+  for (int i = 7; i >= 0; i--) msg.push_back((char)(bitLen >> (i * 8)));
+
+  for (size_t chunk = 0; chunk < total; chunk += 64) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++) {
+      const uint8_t* p = (const uint8_t*)msg.data() + chunk + i * 4;
+      w[i] = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+    }
+    for (int i = 16; i < 80; i++) {
+      uint32_t v = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+      w[i] = (v << 1) | (v >> 31);
+    }
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; i++) {
+      uint32_t f, k;
+      if (i < 20) { f = (b & c) | (~b & d); k = 0x5A827999; }
+      else if (i < 40) { f = b ^ c ^ d; k = 0x6ED9EBA1; }
+      else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+      else { f = b ^ c ^ d; k = 0xCA62C1D6; }
+      uint32_t t = ((a << 5) | (a >> 27)) + f + e + k + w[i];
+      e = d; d = c; c = (b << 30) | (b >> 2); b = a; a = t;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+  }
+  for (int i = 0; i < 5; i++) {
+    out[i * 4] = h[i] >> 24; out[i * 4 + 1] = h[i] >> 16;
+    out[i * 4 + 2] = h[i] >> 8; out[i * 4 + 3] = h[i];
+  }
+}
+
+inline std::string base64(const uint8_t* data, size_t len) {
+  static const char* table = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string out;
+  for (size_t i = 0; i < len; i += 3) {
+    uint32_t v = (uint32_t)data[i] << 16;
+    if (i + 1 < len) v |= (uint32_t)data[i + 1] << 8;
+    if (i + 2 < len) v |= data[i + 2];
+    out.push_back(table[(v >> 18) & 63]);
+    out.push_back(table[(v >> 12) & 63]);
+    out.push_back(i + 1 < len ? table[(v >> 6) & 63] : '=');
+    out.push_back(i + 2 < len ? table[v & 63] : '=');
+  }
+  return out;
+}
+
+inline std::string wsAcceptKey(const std::string& clientKey) {
+  std::string s = clientKey + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+  uint8_t digest[20];
+  sha1((const uint8_t*)s.data(), s.size(), digest);
+  return base64(digest, 20);
+}
+
+// Case-insensitive lookup of an HTTP header value in a raw request/response.
+inline std::string httpHeader(const std::string& head, const char* name) {
+  size_t nameLen = strlen(name);
+  size_t pos = 0;
+  while ((pos = head.find("\r\n", pos)) != std::string::npos) {
+    pos += 2;
+    if (strncasecmp(head.c_str() + pos, name, nameLen) == 0 && head[pos + nameLen] == ':') {
+      size_t start = head.find_first_not_of(' ', pos + nameLen + 1);
+      size_t end = head.find("\r\n", start);
+      return head.substr(start, end - start);
+    }
+  }
+  return std::string();
+}
+
+// ========== FRAMES ==========
+const uint8_t WS_OP_TEXT = 0x1;
+const uint8_t WS_OP_BINARY = 0x2;
+const uint8_t WS_OP_CLOSE = 0x8;
+const uint8_t WS_OP_PING = 0x9;
+const uint8_t WS_OP_PONG = 0xA;
+
+// Frame header for an unfragmented frame. Clients must mask (RFC 6455 5.3).
+inline std::string wsFrameHeader(uint8_t opcode, size_t len, const uint8_t* mask = NULL) {
+  std::string h;
+  h.push_back((char)(0x80 | opcode));
+  uint8_t maskBit = mask ? 0x80 : 0;
+  if (len < 126) {
+    h.push_back((char)(maskBit | len));
+  } else if (len < 65536) {
+    h.push_back((char)(maskBit | 126));
+    h.push_back((char)(len >> 8));
+    h.push_back((char)len);
+  } else {
+    h.push_back((char)(maskBit | 127));
+    for (int i = 7; i >= 0; i--) h.push_back((char)((uint64_t)len >> (i * 8)));
+  }
+  if (mask) h.append((const char*)mask, 4);
+  return h;
+}
+
+inline std::string wsEncodeMasked(uint8_t opcode, const char* data, size_t len) {
+  uint8_t mask[4] = {0x12, 0x34, 0x56, 0x78};
+  std::string f = wsFrameHeader(opcode, len, mask);
+  for (size_t i = 0; i < len; i++) f.push_back(data[i] ^ mask[i & 3]);
+  return f;
+}
+
+// Pops one complete frame off the front of `buf`. Returns false if more data
+// is needed. Payload is unmasked in place.
+inline bool wsParseFrame(std::string& buf, uint8_t* opcode, std::string* payload) {
+  if (buf.size() < 2) return false;
+  const uint8_t* p = (const uint8_t*)buf.data();
+  size_t pos = 2;
+  uint64_t len = p[1] & 0x7F;
+  bool masked = p[1] & 0x80;
+  if (len == 126) {
+    if (buf.size() < 4) return false;
+    len = ((uint64_t)p[2] << 8) | p[3];
+    pos = 4;
+  } else if (len == 127) {
+    if (buf.size() < 10) return false;
+    len = 0;
+    for (int i = 0; i < 8; i++) len = (len << 8) | p[2 + i];
+    pos = 10;
+  }
+  uint8_t mask[4] = {0, 0, 0, 0};
+  if (masked) {
+    if (buf.size() < pos + 4) return false;
+    memcpy(mask, p + pos, 4);
+    pos += 4;
+  }
+  if (buf.size() < pos + len) return false;
+
+  *opcode = p[0] & 0x0F;
+  payload->assign(buf, pos, (size_t)len);
+  if (masked) {
+    for (size_t i = 0; i < payload->size(); i++) (*payload)[i] ^= mask[i & 3];
+  }
+  buf.erase(0, pos + (size_t)len);
+  return true;
+}
+
+#endif  // WS_COMMON_H
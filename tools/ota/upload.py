@@ -0,0 +1,134 @@
+#!/usr/bin/env python3
+"""
+Resumable firmware upload over the pump's chunked OTA endpoints.
+
+Sends the image in chunks, each with its offset and SHA-256. A dropped
+connection or a rejected chunk is retried from the last chunk the pump
+confirmed, and rerunning the script after an interruption (even a pump
+reboot) picks up where it stopped. The pump verifies the whole image
+before it boots it.
+
+  # Build, then upload the new firmware
+  pio run
+  tools/ota/upload.py .pio/build/esp32dev/firmware.bin
+
+  # Smaller chunks lose less on a very poor link; keep retrying for 10 minutes
+  tools/ota/upload.py firmware.bin --host 192.168.1.50 --chunk 8192 --give-up 600
+
+  # Where does the upload stand?
+  curl http://groutpump.local/ota
+"""
+
+import argparse
+import hashlib
+import json
+import sys
+import time
+import urllib.error
+import urllib.request
+
+
+def post(host, path, body=None, timeout=30):
+    req = urllib.request.Request(f"http://{host}{path}", data=body if body is not None else b"", method="POST")
+    if body is not None:
+        req.add_header("Content-Type", "application/octet-stream")
+    try:
+        with urllib.request.urlopen(req, timeout=timeout) as r:
+            return r.status, r.read().decode()
+    except urllib.error.HTTPError as e:
+        return e.code, e.read().decode()
+
+
+def get(host, path, timeout=30):
+    with urllib.request.urlopen(f"http://{host}{path}", timeout=timeout) as r:
+        return json.loads(r.read().decode())
+
+
+def wait_verified(host, timeout):
+    """Poll GET /ota while the pump hashes the image. True once it is restarting into it."""
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        time.sleep(1)
+        try:
+            status = get(host, "/ota")
+        except (OSError, ValueError):
+            continue  # Already restarting, or a dropped poll
+        if status.get("restarting"):
+            return True, status
+        if not status.get("active"):
+            return False, status
+        if status.get("verifying"):
+            print(f"\rverifying {status['verified'] * 100 // status['size']:3d}%", end="", file=sys.stderr)
+    return False, {"lastError": f"still verifying after {timeout:.0f} s"}
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("image", help="firmware.bin")
+    ap.add_argument("--host", default="groutpump.local")
+    ap.add_argument("--chunk", type=int, default=32768, help="bytes per chunk, a multiple of 4096 up to 65536")
+    ap.add_argument("--give-up", type=float, default=300, help="seconds without progress before giving up")
+    args = ap.parse_args()
+
+    with open(args.image, "rb") as f:
+        image = f.read()
+    digest = hashlib.sha256(image).hexdigest()
+    start = time.time()
+    last_progress = start
+    offset = None
+    delay = 1
+
+    while True:
+        code = None
+        try:
+            if offset is None:
+                code, text = post(args.host, f"/ota/begin?size={len(image)}&sha256={digest}&chunk={args.chunk}")
+                if code != 200:
+                    sys.exit(f"begin refused ({code}): {text}")
+                info = json.loads(text)
+                offset = info["offset"]
+                how = "resuming" if offset else "starting"
+                print(f"{how} at {offset} of {len(image)} bytes into {info['partition']}", file=sys.stderr)
+
+            if offset == len(image):
+                print("verifying image...", file=sys.stderr)
+                code, text = post(args.host, "/ota/finish")
+                if code == 202:
+                    ok, status = wait_verified(args.host, 120)
+                    if ok:
+                        print(f"\ndone in {time.time() - start:.0f} s, pump is restarting", file=sys.stderr)
+                        return
+                    sys.exit(f"\nimage rejected: {status.get('lastError', status)}")
+                if code == 409:
+                    offset = json.loads(text)["offset"]
+                    continue
+                sys.exit(f"image rejected ({code}): {text}")
+
+            chunk = image[offset:offset + args.chunk]
+            sha = hashlib.sha256(chunk).hexdigest()
+            code, text = post(args.host, f"/ota/chunk?offset={offset}&sha256={sha}", chunk)
+            if code in (404, 400) and "noSession" in text:
+                offset = None  # Session discarded on the pump: announce the image again
+                continue
+            reply = json.loads(text) if text.startswith("{") else {}
+            if code == 200 or "offset" in reply:
+                if reply["offset"] > offset:
+                    last_progress = time.time()
+                    delay = 1
+                offset = reply["offset"]
+                print(f"\r{offset * 100 // len(image):3d}%  {offset}/{len(image)}", end="", file=sys.stderr)
+            if code != 200:
+                print(f"\nchunk at {offset} rejected ({code}): {reply.get('result', text)}", file=sys.stderr)
+        except (OSError, ValueError) as e:
+            print(f"\nconnection problem: {e}", file=sys.stderr)
+            offset = None  # Re-sync with /ota/begin once the pump answers again
+
+        if code != 200 or offset is None:
+            if time.time() - last_progress > args.give_up:
+                sys.exit(f"no progress for {args.give_up:.0f} s, giving up; rerun to resume")
+            time.sleep(delay)
+            delay = min(delay * 2, 30)
+
+
+if __name__ == "__main__":
+    main()
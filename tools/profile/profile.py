@@ -0,0 +1,147 @@
+#!/usr/bin/env python3
+"""
+Turn a /diag/profile sample dump into folded stacks for a flame graph.
+
+The firmware counts (core, task, pc, caller) samples; this script resolves
+the addresses against firmware.elf with addr2line and prints one
+"task;caller;function count" line per distinct stack. Feed the output to
+flamegraph.pl, or drop it into https://www.speedscope.app.
+
+  # Profile a running pump for 10 s and write profile.folded
+  tools/profile/profile.py --url http://groutpump.local --seconds 10 -o profile.folded
+
+  # Symbolize a dump saved earlier with curl
+  tools/profile/profile.py --input groutpump-profile.txt -o profile.folded
+"""
+
+import argparse
+import glob
+import os
+import shutil
+import subprocess
+import sys
+import time
+import urllib.request
+from collections import Counter
+
+DEFAULT_ELF = ".pio/build/esp32dev/firmware.elf"
+ADDR2LINE = "xtensa-esp32-elf-addr2line"
+NESTED_PC = 0x1  # Sample taken inside another interrupt handler
+
+
+def find_addr2line():
+    path = shutil.which(ADDR2LINE)
+    if path:
+        return path
+    pio = os.path.expanduser("~/.platformio/packages/toolchain-xtensa*/bin/" + ADDR2LINE)
+    matches = sorted(glob.glob(pio))
+    return matches[-1] if matches else None
+
+
+def http(url, method="GET"):
+    req = urllib.request.Request(url, method=method, data=b"" if method == "POST" else None)
+    with urllib.request.urlopen(req, timeout=30) as resp:
+        return resp.read().decode("utf-8", "replace")
+
+
+def record(url, seconds, hz):
+    query = "action=start" + ("&hz=%d" % hz if hz else "")
+    print("start:", http(url + "/diag/profile?" + query, "POST"), file=sys.stderr)
+    time.sleep(seconds)
+    print("stop: ", http(url + "/diag/profile?action=stop", "POST"), file=sys.stderr)
+    return http(url + "/diag/profile")
+
+
+def parse_dump(text):
+    header = {}
+    samples = []
+    for line in text.splitlines():
+        if line.startswith("#"):
+            parts = line[1:].split()
+            if len(parts) == 2:
+                header[parts[0]] = parts[1]
+            continue
+        fields = line.split()
+        if len(fields) != 5 or fields[0] == "core":
+            continue
+        core, task, pc, caller, count = fields
+        samples.append((int(core), task, int(pc, 16), int(caller, 16), int(count)))
+    return header, samples
+
+
+def symbolize(elf, addr2line, addresses, with_lines):
+    """Map each address to "function" (or "function (file:line)")."""
+    names = {NESTED_PC: "[interrupt]", 0: None}
+    wanted = sorted(a for a in addresses if a not in names)
+    if not wanted:
+        return names
+    if not addr2line:
+        sys.exit("addr2line not found; install the ESP32 toolchain or pass --addr2line")
+    out = subprocess.run([addr2line, "-e", elf, "-f", "-C", "-a"] + ["0x%08x" % a for a in wanted],
+                         check=True, capture_output=True, text=True).stdout.splitlines()
+    # Output is three lines per address: address, function, file:line
+    for i, addr in enumerate(wanted):
+        func = out[i * 3 + 1].strip()
+        where = out[i * 3 + 2].strip()
+        if func == "??":
+            func = "0x%08x" % addr
+        if with_lines and not where.startswith("??"):
+            func += " (%s)" % os.path.basename(where)
+        names[addr] = func
+    return names
+
+
+def fold(samples, names, by_core):
+    stacks = Counter()
+    for core, task, pc, caller, count in samples:
+        frames = []
+        if by_core:
+            frames.append("core%d" % core)
+        frames.append(task)
+        if names.get(caller):
+            frames.append(names[caller])
+        frames.append(names[pc])
+        stacks[";".join(f.replace(";", ":") for f in frames)] += count
+    return stacks
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    src = ap.add_mutually_exclusive_group(required=True)
+    src.add_argument("--url", help="device base URL, e.g. http://groutpump.local")
+    src.add_argument("--input", help="saved GET /diag/profile dump")
+    ap.add_argument("--seconds", type=float, default=10, help="profile length with --url (default 10)")
+    ap.add_argument("--hz", type=int, help="sample rate per core (firmware default 997)")
+    ap.add_argument("--elf", default=DEFAULT_ELF, help="firmware ELF matching the running build")
+    ap.add_argument("--addr2line", default=None, help="path to xtensa-esp32-elf-addr2line")
+    ap.add_argument("--by-core", action="store_true", help="split the graph by CPU core")
+    ap.add_argument("--lines", action="store_true", help="append file:line to each frame")
+    ap.add_argument("-o", "--output", help="folded output file (default stdout)")
+    args = ap.parse_args()
+
+    if args.url:
+        text = record(args.url.rstrip("/"), args.seconds, args.hz)
+    else:
+        with open(args.input) as f:
+            text = f.read()
+
+    header, samples = parse_dump(text)
+    if not samples:
+        sys.exit("dump contains no samples")
+    addresses = {s[2] for s in samples} | {s[3] for s in samples}
+    names = symbolize(args.elf, args.addr2line or find_addr2line(), addresses, args.lines)
+    stacks = fold(samples, names, args.by_core)
+
+    out = open(args.output, "w") if args.output else sys.stdout
+    for stack, count in stacks.most_common():
+        out.write("%s %d\n" % (stack, count))
+    if args.output:
+        out.close()
+
+    print("%s samples over %s ms at %s Hz/core, %s dropped, %d distinct stacks" %
+          (header.get("samples", "?"), header.get("duration_ms", "?"), header.get("hz", "?"),
+           header.get("dropped", "?"), len(stacks)), file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
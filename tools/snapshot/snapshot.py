@@ -0,0 +1,186 @@
+#!/usr/bin/env python3
+"""
+Back up, restore and clone pumps with the device snapshot endpoints.
+
+A snapshot is one text file. It holds settings and calibration, the output
+wear counters, flash wear and the fault captures. Each section ends with its
+line count and CRC-32. The pump streams it out without buffering. A restore
+only applies if every section checks out, and then the pump restarts.
+
+  # Back up a pump (add --no-captures for settings and counters only)
+  tools/snapshot/snapshot.py backup -o pump3.txt --host 192.168.1.53
+
+  # Check a file offline before relying on it
+  tools/snapshot/snapshot.py verify pump3.txt
+
+  # Put a replacement controller back the way pump 3 was, wear counters included
+  tools/snapshot/snapshot.py restore pump3.txt --host 192.168.1.60 --sections config,outputwear
+
+  # Copy one pump's settings to the rest of the fleet, each keeping its own WiFi
+  tools/snapshot/snapshot.py clone pump3.txt --hosts 192.168.1.61 192.168.1.62 192.168.1.63
+
+The WiFi password is left out of a backup unless --secrets is given. A
+restore or clone of a file without it keeps each pump's current password.
+
+  # Move the whole fleet to a new network: back up with the password, then clone it
+  tools/snapshot/snapshot.py backup --secrets -o site-b.txt --host 192.168.1.53
+  tools/snapshot/snapshot.py clone site-b.txt --replace-wifi --hosts 192.168.1.61 192.168.1.62
+"""
+
+import argparse
+import re
+import sys
+import time
+import urllib.error
+import urllib.request
+import zlib
+from concurrent.futures import ThreadPoolExecutor
+
+SECTION_RE = re.compile(r"^@section (\S+) (\S+) (\S+)$")
+END_RE = re.compile(r"^@end (\S+) lines=(\d+) crc32=([0-9a-f]{8})$")
+FOOTER_RE = re.compile(r"^@snapshot end sections=(\d+)$")
+REDACTED_RE = re.compile(r"^sec (\S+) ", re.MULTILINE)
+
+
+def verify(text):
+    """Check the framing and every section CRC. Returns (sections, errors)."""
+    lines = text.split("\n")
+    if lines and lines[-1] == "":
+        lines.pop()
+    errors, sections = [], []
+    if not lines or not lines[0].startswith("GROUTPUMP-SNAPSHOT "):
+        return sections, ["not a snapshot"]
+    current, crc, count, footer = None, 0, 0, None
+    for n, line in enumerate(lines[1:], start=2):
+        if current is None:
+            if not line or line.startswith("#"):
+                continue
+            m = SECTION_RE.match(line)
+            f = FOOTER_RE.match(line)
+            if m:
+                current, crc, count = m.groups(), 0, 0
+            elif f:
+                footer = int(f.group(1))
+            else:
+                errors.append(f"line {n}: unexpected {line[:40]!r}")
+            continue
+        m = END_RE.match(line)
+        if not m:
+            crc = zlib.crc32((line + "\n").encode(), crc)
+            count += 1
+            continue
+        name, want_lines, want_crc = m.group(1), int(m.group(2)), int(m.group(3), 16)
+        ok = name == current[0] and want_lines == count and want_crc == crc
+        if not ok:
+            errors.append(f"section {current[0]}: {count} lines crc32={crc:08x}, "
+                          f"file says {want_lines} lines crc32={want_crc:08x}")
+        sections.append((current[0], current[1], current[2], count, ok))
+        current = None
+    if current is not None:
+        errors.append(f"section {current[0]} has no end")
+    if footer is None:
+        errors.append("no end marker (truncated?)")
+    elif footer != len(sections):
+        errors.append(f"end marker says {footer} sections, found {len(sections)}")
+    return sections, errors
+
+
+def backup(host, captures, secrets, timeout):
+    query = "&".join(q for q, on in (("captures=0", not captures), ("secrets=1", secrets)) if on)
+    url = f"http://{host}/snapshot" + (f"?{query}" if query else "")
+    with urllib.request.urlopen(url, timeout=timeout) as r:
+        return r.read().decode()
+
+
+def restore(host, text, sections, keep_wifi, timeout):
+    query = f"?sections={sections}" + ("&keepWifi=1" if keep_wifi else "")
+    req = urllib.request.Request(f"http://{host}/snapshot{query}", data=text.encode(), method="POST")
+    req.add_header("Content-Type", "text/plain")
+    start = time.monotonic()
+    try:
+        with urllib.request.urlopen(req, timeout=timeout) as r:
+            return True, f"{r.read().decode()} in {time.monotonic() - start:.1f} s"
+    except urllib.error.HTTPError as e:
+        return False, f"HTTP {e.code}: {e.read().decode()}"
+    except OSError as e:
+        return False, str(e)
+
+
+def load_checked(path):
+    with open(path) as f:
+        text = f.read()
+    _, errors = verify(text)
+    if errors:
+        for e in errors:
+            print(f"{path}: {e}", file=sys.stderr)
+        sys.exit(1)
+    return text
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("--timeout", type=float, default=30, help="seconds per request")
+    sub = ap.add_subparsers(dest="cmd", required=True)
+
+    b = sub.add_parser("backup", help="download a snapshot")
+    b.add_argument("--host", default="groutpump.local")
+    b.add_argument("-o", "--output", help="file to write (default: stdout)")
+    b.add_argument("--no-captures", action="store_true", help="leave out the fault captures")
+    b.add_argument("--secrets", action="store_true",
+                   help="include the WiFi password (keep the file somewhere safe)")
+
+    v = sub.add_parser("verify", help="check a snapshot file's checksums")
+    v.add_argument("file")
+
+    for name, helptext in (("restore", "restore a snapshot onto one pump"),
+                           ("clone", "restore a snapshot onto several pumps at once")):
+        p = sub.add_parser(name, help=helptext)
+        p.add_argument("file")
+        if name == "restore":
+            p.add_argument("--host", default="groutpump.local")
+        else:
+            p.add_argument("--hosts", nargs="+", required=True)
+        p.add_argument("--sections", default="config", help="comma list of config, outputwear (default: config)")
+        p.add_argument("--replace-wifi", action="store_true",
+                       help="also restore the snapshot's WiFi credentials (the default keeps each pump's own)")
+    args = ap.parse_args()
+
+    if args.cmd == "backup":
+        text = backup(args.host, not args.no_captures, args.secrets, args.timeout)
+        _, errors = verify(text)
+        if args.output:
+            with open(args.output, "w") as f:
+                f.write(text)
+        else:
+            sys.stdout.write(text)
+        for e in errors:
+            print(f"warning: {e}", file=sys.stderr)
+        sys.exit(1 if errors else 0)
+
+    if args.cmd == "verify":
+        with open(args.file) as f:
+            sections, errors = verify(f.read())
+        for name, kind, where, count, ok in sections:
+            print(f"{'ok ' if ok else 'BAD'} {name:<14} {kind:<4} {where:<22} {count} lines")
+        for e in errors:
+            print(e, file=sys.stderr)
+        sys.exit(1 if errors else 0)
+
+    text = load_checked(args.file)
+    redacted = REDACTED_RE.findall(text)
+    if args.replace_wifi and redacted:
+        print(f"warning: {args.file} has no {', '.join(redacted)} (back up with --secrets); "
+              "each pump keeps its current one", file=sys.stderr)
+    hosts = [args.host] if args.cmd == "restore" else args.hosts
+    with ThreadPoolExecutor(max_workers=min(len(hosts), 8)) as pool:
+        results = list(pool.map(
+            lambda h: restore(h, text, args.sections, not args.replace_wifi, args.timeout), hosts))
+    failed = 0
+    for host, (ok, msg) in zip(hosts, results):
+        print(f"{host}: {msg}")
+        failed += not ok
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()
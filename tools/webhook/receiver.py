@@ -0,0 +1,91 @@
+#!/usr/bin/env python3
+"""
+Minimal local receiver for the pump's alarm webhook.
+
+Prints every alarm message the firmware POSTs. It can also answer with
+errors or stall, to exercise the retry and backoff path without a real
+notification service.
+
+  # Listen on port 8080, then point the pump at it
+  tools/webhook/receiver.py --port 8080
+  curl -X POST "http://groutpump.local/alarms/webhook?url=http://<this-host>:8080/alarm"
+  curl -X POST "http://groutpump.local/alarms/webhook?action=test"
+
+  # Fail the first 3 deliveries with 503, then accept
+  tools/webhook/receiver.py --fail-first 3
+
+  # Reject 30% of deliveries at random, and hold every reply for 2 s
+  tools/webhook/receiver.py --fail-rate 0.3 --delay 2
+"""
+
+import argparse
+import json
+import random
+import sys
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+
+def make_handler(args):
+    state = {"received": 0, "seen": set()}
+
+    class Handler(BaseHTTPRequestHandler):
+        def do_POST(self):
+            body = self.rfile.read(int(self.headers.get("Content-Length", 0)))
+            state["received"] += 1
+            n = state["received"]
+            if args.delay:
+                time.sleep(args.delay)
+
+            fail = n <= args.fail_first or random.random() < args.fail_rate
+            try:
+                msg = json.loads(body)
+            except ValueError:
+                msg = None
+
+            stamp = time.strftime("%H:%M:%S")
+            if msg is None:
+                print(f"{stamp} #{n} invalid JSON: {body!r}", flush=True)
+            else:
+                seq = msg.get("seq")
+                retry = " (retry)" if seq in state["seen"] else ""
+                state["seen"].add(seq)
+                if "alarm" in msg:
+                    print(f"{stamp} #{n} seq {seq}{retry}: {msg['alarm']} {msg['event']} -> {msg['state']} "
+                          f"[{msg['severity']}] value {msg['value']} {msg['unit']}"
+                          f"{' -> replying 503' if fail else ''}", flush=True)
+                else:
+                    print(f"{stamp} #{n} seq {seq}{retry}: {msg.get('event')}"
+                          f"{' -> replying 503' if fail else ''}", flush=True)
+                if args.verbose:
+                    print("    " + json.dumps(msg), flush=True)
+
+            self.send_response(503 if fail else 200)
+            self.send_header("Content-Length", "0")
+            self.end_headers()
+
+        def log_message(self, fmt, *a):
+            pass  # One line per message is printed above
+
+    return Handler
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("--port", type=int, default=8080)
+    ap.add_argument("--fail-first", type=int, default=0, help="answer the first N requests with 503")
+    ap.add_argument("--fail-rate", type=float, default=0.0, help="answer this fraction of requests with 503")
+    ap.add_argument("--delay", type=float, default=0.0, help="seconds to wait before replying")
+    ap.add_argument("-v", "--verbose", action="store_true", help="print the full JSON of every message")
+    args = ap.parse_args()
+
+    server = ThreadingHTTPServer(("", args.port), make_handler(args))
+    print(f"Listening on port {args.port}", file=sys.stderr)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()